@@ -4,48 +4,57 @@ section .text
 _start:
 	push rbp
 	mov rbp, rsp
-	sub rsp, 8
 	mov rdi, 10
 	call average
-	mov r10, rax
-	add rsp, 8
 	pop rbp
 	mov rax, 0x2000001
 	xor rdi, rdi
 	syscall
 
 average:
-	push rbp
-	mov rbp, rsp
-	sub rsp, 8
-	mov qword [rbp - 8], rdi
-	sub rsp, 8
-	mov qword [rbp - 16], 0
-	sub rsp, 8
-	mov qword [rbp - 24], 0
-.L0:
-	mov r10, qword [rbp - 24]
-	mov r11, qword [rbp - 8]
-	cmp r10, r11
-	jge .L1
-	mov r10, qword [rbp - 16]
-	mov r11, qword [rbp - 24]
+	xor r10d, r10d
+	xor r11, r11
+	cmp rdi, 4
+	jl .L3
+	mov rsi, rdi
+	and rsi, -4
+	movdqu xmm1, [rel _lane_index2]
+	mov rdx, 2
+	movq xmm2, rdx
+	punpcklqdq xmm2, xmm2
+	paddq xmm2, xmm1
+	mov rdx, 4
+	movq xmm3, rdx
+	punpcklqdq xmm3, xmm3
+	pxor xmm4, xmm4
+	pxor xmm5, xmm5
+.L2:
+	paddq xmm4, xmm1
+	paddq xmm5, xmm2
+	paddq xmm1, xmm3
+	paddq xmm2, xmm3
+	add r11, 4
+	cmp r11, rsi
+	jl .L2
+	paddq xmm4, xmm5
+	pshufd xmm1, xmm4, 0xEE
+	paddq xmm4, xmm1
+	movq rsi, xmm4
+	add r10, rsi
+.L3:
+	cmp r11, rdi
+	jge .L5
+.L4:
 	add r10, r11
-	mov qword [rbp - 16], r10
-	mov r10, qword [rbp - 24]
-	add r10, 1
-	mov qword [rbp - 24], r10
-	jmp .L0
-.L1:
-	add rsp, 8
-	mov r10, qword [rbp - 16]
-	mov r11, qword [rbp - 8]
+	inc r11
+	cmp r11, rdi
+	jl .L4
+.L5:
+	mov r11d, 10
 	mov rax, r10
 	cqo
 	idiv r11
-	mov r10, rax
-	add rsp, 8
-	mov rax, r10
-	add rsp, 8
-	pop rbp
 	ret
+
+section .rodata
+_lane_index2: dq 0, 1
@@ -0,0 +1,10 @@
+(defvar cases 5)
+
+(defun classify (n)
+    (case n
+        (1 10)
+        ((2 3) 20)
+        (4 40)
+        (5 50)))
+
+(+ (classify cases) (classify 9))
\ No newline at end of file
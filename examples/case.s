@@ -0,0 +1,50 @@
+[bits 64]
+section .text
+	global _start
+_start:
+	push rbp
+	mov rbp, rsp
+	mov rdi, qword [rel cases]
+	call classify
+	mov rsi, rax
+	mov rdi, 9
+	call classify
+	add esi, eax
+	pop rbp
+	mov rax, 0x2000001
+	xor rdi, rdi
+	syscall
+
+classify:
+	lea r10, [rdi - 1]
+	cmp r10, 4
+	ja .L5
+	lea r11, [rel .L6]
+	movsxd r10, dword [r11 + r10*4]
+	add r10, r11
+	jmp r10
+.L6:
+	dd .L1 - .L6
+	dd .L2 - .L6
+	dd .L2 - .L6
+	dd .L3 - .L6
+	dd .L4 - .L6
+.L1:
+	mov eax, 10
+	jmp .L0
+.L2:
+	mov eax, 20
+	jmp .L0
+.L3:
+	mov eax, 40
+	jmp .L0
+.L4:
+	mov eax, 50
+	jmp .L0
+.L5:
+	xor eax, eax
+.L0:
+	ret
+
+section .data
+cases: dq 5
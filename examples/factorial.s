@@ -4,38 +4,27 @@ section .text
 _start:
 	push rbp
 	mov rbp, rsp
-	sub rsp, 8
 	mov rdi, 10
 	call factorial
-	mov r10, rax
-	add rsp, 8
 	pop rbp
 	mov rax, 0x2000001
 	xor rdi, rdi
 	syscall
 
 factorial:
+	test rdi, rdi
+	jne .L3
+	mov eax, 1
+	ret
+.L3:
 	push rbp
 	mov rbp, rsp
-	sub rsp, 8
-	mov qword [rbp - 8], rdi
-	mov r10, qword [rbp - 8]
-	mov r11, 0
-	cmp r10, r11
-	jne .L1
-	mov r10, 1
-	jmp .L2
-.L1:
-	mov r10, qword [rbp - 8]
-	mov r11, qword [rbp - 8]
-	mov rdi, 1
-	sub r11, rdi
-	mov rdi, r11
+	push rbx
+	mov rbx, rdi
+	sub rdi, 1
 	call factorial
-	mov r11, rax
-	imul r10, r11
-.L2:
-	mov rax, r10
-	add rsp, 8
+	imul rbx, rax
+	mov rax, rbx
+	pop rbx
 	pop rbp
 	ret
@@ -4,43 +4,32 @@ section .text
 _start:
 	push rbp
 	mov rbp, rsp
-	sub rsp, 8
 	mov rdi, 6
 	call fibonacci
-	mov r10, rax
-	add rsp, 8
 	pop rbp
 	mov rax, 0x2000001
 	xor rdi, rdi
 	syscall
 
 fibonacci:
+	cmp rdi, 1
+	jg .L3
+	mov rax, rdi
+	ret
+.L3:
 	push rbp
 	mov rbp, rsp
-	sub rsp, 8
-	mov qword [rbp - 8], rdi
-	mov r10, qword [rbp - 8]
-	mov r11, 1
-	cmp r10, r11
-	jg .L1
-	mov r10, qword [rbp - 8]
-	jmp .L2
-.L1:
-	mov r10, qword [rbp - 8]
-	mov r11, 1
-	sub r10, r11
-	mov rdi, r10
+	push rbx
+	push r12
+	mov rbx, rdi
+	lea rdi, [rbx - 1]
 	call fibonacci
-	mov r10, rax
-	mov r11, qword [rbp - 8]
-	mov rdi, 2
-	sub r11, rdi
-	mov rdi, r11
+	mov r12, rax
+	lea rdi, [rbx - 2]
 	call fibonacci
-	mov r11, rax
-	add r10, r11
-.L2:
-	mov rax, r10
-	add rsp, 8
+	add r12, rax
+	mov rax, r12
+	pop r12
+	pop rbx
 	pop rbp
 	ret
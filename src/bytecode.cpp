@@ -0,0 +1,315 @@
+#include "bytecode.h"
+#include <algorithm>
+#include <format>
+#include <limits>
+#include <stdexcept>
+
+static bool isIntCompare(const IRInstr& instr) {
+    return instr.op >= IROp::EQ && instr.op <= IROp::LE && instr.type == IRType::I64;
+}
+
+static VMOp arithmeticOp(const IROp op, const IRType type) {
+    if (type == IRType::F64) {
+        switch (op) {
+            case IROp::ADD: return VMOp::ADDF;
+            case IROp::SUB: return VMOp::SUBF;
+            case IROp::MUL: return VMOp::MULF;
+            case IROp::DIV: return VMOp::DIVF;
+            case IROp::EQ: return VMOp::EQF;
+            case IROp::NE: return VMOp::NEF;
+            case IROp::GT: return VMOp::GTF;
+            case IROp::LT: return VMOp::LTF;
+            case IROp::GE: return VMOp::GEF;
+            case IROp::LE: return VMOp::LEF;
+            default: break;
+        }
+    }
+
+    switch (op) {
+        case IROp::ADD: return VMOp::ADDI;
+        case IROp::SUB: return VMOp::SUBI;
+        case IROp::MUL: return VMOp::MULI;
+        case IROp::DIV: return VMOp::DIVI;
+        case IROp::AND: return VMOp::ANDI;
+        case IROp::OR: return VMOp::ORI;
+        case IROp::XOR: return VMOp::XORI;
+        case IROp::EQ: return VMOp::EQI;
+        case IROp::NE: return VMOp::NEI;
+        case IROp::GT: return VMOp::GTI;
+        case IROp::LT: return VMOp::LTI;
+        case IROp::GE: return VMOp::GEI;
+        case IROp::LE: return VMOp::LEI;
+        default: throw std::runtime_error("Unsupported operation in bytecode");
+    }
+}
+
+// Fused branch taken when the compare holds, or when it does not
+static VMOp branchOp(const IROp op, const bool isTaken) {
+    switch (op) {
+        case IROp::EQ: return isTaken ? VMOp::JEQ : VMOp::JNE;
+        case IROp::NE: return isTaken ? VMOp::JNE : VMOp::JEQ;
+        case IROp::GT: return isTaken ? VMOp::JGT : VMOp::JLE;
+        case IROp::LT: return isTaken ? VMOp::JLT : VMOp::JGE;
+        case IROp::GE: return isTaken ? VMOp::JGE : VMOp::JLT;
+        default: return isTaken ? VMOp::JLE : VMOp::JGT;
+    }
+}
+
+VMProgram BytecodeCompiler::compile(const IRModule& module) {
+    program = {};
+    functionIndex.clear();
+    globalIndices.clear();
+
+    for (const auto& global: module.globals) {
+        globalIndex(global.name);
+    }
+
+    for (const auto& func: module.functions) {
+        functionIndex[func.name] = static_cast<uint32_t>(functionIndex.size());
+    }
+
+    for (const auto& func: module.functions) {
+        compileFunction(func);
+    }
+
+    return std::move(program);
+}
+
+void BytecodeCompiler::compileFunction(const IRFunction& func) {
+    const auto paramCount = static_cast<uint16_t>(func.params.size());
+    size_t registerCount = paramCount;
+    size_t scratchCount = 0;
+    std::vector<int> uses(func.valueTypes.size(), 0);
+
+    registers.assign(func.valueTypes.size(), 0);
+    fusedCompares.clear();
+
+    for (const auto& block: func.blocks) {
+        size_t phiCount = 0;
+
+        for (const auto& instr: block.instrs) {
+            if (instr.op == IROp::PARAM) {
+                registers[instr.dst] = static_cast<uint16_t>(instr.imm);
+            } else if (instr.dst != -1) {
+                registers[instr.dst] = static_cast<uint16_t>(registerCount++);
+            }
+
+            for (const int arg: instr.args) uses[arg]++;
+            phiCount += instr.op == IROp::PHI;
+            if (instr.op == IROp::CALL) scratchCount = std::max(scratchCount, instr.args.size());
+        }
+
+        scratchCount = std::max(scratchCount, phiCount);
+    }
+
+    for (const auto& block: func.blocks) {
+        const auto& instrs = block.instrs;
+        if (instrs.size() < 2 || instrs.back().op != IROp::BR) continue;
+
+        const IRInstr& cmp = instrs[instrs.size() - 2];
+        if (isIntCompare(cmp) && cmp.dst == instrs.back().args[0] && uses[cmp.dst] == 1) {
+            fusedCompares[cmp.dst] = &cmp;
+        }
+    }
+
+    scratch = static_cast<uint16_t>(registerCount);
+    registerCount += scratchCount;
+    if (registerCount > std::numeric_limits<uint16_t>::max()) {
+        throw std::runtime_error(std::format("Function {} needs too many registers", func.name));
+    }
+
+    program.functions.push_back({
+        func.name, static_cast<uint32_t>(program.code.size()), static_cast<uint16_t>(registerCount), paramCount,
+        func.returnType
+    });
+
+    blockOffsets.assign(func.blocks.size(), 0);
+    jumpFixups.clear();
+
+    for (size_t i = 0; i < func.blocks.size(); ++i) {
+        const auto& block = func.blocks[i];
+        blockOffsets[i] = static_cast<uint32_t>(program.code.size());
+        nextBlock = static_cast<int>(i) + 1;
+
+        for (const auto& instr: block.instrs) {
+            if (instr.op == IROp::JMP) {
+                emitCopies(func, block.id, instr.blocks[0]);
+                emitJump(VMOp::JMP, instr.blocks[0]);
+            } else if (instr.op == IROp::BR) {
+                compileBranch(func, block.id, instr);
+            } else if (!fusedCompares.contains(instr.dst)) {
+                compileInstr(instr);
+            }
+        }
+    }
+
+    for (const auto& [offset, block]: jumpFixups) {
+        program.code[offset].k = blockOffsets[block];
+    }
+}
+
+void BytecodeCompiler::compileInstr(const IRInstr& instr) {
+    auto& code = program.code;
+    const uint16_t dst = instr.dst != -1 ? registers[instr.dst] : 0;
+
+    switch (instr.op) {
+        case IROp::UNDEF:
+            code.push_back({VMOp::LOADK, dst, 0, 0, addConstant({.i = 0})});
+            break;
+        case IROp::CONST:
+            if (instr.type == IRType::F64) {
+                code.push_back({VMOp::LOADK, dst, 0, 0, addConstant({.f = instr.fimm})});
+            } else if (instr.type == IRType::PTR) {
+                const char* str = program.strings.emplace_back(instr.symbol).c_str();
+                code.push_back({VMOp::LOADK, dst, 0, 0, addConstant({.i = reinterpret_cast<int64_t>(str)})});
+            } else {
+                code.push_back({VMOp::LOADK, dst, 0, 0, addConstant({.i = instr.imm})});
+            }
+            break;
+        case IROp::PARAM:
+        case IROp::PHI:
+            break;
+        case IROp::LOAD:
+            code.push_back({VMOp::GLOAD, dst, 0, 0, globalIndex(instr.symbol)});
+            break;
+        case IROp::STORE:
+            code.push_back({VMOp::GSTORE, registers[instr.args[0]], 0, 0, globalIndex(instr.symbol)});
+            break;
+        case IROp::SITOFP:
+            code.push_back({VMOp::ITOF, dst, registers[instr.args[0]]});
+            break;
+        case IROp::CALL: {
+            const auto it = functionIndex.find(instr.symbol);
+            if (it == functionIndex.end()) {
+                throw std::runtime_error(std::format("Undefined function {}", instr.symbol));
+            }
+
+            // Arguments are passed in consecutive registers
+            for (size_t i = 0; i < instr.args.size(); ++i) {
+                code.push_back({VMOp::MOV, static_cast<uint16_t>(scratch + i), registers[instr.args[i]]});
+            }
+
+            code.push_back({VMOp::CALL, dst, scratch, static_cast<uint16_t>(instr.args.size()), it->second});
+            break;
+        }
+        case IROp::RET:
+            if (instr.args.empty()) {
+                code.push_back({VMOp::LOADK, scratch, 0, 0, addConstant({.i = 0})});
+                code.push_back({VMOp::RET, scratch});
+            } else {
+                code.push_back({VMOp::RET, registers[instr.args[0]]});
+            }
+            break;
+        default:
+            code.push_back({
+                arithmeticOp(instr.op, instr.type), dst, registers[instr.args[0]], registers[instr.args[1]]
+            });
+            break;
+    }
+}
+
+void BytecodeCompiler::compileBranch(const IRFunction& func, const int block, const IRInstr& br) {
+    const int then = br.blocks[0];
+    const int else_ = br.blocks[1];
+    const auto fused = fusedCompares.find(br.args[0]);
+    const IRInstr* cmp = fused != fusedCompares.end() ? fused->second : nullptr;
+
+    const auto emitCondJump = [&](const bool isTaken, const int target) {
+        if (cmp) {
+            emitJump(branchOp(cmp->op, isTaken), target, registers[cmp->args[0]], registers[cmp->args[1]]);
+        } else {
+            emitJump(isTaken ? VMOp::JNZ : VMOp::JZ, target, registers[br.args[0]]);
+        }
+    };
+
+    // Jump to the then block and fall through to the else block
+    if (!hasCopies(func, then) && else_ == nextBlock) {
+        emitCondJump(true, then);
+        emitCopies(func, block, else_);
+        return;
+    }
+
+    if (!hasCopies(func, else_)) {
+        emitCondJump(false, else_);
+        emitCopies(func, block, then);
+        emitJump(VMOp::JMP, then);
+        return;
+    }
+
+    // Both edges need copies, the else edge gets its own trampoline
+    emitCondJump(false, -1);
+    const size_t trampolineJump = program.code.size() - 1;
+    jumpFixups.pop_back();
+
+    emitCopies(func, block, then);
+    program.code.push_back({VMOp::JMP});
+    jumpFixups.emplace_back(program.code.size() - 1, then);
+
+    program.code[trampolineJump].k = static_cast<uint32_t>(program.code.size());
+    emitCopies(func, block, else_);
+    emitJump(VMOp::JMP, else_);
+}
+
+bool BytecodeCompiler::hasCopies(const IRFunction& func, const int to) const {
+    const auto& instrs = func.blocks[to].instrs;
+    return !instrs.empty() && instrs.front().op == IROp::PHI;
+}
+
+void BytecodeCompiler::emitCopies(const IRFunction& func, const int from, const int to) {
+    std::vector<std::pair<uint16_t, uint16_t> > copies;
+
+    for (const auto& instr: func.blocks[to].instrs) {
+        if (instr.op != IROp::PHI) break;
+
+        for (size_t i = 0; i < instr.blocks.size(); ++i) {
+            if (instr.blocks[i] == from && registers[instr.dst] != registers[instr.args[i]]) {
+                copies.emplace_back(registers[instr.dst], registers[instr.args[i]]);
+            }
+        }
+    }
+
+    // The copies happen in parallel. When a phi reads another phi of the same block,
+    // every source is saved to a scratch register first.
+    const bool isOverlapping = std::ranges::any_of(copies, [&](const auto& copy) {
+        return std::ranges::any_of(copies, [&](const auto& other) { return other.second == copy.first; });
+    });
+
+    for (size_t i = 0; i < copies.size(); ++i) {
+        auto& [dst, src] = copies[i];
+        if (isOverlapping) {
+            program.code.push_back({VMOp::MOV, static_cast<uint16_t>(scratch + i), src});
+            src = static_cast<uint16_t>(scratch + i);
+        } else {
+            program.code.push_back({VMOp::MOV, dst, src});
+        }
+    }
+
+    if (isOverlapping) {
+        for (const auto& [dst, src]: copies) {
+            program.code.push_back({VMOp::MOV, dst, src});
+        }
+    }
+}
+
+void BytecodeCompiler::emitJump(const VMOp op, const int block, const uint16_t a, const uint16_t b) {
+    if (op == VMOp::JMP && block == nextBlock) {
+        return;
+    }
+
+    program.code.push_back({op, a, b});
+    jumpFixups.emplace_back(program.code.size() - 1, block);
+}
+
+uint32_t BytecodeCompiler::addConstant(const VMValue value) {
+    program.constants.push_back(value);
+    return static_cast<uint32_t>(program.constants.size() - 1);
+}
+
+uint32_t BytecodeCompiler::globalIndex(const std::string& name) {
+    const auto [it, isInserted] = globalIndices.try_emplace(name, static_cast<uint32_t>(program.globals.size()));
+    if (isInserted) {
+        program.globals.push_back(name);
+    }
+
+    return it->second;
+}
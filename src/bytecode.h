@@ -0,0 +1,100 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ir.h"
+
+// Operands are registers of the current frame unless noted. Integer and double
+// operations are separate instructions, a register holds either.
+enum class VMOp : uint8_t {
+    LOADK,  // a = constants[k]
+    MOV,    // a = b
+    ITOF,   // a = double(b)
+    GLOAD,  // a = globals[k]
+    GSTORE, // globals[k] = a
+    ADDI, SUBI, MULI, DIVI, ANDI, ORI, XORI,
+    EQI, NEI, GTI, LTI, GEI, LEI,
+    ADDF, SUBF, MULF, DIVF,
+    EQF, NEF, GTF, LTF, GEF, LEF,
+    JMP,    // goto k
+    JZ,     // if a == 0 goto k
+    JNZ,    // if a != 0 goto k
+    // Fused integer compare and branch, if a op b goto k
+    JEQ, JNE, JGT, JLT, JGE, JLE,
+    CALL,   // a = functions[k](b, b + 1, ..., b + c - 1)
+    RET,    // return a
+    COUNT
+};
+
+struct VMInstr {
+    VMOp op;
+    uint16_t a{0};
+    uint16_t b{0};
+    uint16_t c{0};
+    // Constant, global, function or jump target
+    uint32_t k{0};
+};
+
+union VMValue {
+    int64_t i;
+    double f;
+};
+
+struct VMFunction {
+    std::string name;
+    uint32_t entry;
+    uint16_t registerCount;
+    uint16_t paramCount;
+    IRType returnType;
+};
+
+struct VMProgram {
+    std::vector<VMInstr> code;
+    std::vector<VMValue> constants;
+    std::vector<VMFunction> functions;
+    std::vector<std::string> globals;
+    // String literals, constants point into them
+    std::deque<std::string> strings;
+};
+
+// Translates the SSA form to register bytecode. Every SSA value gets its own register,
+// parameters come first, and phis become copies at the end of their predecessors.
+class BytecodeCompiler {
+public:
+    VMProgram compile(const IRModule& module);
+
+private:
+    void compileFunction(const IRFunction& func);
+
+    void compileInstr(const IRInstr& instr);
+
+    void compileBranch(const IRFunction& func, int block, const IRInstr& br);
+
+    [[nodiscard]] bool hasCopies(const IRFunction& func, int to) const;
+
+    void emitCopies(const IRFunction& func, int from, int to);
+
+    void emitJump(VMOp op, int block, uint16_t a = 0, uint16_t b = 0);
+
+    uint32_t addConstant(VMValue value);
+
+    uint32_t globalIndex(const std::string& name);
+
+    VMProgram program;
+    std::unordered_map<std::string, uint32_t> functionIndex;
+    std::unordered_map<std::string, uint32_t> globalIndices;
+    // Current function
+    std::vector<uint16_t> registers;
+    // Integer compares only used by the branch that follows them
+    std::unordered_map<int, const IRInstr*> fusedCompares;
+    std::vector<uint32_t> blockOffsets;
+    std::vector<std::pair<uint32_t, int> > jumpFixups;
+    uint16_t scratch{0};
+    int nextBlock{-1};
+};
+
+#endif //BYTECODE_H
@@ -1,233 +1,1503 @@
 #include "codegen.h"
+#include <algorithm>
+#include <bit>
 #include <format>
-
-#define emitHex(n) std::format("0x{:X}", n)
-#define emitLabel(label) generatedCode += std::format("{}:\n", label)
-#define emitInstr1op(op, d) generatedCode += std::format("\t{} {}\n", op, d)
-#define emitInstr2op(op, d, s) generatedCode += std::format("\t{} {}, {}\n", op, d, s)
-#define emitJump(jmp, label) emitInstr1op(jmp, label)
-#define ret() generatedCode += "\tret\n"
-#define cqo() generatedCode += "\tcqo\n"
-#define syscall() generatedCode += "\tsyscall\n"
-#define mov(d, s) emitInstr2op("mov", d, s)
-#define movq(d, s) emitInstr2op("movq", d, s)
-#define movsd(d, s) emitInstr2op("movsd", d, s)
-#define movzx(d, s) emitInstr2op("movzx", d, s)
+#include <ranges>
+#include <unordered_set>
+
+#define emitHex(n) Operand::makeImm(static_cast<int64_t>(n), true)
+#define emitOperand(o) toOperand(o)
+#define emitLabel(label) code.push_back({Opcode::LABEL, 1, {Operand::makeSymbol(label)}})
+#define emitInstr0op(op) code.push_back({op, 0, {}})
+#define emitInstr1op(op, d) code.push_back({op, 1, {emitOperand(d)}})
+#define emitInstr2op(op, d, s) code.push_back({op, 2, {emitOperand(d), emitOperand(s)}})
+#define emitInstr3op(op, d, s1, s2) code.push_back({op, 3, {emitOperand(d), emitOperand(s1), emitOperand(s2)}})
+#define emitInstr4op(op, d, s1, s2, s3) \
+    code.push_back({op, 4, {emitOperand(d), emitOperand(s1), emitOperand(s2), emitOperand(s3)}})
+#define emitJump(jmp, label) emitInstr1op(jmp, Operand::makeSymbol(label))
+#define ret() emitInstr0op(Opcode::RET)
+#define cqo() emitInstr0op(Opcode::CQO)
+#define syscall() emitInstr0op(Opcode::SYSCALL)
+#define vzeroupper() emitInstr0op(Opcode::VZEROUPPER)
+#define mov(d, s) emitInstr2op(Opcode::MOV, d, s)
+#define movq(d, s) emitInstr2op(Opcode::MOVQ, d, s)
+#define movsd(d, s) emitInstr2op(Opcode::MOVSD, d, s)
+#define movzx(d, s) emitInstr2op(Opcode::MOVZX, d, s)
 #define strDirective(s) std::format("db \"{}\", 10", s)
 #define memDirective(d, n) std::format("{} {}", d, n)
 
 #define stack_alloc(size) \
     if (size > 0) { \
-        emitInstr2op("sub", "rsp", size); \
+        emitInstr2op(Opcode::SUB, getRegByID(RSP, REG64), size); \
         stackAllocator.alloc(size); \
     }
 
 #define stack_dealloc(size) \
     if (size > 0) { \
-        emitInstr2op("add", "rsp", size); \
+        emitInstr2op(Opcode::ADD, getRegByID(RSP, REG64), size); \
         stackAllocator.dealloc(size); \
     }
 
 #define push(v) \
-    emitInstr1op("push", v); \
+    emitInstr1op(Opcode::PUSH, v); \
     stackAllocator.alloc(8);
 
 #define pop(rn) \
-    emitInstr1op("pop", rn); \
+    emitInstr1op(Opcode::POP, rn); \
     stackAllocator.dealloc(8);
 
-#define emitSet8L(op, reg) \
-    emitInstr1op(op, getRegName(reg, REG8L)); \
-    movzx(getRegName(reg, REG64), getRegName(reg, REG8L));
-
-#define register_alloc() ([&]() { \
-    auto* reg = registerAllocator.alloc(); \
-    if (reg && isPRESERVED(reg->rType)) { \
-        push(getRegName(reg, REG64)) \
-    } \
-    return reg; \
-    }())
+#define register_alloc(...) registerAllocator.alloc(__VA_ARGS__)
 
 #define register_free(reg) \
     if (reg) { \
         registerAllocator.free(reg); \
-        if (isPRESERVED(reg->rType)) { \
-            pop(getRegName(reg, REG64)) \
-        } \
     }
 
 std::string CodeGen::emit(const ExprPtr& ast) {
-    generatedCode =
-            "[bits 64]\n"
-            "section .text\n"
-            "\tglobal _start\n"
-            "_start:\n";
+    generate(ast);
+
+    generatedCode += "[bits 64]\nsection .text\n\tglobal _start\n";
+    printInstrs(code, symbols, generatedCode);
+    // Sections
+    for (const char* section: sectionNames) {
+        if (!sections.contains(section)) continue;
+        generatedCode += section;
+
+        for (const auto& [name, size]: sections.at(section)) {
+            generatedCode += std::format("{}: {}\n", name, size);
+        }
+    }
+
+    return generatedCode;
+}
+
+std::vector<uint8_t> CodeGen::emitELF(const ExprPtr& ast, const bool isExecutable) {
+    const ElfWriter writer = createWriter(ast);
+    return isExecutable ? writer.executable() : writer.object();
+}
+
+ElfWriter::Image CodeGen::emitImage(const ExprPtr& ast, bool& returnsDouble) {
+    ElfWriter::Image image = createWriter(ast).image();
+    returnsDouble = isResultDouble;
+    return image;
+}
+
+ElfWriter CodeGen::createWriter(const ExprPtr& ast) {
+    generate(ast);
+    encoder.encode(code, symbols);
+
+    ElfWriter writer{encoder, symbols};
+    for (const char* section: sectionNames) {
+        const auto it = sections.find(section);
+        if (it == sections.end()) continue;
+        // "\nsection .data\n" names .data
+        const std::string_view name = std::string_view(it->first).substr(9, it->first.size() - 10);
+
+        for (const auto& [label, directive]: it->second) {
+            writer.addData(name, label, directive);
+        }
+    }
+
+    return writer;
+}
+
+// Appends defun after the top level functions it calls, a function already visited is done or part of a cycle
+static void visitCallees(const DefunExpr& defun, const std::unordered_map<std::string, const DefunExpr*>& defuns,
+                         std::unordered_set<const DefunExpr*>& visited, std::vector<const DefunExpr*>& order) {
+    if (!visited.insert(&defun).second) return;
+
+    for (const auto& form: defun.forms) {
+        ast::walk(form, [&](const ExprPtr& node, bool) {
+            const auto funcCall = cast::toFuncCall(node);
+            if (!funcCall) return;
+
+            const auto it = defuns.find(cast::toString(cast::toVar(funcCall->name)->name)->data);
+            if (it != defuns.end()) visitCallees(*it->second, defuns, visited, order);
+        });
+    }
+
+    order.push_back(&defun);
+}
+
+void CodeGen::generate(const ExprPtr& ast) {
+    rangeAnalyzer.analyze(ast);
+
+    // Top level functions are emitted before _start with their callees first, so a call knows the
+    // registers its callee writes and the caller keeps values in the others
+    std::unordered_map<std::string, const DefunExpr*> defuns;
+    for (auto next = ast; next != nullptr; next = next->child) {
+        if (const auto defun = cast::toDefun(next)) {
+            defuns.try_emplace(cast::toString(cast::toVar(defun->name)->name)->data, defun.get());
+        }
+    }
+
+    std::unordered_set<const DefunExpr*> visited;
+    std::vector<const DefunExpr*> order;
+    for (auto next = ast; next != nullptr; next = next->child) {
+        if (const auto defun = cast::toDefun(next)) visitCallees(*defun, defuns, visited, order);
+    }
 
-    push("rbp")
-    mov("rbp", "rsp");
+    for (const auto* defun: order) {
+        emitDefun(*defun);
+    }
+
+    std::vector<Instr> functionCode = std::move(code);
+    code.clear();
+    currentScope.clear();
+
+    emitLabel(symbols.intern("_start"));
+
+    push(getRegByID(RBP, REG64))
+    mov(getRegByID(RBP, REG64), getRegByID(RSP, REG64));
 
     auto next = ast;
     while (next != nullptr) {
-        auto* reg = emitAST(next);
+        // Top level functions are already emitted
+        auto* reg = cast::toDefun(next) ? nullptr : emitAST(next);
+
+        if (options.jit && next->child == nullptr) {
+            // setq yields the assigned value, as in the IR
+            if (const auto setq = cast::toSetq(next); setq && !reg) {
+                reg = emitLoadRegFromMem(*cast::toVar(setq->pair), REG64);
+            }
+
+            if (!reg) {
+                emitInstr2op(Opcode::XOR, getRegByID(RAX, REG64), getRegByID(RAX, REG64));
+            } else if (isSSE(reg->rType)) {
+                movq(getRegByID(RAX, REG64), getReg(reg, REG64));
+                isResultDouble = true;
+            } else {
+                mov(getRegByID(RAX, REG64), getReg(reg, REG64));
+            }
+        }
+
         register_free(reg)
         next = next->child;
     }
 
-    pop("rbp")
+    pop(getRegByID(RBP, REG64))
 
+    if (options.jit) {
+        // A JIT run returns the value of the last form to its caller
+        ret();
+    } else {
 #if defined(__APPLE__) || defined(__MACH__)
-    mov("rax", emitHex(0x2000001));
+        mov(getRegByID(RAX, REG64), emitHex(0x2000001));
 #elif defined(__linux__)
-    mov("rax", 60);
+        mov(getRegByID(RAX, REG64), 60);
 #else
-    throw std::runtime_error("Unsupported Operating System");
+        throw std::runtime_error("Unsupported Operating System");
 #endif
 
-    emitInstr2op("xor", "rdi", "rdi");
-    syscall();
+        emitInstr2op(Opcode::XOR, getRegByID(RDI, REG64), getRegByID(RDI, REG64));
+        syscall();
+    }
+
+    allocateRegisters(0);
+
+    code.insert(code.end(), functionCode.begin(), functionCode.end());
+
+    // Nested function definitions, which may add more
+    for (size_t i = 0; i < functions.size(); ++i) {
+        const auto [func, defun] = functions[i];
+        (this->*func)(defun);
+    }
+
+    if (options.peephole) {
+        peephole.run(code, symbols);
+    }
+
+    layoutSections();
+}
+
+// dq, dd, dw, db and resq, resd, resw, resb
+static int64_t alignmentOf(const std::string& directive) {
+    switch (directive[directive.find(' ') - 1]) {
+        case 'q': return 8;
+        case 'd': return 4;
+        case 'w': return 2;
+        default: return 1;
+    }
+}
+
+// Bytes a data directive lays out, a quoted string takes one per character
+static int64_t sizeOf(const std::string& directive) {
+    const int64_t width = alignmentOf(directive);
+    const std::string_view rest = std::string_view(directive).substr(directive.find(' ') + 1);
+
+    if (directive.starts_with("res")) {
+        return width * std::stoll(std::string(rest));
+    }
+
+    int64_t size = 0;
+    size_t begin = 0;
+    bool isQuoted = false;
+    for (size_t i = 0; i <= rest.size(); ++i) {
+        if (i < rest.size() && rest[i] == '"') isQuoted = !isQuoted;
+        if (i < rest.size() && (isQuoted || rest[i] != ',')) continue;
+
+        const std::string_view item = rest.substr(begin, i - begin);
+        const size_t quote = item.find('"');
+        size += quote == std::string_view::npos ? width : static_cast<int64_t>(item.rfind('"') - quote - 1);
+        begin = i + 1;
+    }
+
+    return size;
+}
+
+std::unordered_map<uint32_t, int64_t> CodeGen::countReferences() const {
+    std::unordered_map<uint32_t, size_t> labels;
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i].op == Opcode::LABEL) labels[code[i].operands[0].symbol] = i;
+    }
+
+    // A backward jump closes a loop that starts at its target, the nesting changes are summed up below
+    std::vector<int> nesting(code.size() + 1);
+    for (size_t i = 0; i < code.size(); ++i) {
+        const Instr& instr = code[i];
+        if (!isJump(instr.op) || instr.op == Opcode::DD || instr.operands[0].kind != OperandKind::SYMBOL) continue;
+
+        if (const auto it = labels.find(instr.operands[0].symbol); it != labels.end() && it->second < i) {
+            ++nesting[it->second];
+            --nesting[i + 1];
+        }
+    }
+
+    std::unordered_map<uint32_t, int64_t> references;
+    int depth = 0;
+    for (size_t i = 0; i < code.size(); ++i) {
+        depth += nesting[i];
+
+        int64_t weight = 1;
+        for (int d = 0; d < std::min(depth, maxLoopDepth); ++d) weight *= loopReferenceWeight;
+
+        for (int j = 0; j < code[i].count; ++j) {
+            const Operand& operand = code[i].operands[j];
+            if (operand.isMem() && operand.reg == Operand::RIP) references[operand.symbol] += weight;
+        }
+    }
+
+    return references;
+}
+
+void CodeGen::layoutSections() {
+    const auto references = countReferences();
+    auto weightOf = [&](const std::string& label) {
+        const auto it = references.find(symbols.intern(label));
+        return it != references.end() ? it->second : 0;
+    };
+
+    for (auto& [section, data]: sections) {
+        // Hot entries first with the most referenced ahead, so they share cache lines. Within the hot and the
+        // cold entries larger alignments come first, which packs them without padding.
+        auto keyOf = [&](const std::pair<std::string, std::string>& entry) {
+            const int64_t weight = weightOf(entry.first);
+            const bool isHot = weight >= minHotReferences;
+            return std::tuple{isHot, alignmentOf(entry.second), isHot ? weight : 0};
+        };
+        std::ranges::stable_sort(data, std::greater{}, keyOf);
+
+        const auto cold = std::ranges::find_if(data, [&](const auto& entry) { return !std::get<0>(keyOf(entry)); });
+        if (cold == data.begin() || cold == data.end()) continue;
+
+        // The cold entries start on a cache line of their own, unless the whole section fits in one
+        int64_t hotSize = 0, size = 0;
+        for (auto it = data.begin(); it != data.end(); ++it) {
+            const int64_t n = sizeOf(it->second);
+            size += n;
+            if (it < cold) hotSize += n;
+        }
+
+        const int64_t padding = (cacheLineSize - hotSize % cacheLineSize) % cacheLineSize;
+        if (!padding || size <= cacheLineSize) continue;
+
+        std::string directive;
+        if (section == "\nsection .bss\n") {
+            directive = memDirective(dataSizeUninitialized[REG8L], padding);
+        } else {
+            directive = memDirective(dataSizeInitialized[REG8L], "0");
+            for (int64_t i = 1; i < padding; ++i) directive += ", 0";
+        }
+
+        // "\nsection .data\n" pads with _data_pad
+        data.insert(cold, {std::format("_{}_pad", section.substr(10, section.size() - 11)), directive});
+    }
+}
+
+void CodeGen::allocateRegisters(const size_t begin) {
+    const auto [saved, spillSize] = registerAllocator.allocate(code, begin);
+    verifyShrinkWrap(begin);
+
+    const bool isLeaf = std::none_of(code.begin() + static_cast<std::ptrdiff_t>(begin), code.end(),
+                                     [](const Instr& instr) {
+                                         return instr.op == Opcode::CALL || instr.op == Opcode::SYSCALL;
+                                     });
+    if (options.omitFramePointer && isLeaf && omitFramePointer(begin, saved, spillSize)) {
+        return;
+    }
+
+    if (!saved && !spillSize) {
+        return;
+    }
+
+    // Callee-saved registers are pushed right below rbp, followed by the spill slots, and the
+    // locals move down past both. Only _start is entered from outside and nothing it calls needs an
+    // aligned stack, so the area is not padded.
+    std::vector<uint32_t> savedRegs;
+    for (uint32_t id = 0; id < xmm0; ++id) {
+        if (saved & 1u << id) savedRegs.push_back(id);
+    }
+
+    const auto pushSize = static_cast<int64_t>(savedRegs.size()) * 8;
+    const int64_t spillArea = spillSize;
+    const int64_t frameSize = pushSize + spillArea;
+    const Operand rbp = getRegByID(RBP, REG64);
+    const Operand rsp = getRegByID(RSP, REG64);
+
+    std::vector<Instr> function(code.begin() + static_cast<std::ptrdiff_t>(begin), code.end());
+    code.resize(begin);
+
+    bool isPrologue = true;
+    for (Instr& instr: function) {
+        for (int i = 0; i < instr.count; ++i) {
+            Operand& operand = instr.operands[i];
+            if (!operand.isMem()) continue;
+
+            if (operand.reg == Operand::FRAME) {
+                operand.reg = RBP;
+                operand.value = -(pushSize + operand.value);
+            } else if (operand.reg == RBP && operand.value < 0) {
+                operand.value -= frameSize;
+            }
+        }
+
+        if (instr.op == Opcode::POP && instr.operands[0] == rbp) {
+            if (spillArea) emitInstr2op(Opcode::ADD, rsp, spillArea);
+            for (auto it = savedRegs.rbegin(); it != savedRegs.rend(); ++it) {
+                emitInstr1op(Opcode::POP, getRegByID(*it, REG64));
+            }
+        }
+
+        code.push_back(instr);
+
+        if (isPrologue && instr.op == Opcode::MOV && instr.operands[0] == rbp && instr.operands[1] == rsp) {
+            for (const uint32_t id: savedRegs) {
+                emitInstr1op(Opcode::PUSH, getRegByID(id, REG64));
+            }
+            if (spillArea) emitInstr2op(Opcode::SUB, rsp, spillArea);
+            isPrologue = false;
+        }
+    }
+}
+
+bool CodeGen::omitFramePointer(const size_t begin, const uint32_t saved, const uint32_t spillSize) {
+    static constexpr int64_t RED_ZONE_SIZE = 128;
+    const Operand rbp = getRegByID(RBP, REG64);
+    const Operand rsp = getRegByID(RSP, REG64);
+
+    // Nothing moves rsp apart from the frame setup, which goes away
+    int64_t frameSize = spillSize;
+    for (size_t i = begin; i < code.size(); ++i) {
+        const Instr& instr = code[i];
+
+        if ((instr.op == Opcode::PUSH || instr.op == Opcode::POP) && instr.operands[0] != rbp) return false;
+
+        for (int k = 0; k < instr.count; ++k) {
+            const Operand& operand = instr.operands[k];
+
+            if (operand.isMem() && operand.reg == RSP) return false;
+            if (operand.isMem() && operand.reg == RBP && operand.value < 0) {
+                frameSize = std::max(frameSize, spillSize - operand.value);
+            }
+        }
+    }
+
+    if (frameSize > RED_ZONE_SIZE) {
+        return false;
+    }
+
+    // The callee-saved registers are pushed on entry, the spill slots and locals lie below
+    // them. rbp would have pointed right below the return address.
+    std::vector<uint32_t> savedRegs;
+    for (uint32_t id = 0; id < xmm0; ++id) {
+        if (saved & 1u << id) savedRegs.push_back(id);
+    }
+
+    const auto pushSize = static_cast<int64_t>(savedRegs.size()) * 8;
+
+    std::vector<Instr> function(code.begin() + static_cast<std::ptrdiff_t>(begin), code.end());
+    code.resize(begin);
+
+    for (Instr& instr: function) {
+        for (int i = 0; i < instr.count; ++i) {
+            Operand& operand = instr.operands[i];
+            if (!operand.isMem()) continue;
+
+            if (operand.reg == Operand::FRAME) {
+                operand.reg = RSP;
+                operand.value = -operand.value;
+            } else if (operand.reg == RBP) {
+                operand.reg = RSP;
+                operand.value = operand.value < 0 ? operand.value - spillSize : operand.value + pushSize - 8;
+            }
+        }
+
+        const bool isStackAdjust = (instr.op == Opcode::SUB || instr.op == Opcode::ADD) && instr.operands[0] == rsp;
+        if (isStackAdjust || (instr.op == Opcode::MOV && instr.operands[0] == rbp && instr.operands[1] == rsp)) {
+            continue;
+        }
+
+        if (instr.op == Opcode::PUSH) {
+            for (const uint32_t id: savedRegs) {
+                emitInstr1op(Opcode::PUSH, getRegByID(id, REG64));
+            }
+        } else if (instr.op == Opcode::POP) {
+            for (auto it = savedRegs.rbegin(); it != savedRegs.rend(); ++it) {
+                emitInstr1op(Opcode::POP, getRegByID(*it, REG64));
+            }
+        } else {
+            code.push_back(instr);
+        }
+    }
+
+    return true;
+}
+
+// Basic blocks of a function as start positions, the block each label begins and the successors
+struct Blocks {
+    std::vector<size_t> starts;
+    std::unordered_map<uint32_t, size_t> labels;
+    std::vector<std::vector<size_t> > succs;
+};
+
+static Blocks splitBlocks(const std::vector<Instr>& code, const size_t first) {
+    Blocks blocks;
+
+    for (size_t i = first; i < code.size(); ++i) {
+        const bool isAfterBranch = i > first && (isJump(code[i - 1].op) || code[i - 1].op == Opcode::RET);
+        if (i == first || code[i].op == Opcode::LABEL || isAfterBranch) {
+            blocks.starts.push_back(i);
+        }
+        if (code[i].op == Opcode::LABEL) {
+            blocks.labels[code[i].operands[0].symbol] = blocks.starts.size() - 1;
+        }
+    }
+
+    const size_t count = blocks.starts.size();
+    blocks.starts.push_back(code.size());
+    blocks.succs.resize(count);
+
+    for (size_t b = 0; b < count; ++b) {
+        const Instr& last = code[blocks.starts[b + 1] - 1];
+        if (isJump(last.op)) blocks.succs[b].push_back(blocks.labels.at(last.operands[0].symbol));
+        if (last.op != Opcode::JMP && last.op != Opcode::RET && b + 1 < count) blocks.succs[b].push_back(b + 1);
+    }
+
+    return blocks;
+}
+
+// Registers an operand reads or writes, the base and index of a memory operand
+static std::vector<uint32_t> registersOf(const Operand& operand) {
+    std::vector<uint32_t> regs;
+    if (operand.isReg() || operand.isMem()) regs.push_back(operand.reg);
+    if (operand.isIndexed()) regs.push_back(operand.index);
+    return regs;
+}
+
+// Blocks reachable from a block, without passing through the stop blocks
+static std::vector<bool> reachable(const Blocks& blocks, const size_t from, const std::vector<bool>& stop = {}) {
+    std::vector<bool> isReached(blocks.succs.size(), false);
+    std::vector<size_t> worklist{from};
+    isReached[from] = true;
+
+    while (!worklist.empty()) {
+        const size_t b = worklist.back();
+        worklist.pop_back();
+        if (!stop.empty() && stop[b]) continue;
+
+        for (const size_t succ: blocks.succs[b]) {
+            if (!isReached[succ]) {
+                isReached[succ] = true;
+                worklist.push_back(succ);
+            }
+        }
+    }
+
+    return isReached;
+}
+
+void CodeGen::shrinkWrap(const size_t begin) {
+    const Operand rbp = getRegByID(RBP, REG64);
+    const Operand rsp = getRegByID(RSP, REG64);
+
+    // The body follows the label and the frame setup
+    const std::vector<Instr> function(code.begin() + static_cast<std::ptrdiff_t>(begin + 3), code.end());
+    const Blocks blocks = splitBlocks(function, 0);
+    const size_t count = blocks.succs.size();
+
+    const auto needsFrame = [&](const Instr& instr) {
+        if (instr.op == Opcode::CALL || instr.op == Opcode::SYSCALL || instr.op == Opcode::PUSH) return true;
+        if (instr.op == Opcode::POP) return instr.operands[0] != rbp;
+        if ((instr.op == Opcode::SUB || instr.op == Opcode::ADD) && instr.operands[0] == rsp) return true;
+
+        return std::any_of(instr.operands, instr.operands + instr.count, [](const Operand& operand) {
+            return operand.isMem() && (operand.reg == RBP || operand.reg == RSP);
+        });
+    };
+
+    std::vector<bool> isFrameBlock(count, false);
+    for (size_t b = 0; b < count; ++b) {
+        isFrameBlock[b] = std::any_of(function.begin() + static_cast<std::ptrdiff_t>(blocks.starts[b]),
+                                      function.begin() + static_cast<std::ptrdiff_t>(blocks.starts[b + 1]),
+                                      needsFrame);
+    }
+
+    // The entry branches to a path that needs the frame and to one that does not
+    if (count < 2 || function[0].op == Opcode::LABEL || isFrameBlock[0]) return;
+
+    const Instr& branch = function[blocks.starts[1] - 1];
+    if (!isJump(branch.op) || branch.op == Opcode::JMP) return;
+
+    const bool isWide = std::any_of(function.begin(), function.begin() + static_cast<std::ptrdiff_t>(blocks.starts[1]),
+                                    [](const Instr& instr) {
+                                        return std::any_of(instr.operands, instr.operands + instr.count,
+                                                           [](const Operand& operand) {
+                                                               return operand.size == Operand::WIDE;
+                                                           });
+                                    });
+    if (isWide) return;
+
+    // A jump table addresses its own label, which the copy of the fast path would rename
+    if (std::ranges::any_of(function, [](const Instr& instr) { return instr.op == Opcode::JMPR; })) return;
+
+    const size_t taken = blocks.succs[0][0];
+    const std::vector<bool> reachTaken = reachable(blocks, taken);
+    const std::vector<bool> reachNext = reachable(blocks, 1);
+    if (reachTaken[0] || reachNext[0]) return;
+
+    const auto isFramePath = [&](const std::vector<bool>& reach) {
+        for (size_t b = 0; b < count; ++b) {
+            if (reach[b] && isFrameBlock[b]) return true;
+        }
+        return false;
+    };
+
+    const bool isTakenSlow = isFramePath(reachTaken);
+    if (isTakenSlow == isFramePath(reachNext)) return;
+
+    const std::vector<bool>& fast = isTakenSlow ? reachNext : reachTaken;
+    const std::vector<bool>& slow = isTakenSlow ? reachTaken : reachNext;
+
+    // The fast path is copied with labels of its own, blocks both paths share are then on one only
+    std::unordered_map<uint32_t, uint32_t> fastLabels;
+    for (size_t b = 1; b < count; ++b) {
+        const Instr& instr = function[blocks.starts[b]];
+        if (fast[b] && instr.op == Opcode::LABEL) fastLabels[instr.operands[0].symbol] = createLabel();
+    }
+
+    // Values of the slow path get registers of their own, which may be callee-saved without
+    // the fast path having to save them
+    std::unordered_map<uint32_t, uint32_t> renamed;
+    for (size_t b = 1; b < count; ++b) {
+        if (!slow[b]) continue;
+
+        for (size_t i = blocks.starts[b]; i < blocks.starts[b + 1]; ++i) {
+            for (int k = 0; k < function[i].count; ++k) {
+                for (const uint32_t id: registersOf(function[i].operands[k])) {
+                    if (id < VIRTUAL_REGISTER_BASE || renamed.contains(id)) continue;
+
+                    Register* reg = registerAllocator.alloc(registerAllocator.regFromID(id)->rType);
+                    renamed[id] = reg->id;
+                    registerAllocator.free(reg);
+                }
+            }
+        }
+    }
+
+    const auto emitFrameSetup = [&] {
+        emitInstr1op(Opcode::PUSH, rbp);
+        mov(rbp, rsp);
+
+        // Values computed on entry are copied over
+        std::vector<uint32_t> copied;
+        for (size_t i = 0; i < blocks.starts[1]; ++i) {
+            for (int k = 0; k < function[i].count; ++k) {
+                for (const uint32_t id: registersOf(function[i].operands[k])) {
+                    if (!renamed.contains(id) || std::ranges::find(copied, id) != copied.end()) continue;
+
+                    emitMoveReg(registerAllocator.regFromID(renamed.at(id)), registerAllocator.regFromID(id));
+                    copied.push_back(id);
+                }
+            }
+        }
+    };
+
+    // The fast path returns without touching the frame
+    const auto emitFastPath = [&] {
+        for (size_t b = 1; b < count; ++b) {
+            if (!fast[b]) continue;
+
+            for (size_t i = blocks.starts[b]; i < blocks.starts[b + 1]; ++i) {
+                Instr instr = function[i];
+                if (instr.op == Opcode::POP) continue;
+
+                if (instr.op == Opcode::LABEL || isJump(instr.op)) {
+                    instr.operands[0].symbol = fastLabels.at(instr.operands[0].symbol);
+                }
+                code.push_back(instr);
+            }
+        }
+    };
+
+    const uint32_t landing = createLabel();
+    const auto emitSlowPath = [&] {
+        bool isFallthrough = !isTakenSlow;
+
+        for (size_t b = 1; b < count; ++b) {
+            if (!slow[b]) continue;
+
+            if (b == taken) {
+                if (isFallthrough) emitJump(Opcode::JMP, function[blocks.starts[b]].operands[0].symbol);
+                emitLabel(landing);
+                emitFrameSetup();
+            }
+
+            for (size_t i = blocks.starts[b]; i < blocks.starts[b + 1]; ++i) {
+                Instr instr = function[i];
+                for (int k = 0; k < instr.count; ++k) {
+                    Operand& operand = instr.operands[k];
+                    if ((operand.isReg() || operand.isMem()) && renamed.contains(operand.reg)) {
+                        operand.reg = static_cast<uint16_t>(renamed.at(operand.reg));
+                    }
+                    if (operand.isIndexed() && renamed.contains(operand.index)) {
+                        operand.index = static_cast<uint16_t>(renamed.at(operand.index));
+                    }
+                }
+                code.push_back(instr);
+            }
+
+            const Opcode last = function[blocks.starts[b + 1] - 1].op;
+            isFallthrough = last != Opcode::JMP && last != Opcode::RET;
+        }
+    };
+
+    code.resize(begin + 1);
+    code.insert(code.end(), function.begin(), function.begin() + static_cast<std::ptrdiff_t>(blocks.starts[1]));
+    code.back().operands[0].symbol = isTakenSlow ? landing : fastLabels.at(branch.operands[0].symbol);
+
+    if (isTakenSlow) {
+        emitFastPath();
+        emitSlowPath();
+    } else {
+        emitFrameSetup();
+        emitSlowPath();
+        emitFastPath();
+    }
+}
+
+void CodeGen::verifyShrinkWrap(const size_t begin) {
+    const Operand rbp = getRegByID(RBP, REG64);
+    const Operand rsp = getRegByID(RSP, REG64);
+
+    if (code[begin + 1].op == Opcode::PUSH) return;
+
+    const auto setup = std::find_if(code.begin() + static_cast<std::ptrdiff_t>(begin), code.end(),
+                                    [&](const Instr& instr) {
+                                        return instr.op == Opcode::PUSH && instr.operands[0] == rbp;
+                                    });
+    if (setup == code.end()) return;
+
+    // Blocks that run before the frame is set up
+    const Blocks blocks = splitBlocks(code, begin + 1);
+    std::vector<bool> isSetup(blocks.succs.size(), false);
+    for (size_t b = 0; b < isSetup.size(); ++b) {
+        isSetup[b] = blocks.starts[b] <= static_cast<size_t>(setup - code.begin()) &&
+                     static_cast<size_t>(setup - code.begin()) < blocks.starts[b + 1];
+    }
+
+    const std::vector<bool> isFrameless = reachable(blocks, 0, isSetup);
+    bool isClobbered = false;
+
+    for (size_t b = 0; b < isFrameless.size(); ++b) {
+        if (!isFrameless[b] || isSetup[b]) continue;
+
+        for (size_t i = blocks.starts[b]; i < blocks.starts[b + 1]; ++i) {
+            for (int k = 0; k < code[i].count; ++k) {
+                // rbp and rsp count as callee-saved, the frame and rip bases are not registers
+                for (const uint32_t id: registersOf(code[i].operands[k])) {
+                    isClobbered |= id < REGISTER_COUNT && isPRESERVED(registerAllocator.regFromID(id)->rType);
+                }
+                isClobbered |= code[i].operands[k].isMem() && code[i].operands[k].reg == Operand::FRAME;
+            }
+        }
+    }
+
+    if (!isClobbered) return;
+
+    code.erase(setup, setup + 2);
+    code.insert(code.begin() + static_cast<std::ptrdiff_t>(begin + 1), {{Opcode::PUSH, 1, {rbp}}, {Opcode::MOV, 2, {rbp, rsp}}});
+
+    for (size_t i = begin + 1; i < code.size(); ++i) {
+        const bool isRestored = code[i - 1].op == Opcode::POP && code[i - 1].operands[0] == rbp;
+        if (code[i].op == Opcode::RET && !isRestored) {
+            code.insert(code.begin() + static_cast<std::ptrdiff_t>(i), {Opcode::POP, 1, {rbp}});
+            ++i;
+        }
+    }
+}
+
+Register* CodeGen::emitAST(const ExprPtr& ast) {
+    if (cast::toBinop(ast)) {
+        return emitSet(ast);
+    } else if (const auto dotimes = cast::toDotimes(ast)) {
+        return emitDotimes(*dotimes);
+    } else if (const auto loop = cast::toLoop(ast)) {
+        return emitLoop(*loop);
+    } else if (const auto let = cast::toLet(ast)) {
+        return emitLet(*let);
+    } else if (const auto setq = cast::toSetq(ast)) {
+        emitSetq(*setq);
+    } else if (const auto defvar = cast::toDefvar(ast)) {
+        emitDefvar(*defvar);
+    } else if (const auto defconst = cast::toDefconstant(ast)) {
+        emitDefconst(*defconst);
+    } else if (const auto defun = cast::toDefun(ast)) {
+        functions.emplace_back(&CodeGen::emitDefun, *defun);
+    } else if (const auto funcCall = cast::toFuncCall(ast)) {
+        return emitFuncCall(*funcCall);
+    } else if (const auto if_ = cast::toIf(ast)) {
+        return emitIf(*if_);
+    } else if (const auto when = cast::toWhen(ast)) {
+        return emitWhen(*when);
+    } else if (const auto cond = cast::toCond(ast)) {
+        return emitCond(*cond);
+    } else if (cast::toInt(ast) || cast::toDouble(ast) || cast::toVar(ast) || cast::toNIL(ast)) {
+        return emitPrimitive(ast);
+    }
+
+    return nullptr;
+}
+
+Register* CodeGen::emitBinop(const BinOpExpr& binop) {
+    // Integer trees of variables and constants are tiled by the instruction selector
+    if (Register* reg = emitSelected(binop)) {
+        return reg;
+    }
+
+    // The low half of the result is exact, a result that fits 32 bits needs no REX.W
+    const uint32_t size = rangeAnalyzer.isUInt32(binop) ? REG32 : REG64;
+
+    switch (binop.opToken.type) {
+        case TokenType::PLUS:
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::ADD, Opcode::ADDSD}, size);
+        case TokenType::MINUS:
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::SUB, Opcode::SUBSD}, size);
+        case TokenType::DIV:
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::IDIV, Opcode::DIVSD});
+        case TokenType::MUL:
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::IMUL, Opcode::MULSD}, size);
+        case TokenType::LOGAND:
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::AND, Opcode::PAND}, size);
+        case TokenType::LOGIOR:
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::OR, Opcode::POR}, size);
+        case TokenType::LOGXOR:
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::XOR, Opcode::PXOR}, size);
+        case TokenType::LOGNOR: {
+            const ExprPtr negOne = std::make_shared<IntExpr>(-1);
+            // Bitwise NOT seperately
+            Register* regLhs = emitExpr(binop.lhs, negOne, {Opcode::XOR, Opcode::PXOR});
+            Register* regRhs = emitExpr(binop.rhs, negOne, {Opcode::XOR, Opcode::PXOR});
+            emitInstr2op(Opcode::AND, getReg(regLhs, REG64), getReg(regRhs, REG64));
+            register_free(regRhs)
+            return regLhs;
+        }
+        // Compares only set the flags, emitSet materializes tests
+        case TokenType::EQUAL:
+        case TokenType::NEQUAL:
+        case TokenType::GREATER_THEN:
+        case TokenType::LESS_THEN:
+        case TokenType::GREATER_THEN_EQ:
+        case TokenType::LESS_THEN_EQ: {
+            const bool isInt32 = rangeAnalyzer.isInt32(*binop.lhs) && rangeAnalyzer.isInt32(*binop.rhs);
+            return emitExpr(binop.lhs, binop.rhs, {Opcode::CMP, Opcode::UCOMISD}, isInt32 ? REG32 : REG64);
+        }
+        default:
+            return nullptr;
+    }
+}
+
+Register* CodeGen::emitSelected(const BinOpExpr& binop) {
+    if (!selector.label(binop, Goal::REG, [this](const ExprPtr& expr) { return selectLeaf(expr); })) {
+        return nullptr;
+    }
+
+    return emitTile(binop, Goal::REG).reg;
+}
+
+Register* CodeGen::emitCompare(const BinOpExpr& binop) {
+    if (!selector.label(binop, Goal::FLAGS, [this](const ExprPtr& expr) { return selectLeaf(expr); })) {
+        return emitBinop(binop);
+    }
+
+    emitTile(binop, Goal::FLAGS);
+    return nullptr;
+}
+
+std::optional<InstructionSelector::Leaf> CodeGen::selectLeaf(const ExprPtr& expr) {
+    if (isKnownInt(expr)) {
+        return InstructionSelector::Leaf{Goal::IMM, rangeAnalyzer.rangeOf(*expr).lo, nullptr};
+    }
+
+    const auto var = cast::toVar(expr);
+    if (!var) {
+        return std::nullopt;
+    }
+
+    if (const Register* varReg = getVarReg(*var)) {
+        if (isSSE(varReg->rType)) return std::nullopt;
+        return InstructionSelector::Leaf{Goal::SRC, 0, var};
+    }
+    if (var->vType == VarType::INT) {
+        return InstructionSelector::Leaf{Goal::MEM, 0, var};
+    }
+
+    return std::nullopt;
+}
+
+CodeGen::Tile CodeGen::emitTile(const IExpr& node, const Goal goal) {
+    const auto [pattern, isSwapped] = selector.choiceOf(node, goal);
+
+    if (!pattern) {
+        const auto& leaf = selector.leafOf(node);
+        if (leaf.goal == Goal::IMM) {
+            return {Operand::makeImm(leaf.value)};
+        }
+        if (leaf.goal == Goal::SRC) {
+            Register* varReg = getVarReg(*leaf.var);
+            return {getReg(varReg, REG64), varReg};
+        }
+        return {getAddr(cast::toString(leaf.var->name)->data, leaf.var->sType, REG64)};
+    }
+
+    // Chain rules reduce the same node to another goal
+    if (pattern->ops.empty()) {
+        Tile tile = emitTile(node, pattern->lhs);
+
+        switch (pattern->form) {
+            case TileForm::COPY: {
+                Register* reg = register_alloc();
+                const Operand& src = tile.operand;
+
+                if (src.isImm() && src.value == 0) {
+                    emitInstr2op(Opcode::XOR, getReg(reg, REG32), getReg(reg, REG32));
+                } else {
+                    mov(getReg(reg, src.isImm() && src.value > 0 ? REG32 : REG64), src);
+                }
+                freeTile(tile);
+                return {getReg(reg, REG64), reg, 1, {reg}};
+            }
+            case TileForm::LEA: {
+                // The address is read before the destination is written, so a register it owns is reused
+                Register* reg = tile.owned.empty() ? register_alloc() : tile.owned.front();
+                if (tile.operand != Operand::makeMem(Operand::UNSIZED, reg->id, 0)) {
+                    emitInstr2op(Opcode::LEA, getReg(reg, REG64), tile.operand);
+                }
+                freeTile(tile, reg);
+                return {getReg(reg, REG64), reg, 1, {reg}};
+            }
+            case TileForm::BASE:
+                tile.operand = Operand::makeMem(Operand::UNSIZED, tile.operand.reg, 0);
+                return tile;
+            default:
+                return tile;
+        }
+    }
+
+    const auto& binop = static_cast<const BinOpExpr&>(node);
+    Tile lhs = emitTile(*(isSwapped ? binop.rhs : binop.lhs), pattern->lhs);
+    Tile rhs = emitTile(*(isSwapped ? binop.lhs : binop.rhs), pattern->rhs);
+
+    // The low half of the result is exact, a result that fits 32 bits needs no REX.W
+    const bool isInt32 = goal == Goal::FLAGS
+                             ? rangeAnalyzer.isInt32(*binop.lhs) && rangeAnalyzer.isInt32(*binop.rhs)
+                             : rangeAnalyzer.isUInt32(binop);
+    auto sized = [size = isInt32 ? REG32 : REG64](Operand operand) {
+        if (!operand.isImm()) operand.size = static_cast<uint8_t>(size);
+        return operand;
+    };
+
+    switch (pattern->form) {
+        case TileForm::OP:
+            emitInstr2op(pattern->opcode, sized(lhs.operand), sized(rhs.operand));
+            freeTile(rhs);
+            return lhs;
+        case TileForm::UNARY:
+            emitInstr1op(pattern->opcode, sized(lhs.operand));
+            return lhs;
+        case TileForm::IMUL3: {
+            Register* reg = register_alloc();
+            emitInstr3op(Opcode::IMUL, sized(getReg(reg, REG64)), sized(lhs.operand), rhs.operand);
+            freeTile(lhs);
+            return {getReg(reg, REG64), reg, 1, {reg}};
+        }
+        case TileForm::SCALE:
+            lhs.scale = rhs.operand.value;
+            return lhs;
+        case TileForm::BASE_INDEX:
+            lhs.operand = Operand::makeIndexed(Operand::UNSIZED, lhs.operand.reg, rhs.operand.reg, rhs.scale, 0);
+            lhs.owned.insert(lhs.owned.end(), rhs.owned.begin(), rhs.owned.end());
+            return lhs;
+        case TileForm::MULTIPLE:
+            lhs.operand = Operand::makeIndexed(Operand::UNSIZED, lhs.operand.reg, lhs.operand.reg,
+                                               rhs.operand.value - 1, 0);
+            return lhs;
+        case TileForm::DISP: {
+            const bool isSub = binop.opToken.type == TokenType::MINUS;
+            const int64_t disp = lhs.operand.value + (isSub ? -rhs.operand.value : rhs.operand.value);
+
+            if (disp >= std::numeric_limits<int32_t>::min() && disp <= std::numeric_limits<int32_t>::max()) {
+                lhs.operand.value = disp;
+                return lhs;
+            }
+            // Out of range of a displacement, the address so far is computed first
+            Register* reg = lhs.owned.empty() ? register_alloc() : lhs.owned.front();
+            emitInstr2op(Opcode::LEA, getReg(reg, REG64), lhs.operand);
+            emitInstr2op(isSub ? Opcode::SUB : Opcode::ADD, getReg(reg, REG64), rhs.operand);
+            freeTile(lhs, reg);
+            return {Operand::makeMem(Operand::UNSIZED, reg->id, 0), reg, 1, {reg}};
+        }
+        case TileForm::COMPARE:
+            emitInstr2op(Opcode::CMP, sized(lhs.operand), sized(rhs.operand));
+            freeTile(lhs);
+            freeTile(rhs);
+            return {};
+        case TileForm::TEST:
+            emitInstr2op(Opcode::TEST, sized(lhs.operand), sized(lhs.operand));
+            freeTile(lhs);
+            return {};
+        default:
+            throw std::runtime_error(std::format("Pattern {} cannot tile an operator", pattern->name));
+    }
+}
+
+void CodeGen::freeTile(const Tile& tile, const Register* kept) {
+    for (Register* reg: tile.owned) {
+        if (reg != kept) registerAllocator.free(reg);
+    }
+}
+
+Register* CodeGen::emitDotimes(const DotimesExpr& dotimes) {
+    const auto iterVar = cast::toVar(dotimes.iterationCount);
+    const std::string iterVarName = cast::toString(iterVar->name)->data;
+    // Labels
+    const uint32_t loopLabel = createLabel();
+    const uint32_t doneLabel = createLabel();
+    // Reductions over the iter var run on packed registers
+    if (const auto reduction = loopVectorizer.match(dotimes); reduction && canVectorize(dotimes, *reduction)) {
+        return emitVectorizedDotimes(dotimes, *reduction);
+    }
+    // Globals only the body touches stay in registers for the whole loop
+    const auto promoted = promoteGlobals(dotimes.statements, 1);
+    // Find out how the body uses the iter var
+    bool isUsed{false}, isEscaped{false};
+    for (const auto& statement: dotimes.statements) {
+        ast::walk(statement, [&](const ExprPtr& node, const bool isBinding) {
+            if (const auto var = cast::toVar(node); var && cast::toString(var->name)->data == iterVarName) {
+                (isBinding ? isEscaped : isUsed) = true;
+            }
+        });
+    }
+    // The iteration count is evaluated once, before the first iteration
+    const auto countInt = cast::toInt(iterVar->value);
+    Register* countReg = nullptr;
+
+    if (!countInt || (!isUsed && !isEscaped)) {
+        countReg = countInt ? emitInt(*countInt) : emitNode(iterVar->value);
+    }
+
+    auto emitStatements = [&] {
+        for (const auto& statement: dotimes.statements) {
+            Register* reg = emitAST(statement);
+            register_free(reg)
+        }
+    };
+    // The iter var is never observed, count down to zero
+    if (!isUsed && !isEscaped) {
+        const Operand countRegOp = getReg(countReg, REG64);
+
+        if (!countInt || countInt->n <= 0) {
+            emitInstr2op(Opcode::TEST, countRegOp, countRegOp);
+            emitJump(Opcode::JLE, doneLabel);
+        }
+
+        emitLabel(loopLabel);
+        emitStatements();
+        emitInstr1op(Opcode::DEC, countRegOp);
+        emitJump(Opcode::JNZ, loopLabel);
+        emitLabel(doneLabel);
+        demoteGlobals(promoted);
+
+        register_free(countReg)
+        return nullptr;
+    }
+    // The iter var lives in a register, assignments in the body update it
+    Register* iterReg = register_alloc();
+    const Operand iterVarOp = getReg(iterReg, REG64);
+    emitInstr2op(Opcode::XOR, iterVarOp, iterVarOp);
+
+    Register* shadowedReg = registerVars.contains(iterVarName) ? registerVars.at(iterVarName) : nullptr;
+    registerVars[iterVarName] = iterReg;
+
+    const Operand countOp = countInt ? Operand::makeImm(countInt->n) : getReg(countReg, REG64);
+    // Skip the loop if the count is not positive
+    if (!countInt) {
+        emitInstr2op(Opcode::TEST, countOp, countOp);
+        emitJump(Opcode::JLE, doneLabel);
+    } else if (countInt->n <= 0) {
+        emitJump(Opcode::JMP, doneLabel);
+    }
+
+    emitLabel(loopLabel);
+    emitStatements();
+    emitInstr1op(Opcode::INC, iterVarOp);
+    emitInstr2op(Opcode::CMP, iterVarOp, countOp);
+    emitJump(Opcode::JL, loopLabel);
+    emitLabel(doneLabel);
+    demoteGlobals(promoted);
+
+    if (shadowedReg) {
+        registerVars[iterVarName] = shadowedReg;
+    } else {
+        registerVars.erase(iterVarName);
+    }
+
+    register_free(iterReg)
+    register_free(countReg)
+    return nullptr;
+}
+
+bool CodeGen::canVectorize(const DotimesExpr& dotimes, const Reduction& reduction) {
+    const int lanes = options.avx2 ? 4 : 2;
+    // There is no 64-bit signed compare before SSE4.2
+    if (!options.avx2 && (reduction.op == ReductionOp::MIN || reduction.op == ReductionOp::MAX)) {
+        return false;
+    }
+    // Not worth it for fewer iterations than one pass of the vector loop
+    if (const auto countInt = cast::toInt(cast::toVar(dotimes.iterationCount)->value);
+        countInt && countInt->n < lanes * 2) {
+        return false;
+    }
+    // Iter vectors, step, two accumulators, invariants, the term and the multiply/compare temporaries
+    const int required = 5 + static_cast<int>(reduction.invariants.size()) + reduction.termDepth + 1 + 2;
+
+    return registerAllocator.available(SSE) >= required;
+}
+
+Register* CodeGen::emitVectorizedDotimes(const DotimesExpr& dotimes, const Reduction& reduction) {
+    const auto iterVar = cast::toVar(dotimes.iterationCount);
+    const std::string iterVarName = cast::toString(iterVar->name)->data;
+    const auto& acc = reduction.accumulator;
+    // Each pass of the vector loop covers two vectors, one per accumulator
+    const int lanes = options.avx2 ? 4 : 2;
+    const int step = lanes * 2;
+    // Labels
+    const uint32_t vecLoopLabel = createLabel();
+    const uint32_t tailLabel = createLabel();
+    const uint32_t loopLabel = createLabel();
+    const uint32_t doneLabel = createLabel();
+    // The iteration count is evaluated once
+    const auto countInt = cast::toInt(iterVar->value);
+    Register* countReg = countInt ? emitInt(*countInt) : emitNode(iterVar->value);
+    const Operand countRegOp = getReg(countReg, REG64);
+
+    Register* iterReg = register_alloc();
+    const Operand iterRegOp = getReg(iterReg, REG64);
+    emitInstr2op(Opcode::XOR, iterRegOp, iterRegOp);
+
+    if (!countInt) {
+        emitInstr2op(Opcode::CMP, countRegOp, step);
+        emitJump(Opcode::JL, tailLabel);
+    }
+    // Iterations handled by the vector loop
+    Register* endReg = register_alloc();
+    const Operand endRegOp = getReg(endReg, REG64);
+    mov(endRegOp, countRegOp);
+    emitInstr2op(Opcode::AND, endRegOp, -step);
+
+    isVecWide = options.avx2;
+    // Iter var lanes {i, i+1, ...} for both accumulators and the per pass increment,
+    // only built when the term reads the iter var
+    Register* iterVecs[2] = {nullptr, nullptr};
+    Register* stepVec = nullptr;
+    if (reduction.readsIterVar) {
+        iterVecs[0] = registerAllocator.alloc(SSE);
+        iterVecs[1] = registerAllocator.alloc(SSE);
+        emitInstr2op(options.avx2 ? Opcode::VMOVDQU : Opcode::MOVDQU,
+                     getVecReg(iterVecs[0]),
+                     getLaneIndexConstant(lanes));
+
+        emitVecBroadcast(iterVecs[1], Operand::makeImm(lanes));
+        emitVecOp(Opcode::PADDQ, iterVecs[1], iterVecs[0]);
+
+        stepVec = registerAllocator.alloc(SSE);
+        emitVecBroadcast(stepVec, Operand::makeImm(step));
+    }
+    // Accumulators start at the identity of the reduction
+    Operand identity;
+    switch (reduction.op) {
+        case ReductionOp::MUL: identity = Operand::makeImm(1);
+            break;
+        case ReductionOp::AND: identity = Operand::makeImm(-1);
+            break;
+        case ReductionOp::MIN: identity = emitHex(INT64_MAX);
+            break;
+        case ReductionOp::MAX: identity = emitHex(INT64_MIN);
+            break;
+        default: identity = Operand::makeImm(0);
+            break;
+    }
+
+    Register* accVecs[2] = {registerAllocator.alloc(SSE), registerAllocator.alloc(SSE)};
+    for (const auto* accVec: accVecs) {
+        emitVecBroadcast(accVec, identity);
+    }
+    // Loop invariants are broadcast once
+    std::vector<Register*> invariantRegs;
+    for (const auto& invariant: reduction.invariants) {
+        Register* reg = registerAllocator.alloc(SSE);
+
+        if (const auto int_ = cast::toInt(invariant)) {
+            emitVecBroadcast(reg, Operand::makeImm(int_->n));
+        } else {
+            Register* valueReg = emitLoadRegFromMem(*cast::toVar(invariant), REG64);
+            emitVecBroadcast(reg, getReg(valueReg, REG64));
+            register_free(valueReg)
+        }
+
+        invariantRegs.push_back(reg);
+    }
+
+    emitLabel(vecLoopLabel);
+    for (int i = 0; i < 2; ++i) {
+        // A bare iter var or invariant is reduced in place
+        if (!cast::toBinop(reduction.term)) {
+            const auto it = std::ranges::find_if(reduction.invariants, [&](const ExprPtr& invariant) {
+                return LoopVectorizer::isSameTerm(invariant, reduction.term);
+            });
+            emitVecReduce(reduction.op, accVecs[i],
+                          it != reduction.invariants.end()
+                              ? invariantRegs[it - reduction.invariants.begin()]
+                              : iterVecs[i]);
+            continue;
+        }
+
+        Register* termVec = emitVecTerm(reduction.term, iterVecs[i], invariantRegs, reduction);
+        emitVecReduce(reduction.op, accVecs[i], termVec);
+        register_free(termVec)
+    }
+
+    if (reduction.readsIterVar) {
+        for (const auto* iterVec: iterVecs) {
+            emitVecOp(Opcode::PADDQ, iterVec, stepVec);
+        }
+    }
+
+    emitInstr2op(Opcode::ADD, iterRegOp, step);
+    emitInstr2op(Opcode::CMP, iterRegOp, endRegOp);
+    emitJump(Opcode::JL, vecLoopLabel);
+    // Horizontal reduction of both accumulators into one lane
+    emitVecReduce(reduction.op, accVecs[0], accVecs[1]);
+
+    Register* tmpVec = registerAllocator.alloc(SSE);
+    if (options.avx2) {
+        const Operand accWideOp = getVecReg(accVecs[0]);
+        isVecWide = false;
+        emitInstr3op(Opcode::VEXTRACTI128, getVecReg(tmpVec), accWideOp, 1);
+        emitVecReduce(reduction.op, accVecs[0], tmpVec);
+    }
+
+    emitInstr3op(options.avx2 ? Opcode::VPSHUFD : Opcode::PSHUFD, getVecReg(tmpVec), getVecReg(accVecs[0]), emitHex(0xEE));
+    emitVecReduce(reduction.op, accVecs[0], tmpVec);
+
+    Register* sumReg = register_alloc();
+    const Operand sumRegOp = getReg(sumReg, REG64);
+    emitInstr2op(options.avx2 ? Opcode::VMOVQ : Opcode::MOVQ, sumRegOp, getVecReg(accVecs[0]));
+
+    if (options.avx2) {
+        vzeroupper();
+    }
+
+    for (auto* reg: {iterVecs[0], iterVecs[1], stepVec, accVecs[0], accVecs[1], tmpVec}) {
+        register_free(reg)
+    }
+
+    for (auto* reg: invariantRegs) {
+        register_free(reg)
+    }
+    // Fold the vector result into the accumulator
+    const std::string accName = cast::toString(acc->name)->data;
+    Register* accReg = emitLoadRegFromMem(*acc, REG64);
+    const Operand accRegOp = getReg(accReg, REG64);
+
+    switch (reduction.op) {
+        case ReductionOp::ADD: emitInstr2op(Opcode::ADD, accRegOp, sumRegOp);
+            break;
+        case ReductionOp::SUB: emitInstr2op(Opcode::SUB, accRegOp, sumRegOp);
+            break;
+        case ReductionOp::MUL: emitInstr2op(Opcode::IMUL, accRegOp, sumRegOp);
+            break;
+        case ReductionOp::AND: emitInstr2op(Opcode::AND, accRegOp, sumRegOp);
+            break;
+        case ReductionOp::IOR: emitInstr2op(Opcode::OR, accRegOp, sumRegOp);
+            break;
+        case ReductionOp::XOR: emitInstr2op(Opcode::XOR, accRegOp, sumRegOp);
+            break;
+        case ReductionOp::MIN:
+            emitInstr2op(Opcode::CMP, accRegOp, sumRegOp);
+            emitInstr2op(Opcode::CMOVG, accRegOp, sumRegOp);
+            break;
+        case ReductionOp::MAX:
+            emitInstr2op(Opcode::CMP, accRegOp, sumRegOp);
+            emitInstr2op(Opcode::CMOVL, accRegOp, sumRegOp);
+            break;
+    }
+
+    emitStoreMemFromReg(accName, acc->sType, accReg, REG64);
+    register_free(accReg)
+    register_free(sumReg)
+    register_free(endReg)
+    // Scalar epilogue for the remaining iterations
+    emitLabel(tailLabel);
+    emitInstr2op(Opcode::CMP, iterRegOp, countRegOp);
+    emitJump(Opcode::JGE, doneLabel);
+
+    Register* shadowedReg = registerVars.contains(iterVarName) ? registerVars.at(iterVarName) : nullptr;
+    registerVars[iterVarName] = iterReg;
+
+    emitLabel(loopLabel);
+    Register* reg = emitAST(dotimes.statements[0]);
+    register_free(reg)
+    emitInstr1op(Opcode::INC, iterRegOp);
+    emitInstr2op(Opcode::CMP, iterRegOp, countRegOp);
+    emitJump(Opcode::JL, loopLabel);
+    emitLabel(doneLabel);
+
+    if (shadowedReg) {
+        registerVars[iterVarName] = shadowedReg;
+    } else {
+        registerVars.erase(iterVarName);
+    }
+
+    register_free(iterReg)
+    register_free(countReg)
+    return nullptr;
+}
+
+Register* CodeGen::emitVecTerm(const ExprPtr& term,
+                               const Register* iterVec,
+                               const std::vector<Register*>& invariantRegs,
+                               const Reduction& reduction) {
+    auto leafReg = [&](const ExprPtr& leaf) -> const Register* {
+        for (size_t i = 0; i < reduction.invariants.size(); ++i) {
+            if (LoopVectorizer::isSameTerm(reduction.invariants[i], leaf)) {
+                return invariantRegs[i];
+            }
+        }
+
+        return iterVec;
+    };
+
+    const auto binop = cast::toBinop(term);
+    if (!binop) {
+        Register* reg = registerAllocator.alloc(SSE);
+        emitInstr2op(options.avx2 ? Opcode::VMOVDQA : Opcode::MOVDQA, getVecReg(reg), getVecReg(leafReg(term)));
+        return reg;
+    }
+
+    Register* lhs = emitVecTerm(binop->lhs, iterVec, invariantRegs, reduction);
+    // Leaves are used in place, only inner nodes need a register of their own
+    Register* rhs = cast::toBinop(binop->rhs) ? emitVecTerm(binop->rhs, iterVec, invariantRegs, reduction) : nullptr;
+    const Register* src = rhs ? rhs : leafReg(binop->rhs);
+
+    switch (binop->opToken.type) {
+        case TokenType::PLUS: emitVecOp(Opcode::PADDQ, lhs, src);
+            break;
+        case TokenType::MINUS: emitVecOp(Opcode::PSUBQ, lhs, src);
+            break;
+        case TokenType::MUL: emitVecMul(lhs, src, rangeAnalyzer.isUInt32(*binop->lhs) &&
+                                                  rangeAnalyzer.isUInt32(*binop->rhs));
+            break;
+        case TokenType::LOGAND: emitVecOp(Opcode::PAND, lhs, src);
+            break;
+        case TokenType::LOGIOR: emitVecOp(Opcode::POR, lhs, src);
+            break;
+        case TokenType::LOGXOR: emitVecOp(Opcode::PXOR, lhs, src);
+            break;
+        default:
+            break;
+    }
+
+    register_free(rhs)
+    return lhs;
+}
+
+void CodeGen::emitVecOp(const Opcode op, const Register* dst, const Register* src) {
+    const Operand dstOp = getVecReg(dst);
+
+    if (options.avx2) {
+        emitInstr3op(toVEX(op), dstOp, dstOp, getVecReg(src));
+    } else {
+        emitInstr2op(op, dstOp, getVecReg(src));
+    }
+}
 
-    // Function definitions
-    for (const auto& [func, defun]: functions) {
-        (this->*func)(defun);
+void CodeGen::emitVecMul(const Register* dst, const Register* src, const bool isUInt32) {
+    // Both factors fit the low halves, a single 32x32->64 product is exact
+    if (isUInt32) {
+        emitVecOp(Opcode::PMULUDQ, dst, src);
+        return;
     }
-    // Sections
-    for (const auto& [section, data]: sections) {
-        generatedCode += section;
 
-        for (const auto& [name, size]: data) {
-            generatedCode += std::format("{}: {}\n", name, size);
-        }
+    // There is no packed 64-bit multiply below AVX-512, build it from 32x32->64 products:
+    // lo(a)*lo(b) + ((hi(a)*lo(b) + lo(a)*hi(b)) << 32)
+    Register* tmp1 = registerAllocator.alloc(SSE);
+    Register* tmp2 = registerAllocator.alloc(SSE);
+    const Operand dstOp = getVecReg(dst);
+    const Operand srcOp = getVecReg(src);
+    const Operand tmp1Op = getVecReg(tmp1);
+    const Operand tmp2Op = getVecReg(tmp2);
+
+    if (options.avx2) {
+        emitInstr3op(Opcode::VPSRLQ, tmp1Op, dstOp, 32);
+        emitInstr3op(Opcode::VPMULUDQ, tmp1Op, tmp1Op, srcOp);
+        emitInstr3op(Opcode::VPSRLQ, tmp2Op, srcOp, 32);
+        emitInstr3op(Opcode::VPMULUDQ, tmp2Op, tmp2Op, dstOp);
+    } else {
+        emitInstr2op(Opcode::MOVDQA, tmp1Op, dstOp);
+        emitInstr2op(Opcode::PSRLQ, tmp1Op, 32);
+        emitInstr2op(Opcode::PMULUDQ, tmp1Op, srcOp);
+        emitInstr2op(Opcode::MOVDQA, tmp2Op, srcOp);
+        emitInstr2op(Opcode::PSRLQ, tmp2Op, 32);
+        emitInstr2op(Opcode::PMULUDQ, tmp2Op, dstOp);
     }
 
-    return generatedCode;
-}
+    emitVecOp(Opcode::PADDQ, tmp1, tmp2);
 
-Register* CodeGen::emitAST(const ExprPtr& ast) {
-    if (const auto binop = cast::toBinop(ast)) {
-        return emitBinop(*binop);
-    } else if (const auto dotimes = cast::toDotimes(ast)) {
-        return emitDotimes(*dotimes);
-    } else if (const auto loop = cast::toLoop(ast)) {
-        return emitLoop(*loop);
-    } else if (const auto let = cast::toLet(ast)) {
-        return emitLet(*let);
-    } else if (const auto setq = cast::toSetq(ast)) {
-        emitSetq(*setq);
-    } else if (const auto defvar = cast::toDefvar(ast)) {
-        emitDefvar(*defvar);
-    } else if (const auto defconst = cast::toDefconstant(ast)) {
-        emitDefconst(*defconst);
-    } else if (const auto defun = cast::toDefun(ast)) {
-        functions.emplace_back(&CodeGen::emitDefun, *defun);
-    } else if (const auto funcCall = cast::toFuncCall(ast)) {
-        return emitFuncCall(*funcCall);
-    } else if (const auto if_ = cast::toIf(ast)) {
-        return emitIf(*if_);
-    } else if (const auto when = cast::toWhen(ast)) {
-        return emitWhen(*when);
-    } else if (const auto cond = cast::toCond(ast)) {
-        return emitCond(*cond);
-    } else if (cast::toInt(ast) || cast::toDouble(ast) || cast::toVar(ast)) {
-        return emitPrimitive(ast);
+    if (options.avx2) {
+        emitInstr3op(Opcode::VPSLLQ, tmp1Op, tmp1Op, 32);
+    } else {
+        emitInstr2op(Opcode::PSLLQ, tmp1Op, 32);
     }
 
-    return nullptr;
+    emitVecOp(Opcode::PMULUDQ, dst, src);
+    emitVecOp(Opcode::PADDQ, dst, tmp1);
+
+    register_free(tmp2)
+    register_free(tmp1)
 }
 
-Register* CodeGen::emitBinop(const BinOpExpr& binop) {
-    switch (binop.opToken.type) {
-        case TokenType::PLUS:
-            return emitExpr(binop.lhs, binop.rhs, {"add", "addsd"});
-        case TokenType::MINUS:
-            return emitExpr(binop.lhs, binop.rhs, {"sub", "subsd"});
-        case TokenType::DIV:
-            return emitExpr(binop.lhs, binop.rhs, {"idiv", "divsd"});
-        case TokenType::MUL:
-            return emitExpr(binop.lhs, binop.rhs, {"imul", "mulsd"});
-        case TokenType::LOGAND:
-            return emitExpr(binop.lhs, binop.rhs, {"and", nullptr});
-        case TokenType::LOGIOR:
-            return emitExpr(binop.lhs, binop.rhs, {"or", nullptr});
-        case TokenType::LOGXOR:
-            return emitExpr(binop.lhs, binop.rhs, {"xor", nullptr});
-        case TokenType::LOGNOR: {
-            const ExprPtr negOne = std::make_shared<IntExpr>(-1);
-            // Bitwise NOT seperately
-            Register* regLhs = emitExpr(binop.lhs, negOne, {"xor", nullptr});
-            Register* regRhs = emitExpr(binop.rhs, negOne, {"xor", nullptr});
-            emitInstr2op("and", getRegName(regLhs, REG64), getRegName(regRhs, REG64));
-            register_free(regRhs)
-            return regLhs;
+void CodeGen::emitVecReduce(const ReductionOp op, const Register* acc, const Register* src) {
+    switch (op) {
+        case ReductionOp::ADD:
+        case ReductionOp::SUB:
+            // acc - a - b == acc - (a + b), the terms are summed and subtracted once at the end
+            emitVecOp(Opcode::PADDQ, acc, src);
+            break;
+        case ReductionOp::MUL:
+            emitVecMul(acc, src);
+            break;
+        case ReductionOp::AND:
+            emitVecOp(Opcode::PAND, acc, src);
+            break;
+        case ReductionOp::IOR:
+            emitVecOp(Opcode::POR, acc, src);
+            break;
+        case ReductionOp::XOR:
+            emitVecOp(Opcode::PXOR, acc, src);
+            break;
+        case ReductionOp::MIN:
+        case ReductionOp::MAX: {
+            // Only reached with AVX2: take src in the lanes where it wins
+            Register* mask = registerAllocator.alloc(SSE);
+            const Operand maskOp = getVecReg(mask);
+            const Operand accOp = getVecReg(acc);
+            const Operand srcOp = getVecReg(src);
+
+            if (op == ReductionOp::MAX) {
+                emitInstr3op(Opcode::VPCMPGTQ, maskOp, srcOp, accOp);
+            } else {
+                emitInstr3op(Opcode::VPCMPGTQ, maskOp, accOp, srcOp);
+            }
+
+            emitInstr4op(Opcode::VBLENDVPD, accOp, accOp, srcOp, maskOp);
+            register_free(mask)
+            break;
         }
-        case TokenType::NOT:
-            return emitCmpZero(binop.lhs);
-        case TokenType::EQUAL:
-        case TokenType::NEQUAL:
-        case TokenType::GREATER_THEN:
-        case TokenType::LESS_THEN:
-        case TokenType::GREATER_THEN_EQ:
-        case TokenType::LESS_THEN_EQ:
-        case TokenType::AND:
-        case TokenType::OR:
-            return emitExpr(binop.lhs, binop.rhs, {"cmp", "ucomisd"});
-        default:
-            return nullptr;
     }
 }
 
-Register* CodeGen::emitDotimes(const DotimesExpr& dotimes) {
-    const auto iterVar = cast::toVar(dotimes.iterationCount);
-    const std::string iterVarName = cast::toString(iterVar->name)->data;
-    // Labels
-    const std::string loopLabel = createLabel();
-    const std::string doneLabel = createLabel();
-    // Loop condition
-    ExprPtr name = iterVar->name;
-    ExprPtr value = std::make_shared<IntExpr>(0);
-    ExprPtr lhs = std::make_shared<VarExpr>(name, value, SymbolType::LOCAL);
-    cast::toVar(lhs)->vType = iterVar->vType;
-
-    ExprPtr rhs = iterVar->value;
-    auto token = Token{TokenType::LESS_THEN};
-    ExprPtr test = std::make_shared<BinOpExpr>(lhs, rhs, token);
-    // Address of iter var
-    stack_alloc(memorySizeInBytes[REG64])
-    std::string iterVarAddr = getAddr(iterVarName, SymbolType::LOCAL, REG64);
-    // Set 0 to iter var
-    mov(iterVarAddr, 0);
-    // Loop label
-    emitLabel(loopLabel);
-    emitTest(test, std::string(), doneLabel);
-    // Emit statements
+void CodeGen::emitVecBroadcast(const Register* dst, const Operand& value) {
+    const Operand dstOp = getVecReg(dst);
+
+    if (value.isImm() && value.value == 0) {
+        emitVecOp(Opcode::PXOR, dst, dst);
+        return;
+    }
+
+    if (value.isImm() && value.value == -1) {
+        emitVecOp(Opcode::PCMPEQD, dst, dst);
+        return;
+    }
+    // Immediates go through a scratch register first
     Register* reg = nullptr;
-    for (const auto& statement: dotimes.statements) {
-        reg = emitAST(statement);
-        register_free(reg)
+    Operand regOp = value;
+    if (value.isImm()) {
+        reg = register_alloc();
+        regOp = getReg(reg, REG64);
+        mov(regOp, value);
     }
-    // Increment iteration count
-    reg = register_alloc();
-    const char* regStr = getRegName(reg, REG64);
 
-    mov(regStr, iterVarAddr);
-    emitInstr2op("add", regStr, 1);
-    mov(iterVarAddr, regStr);
+    const Operand dstLowOp = getRegByID(dst->id, REG64);
+    if (options.avx2) {
+        emitInstr2op(Opcode::VMOVQ, dstLowOp, regOp);
+        emitInstr2op(Opcode::VPBROADCASTQ, dstOp, dstLowOp);
+    } else {
+        emitInstr2op(Opcode::MOVQ, dstOp, regOp);
+        emitInstr2op(Opcode::PUNPCKLQDQ, dstOp, dstOp);
+    }
 
     register_free(reg)
+}
 
-    emitJump("jmp", loopLabel);
-    emitLabel(doneLabel);
+Operand CodeGen::getVecReg(const Register* reg) const {
+    return Operand::makeReg(reg->id, isVecWide ? Operand::WIDE : static_cast<uint32_t>(REG64));
+}
 
-    stack_dealloc(memorySizeInBytes[REG64])
+Operand CodeGen::getLaneIndexConstant(const int lanes) {
+    static const std::string names[] = {"_lane_index2", "_lane_index4"};
+    const std::string& name = names[lanes == 4];
+    const char* section = "\nsection .rodata\n";
+    const Operand addr = Operand::makeRel(Operand::UNSIZED, symbols.intern(name));
 
-    return reg;
+    if (sections.contains(section)) {
+        for (const auto& [label, _]: sections.at(section)) {
+            if (label == name) {
+                return addr;
+            }
+        }
+    }
+
+    updateSections(section, std::make_pair(name, lanes == 4 ? "dq 0, 1, 2, 3" : "dq 0, 1"));
+    return addr;
 }
 
 Register* CodeGen::emitLoop(const LoopExpr& loop) {
     Register* reg = nullptr;
     // Labels
-    std::string loopLabel = createLabel();
-    std::string doneLabel = createLabel();
+    const uint32_t loopLabel = createLabel();
+    const uint32_t doneLabel = createLabel();
 
+    const auto promoted = promoteGlobals(loop.sexprs, 1);
     emitLabel(loopLabel);
 
     bool hasReturn{false};
@@ -246,16 +1516,17 @@ Register* CodeGen::emitLoop(const LoopExpr& loop) {
                 continue;
             }
 
-            emitTest(when->test, std::string(), loopLabel);
-            emitJump("jmp", doneLabel);
+            emitBranch(when->test, loopLabel, false);
+            emitJump(Opcode::JMP, doneLabel);
             hasReturn = true;
             break;
         }
 
         if (!hasReturn)
-            emitJump("jmp", loopLabel);
+            emitJump(Opcode::JMP, loopLabel);
     }
     emitLabel(doneLabel);
+    demoteGlobals(promoted);
 
     return reg;
 }
@@ -265,15 +1536,29 @@ Register* CodeGen::emitLet(const LetExpr& let) {
     uint32_t requiredStackMem = 0;
 
     for (const auto& var: let.bindings) {
-        const int size = memorySizeInBytes[getMemSize(var)];
-        requiredStackMem += size;
+        if (!isPromotable(*cast::toVar(var), let.body)) {
+            requiredStackMem += memorySizeInBytes[getMemSize(var)];
+        }
     }
 
     stack_alloc(requiredStackMem)
 
+    // Promoted bindings get a register, the ones they shadow are restored after the body
+    std::vector<std::pair<std::string, Register*> > shadowedRegs;
     for (const auto& var: let.bindings) {
-        const uint32_t memSize = getMemSize(var);
-        handleAssignment(var, memSize);
+        const auto var_ = cast::toVar(var);
+
+        if (!isPromotable(*var_, let.body)) {
+            handleAssignment(var, getMemSize(var));
+            continue;
+        }
+
+        const std::string varName = cast::toString(var_->name)->data;
+        Register* varReg = var_->vType == VarType::DOUBLE ? registerAllocator.alloc(SSE) : register_alloc();
+        emitAssignVarReg(varReg, var_->value);
+
+        shadowedRegs.emplace_back(varName, registerVars.contains(varName) ? registerVars.at(varName) : nullptr);
+        registerVars[varName] = varReg;
     }
 
     for (const auto& sexpr: let.body) {
@@ -281,6 +1566,17 @@ Register* CodeGen::emitLet(const LetExpr& let) {
         register_free(reg)
     }
 
+    for (auto it = shadowedRegs.rbegin(); it != shadowedRegs.rend(); ++it) {
+        const auto& [varName, shadowedReg] = *it;
+        register_free(registerVars.at(varName))
+
+        if (shadowedReg) {
+            registerVars[varName] = shadowedReg;
+        } else {
+            registerVars.erase(varName);
+        }
+    }
+
     stack_dealloc(requiredStackMem)
 
     return reg;
@@ -303,148 +1599,209 @@ void CodeGen::emitDefun(const DefunExpr& defun) {
     const auto func = cast::toVar(defun.name);
     currentScope = cast::toString(func->name)->data;
 
-    emitLabel("\n" + currentScope);
-    push("rbp")
-    mov("rbp", "rsp");
+    const size_t begin = code.size();
+    emitLabel(symbols.intern(currentScope));
+    push(getRegByID(RBP, REG64))
+    mov(getRegByID(RBP, REG64), getRegByID(RSP, REG64));
 
     uint32_t stackSize = 0;
-    int scratchIdx = 0, sseIdx = 0;
+    size_t scratchIdx = 0, sseIdx = 0;
     for (auto& arg: defun.args) {
         const auto param = cast::toVar(arg);
         const std::string paramName = cast::toString(param->name)->data;
 
-        if (param->vType == VarType::INT) {
-            if (scratchIdx > 5)
-                continue;
-            scratchIdx++;
-        } else if (param->vType == VarType::DOUBLE) {
-            if (sseIdx > 7)
-                continue;
-            sseIdx++;
+        // Parameters past the argument registers are on the stack in declaration order
+        if ((param->vType == VarType::INT && scratchIdx == std::size(paramRegisters)) ||
+            (param->vType == VarType::DOUBLE && sseIdx == std::size(paramRegistersSSE))) {
+            stackAllocator.pushStackFrame(currentScope, paramName, SymbolType::PARAM);
+            continue;
+        }
+        scratchIdx += param->vType == VarType::INT;
+        sseIdx += param->vType == VarType::DOUBLE;
+
+        if (!isPromotable(*param, defun.forms)) {
+            stackSize += memorySizeInBytes[getMemSize(arg)];
+            // The caller's frame is above rbp, uses the analysis left as stack parameters get the local slot
+            if (param->sType == SymbolType::PARAM) {
+                stackAllocator.pushRegisterParam(currentScope, paramName);
+            } else {
+                stackAllocator.pushStackFrame(currentScope, paramName, param->sType);
+            }
         }
-
-        stackSize += memorySizeInBytes[getMemSize(arg)];
-        stackAllocator.pushStackFrame(currentScope, paramName, param->sType);
     }
 
     stack_alloc(stackSize)
 
+    // Parameters are copied out of the argument registers, into registers of their own when possible
+    std::vector<std::string> paramRegs;
     scratchIdx = 0, sseIdx = 0;
     for (const auto& arg: defun.args) {
         const auto param = cast::toVar(arg);
         const std::string paramName = cast::toString(param->name)->data;
 
-        if ((param->vType == VarType::INT && scratchIdx > 5) || (param->vType == VarType::DOUBLE && sseIdx > 7)) {
+        if ((param->vType == VarType::INT && scratchIdx == std::size(paramRegisters)) ||
+            (param->vType == VarType::DOUBLE && sseIdx == std::size(paramRegistersSSE))) {
             continue;
         }
 
-        mov(getAddr(paramName, param->sType, REG64),
-            getRegNameByID(param->vType == VarType::INT
-                ? paramRegisters[scratchIdx++]
-                : paramRegistersSSE[sseIdx++], REG64));
+        Register* argReg = registerAllocator.regFromID(param->vType == VarType::INT
+                                                           ? paramRegisters[scratchIdx++]
+                                                           : paramRegistersSSE[sseIdx++]);
+
+        if (isPromotable(*param, defun.forms)) {
+            Register* varReg = isSSE(argReg->rType) ? registerAllocator.alloc(SSE) : register_alloc();
+            emitMoveReg(varReg, argReg);
+
+            registerVars[paramName] = varReg;
+            paramRegs.push_back(paramName);
+        } else {
+            emitStoreMemFromReg(paramName, param->sType, argReg, REG64);
+        }
     }
 
+    // Outside of loops a global has to be touched twice to make up for the load and the store
+    const auto promoted = promoteGlobals(defun.forms, 2);
+
     Register* reg = nullptr;
     for (const auto& form: defun.forms) {
-        if (form == defun.forms.back() && cast::toBinop(form)) {
-            reg = emitSet(form);
-        } else {
-            reg = emitAST(form);
-        }
+        reg = emitAST(form);
     }
 
+    demoteGlobals(promoted);
+
     if (reg && isSSE(reg->rType)) {
-        movsd("xmm0", getRegName(reg, REG64));
+        movsd(getRegByID(xmm0, REG64), getReg(reg, REG64));
     } else if (reg && !isSSE(reg->rType)) {
-        mov("rax", getRegName(reg, REG64));
+        mov(getRegByID(RAX, REG64), getReg(reg, REG64));
     }
 
     register_free(reg)
+
+    for (const auto& paramName: paramRegs) {
+        register_free(registerVars.at(paramName))
+        registerVars.erase(paramName);
+    }
+
     stack_dealloc(stackSize)
-    pop("rbp")
+    pop(getRegByID(RBP, REG64))
     ret();
+
+    shrinkWrap(begin);
+    allocateRegisters(begin);
+
+    // The result registers are written even when the body leaves them alone
+    functionClobbers[cast::toString(func->name)->data] =
+        RegisterAllocator::clobbersOf(code, begin) | 1u << RAX | 1u << xmm0;
 }
 
 Register* CodeGen::emitFuncCall(const FuncCallExpr& funcCall) {
     const auto func = cast::toVar(funcCall.name);
     const std::string funcName = cast::toString(func->name)->data;
 
-    // Calculate the proper stack size before function call
-    uint32_t stackAlignedSize = stackAllocator.calculateRequiredStackSize(funcCall.args);
-    stack_alloc(stackAlignedSize)
-
-    Register* reg;
-    int scratchIdx = 0, sseIdx = 0, stackIdx = 0;
+    // Room for the arguments passed on the stack
+    const uint32_t stackArgsSize = stackAllocator.calculateRequiredStackSize(funcCall.args, std::size(paramRegisters),
+                                                                             std::size(paramRegistersSSE));
+    stack_alloc(stackArgsSize)
+
+    // Arguments are evaluated before any of them is moved to its register, a nested call
+    // would clobber the argument registers
+    std::vector<std::pair<uint32_t, std::any> > regArgs;
+    std::vector<Register*> argRegs;
+    size_t scratchIdx = 0, sseIdx = 0;
+    int stackIdx = 0;
     for (const auto& arg: funcCall.args) {
         const auto param = cast::toVar(arg);
 
-        // If scratch param size > 5 or sse param size > 7, push the params onto stack
-        if ((scratchIdx > 5 && param->vType == VarType::INT) || (sseIdx > 7 && param->vType == VarType::DOUBLE)) {
+        // Parameters past the argument registers are pushed onto the stack
+        if ((param->vType == VarType::INT && scratchIdx == std::size(paramRegisters)) ||
+            (param->vType == VarType::DOUBLE && sseIdx == std::size(paramRegistersSSE))) {
             pushParamOntoStack(funcName, *param, stackIdx);
             continue;
         }
         // Push parameter to the appropriate register
         if (const auto innerVar = cast::toVar(param->value)) {
             const std::string paramName = cast::toString(innerVar->name)->data;
-            pushParamToRegister(param->vType == VarType::INT
-                                    ? paramRegisters[scratchIdx++]
-                                    : paramRegistersSSE[sseIdx++],
-                                getAddr(paramName, innerVar->sType, REG64).c_str());
-        } else if (const auto binop = cast::toBinop(param->value)) {
-            reg = emitBinop(*binop);
-            pushParamToRegister(isSSE(reg->rType)
-                                    ? paramRegistersSSE[sseIdx++]
-                                    : paramRegisters[scratchIdx++],
-                                getRegName(reg, REG64));
-            register_free(reg)
+            const Register* varReg = getVarReg(*innerVar);
+            regArgs.emplace_back(param->vType == VarType::INT
+                                     ? paramRegisters[scratchIdx++]
+                                     : paramRegistersSSE[sseIdx++],
+                                 varReg
+                                     ? getReg(varReg, REG64)
+                                     : getAddr(paramName, innerVar->sType, REG64));
+        } else if (cast::toBinop(param->value)) {
+            Register* reg = emitSet(param->value);
+            regArgs.emplace_back(isSSE(reg->rType)
+                                     ? paramRegistersSSE[sseIdx++]
+                                     : paramRegisters[scratchIdx++],
+                                 getReg(reg, REG64));
+            argRegs.push_back(reg);
         } else if (const auto fc = cast::toFuncCall(param->value)) {
-            reg = emitFuncCall(*fc);
-
-            pushParamToRegister(isSSE(reg->rType)
-                                    ? paramRegistersSSE[sseIdx++]
-                                    : paramRegisters[scratchIdx++],
-                                getRegName(reg, REG64));
-            register_free(reg)
+            Register* reg = emitFuncCall(*fc);
+            regArgs.emplace_back(isSSE(reg->rType)
+                                     ? paramRegistersSSE[sseIdx++]
+                                     : paramRegisters[scratchIdx++],
+                                 getReg(reg, REG64));
+            argRegs.push_back(reg);
         } else {
             if (param->vType == VarType::INT) {
-                pushParamToRegister(paramRegisters[scratchIdx++], cast::toInt(param->value)->n);
+                regArgs.emplace_back(paramRegisters[scratchIdx++], cast::toInt(param->value)->n);
             } else if (param->vType == VarType::DOUBLE) {
-                pushParamToRegister(paramRegistersSSE[sseIdx++], cast::toDouble(param->value)->n);
+                regArgs.emplace_back(paramRegistersSSE[sseIdx++], cast::toDouble(param->value)->n);
             }
         }
     }
 
-    emitInstr1op("call", funcName);
+    uint32_t argMask = 0;
+    for (const auto& [rid, value]: regArgs) {
+        pushParamToRegister(rid, value);
+        argMask |= 1u << rid;
+    }
+
+    for (auto* reg: argRegs) {
+        register_free(reg)
+    }
+
+    // The call operand records the argument registers and the registers the callee writes for liveness
+    Operand callee = Operand::makeSymbol(symbols.intern(funcName));
+    const auto clobbers = functionClobbers.find(funcName);
+    callee.value = argMask | static_cast<int64_t>(clobbers != functionClobbers.end() ? clobbers->second : 0) << 32;
+    emitInstr1op(Opcode::CALL, callee);
 
+    Register* reg;
     if (cast::toDouble(funcCall.returnType)) {
         reg = registerAllocator.alloc(SSE);
-        movsd(getRegName(reg, REG64), "xmm0");
+        movsd(getReg(reg, REG64), getRegByID(xmm0, REG64));
     } else {
         reg = register_alloc();
-        mov(getRegName(reg, REG64), "rax");
+        mov(getReg(reg, REG64), getRegByID(RAX, REG64));
     }
 
-    stack_dealloc(stackAlignedSize)
+    stack_dealloc(stackArgsSize)
 
     return reg;
 }
 
 Register* CodeGen::emitIf(const IfExpr& if_) {
-    const std::string trueLabel = createLabel();
-    const std::string elseLabel = createLabel();
+    if (!cast::toUninitialized(if_.else_)) {
+        if (Register* reg = emitSelect({{if_.test, if_.then}}, if_.else_)) {
+            register_free(reg)
+            return reg;
+        }
+    }
+
+    const uint32_t elseLabel = createLabel();
     // Emit test
-    emitTest(if_.test, trueLabel, elseLabel);
+    emitBranch(if_.test, elseLabel, false);
     // Emit then
     Register* reg = nullptr;
     reg = emitAST(if_.then);
     // Emit else
     if (!cast::toUninitialized(if_.else_)) {
-        std::string done = createLabel();
-        emitJump("jmp", done);
+        const uint32_t done = createLabel();
+        emitJump(Opcode::JMP, done);
         emitLabel(elseLabel);
 
-        register_free(reg)
-        reg = emitAST(if_.else_);
+        reg = emitMerge(reg, emitAST(if_.else_));
         emitLabel(done);
     } else {
         emitLabel(elseLabel);
@@ -455,9 +1812,9 @@ Register* CodeGen::emitIf(const IfExpr& if_) {
 }
 
 Register* CodeGen::emitWhen(const WhenExpr& when) {
-    const std::string doneLabel = createLabel();
+    const uint32_t doneLabel = createLabel();
     // Emit test
-    emitTest(when.test, std::string(), doneLabel);
+    emitBranch(when.test, doneLabel, false);
     // Emit then
     Register* reg = nullptr;
     for (const auto& form: when.then) {
@@ -469,24 +1826,356 @@ Register* CodeGen::emitWhen(const WhenExpr& when) {
     return reg;
 }
 
-Register* CodeGen::emitCond(const CondExpr& cond) {
-    const std::string done = createLabel();
+Register* CodeGen::emitCond(const CondExpr& cond) {
+    // A cond ending in a t clause is a chain of selects when every clause has a single form
+    const auto isSingle = [](const auto& variant) { return variant.second.size() == 1; };
+    if (!cond.variants.empty() && cast::toT(cond.variants.back().first) &&
+        std::ranges::all_of(cond.variants, isSingle)) {
+        std::vector<std::pair<ExprPtr, ExprPtr> > variants;
+        for (auto it = cond.variants.begin(); it != cond.variants.end() - 1; ++it) {
+            variants.emplace_back(it->first, it->second.front());
+        }
+
+        if (Register* reg = emitSelect(variants, cond.variants.back().second.front())) {
+            return reg;
+        }
+    }
+
+    if (const auto switch_ = switchOf(cond)) {
+        return emitSwitch(cond, *switch_);
+    }
+
+    const uint32_t done = createLabel();
+
+    Register* reg = nullptr;
+    for (const auto& [test, forms]: cond.variants) {
+        const uint32_t elseLabel = createLabel();
+        emitBranch(test, elseLabel, false);
+
+        Register* formReg = nullptr;
+        for (const auto& form: forms) {
+            register_free(formReg)
+            formReg = emitAST(form);
+        }
+
+        reg = emitMerge(reg, formReg);
+        emitJump(Opcode::JMP, done);
+        emitLabel(elseLabel);
+    }
+    emitLabel(done);
+
+    return reg;
+}
+
+std::optional<CodeGen::Switch> CodeGen::switchOf(const CondExpr& cond) {
+    if (!options.lowerSwitches) {
+        return std::nullopt;
+    }
+
+    Switch switch_{nullptr, {}, cond.variants.size()};
+
+    // The key is the first variable compared, an integer that is not a constant
+    const auto isKey = [&](const ExprPtr& expr) {
+        const auto var = cast::toVar(expr);
+        if (!var) return false;
+
+        if (!switch_.key) {
+            const auto leaf = selectLeaf(expr);
+            if (!leaf || leaf->goal == Goal::IMM) return false;
+            switch_.key = var;
+        }
+        return cast::toString(var->name)->data == cast::toString(switch_.key->name)->data;
+    };
+
+    // (= key 1), or (or (= key 1) (= key 2)) for the values of a case clause
+    std::function<bool(const ExprPtr&, size_t)> addCases = [&](const ExprPtr& test, const size_t clause) {
+        const auto binop = cast::toBinop(test);
+        if (!binop) return false;
+
+        if (binop->opToken.type == TokenType::OR) {
+            return addCases(binop->lhs, clause) && addCases(binop->rhs, clause);
+        }
+        if (binop->opToken.type != TokenType::EQUAL) return false;
+
+        const bool isKeyLhs = isKey(binop->lhs);
+        const ExprPtr& value = isKeyLhs ? binop->rhs : binop->lhs;
+        if ((!isKeyLhs && !isKey(binop->rhs)) || !isKnownInt(value)) return false;
+
+        // The first clause testing a value is the one taken
+        const int64_t n = rangeAnalyzer.rangeOf(*value).lo;
+        if (std::ranges::find(switch_.cases, n, &std::pair<int64_t, size_t>::first) == switch_.cases.end()) {
+            switch_.cases.emplace_back(n, clause);
+        }
+        return true;
+    };
+
+    for (size_t i = 0; i < cond.variants.size(); ++i) {
+        const ExprPtr& test = cond.variants[i].first;
+
+        if (i + 1 == cond.variants.size() && cast::toT(test)) {
+            switch_.otherwise = i;
+        } else if (!addCases(test, i)) {
+            return std::nullopt;
+        }
+    }
+
+    if (switch_.cases.size() < minSwitchCases) {
+        return std::nullopt;
+    }
+
+    std::ranges::sort(switch_.cases);
+    return switch_;
+}
+
+Register* CodeGen::emitSwitch(const CondExpr& cond, const Switch& switch_) {
+    const uint32_t done = createLabel();
+
+    std::vector<uint32_t> labels(cond.variants.size());
+    std::ranges::generate(labels, [this] { return createLabel(); });
+    const uint32_t otherwise = switch_.otherwise < labels.size() ? labels[switch_.otherwise] : done;
+
+    // Every compare reads the key in place
+    const VarExpr& var = *switch_.key;
+    const Register* keyReg = getVarReg(var);
+    const Operand key = keyReg
+                            ? getReg(keyReg, REG64)
+                            : getAddr(cast::toString(var.name)->data, var.sType, REG64);
+
+    emitSwitchCases(key, switch_.cases, labels, otherwise);
+
+    Register* reg = nullptr;
+    for (size_t i = 0; i < cond.variants.size(); ++i) {
+        emitLabel(labels[i]);
+
+        Register* formReg = nullptr;
+        for (const auto& form: cond.variants[i].second) {
+            register_free(formReg)
+            formReg = emitAST(form);
+        }
+
+        reg = emitMerge(reg, formReg);
+        emitJump(Opcode::JMP, done);
+    }
+    emitLabel(done);
+
+    return reg;
+}
+
+void CodeGen::emitSwitchCases(const Operand& key, const std::span<const std::pair<int64_t, size_t> > cases,
+                              const std::vector<uint32_t>& labels, const uint32_t otherwise) {
+    const int64_t lo = cases.front().first;
+    const int64_t hi = cases.back().first;
+
+    if (cases.size() < minSwitchCases) {
+        for (const auto& [value, clause]: cases) {
+            emitInstr2op(Opcode::CMP, key, value);
+            emitJump(Opcode::JE, labels[clause]);
+        }
+        emitJump(Opcode::JMP, otherwise);
+        return;
+    }
+
+    std::vector<size_t> clauses;
+    for (const size_t clause: cases | std::views::values) {
+        if (std::ranges::find(clauses, clause) == clauses.end()) clauses.push_back(clause);
+    }
+
+    // A mask per clause with the bits of its values set
+    if (hi - lo < 64 && clauses.size() <= maxBitTestClauses) {
+        Register* index = emitSwitchIndex(key, lo, hi, otherwise);
+        Register* mask = register_alloc();
+
+        for (const size_t clause: clauses) {
+            uint64_t bits = 0;
+            for (const auto& [value, c]: cases) {
+                if (c == clause) bits |= uint64_t{1} << (value - lo);
+            }
+
+            mov(getReg(mask, REG64), emitHex(bits));
+            emitInstr2op(Opcode::BT, getReg(mask, REG64), getReg(index, REG64));
+            emitJump(Opcode::JB, labels[clause]);
+        }
+        emitJump(Opcode::JMP, otherwise);
+
+        register_free(mask)
+        register_free(index)
+        return;
+    }
+
+    // Entries hold the distance from the table to their case, which keeps the text position independent
+    if (static_cast<int64_t>(cases.size()) * 100 >= (hi - lo + 1) * minJumpTableDensity) {
+        Register* index = emitSwitchIndex(key, lo, hi, otherwise);
+        Register* base = register_alloc();
+        const uint32_t table = createLabel();
+
+        emitInstr2op(Opcode::LEA, getReg(base, REG64), Operand::makeRel(Operand::UNSIZED, table));
+        emitInstr2op(Opcode::MOVSXD, getReg(index, REG64), Operand::makeIndexed(REG32, base->id, index->id, 4, 0));
+        emitInstr2op(Opcode::ADD, getReg(index, REG64), getReg(base, REG64));
+        emitInstr1op(Opcode::JMPR, getReg(index, REG64));
+        register_free(base)
+        register_free(index)
+
+        emitLabel(table);
+        auto it = cases.begin();
+        for (int64_t value = lo; value <= hi; ++value) {
+            const uint32_t target = it->first == value ? labels[(it++)->second] : otherwise;
+            emitInstr2op(Opcode::DD, Operand::makeSymbol(target), Operand::makeSymbol(table));
+        }
+        return;
+    }
+
+    // Sparse cases are searched, each half may be dense enough for a table of its own
+    const size_t mid = cases.size() / 2;
+    const uint32_t upper = createLabel();
+
+    emitInstr2op(Opcode::CMP, key, cases[mid].first);
+    emitJump(Opcode::JGE, upper);
+    emitSwitchCases(key, cases.first(mid), labels, otherwise);
+    emitLabel(upper);
+    emitSwitchCases(key, cases.subspan(mid), labels, otherwise);
+}
+
+Register* CodeGen::emitSwitchIndex(const Operand& key, const int64_t lo, const int64_t hi, const uint32_t otherwise) {
+    Register* index = register_alloc();
+
+    if (key.isReg() && lo != 0 && lo > std::numeric_limits<int32_t>::min()) {
+        emitInstr2op(Opcode::LEA, getReg(index, REG64), Operand::makeMem(Operand::UNSIZED, key.reg, -lo));
+    } else {
+        mov(getReg(index, REG64), key);
+        if (lo != 0) {
+            emitInstr2op(Opcode::SUB, getReg(index, REG64), lo);
+        }
+    }
+
+    // Keys below lo wrap around to large unsigned values
+    emitInstr2op(Opcode::CMP, getReg(index, REG64), hi - lo);
+    emitJump(Opcode::JA, otherwise);
+    return index;
+}
+
+Register* CodeGen::emitSelect(const std::vector<std::pair<ExprPtr, ExprPtr> >& variants, const ExprPtr& otherwise) {
+    const auto leafOf = [this](const ExprPtr& expr) { return selectLeaf(expr); };
+
+    if (!options.ifConvert || variants.empty() || variants.size() > maxSelectVariants) {
+        return nullptr;
+    }
+
+    // Tests are integer compares the selector feeds straight into the flags
+    const std::optional<bool> isDouble = selectArmClass(otherwise);
+    for (const auto& [test, arm]: variants) {
+        const auto binop = cast::toBinop(test);
+        if (!isDouble || selectArmClass(arm) != isDouble || !binop || !selector.label(*binop, Goal::FLAGS, leafOf)) {
+            return nullptr;
+        }
+    }
+
+    // The first test that holds wins, so the chain is built from the last clause up
+    Register* reg = emitAST(otherwise);
+    for (auto it = variants.rbegin(); it != variants.rend(); ++it) {
+        const auto& binop = *cast::toBinop(it->first);
+        const ExprPtr& arm = it->second;
+        // cmov reads an integer variable in place
+        std::optional<Operand> src;
+        if (!*isDouble && cast::toVar(arm) && !isKnownInt(arm)) {
+            src = foldOperand(arm, reg, Opcode::MOV, REG64);
+        }
+
+        Register* armReg = src ? nullptr : emitAST(arm);
+        selector.label(binop, Goal::FLAGS, leafOf);
+        emitTile(binop, Goal::FLAGS);
+
+        reg = emitConditionalMove(binop.opToken.type, reg, src ? *src : getReg(armReg, REG64));
+        register_free(armReg)
+    }
+
+    return reg;
+}
+
+std::optional<bool> CodeGen::selectArmClass(const ExprPtr& arm) {
+    if (isKnownInt(arm)) {
+        return false;
+    }
+    if (cast::toDouble(arm)) {
+        return true;
+    }
+
+    if (const auto var = cast::toVar(arm)) {
+        if (const Register* varReg = getVarReg(*var)) {
+            return isSSE(varReg->rType);
+        }
+        // Parameters on the stack are loaded into a general purpose register whatever their type
+        if (var->vType == VarType::INT || (var->vType == VarType::DOUBLE && var->sType != SymbolType::PARAM)) {
+            return var->vType == VarType::DOUBLE;
+        }
+        return std::nullopt;
+    }
+
+    const auto binop = cast::toBinop(arm);
+    if (binop && selector.label(*binop, Goal::REG, [this](const ExprPtr& expr) { return selectLeaf(expr); }) &&
+        selector.costOf(*binop, Goal::REG) <= maxSelectArmCost) {
+        return false;
+    }
+
+    return std::nullopt;
+}
+
+// The cmov taken when the compare of op holds, and the setcc of the opposite condition
+static std::pair<Opcode, Opcode> conditionalMoveOf(const TokenType op) {
+    switch (op) {
+        case TokenType::EQUAL: return {Opcode::CMOVE, Opcode::SETNE};
+        case TokenType::NEQUAL: return {Opcode::CMOVNE, Opcode::SETE};
+        case TokenType::GREATER_THEN: return {Opcode::CMOVG, Opcode::SETLE};
+        case TokenType::LESS_THEN: return {Opcode::CMOVL, Opcode::SETGE};
+        case TokenType::GREATER_THEN_EQ: return {Opcode::CMOVGE, Opcode::SETL};
+        default: return {Opcode::CMOVLE, Opcode::SETG};
+    }
+}
+
+Register* CodeGen::emitConditionalMove(const TokenType op, Register* reg, const Operand& src) {
+    const auto [cmov, setOpposite] = conditionalMoveOf(op);
+
+    if (!isSSE(reg->rType)) {
+        emitInstr2op(cmov, getReg(reg, REG64), src);
+        return reg;
+    }
+
+    // 0 - 1 is an all ones mask when the compare holds, 1 - 1 an empty one. mov keeps the flags,
+    // xor would not.
+    Register* maskGPR = register_alloc();
+    mov(getReg(maskGPR, REG32), 0);
+    emitInstr1op(setOpposite, getReg(maskGPR, REG8L));
+    emitInstr1op(Opcode::DEC, getReg(maskGPR, REG64));
+
+    Register* mask = registerAllocator.alloc(SSE);
+    movq(getReg(mask, REG64), getReg(maskGPR, REG64));
+    register_free(maskGPR)
+
+    if (options.avx2) {
+        emitInstr4op(Opcode::VBLENDVPD, getReg(reg, REG64), getReg(reg, REG64), src, getReg(mask, REG64));
+        register_free(mask)
+        return reg;
+    }
 
-    Register* reg = nullptr;
-    for (const auto& [test, forms]: cond.variants) {
-        const std::string elseLabel = createLabel();
-        emitTest(test, std::string(), elseLabel);
+    // (mask & src) | (~mask & reg)
+    emitInstr2op(Opcode::ANDPD, src, getReg(mask, REG64));
+    emitInstr2op(Opcode::ANDNPD, getReg(mask, REG64), getReg(reg, REG64));
+    emitInstr2op(Opcode::ORPD, getReg(mask, REG64), src);
+    register_free(reg)
+    return mask;
+}
 
-        for (const auto& form: forms) {
-            reg = emitAST(form);
-            register_free(reg)
-        }
+Register* CodeGen::emitMerge(Register* reg, Register* branchReg) {
+    if (!reg || !branchReg || isSSE(reg->rType) != isSSE(branchReg->rType)) {
+        return branchReg ? branchReg : reg;
+    }
 
-        emitJump("jmp", done);
-        emitLabel(elseLabel);
+    if (isSSE(reg->rType)) {
+        movsd(getReg(reg, REG64), getReg(branchReg, REG64));
+    } else {
+        mov(getReg(reg, REG64), getReg(branchReg, REG64));
     }
-    emitLabel(done);
 
+    register_free(branchReg)
     return reg;
 }
 
@@ -500,37 +2189,80 @@ Register* CodeGen::emitPrimitive(const ExprPtr& prim) {
     }
 
     if (const auto var = cast::toVar(prim)) {
-        const std::string varName = cast::toString(var->name)->data;
+        if (getVarReg(*var)) {
+            return emitLoadRegFromMem(*var, REG64);
+        }
 
         Register* reg = register_alloc();
-        mov(getRegName(reg, REG64), getAddr(varName, var->sType, REG64));
+        mov(getReg(reg, REG64), getAddr(cast::toString(var->name)->data, var->sType, REG64));
 
         return reg;
     }
+    // nil as a value is 0, as in the IR
+    if (cast::toNIL(prim)) {
+        Register* reg = register_alloc();
+        emitInstr2op(Opcode::XOR, getReg(reg, REG32), getReg(reg, REG32));
+        return reg;
+    }
 
     return nullptr;
 }
 
 Register* CodeGen::emitInt(const IntExpr& int_) {
     auto* reg = register_alloc();
-    mov(getRegName(reg, REG64), int_.n);
+
+    if (int_.n == 0) {
+        emitInstr2op(Opcode::XOR, getReg(reg, REG32), getReg(reg, REG32));
+    } else {
+        // Writing the low half zero-extends and drops the REX.W prefix
+        mov(getReg(reg, int_.n >= 0 ? REG32 : REG64), int_.n);
+    }
     return reg;
 }
 
 Register* CodeGen::emitDouble(const DoubleExpr& double_) {
-    Register* reg = register_alloc();
-    const char* regStr = getRegName(reg, REG64);
-
     auto* regSSE = registerAllocator.alloc(SSE);
+    emitLoadDouble(getReg(regSSE, REG64), double_.n);
+    return regSSE;
+}
+
+void CodeGen::emitLoadDouble(const Operand& dst, const double n) {
+    // Only +0.0 is all zero bits, -0.0 has the sign set
+    if (std::bit_cast<uint64_t>(n) == 0) {
+        emitInstr2op(Opcode::XORPD, dst, dst);
+    } else {
+        movsd(dst, getDoubleConstant(n));
+    }
+}
 
-    uint64_t hex = *reinterpret_cast<const uint64_t*>(&double_.n);
+Operand CodeGen::getDoubleConstant(const double n) {
+    const auto bits = std::bit_cast<uint64_t>(n);
 
-    mov(regStr, emitHex(hex));
-    movq(getRegName(regSSE, REG64), regStr);
+    if (const auto it = doubleConstants.find(bits); it != doubleConstants.end()) {
+        return Operand::makeRel(REG64, it->second);
+    }
 
-    register_free(reg)
+    // dq keeps every entry 8-byte aligned, a scalar load never splits a cache line
+    const std::string name = std::format("_double{}", doubleConstants.size());
+    updateSections("\nsection .rodata\n",
+                   std::make_pair(name, memDirective(dataSizeInitialized[REG64], std::format("0x{:X}", bits))));
 
-    return regSSE;
+    const uint32_t symbol = symbols.intern(name);
+    doubleConstants.emplace(bits, symbol);
+    return Operand::makeRel(REG64, symbol);
+}
+
+Operand CodeGen::getStringConstant(const std::string& str) {
+    if (const auto it = stringConstants.find(str); it != stringConstants.end()) {
+        return Operand::makeRel(Operand::UNSIZED, it->second);
+    }
+
+    const std::string name = std::format("_string{}", stringConstants.size());
+    updateSections("\nsection .rodata\n", std::make_pair(name, strDirective(str)));
+
+    const uint32_t symbol = symbols.intern(name);
+    stringConstants.emplace(str, symbol);
+    return Operand::makeRel(Operand::UNSIZED, symbol);
 }
 
 Register* CodeGen::emitNumb(const ExprPtr& n) {
@@ -547,8 +2279,8 @@ Register* CodeGen::emitNumb(const ExprPtr& n) {
 }
 
 Register* CodeGen::emitNode(const ExprPtr& node) {
-    if (const auto binOp = cast::toBinop(node)) {
-        return emitBinop(*binOp);
+    if (cast::toBinop(node)) {
+        return emitSet(node);
     }
 
     if (const auto funcCall = cast::toFuncCall(node)) {
@@ -558,18 +2290,45 @@ Register* CodeGen::emitNode(const ExprPtr& node) {
     return emitNumb(node);
 }
 
-Register* CodeGen::emitExpr(const ExprPtr& lhs, const ExprPtr& rhs, std::pair<const char*, const char*> op) {
-    Register* regLhs = emitNode(lhs);
-    Register* regRhs = emitNode(rhs);
+Register* CodeGen::emitExpr(const ExprPtr& lhs,
+                            const ExprPtr& rhs,
+                            const std::pair<Opcode, Opcode> op,
+                            const uint32_t size) {
+    Register* regLhs;
+    Register* regRhs;
+
+    static constexpr Opcode commutative[] = {Opcode::ADD, Opcode::IMUL, Opcode::AND, Opcode::OR, Opcode::XOR};
+
+    // A known integer takes the type of the other side, so a double operand never needs cvtsi2sd
+    if (isKnownInt(lhs) && !isKnownInt(rhs)) {
+        regRhs = emitNode(rhs);
+
+        if (std::ranges::find(commutative, op.first) != std::end(commutative) && !isSSE(regRhs->rType)) {
+            emitInstr2op(op.first, getReg(regRhs, size), Operand::makeImm(rangeAnalyzer.rangeOf(*lhs).lo));
+            return regRhs;
+        }
+
+        regLhs = emitKnownInt(lhs, isSSE(regRhs->rType));
+    } else {
+        regLhs = isKnownInt(lhs) ? emitKnownInt(lhs, false) : emitNode(lhs);
+
+        const Opcode folded = isSSE(regLhs->rType) ? op.second : op.first;
+        if (const auto operand = foldOperand(rhs, regLhs, folded, size)) {
+            emitInstr2op(folded, getReg(regLhs, isSSE(regLhs->rType) ? REG64 : size), *operand);
+            return regLhs;
+        }
+
+        regRhs = isKnownInt(rhs) ? emitKnownInt(rhs, isSSE(regLhs->rType)) : emitNode(rhs);
+    }
 
     if (isSSE(regLhs->rType) && !isSSE(regRhs->rType)) {
         auto* newReg = registerAllocator.alloc(SSE);
-        const char* newRegStr = getRegName(newReg, REG64);
+        const Operand newRegOp = getReg(newReg, REG64);
 
-        emitInstr2op("cvtsi2sd", newRegStr, getRegName(regRhs, REG64));
+        emitInstr2op(Opcode::CVTSI2SD, newRegOp, getReg(regRhs, REG64));
         register_free(regRhs)
 
-        emitInstr2op(op.second, getRegName(regLhs, REG64), newRegStr);
+        emitInstr2op(op.second, getReg(regLhs, REG64), newRegOp);
         register_free(newReg);
 
         return regLhs;
@@ -577,43 +2336,116 @@ Register* CodeGen::emitExpr(const ExprPtr& lhs, const ExprPtr& rhs, std::pair<co
 
     if (!isSSE(regLhs->rType) && isSSE(regRhs->rType)) {
         auto* newReg = registerAllocator.alloc(SSE);
-        const char* newRegStr = getRegName(newReg, REG64);
-        const char* regRhsStr = getRegName(regRhs, REG64);
+        const Operand newRegOp = getReg(newReg, REG64);
+        const Operand regRhsOp = getReg(regRhs, REG64);
 
-        emitInstr2op("cvtsi2sd", newRegStr, getRegName(regLhs, REG64));
+        emitInstr2op(Opcode::CVTSI2SD, newRegOp, getReg(regLhs, REG64));
         register_free(regLhs)
 
-        emitInstr2op(op.second, newRegStr, regRhsStr);
-        movsd(regRhsStr, newRegStr);
+        emitInstr2op(op.second, newRegOp, regRhsOp);
+        movsd(regRhsOp, newRegOp);
         register_free(newReg);
         return regRhs;
     }
 
     if (isSSE(regLhs->rType) && isSSE(regRhs->rType)) {
-        emitInstr2op(op.second, getRegName(regLhs, REG64), getRegName(regRhs, REG64));
+        emitInstr2op(op.second, getReg(regLhs, REG64), getReg(regRhs, REG64));
         register_free(regRhs);
         return regLhs;
     }
 
     // rax -> dividend
     // idiv divisor[register/memory]
-    if (std::strcmp(op.first, "idiv") == 0) {
-        mov("rax", getRegName(regLhs, REG64));
+    if (op.first == Opcode::IDIV) {
+        mov(getRegByID(RAX, REG64), getReg(regLhs, REG64));
         cqo();
-        emitInstr1op("idiv", getRegName(regRhs, REG64));
-        mov(getRegName(regLhs, REG64), "rax");
+        emitInstr1op(Opcode::IDIV, getReg(regRhs, REG64));
+        mov(getReg(regLhs, REG64), getRegByID(RAX, REG64));
     } else {
-        emitInstr2op(op.first, getRegName(regLhs, REG64), getRegName(regRhs, REG64));
+        emitInstr2op(op.first, getReg(regLhs, size), getReg(regRhs, size));
     }
 
     register_free(regRhs);
     return regLhs;
 }
 
+std::optional<Operand> CodeGen::foldOperand(const ExprPtr& expr, const Register* dst, const Opcode op,
+                                            const uint32_t size) {
+    // Scalar double operations read 64 bits of memory, the packed ones need an aligned 128
+    static constexpr Opcode memOpsSSE[] = {Opcode::ADDSD, Opcode::SUBSD, Opcode::MULSD, Opcode::DIVSD, Opcode::UCOMISD};
+    const bool isDouble = isSSE(dst->rType);
+
+    if (op == Opcode::IDIV) {
+        return std::nullopt;
+    }
+
+    if (!isDouble && isKnownInt(expr)) {
+        return Operand::makeImm(rangeAnalyzer.rangeOf(*expr).lo);
+    }
+
+    // Double constants are read from the pool
+    if (isDouble && std::ranges::find(memOpsSSE, op) != std::end(memOpsSSE)) {
+        if (const auto double_ = cast::toDouble(expr)) {
+            return getDoubleConstant(double_->n);
+        }
+        if (isKnownInt(expr)) {
+            return getDoubleConstant(static_cast<double>(rangeAnalyzer.rangeOf(*expr).lo));
+        }
+    }
+
+    const auto var = cast::toVar(expr);
+    if (!var) {
+        return std::nullopt;
+    }
+
+    // Only read, a variable kept in a register needs no copy
+    if (const Register* varReg = getVarReg(*var)) {
+        if (isSSE(varReg->rType) != isDouble) return std::nullopt;
+        return getReg(varReg, isDouble ? REG64 : size);
+    }
+
+    const std::string& varName = cast::toString(var->name)->data;
+    if (!isDouble && var->vType == VarType::INT) {
+        return getAddr(varName, var->sType, size);
+    }
+    if (isDouble && var->vType == VarType::DOUBLE && var->sType != SymbolType::PARAM &&
+        std::ranges::find(memOpsSSE, op) != std::end(memOpsSSE)) {
+        return getAddr(varName, var->sType, REG64);
+    }
+
+    return std::nullopt;
+}
+
+Register* CodeGen::emitKnownInt(const ExprPtr& expr, const bool isDouble) {
+    const int64_t n = rangeAnalyzer.rangeOf(*expr).lo;
+
+    if (isDouble) {
+        return emitDouble(DoubleExpr(static_cast<double>(n)));
+    }
+
+    return emitInt(IntExpr(static_cast<int>(n)));
+}
+
+bool CodeGen::isKnownInt(const ExprPtr& expr) const {
+    // Only side-effect free expressions can be replaced by their value
+    std::function<bool(const ExprPtr&)> isPure = [&](const ExprPtr& node) {
+        if (cast::toInt(node) || cast::toVar(node)) return true;
+
+        const auto binop = cast::toBinop(node);
+        return binop && isPure(binop->lhs) && isPure(binop->rhs);
+    };
+
+    const Range range = rangeAnalyzer.rangeOf(*expr);
+    return range.isConstant() &&
+           range.isWithin(std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max()) &&
+           isPure(expr);
+}
+
 void CodeGen::emitSection(const ExprPtr& var, const bool isConstant) {
     const auto var_ = cast::toVar(var);
 
-    if (cast::toBinop(var_->value) || cast::toFuncCall(var_->value)) {
+    // A string points into the pool, the address is stored on startup as it has no relocation
+    if (cast::toBinop(var_->value) || cast::toFuncCall(var_->value) || cast::toString(var_->value)) {
         updateSections("\nsection .bss\n",
                        std::make_pair(cast::toString(var_->name)->data,
                                       memDirective(dataSizeUninitialized[REG64], 1)));
@@ -639,7 +2471,7 @@ void CodeGen::emitSection(const ExprPtr& var, const bool isConstant) {
         uint64_t hex = *reinterpret_cast<uint64_t*>(&double_->n);
         updateSections(isConstant ? "\nsection .rodata\n" : "\nsection .data\n",
                        std::make_pair(cast::toString(var_->name)->data,
-                                      memDirective(dataSizeInitialized[REG64], emitHex(hex))));
+                                      memDirective(dataSizeInitialized[REG64], std::format("0x{:X}", hex))));
     } else if (cast::toVar(var_->value)) {
         const uint32_t memSize = getMemSize(var_);
 
@@ -647,285 +2479,216 @@ void CodeGen::emitSection(const ExprPtr& var, const bool isConstant) {
                        std::make_pair(cast::toString(var_->name)->data,
                                       memDirective(dataSizeInitialized[memSize], 0)));
         handleAssignment(var, memSize);
-    } else if (const auto str = cast::toString(var_->value)) {
-        updateSections("\nsection .rodata\n",
-                       std::make_pair(cast::toString(var_->name)->data,
-                                      strDirective(str->data)));
     }
 }
 
-void CodeGen::emitTest(const ExprPtr& test, const std::string& trueLabel, const std::string& elseLabel) {
-    Register* reg;
-
-    if (const auto binop = cast::toBinop(test)) {
-        switch (binop->opToken.type) {
-            case TokenType::PLUS:
-            case TokenType::MINUS:
-            case TokenType::DIV:
-            case TokenType::MUL:
-            case TokenType::LOGAND:
-            case TokenType::LOGIOR:
-            case TokenType::LOGXOR:
-            case TokenType::LOGNOR: {
-                reg = emitBinop(*binop);
-                emitInstr2op((isSSE(reg->rType) ? "ucomisd" : "cmp"), getRegName(reg, REG64), 0);
-                emitJump("je", elseLabel);
-                register_free(reg)
-                break;
-            }
-            case TokenType::EQUAL:
-            case TokenType::NOT:
-                reg = emitBinop(*binop);
-                emitJump("jne", elseLabel);
-                register_free(reg)
-                break;
-            case TokenType::NEQUAL:
-                reg = emitBinop(*binop);
-                emitJump("je", elseLabel);
-                register_free(reg)
-                break;
-            case TokenType::GREATER_THEN:
-                reg = emitBinop(*binop);
-                emitJump("jle", elseLabel);
-                register_free(reg)
-                break;
-            case TokenType::LESS_THEN:
-                reg = emitBinop(*binop);
-                emitJump("jge", elseLabel);
-                register_free(reg)
-                break;
-            case TokenType::GREATER_THEN_EQ:
-                reg = emitBinop(*binop);
-                emitJump("jl", elseLabel);
-                register_free(reg)
-                break;
-            case TokenType::LESS_THEN_EQ:
-                reg = emitBinop(*binop);
-                emitJump("jg", elseLabel);
-                register_free(reg)
-                break;
-            case TokenType::AND: {
-                auto andComp = [&](const ExprPtr& node) {
-                    if (isPrimitive(node)) {
-                        Register* regLhs = emitCmpZero(node);
-                        emitJump("je", elseLabel);
-                        register_free(regLhs)
-                    } else {
-                        emitTest(node, trueLabel, elseLabel);
-                    }
-                };
-
-                andComp(binop->lhs);
-                andComp(binop->rhs);
-                break;
-            }
-            case TokenType::OR: {
-                if (isPrimitive(binop->lhs)) {
-                    Register* regLhs = emitCmpZero(binop->lhs);
-                    emitJump("jne", trueLabel);
-                    register_free(regLhs)
-                } else if (const auto bop = cast::toBinop(binop->lhs)) {
-                    reg = emitBinop(*bop);
-                    emitJmpTrueLabel(reg, bop->opToken.type, trueLabel);
-                    register_free(reg)
-                } else {
-                    emitTest(binop->lhs, trueLabel, elseLabel);
-                }
-
-                if (isPrimitive(binop->rhs)) {
-                    Register* regRhs = emitCmpZero(binop->rhs);
-                    emitJump("je", elseLabel);
-                    register_free(regRhs)
-                } else {
-                    emitTest(binop->rhs, trueLabel, elseLabel);
-                }
+static bool isCompare(const TokenType op) {
+    return op == TokenType::EQUAL || op == TokenType::NEQUAL || op == TokenType::GREATER_THEN ||
+           op == TokenType::LESS_THEN || op == TokenType::GREATER_THEN_EQ || op == TokenType::LESS_THEN_EQ;
+}
 
-                emitLabel(trueLabel);
-                break;
-            }
-            default:
-                break;
-        }
-    } else if (const auto funcCall = cast::toFuncCall(test)) {
-        reg = emitFuncCall(*funcCall);
-        emitInstr2op((isSSE(reg->rType) ? "ucomisd" : "cmp"), getRegName(reg, REG64), 0);
-        emitJump("je", elseLabel);
-        register_free(reg)
-    } else if (const auto var = cast::toVar(test)) {
-        reg = emitLoadRegFromMem(*var, REG64);
-        emitInstr2op((isSSE(reg->rType) ? "ucomisd" : "cmp"), getRegName(reg, REG64), 0);
-        emitJump("je", elseLabel);
-        register_free(reg)
-    } else if (cast::toNIL(test)) {
-        emitJump("jmp", elseLabel);
-    } else if (cast::toT(test)) {
-        emitJump("jmp", trueLabel);
-        emitLabel(trueLabel);
+// The compare that holds when op does not, t and nil stand for tests that always and never hold
+static TokenType negated(const TokenType op) {
+    switch (op) {
+        case TokenType::EQUAL: return TokenType::NEQUAL;
+        case TokenType::NEQUAL: return TokenType::EQUAL;
+        case TokenType::GREATER_THEN: return TokenType::LESS_THEN_EQ;
+        case TokenType::LESS_THEN: return TokenType::GREATER_THEN_EQ;
+        case TokenType::GREATER_THEN_EQ: return TokenType::LESS_THEN;
+        case TokenType::LESS_THEN_EQ: return TokenType::GREATER_THEN;
+        case TokenType::T: return TokenType::NIL;
+        default: return TokenType::T;
     }
 }
 
-void CodeGen::emitJmpTrueLabel(const Register* reg, const TokenType type, const std::string& label) {
-    switch (type) {
-        case TokenType::PLUS:
-        case TokenType::MINUS:
-        case TokenType::DIV:
-        case TokenType::MUL:
-        case TokenType::LOGAND:
-        case TokenType::LOGIOR:
-        case TokenType::LOGXOR:
-        case TokenType::LOGNOR: {
-            emitInstr2op((isSSE(reg->rType) ? "ucomisd" : "cmp"), getRegName(reg, REG64), 0);
-            emitJump("jne", label);
-            break;
-        }
-        case TokenType::EQUAL:
-        case TokenType::NOT:
-            emitJump("je", label);
-            break;
-        case TokenType::NEQUAL:
-            emitJump("jne", label);
-            break;
-        case TokenType::GREATER_THEN:
-            emitJump("jg", label);
-            break;
-        case TokenType::LESS_THEN:
-            emitJump("jl", label);
-            break;
-        case TokenType::GREATER_THEN_EQ:
-            emitJump("jge", label);
-            break;
-        case TokenType::LESS_THEN_EQ:
-            emitJump("jle", label);
-            break;
-        default: break;
+// The jump and the setcc taken when the compare of op is isTrue. ucomisd sets the flags of an unsigned
+// compare.
+static std::pair<Opcode, Opcode> conditionOf(const TokenType op, const bool isDouble, const bool isTrue) {
+    switch (isTrue ? op : negated(op)) {
+        case TokenType::EQUAL: return {Opcode::JE, Opcode::SETE};
+        case TokenType::NEQUAL: return {Opcode::JNE, Opcode::SETNE};
+        case TokenType::GREATER_THEN: return isDouble
+                                                 ? std::pair{Opcode::JA, Opcode::SETA}
+                                                 : std::pair{Opcode::JG, Opcode::SETG};
+        case TokenType::LESS_THEN: return isDouble
+                                              ? std::pair{Opcode::JB, Opcode::SETB}
+                                              : std::pair{Opcode::JL, Opcode::SETL};
+        case TokenType::GREATER_THEN_EQ: return isDouble
+                                                    ? std::pair{Opcode::JAE, Opcode::SETAE}
+                                                    : std::pair{Opcode::JGE, Opcode::SETGE};
+        default: return isDouble ? std::pair{Opcode::JBE, Opcode::SETBE} : std::pair{Opcode::JLE, Opcode::SETLE};
     }
 }
 
-Register* CodeGen::emitSet(const ExprPtr& set) {
-    Register* setReg = nullptr;
-
-    if (const auto binop = cast::toBinop(set)) {
+void CodeGen::emitBranch(const ExprPtr& test, const uint32_t label, const bool isTrue) {
+    if (const auto binop = cast::toBinop(test)) {
         switch (binop->opToken.type) {
-            case TokenType::PLUS:
-            case TokenType::MINUS:
-            case TokenType::DIV:
-            case TokenType::MUL:
-            case TokenType::LOGAND:
-            case TokenType::LOGIOR:
-            case TokenType::LOGXOR:
-            case TokenType::LOGNOR:
-                setReg = emitBinop(*binop);
-                break;
-            case TokenType::EQUAL:
             case TokenType::NOT:
-                setReg = emitSetReg(*binop);
-                emitSet8L("sete", setReg)
-                break;
-            case TokenType::NEQUAL:
-                setReg = emitSetReg(*binop);
-                emitSet8L("setne", setReg)
-                break;
-            case TokenType::GREATER_THEN:
-                setReg = emitSetReg(*binop);
-                emitSet8L("setg", setReg)
-                break;
-            case TokenType::LESS_THEN:
-                setReg = emitSetReg(*binop);
-                emitSet8L("setl", setReg)
-                break;
-            case TokenType::GREATER_THEN_EQ:
-                setReg = emitSetReg(*binop);
-                emitSet8L("setge", setReg)
-                break;
-            case TokenType::LESS_THEN_EQ:
-                setReg = emitSetReg(*binop);
-                emitSet8L("setle", setReg)
-                break;
+                emitBranch(binop->lhs, label, !isTrue);
+                return;
             case TokenType::AND:
-                return emitLogOp(*binop, "and");
-            case TokenType::OR:
-                return emitLogOp(*binop, "or");
+            case TokenType::OR: {
+                // and jumps when either side fails, or jumps when either side holds. The other way round the
+                // lhs skips the rhs when it decides the result.
+                if ((binop->opToken.type == TokenType::AND) != isTrue) {
+                    emitBranch(binop->lhs, label, isTrue);
+                    emitBranch(binop->rhs, label, isTrue);
+                    return;
+                }
+
+                const uint32_t skip = createLabel();
+                emitBranch(binop->lhs, skip, !isTrue);
+                emitBranch(binop->rhs, label, isTrue);
+                emitLabel(skip);
+                return;
+            }
             default:
                 break;
         }
-    } else if (const auto funcCall = cast::toFuncCall(set)) {
-        return emitFuncCall(*funcCall);
     }
 
-    return setReg;
-}
+    const Condition condition = emitCondition(test);
+    if (condition.op == TokenType::T || condition.op == TokenType::NIL) {
+        if ((condition.op == TokenType::T) == isTrue) emitJump(Opcode::JMP, label);
+        return;
+    }
 
-Register* CodeGen::emitLogOp(const BinOpExpr& binop, const char* op) {
-    struct RegisterInfo {
-        Register* reg{nullptr};
-        Register* setReg{nullptr};
-        const char* setRegStr{};
-        const char* setReg8LStr{};
-    };
+    emitJump(conditionOf(condition.op, condition.isDouble, isTrue).first, label);
+}
 
-    auto prepareRegister = [&](const ExprPtr& node, RegisterInfo& regInfo) {
-        regInfo.reg = emitCmpZero(node);
-        regInfo.setReg = isSSE(regInfo.reg->rType) ? register_alloc() : regInfo.reg;
+CodeGen::Condition CodeGen::emitCondition(const ExprPtr& test) {
+    if (cast::toT(test)) {
+        return {TokenType::T};
+    }
+    if (cast::toNIL(test)) {
+        return {TokenType::NIL};
+    }
+    if (isKnownInt(test)) {
+        return {rangeAnalyzer.rangeOf(*test).lo != 0 ? TokenType::T : TokenType::NIL};
+    }
 
-        regInfo.setRegStr = getRegName(regInfo.setReg, REG64);
-        regInfo.setReg8LStr = getRegName(regInfo.setReg, REG8L);
+    const auto binop = cast::toBinop(test);
+    if (binop && isCompare(binop->opToken.type)) {
+        Register* reg = emitCompare(*binop);
+        const bool isDouble = reg && isSSE(reg->rType);
+        register_free(reg)
+        return {binop->opToken.type, isDouble};
+    }
 
-        emitInstr2op("xor", regInfo.setRegStr, regInfo.setRegStr);
-        emitInstr1op("setne", regInfo.setReg8LStr);
-    };
+    // An integer variable is compared in place
+    if (const auto leaf = selectLeaf(test); leaf && leaf->goal != Goal::IMM) {
+        const VarExpr& var = *leaf->var;
+        const Operand operand = leaf->goal == Goal::SRC
+                                    ? getReg(getVarReg(var), REG64)
+                                    : getAddr(cast::toString(var.name)->data, var.sType, REG64);
+        emitInstr2op(leaf->goal == Goal::SRC ? Opcode::TEST : Opcode::CMP, operand,
+                     leaf->goal == Goal::SRC ? operand : Operand::makeImm(0));
+        return {TokenType::NEQUAL};
+    }
 
-    RegisterInfo lhs;
-    prepareRegister(binop.lhs, lhs);
+    // A form without a value, such as setq or a string, always holds
+    Register* reg = emitAST(test);
+    if (!reg) {
+        return {TokenType::T};
+    }
 
-    RegisterInfo rhs;
-    prepareRegister(binop.rhs, rhs);
+    emitTestZero(reg);
+    register_free(reg)
+    return {TokenType::NEQUAL};
+}
 
-    emitInstr2op(op, lhs.setReg8LStr, rhs.setReg8LStr);
-    movzx(lhs.setRegStr, lhs.setReg8LStr);
+Register* CodeGen::emitSet(const ExprPtr& set) {
+    if (const auto binop = cast::toBinop(set)) {
+        const TokenType type = binop->opToken.type;
+        if (!isCompare(type) && type != TokenType::NOT && type != TokenType::AND && type != TokenType::OR) {
+            return emitBinop(*binop);
+        }
 
-    if (isSSE(lhs.reg->rType)) {
-        emitInstr2op("cvtsi2sd", getRegName(lhs.reg, REG64), lhs.setRegStr);
-        register_free(lhs.setReg)
+        // Cleared before the tests, xor clobbers the flags. setcc then writes a register that is already
+        // zero-extended, so neither movzx nor a partial register merge follows.
+        Register* reg = register_alloc();
+        emitInstr2op(Opcode::XOR, getReg(reg, REG32), getReg(reg, REG32));
+        emitBool(set, reg);
+        return reg;
     }
 
-    if (isSSE(rhs.reg->rType)) {
-        register_free(rhs.setReg)
+    if (const auto funcCall = cast::toFuncCall(set)) {
+        return emitFuncCall(*funcCall);
+    }
+    if (const auto if_ = cast::toIf(set)) {
+        return emitIf(*if_);
     }
 
-    register_free(rhs.reg)
-    return lhs.reg;
+    return nullptr;
 }
 
-Register* CodeGen::emitSetReg(const BinOpExpr& binop) {
-    const auto reg = emitBinop(binop);
+void CodeGen::emitBool(const ExprPtr& test, const Register* reg) {
+    const auto binop = cast::toBinop(test);
+    const TokenType type = binop ? binop->opToken.type : TokenType::T;
+
+    if (type == TokenType::AND || type == TokenType::OR) {
+        // The lhs decides and, reg stays 0, or decides or and reg becomes 1
+        const uint32_t decided = createLabel();
+        emitBranch(binop->lhs, decided, type == TokenType::OR);
+        emitBool(binop->rhs, reg);
+
+        if (type == TokenType::OR) {
+            const uint32_t done = createLabel();
+            emitJump(Opcode::JMP, done);
+            emitLabel(decided);
+            mov(getReg(reg, REG32), 1);
+            emitLabel(done);
+        } else {
+            emitLabel(decided);
+        }
+        return;
+    }
 
-    if (isSSE(reg->rType)) {
-        register_free(reg)
-        return register_alloc();
+    Condition condition;
+    if (type != TokenType::NOT) {
+        condition = emitCondition(test);
+    } else if (const auto operand = cast::toBinop(binop->lhs);
+        operand && (operand->opToken.type == TokenType::AND || operand->opToken.type == TokenType::OR ||
+                    operand->opToken.type == TokenType::NOT)) {
+        emitBool(binop->lhs, reg);
+        emitInstr2op(Opcode::XOR, getReg(reg, REG32), 1);
+        return;
+    } else {
+        condition = emitCondition(binop->lhs);
+        condition.op = negated(condition.op);
     }
 
-    return reg;
+    if (condition.op == TokenType::T) {
+        mov(getReg(reg, REG32), 1);
+    } else if (condition.op != TokenType::NIL) {
+        emitInstr1op(conditionOf(condition.op, condition.isDouble, true).second, getReg(reg, REG8L));
+    }
 }
 
-Register* CodeGen::emitCmpZero(const ExprPtr& node) {
-    const ExprPtr zero = std::make_shared<IntExpr>(0);
-    return emitExpr(node, zero, {"cmp", "ucomisd"});
+void CodeGen::emitTestZero(const Register* reg) {
+    if (!isSSE(reg->rType)) {
+        emitInstr2op(Opcode::TEST, getReg(reg, REG64), getReg(reg, REG64));
+        return;
+    }
+
+    // ucomisd has no immediate form
+    Register* zero = registerAllocator.alloc(SSE);
+    emitInstr2op(Opcode::XORPD, getReg(zero, REG64), getReg(zero, REG64));
+    emitInstr2op(Opcode::UCOMISD, getReg(reg, REG64), getReg(zero, REG64));
+    register_free(zero)
 }
 
 void CodeGen::handleAssignment(const ExprPtr& var, const uint32_t size) {
     const auto var_ = cast::toVar(var);
     const std::string varName = cast::toString(var_->name)->data;
 
-    if (const auto int_ = cast::toInt(var_->value)) {
+    if (const Register* varReg = getVarReg(*var_)) {
+        emitAssignVarReg(varReg, var_->value);
+    } else if (const auto int_ = cast::toInt(var_->value)) {
         mov(getAddr(varName, var_->sType, REG64), int_->n);
     } else if (const auto double_ = cast::toDouble(var_->value)) {
-        auto* reg = register_alloc();
-        const char* regStr = getRegName(reg, REG64);
-
-        uint64_t hex = *reinterpret_cast<uint64_t*>(&double_->n);
-
-        mov(regStr, emitHex(hex));
-        mov(getAddr(varName, var_->sType, REG64), regStr);
+        Register* reg = emitDouble(*double_);
+        movsd(getAddr(varName, var_->sType, REG64), getReg(reg, REG64));
         register_free(reg)
     } else if (cast::toVar(var_->value)) {
         handleVariable(*var_, size);
@@ -936,18 +2699,11 @@ void CodeGen::handleAssignment(const ExprPtr& var, const uint32_t size) {
     } else if (cast::toUninitialized(var_->value) && var_->sType == SymbolType::LOCAL) {
         getAddr(varName, var_->sType, REG64);
     } else if (const auto str = cast::toString(var_->value)) {
-        std::string label = ".L." + varName;
-        std::string labelAddr = getAddr(label, var_->sType, size);
-        std::string varAddr = getAddr(varName, var_->sType, size);
-
-        updateSections("\nsection .data\n",
-                       std::make_pair(label, strDirective(str->data)));
-
         auto* reg = register_alloc();
-        const char* regStr = getRegName(reg, REG64);
+        const Operand regOp = getReg(reg, REG64);
 
-        emitInstr2op("lea", regStr, labelAddr);
-        mov(varAddr, regStr);
+        emitInstr2op(Opcode::LEA, regOp, getStringConstant(str->data));
+        mov(getAddr(varName, var_->sType, size), regOp);
         register_free(reg)
     } else {
         auto* reg = emitSet(var_->value);
@@ -970,26 +2726,34 @@ Register* CodeGen::emitLoadRegFromMem(const VarExpr& var, const uint32_t size) {
     Register* reg = nullptr;
     const std::string varName = cast::toString(var.name)->data;
 
+    // Reads copy the variable, the result is clobbered by the expression using it
+    if (const Register* varReg = getVarReg(var)) {
+        reg = isSSE(varReg->rType) ? registerAllocator.alloc(SSE) : register_alloc();
+        emitMoveReg(reg, varReg);
+        return reg;
+    }
+
     switch (var.sType) {
         case SymbolType::PARAM: {
             reg = register_alloc();
-            mov(getRegName(reg, REG64), getAddr(varName, var.sType, size));
+            mov(getReg(reg, REG64), getAddr(varName, var.sType, size));
             break;
         }
         case SymbolType::LOCAL:
         case SymbolType::GLOBAL: {
             if (var.vType == VarType::INT) {
                 reg = register_alloc();
-                mov(getRegName(reg, REG64), getAddr(varName, var.sType, size));
+                mov(getReg(reg, REG64), getAddr(varName, var.sType, size));
             } else if (var.vType == VarType::DOUBLE) {
                 reg = registerAllocator.alloc(SSE);
-                movsd(getRegName(reg, REG64), getAddr(varName, var.sType, size));
+                movsd(getReg(reg, REG64), getAddr(varName, var.sType, size));
             } else if (cast::toString(var.value)) {
+                // The variable holds the address of its string
                 reg = register_alloc();
-                emitInstr2op("lea", getRegName(reg, REG64), getAddr(varName, var.sType, size));
+                mov(getReg(reg, REG64), getAddr(varName, var.sType, REG64));
             } else if (cast::toNIL(var.value) || cast::toT(var.value)) {
                 reg = register_alloc();
-                movzx(getRegName(reg, REG64), getAddr(varName, var.sType, size));
+                movzx(getReg(reg, REG64), getAddr(varName, var.sType, size));
             }
             break;
         }
@@ -1004,27 +2768,165 @@ void CodeGen::emitStoreMemFromReg(const std::string& varName,
                                   const SymbolType stype,
                                   const Register* reg,
                                   const uint32_t size) {
-    const char* regStr = getRegName(reg, size);
+    if (const auto it = registerVars.find(varName); it != registerVars.end() && stype != SymbolType::GLOBAL) {
+        emitMoveReg(it->second, reg);
+        return;
+    }
+    if (const auto it = promotedGlobals.find(varName); it != promotedGlobals.end() && stype == SymbolType::GLOBAL) {
+        emitMoveReg(it->second, reg);
+        return;
+    }
+
+    const Operand regOp = getReg(reg, size);
 
     if (isSSE(reg->rType)) {
-        movsd(getAddr(varName, stype, size), regStr);
+        movsd(getAddr(varName, stype, size), regOp);
+    } else {
+        mov(getAddr(varName, stype, size), regOp);
+    }
+}
+
+Register* CodeGen::getVarReg(const VarExpr& var) {
+    const auto& vars = var.sType == SymbolType::GLOBAL ? promotedGlobals : registerVars;
+    const auto it = vars.find(cast::toString(var.name)->data);
+    return it != vars.end() ? it->second : nullptr;
+}
+
+std::vector<CodeGen::PromotedGlobal> CodeGen::promoteGlobals(const std::vector<ExprPtr>& region,
+                                                             const int minReferences) {
+    // A call could read or write any global and a definition rebinds it, nothing else can observe one
+    bool isObservable = false;
+    std::vector<std::pair<PromotedGlobal, int> > candidates;
+
+    for (const auto& form: region) {
+        ast::walk(form, [&](const ExprPtr& node, const bool isBinding) {
+            if (cast::toFuncCall(node) || cast::toDefun(node) || cast::toDefvar(node) || cast::toDefconstant(node)) {
+                isObservable = true;
+                return;
+            }
+
+            const auto var = cast::toVar(node);
+            if (!var || var->sType != SymbolType::GLOBAL ||
+                (var->vType != VarType::INT && var->vType != VarType::DOUBLE)) {
+                return;
+            }
+
+            const std::string& name = cast::toString(var->name)->data;
+            if (promotedGlobals.contains(name)) return;
+
+            auto it = std::ranges::find_if(candidates, [&](const auto& c) { return c.first.name == name; });
+            if (it == candidates.end()) {
+                candidates.push_back({{name, var->vType == VarType::DOUBLE, false, nullptr}, 0});
+                it = std::prev(candidates.end());
+            }
+            it->first.isStored |= isBinding;
+            ++it->second;
+        });
+    }
+
+    if (isObservable) {
+        return {};
+    }
+
+    // The most referenced globals get the registers
+    std::ranges::stable_sort(candidates, std::greater{}, [](const auto& c) { return c.second; });
+
+    std::vector<PromotedGlobal> promoted;
+    for (auto& [global, references]: candidates) {
+        if (references < minReferences || promoted.size() == maxPromotedGlobals) break;
+
+        global.reg = global.isDouble ? registerAllocator.alloc(SSE) : register_alloc();
+        const Operand addr = getAddr(global.name, SymbolType::GLOBAL, REG64);
+        if (global.isDouble) {
+            movsd(getReg(global.reg, REG64), addr);
+        } else {
+            mov(getReg(global.reg, REG64), addr);
+        }
+
+        promotedGlobals[global.name] = global.reg;
+        promoted.push_back(global);
+    }
+
+    return promoted;
+}
+
+void CodeGen::demoteGlobals(const std::vector<PromotedGlobal>& promoted) {
+    for (const auto& global: promoted) {
+        promotedGlobals.erase(global.name);
+
+        if (global.isStored) {
+            emitStoreMemFromReg(global.name, SymbolType::GLOBAL, global.reg, REG64);
+        }
+        register_free(global.reg)
+    }
+}
+
+bool CodeGen::isPromotable(const VarExpr& var, const std::vector<ExprPtr>& scope) const {
+    if (var.sType != SymbolType::LOCAL || (var.vType != VarType::INT && var.vType != VarType::DOUBLE)) {
+        return false;
+    }
+
+    // A nested defun is emitted after the scope ends and would read the variable from the stack
+    const std::string& varName = cast::toString(var.name)->data;
+    bool isEscaped = false;
+
+    for (const auto& form: scope) {
+        ast::walk(form, [&](const ExprPtr& node, bool) {
+            if (!cast::toDefun(node)) return;
+
+            ast::walk(node, [&](const ExprPtr& inner, bool) {
+                const auto innerVar = cast::toVar(inner);
+                isEscaped |= innerVar && cast::toString(innerVar->name)->data == varName;
+            });
+        });
+    }
+
+    return !isEscaped;
+}
+
+void CodeGen::emitAssignVarReg(const Register* varReg, const ExprPtr& value) {
+    Register* reg;
+
+    if (const auto int_ = cast::toInt(value)) {
+        reg = emitInt(*int_);
+    } else if (const auto double_ = cast::toDouble(value)) {
+        reg = emitDouble(*double_);
+    } else if (const auto var = cast::toVar(value)) {
+        reg = emitLoadRegFromMem(*var, REG64);
+    } else if (cast::toNIL(value) || cast::toT(value)) {
+        reg = emitInt(IntExpr(cast::toT(value) ? 1 : 0));
+    } else {
+        reg = emitSet(value);
+    }
+
+    if (reg) {
+        emitMoveReg(varReg, reg);
+        register_free(reg)
+    }
+}
+
+void CodeGen::emitMoveReg(const Register* dst, const Register* src) {
+    const Operand dstOp = getReg(dst, REG64);
+    const Operand srcOp = getReg(src, REG64);
+
+    if (isSSE(dst->rType) != isSSE(src->rType)) {
+        // Same bits as a store and a load of the other type
+        movq(dstOp, srcOp);
+    } else if (isSSE(dst->rType)) {
+        movsd(dstOp, srcOp);
     } else {
-        mov(getAddr(varName, stype, size), regStr);
+        mov(dstOp, srcOp);
     }
 }
 
-std::string CodeGen::getAddr(const std::string& varName, const SymbolType stype, const uint32_t size) {
+Operand CodeGen::getAddr(const std::string& varName, const SymbolType stype, const uint32_t size) {
     switch (stype) {
         case SymbolType::GLOBAL:
-            return std::format("{} [rel {}]", memorySize[size], varName);
+            return Operand::makeRel(size, symbols.intern(varName));
         case SymbolType::LOCAL:
-            return std::format("{} [rbp - {}]",
-                               memorySize[size],
-                               stackAllocator.pushStackFrame(currentScope, varName, stype));
+            return Operand::makeMem(size, RBP, -stackAllocator.pushStackFrame(currentScope, varName, stype));
         case SymbolType::PARAM:
-            return std::format("{} [rbp + {}]",
-                               memorySize[size],
-                               stackAllocator.pushStackFrame(currentScope, varName, stype));
+            return Operand::makeMem(size, RBP, stackAllocator.pushStackFrame(currentScope, varName, stype));
         default:
             throw std::runtime_error("Unknown SymbolType.");
     }
@@ -1050,27 +2952,19 @@ uint32_t CodeGen::getMemSize(const ExprPtr& var) {
 
 void CodeGen::pushParamToRegister(const uint32_t rid, const std::any& value) {
     const auto* reg = registerAllocator.regFromID(rid);
-    const char* regStr = getRegName(reg, REG64);
+    const Operand regOp = getReg(reg, REG64);
 
     if (isSSE(reg->rType)) {
         try {
-            auto n = std::any_cast<double>(value);
-            uint64_t hex = *reinterpret_cast<uint64_t*>(&n);
-
-            auto* regScr = register_alloc();
-            const char* regScrStr = getRegName(regScr, REG64);
-
-            mov(regScrStr, emitHex(hex));
-            movq(regStr, regScrStr);
-            register_free(regScr)
+            emitLoadDouble(regOp, std::any_cast<double>(value));
         } catch ([[maybe_unused]] const std::bad_any_cast& e) {
-            movsd(regStr, std::any_cast<const char*>(value));
+            movsd(regOp, std::any_cast<Operand>(value));
         }
     } else {
         try {
-            mov(regStr, std::any_cast<int>(value));
+            mov(regOp, std::any_cast<int>(value));
         } catch ([[maybe_unused]] const std::bad_any_cast& e) {
-            mov(regStr, std::any_cast<const char*>(value));
+            mov(regOp, std::any_cast<Operand>(value));
         }
     }
 }
@@ -1080,35 +2974,29 @@ void CodeGen::pushParamOntoStack(const std::string& funcName, const VarExpr& par
 
     stackAllocator.pushStackFrame(funcName, paramName, SymbolType::PARAM);
 
-    const std::string addr = stackIdx ? std::format("qword [rsp + {}]", stackIdx) : "qword [rsp]";
+    const Operand addr = Operand::makeMem(REG64, RSP, stackIdx);
 
     if (const auto int_ = cast::toInt(param.value)) {
         mov(addr, int_->n);
     } else if (const auto double_ = cast::toDouble(param.value)) {
-        auto* regScr = register_alloc();
-        const char* regScrStr = getRegName(regScr, REG64);
-
-        uint64_t hex = *reinterpret_cast<uint64_t*>(&double_->n);
-
-        mov(regScrStr, emitHex(hex));
-        mov(addr, regScrStr);
-
-        register_free(regScr)
+        Register* reg = emitDouble(*double_);
+        movsd(addr, getReg(reg, REG64));
+        register_free(reg)
     }
 
     stackIdx += 8;
 }
 
-const char* CodeGen::getRegName(const Register* reg, const uint32_t size) {
-    return registerAllocator.nameFromReg(reg, size);
+Operand CodeGen::getReg(const Register* reg, const uint32_t size) {
+    return Operand::makeReg(reg->id, size);
 }
 
-const char* CodeGen::getRegNameByID(const uint32_t id, const uint32_t size) {
-    return registerAllocator.nameFromID(id, size);
+Operand CodeGen::getRegByID(const uint32_t id, const uint32_t size) {
+    return Operand::makeReg(id, size);
 }
 
-std::string CodeGen::createLabel() {
-    return ".L" + std::to_string(currentLabelCount++);
+uint32_t CodeGen::createLabel() {
+    return symbols.intern(std::format(".L{}", currentLabelCount++));
 }
 
 void CodeGen::updateSections(const char* name, const std::pair<std::string, std::string>& data) {
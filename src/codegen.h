@@ -2,26 +2,117 @@
 #define CODEGEN_H
 
 #include <any>
+#include <optional>
+#include <span>
 #include <string>
 #include <unordered_map>
 #include "parser.h"
 #include "stack.h"
 #include "register.h"
+#include "range.h"
+#include "instr.h"
+#include "elf.h"
+#include "peephole.h"
+#include "selector.h"
+#include "vectorizer.h"
+
+struct CodeGenOptions {
+    // Use 256-bit AVX2 registers for vectorized loops instead of SSE2
+    bool avx2{false};
+    // Run the peephole optimizer over the text section
+    bool peephole{true};
+    // Return the value of the last form from _start instead of exiting
+    bool jit{false};
+    // Leaf functions keep their frame in the red zone below rsp instead of setting up rbp
+    bool omitFramePointer{true};
+    // If and cond with cheap, side-effect free arms evaluate every arm and select the result
+    bool ifConvert{true};
+    // Cond and case chains testing one variable against constants dispatch through jump tables, bit tests
+    // and binary search instead of a compare per clause
+    bool lowerSwitches{true};
+};
 
 class CodeGen {
 public:
-    CodeGen() : currentScope("main") {
+    explicit CodeGen(const CodeGenOptions& options = {}) : options(options), currentScope("main") {
     }
 
     std::string emit(const ExprPtr& ast);
 
+    // Encodes the program as a static executable or a relocatable object
+    std::vector<uint8_t> emitELF(const ExprPtr& ast, bool isExecutable);
+
+    // Lays out the program for loading into memory, see JIT. returnsDouble tells whether the
+    // last top level form is a double, whose bits the entry returns in rax
+    ElfWriter::Image emitImage(const ExprPtr& ast, bool& returnsDouble);
+
+    [[nodiscard]] std::string stats() const { return peephole.stats(); }
+
 private:
+    void generate(const ExprPtr& ast);
+
+    ElfWriter createWriter(const ExprPtr& ast);
+
+    // Assigns physical registers to the function starting at begin and saves the
+    // callee-saved registers it uses
+    void allocateRegisters(size_t begin);
+
+    // Rewrites a leaf function to address its frame from rsp, false if it does not fit the red zone
+    bool omitFramePointer(size_t begin, uint32_t saved, uint32_t spillSize);
+
+    // Moves the frame setup of a function from its entry onto the branch that needs it
+    void shrinkWrap(size_t begin);
+
+    // Sets the frame up on entry again if the allocator gave the frame-less path a callee-saved
+    // register or a spill slot
+    void verifyShrinkWrap(size_t begin);
+
     Register* emitAST(const ExprPtr& ast);
 
     Register* emitBinop(const BinOpExpr& binop);
 
+    // An operand built by a tile of the instruction selector and the registers it holds
+    struct Tile {
+        Operand operand;
+        Register* reg{nullptr};
+        // Scale of an INDEX operand
+        int64_t scale{1};
+        std::vector<Register*> owned{};
+    };
+
+    // Tiles binop with the instruction selector, nullptr if its tree has nodes no pattern covers
+    Register* emitSelected(const BinOpExpr& binop);
+
+    // Emits a compare for the branch that follows, nullptr when its result is only in the flags
+    Register* emitCompare(const BinOpExpr& binop);
+
+    std::optional<InstructionSelector::Leaf> selectLeaf(const ExprPtr& expr);
+
+    Tile emitTile(const IExpr& node, Goal goal);
+
+    void freeTile(const Tile& tile, const Register* kept = nullptr);
+
     Register* emitDotimes(const DotimesExpr& dotimes);
 
+    bool canVectorize(const DotimesExpr& dotimes, const Reduction& reduction);
+
+    Register* emitVectorizedDotimes(const DotimesExpr& dotimes, const Reduction& reduction);
+
+    Register* emitVecTerm(const ExprPtr& term, const Register* iterVec, const std::vector<Register*>& invariantRegs,
+                          const Reduction& reduction);
+
+    void emitVecOp(Opcode op, const Register* dst, const Register* src);
+
+    void emitVecMul(const Register* dst, const Register* src, bool isUInt32 = false);
+
+    void emitVecReduce(ReductionOp op, const Register* acc, const Register* src);
+
+    void emitVecBroadcast(const Register* dst, const Operand& value);
+
+    Operand getVecReg(const Register* reg) const;
+
+    Operand getLaneIndexConstant(int lanes);
+
     Register* emitLoop(const LoopExpr& loop);
 
     Register* emitLet(const LetExpr& let);
@@ -42,31 +133,96 @@ private:
 
     Register* emitCond(const CondExpr& cond);
 
+    // The cases of a cond whose tests compare one integer variable with constants
+    struct Switch {
+        std::shared_ptr<VarExpr> key;
+        // Case values in ascending order and the clause each selects
+        std::vector<std::pair<int64_t, size_t> > cases;
+        // Clause of the trailing t, or the clause count without one
+        size_t otherwise;
+    };
+
+    std::optional<Switch> switchOf(const CondExpr& cond);
+
+    Register* emitSwitch(const CondExpr& cond, const Switch& switch_);
+
+    // Jumps to the label of the clause key selects, by a compare chain for few cases, bit tests for few clauses
+    // in a small range, a jump table for dense cases and otherwise by splitting the cases in half
+    void emitSwitchCases(const Operand& key, std::span<const std::pair<int64_t, size_t> > cases,
+                         const std::vector<uint32_t>& labels, uint32_t otherwise);
+
+    // key - lo in a register, after a jump to otherwise when key is outside [lo, hi]
+    Register* emitSwitchIndex(const Operand& key, int64_t lo, int64_t hi, uint32_t otherwise);
+
+    // Evaluates every arm and keeps the one of the first test that holds with cmov or a blend, nullptr
+    // if a test or an arm is not cheap enough to run unconditionally
+    Register* emitSelect(const std::vector<std::pair<ExprPtr, ExprPtr> >& variants, const ExprPtr& otherwise);
+
+    // Whether arm is cheap and side-effect free, and if so whether its value is a double
+    std::optional<bool> selectArmClass(const ExprPtr& arm);
+
+    // Replaces the value of reg by src when the compare of op holds, returns the register holding
+    // the result. A double source has to be a register the caller owns, the blend clobbers it.
+    Register* emitConditionalMove(TokenType op, Register* reg, const Operand& src);
+
+    // Moves the value of a branch to the register holding the value of the other branches
+    Register* emitMerge(Register* reg, Register* branchReg);
+
     Register* emitPrimitive(const ExprPtr& prim);
 
     Register* emitInt(const IntExpr& int_);
 
     Register* emitDouble(const DoubleExpr& double_);
 
+    // movsd from the constant pool, xorpd for 0.0
+    void emitLoadDouble(const Operand& dst, double n);
+
+    // Deduplicated .rodata entry holding the bits of n
+    Operand getDoubleConstant(double n);
+
+    // Deduplicated .rodata entry holding the characters of str
+    Operand getStringConstant(const std::string& str);
+
     Register* emitNumb(const ExprPtr& n);
 
     Register* emitNode(const ExprPtr& node);
 
-    Register* emitExpr(const ExprPtr& lhs, const ExprPtr& rhs, std::pair<const char*, const char*> op);
+    Register* emitExpr(const ExprPtr& lhs,
+                       const ExprPtr& rhs,
+                       std::pair<Opcode, Opcode> op,
+                       uint32_t size = REG64);
+
+    // The immediate, register or memory operand an instruction can take for expr in place of a
+    // register loaded first
+    std::optional<Operand> foldOperand(const ExprPtr& expr, const Register* dst, Opcode op, uint32_t size);
+
+    Register* emitKnownInt(const ExprPtr& expr, bool isDouble);
+
+    bool isKnownInt(const ExprPtr& expr) const;
 
     void emitSection(const ExprPtr& var, bool isConstant = false);
 
-    void emitTest(const ExprPtr& test, const std::string& trueLabel, const std::string& elseLabel);
+    // Jumps to label when test is isTrue and falls through otherwise. And, or and not only pick the targets
+    // of the branches, every compare stays in the flags.
+    void emitBranch(const ExprPtr& test, uint32_t label, bool isTrue);
 
-    void emitJmpTrueLabel(const Register* reg, TokenType type, const std::string& label);
+    // The compare under which a test holds. T and nil stand for tests decided at compile time.
+    struct Condition {
+        TokenType op;
+        // The flags come from ucomisd
+        bool isDouble{false};
+    };
 
-    Register* emitSet(const ExprPtr& set);
+    // Sets the flags for a test that is no and, or or not, a test decided at compile time emits nothing
+    Condition emitCondition(const ExprPtr& test);
 
-    Register* emitLogOp(const BinOpExpr& binop, const char* op);
+    // The value of a form, a test is only materialized to 0 or 1 here, when it is stored or returned
+    Register* emitSet(const ExprPtr& set);
 
-    Register* emitSetReg(const BinOpExpr& binop);
+    // Materializes test into reg, which has to be zero
+    void emitBool(const ExprPtr& test, const Register* reg);
 
-    Register* emitCmpZero(const ExprPtr& node);
+    void emitTestZero(const Register* reg);
 
     void handleAssignment(const ExprPtr& var, uint32_t size);
 
@@ -76,7 +232,33 @@ private:
 
     void emitStoreMemFromReg(const std::string& varName, SymbolType stype, const Register* reg, uint32_t size);
 
-    std::string getAddr(const std::string& varName, SymbolType stype, uint32_t size);
+    Register* getVarReg(const VarExpr& var);
+
+    // A global kept in a register while a region that is its only observer runs
+    struct PromotedGlobal {
+        std::string name;
+        bool isDouble;
+        // Assigned in the region, written back at its exit
+        bool isStored;
+        Register* reg;
+    };
+
+    // Loads the globals region references at least minReferences times into registers, none if a call
+    // or a definition in region could observe them
+    std::vector<PromotedGlobal> promoteGlobals(const std::vector<ExprPtr>& region, int minReferences);
+
+    // Writes the assigned globals back at the exit of their region
+    void demoteGlobals(const std::vector<PromotedGlobal>& promoted);
+
+    // Parameters and let variables of a scope live in registers unless a nested defun uses them
+    [[nodiscard]] bool isPromotable(const VarExpr& var, const std::vector<ExprPtr>& scope) const;
+
+    void emitAssignVarReg(const Register* varReg, const ExprPtr& value);
+
+    // A move between registers of different classes copies the bits
+    void emitMoveReg(const Register* dst, const Register* src);
+
+    Operand getAddr(const std::string& varName, SymbolType stype, uint32_t size);
 
     uint32_t getMemSize(const ExprPtr& var);
 
@@ -84,31 +266,63 @@ private:
 
     void pushParamOntoStack(const std::string& funcName, const VarExpr& param, int& stackIdx);
 
-    const char* getRegName(const Register* reg, uint32_t size);
+    static Operand getReg(const Register* reg, uint32_t size);
 
-    const char* getRegNameByID(uint32_t id, uint32_t size);
+    static Operand getRegByID(uint32_t id, uint32_t size);
 
-    std::string createLabel();
+    uint32_t createLabel();
 
     void updateSections(const char* name, const std::pair<std::string, std::string>& data);
 
-    static bool isPrimitive(const ExprPtr& var);
+    // Static references to each symbol in the text section, a reference inside a loop weighs
+    // loopReferenceWeight times more per level of nesting
+    [[nodiscard]] std::unordered_map<uint32_t, int64_t> countReferences() const;
+
+    // Orders the entries of every data section into a hot region of the most referenced ones and a cold
+    // region on the cache lines after it, each packed by alignment
+    void layoutSections();
 
     std::string generatedCode;
+    // Text section, printed after the peephole pass
+    std::vector<Instr> code;
+    SymbolTable symbols;
+    PeepholeOptimizer peephole;
+    InstructionSelector selector;
+    Encoder encoder;
+    // Options
+    CodeGenOptions options;
     // Label
     int currentLabelCount{0};
+    // Type of the value a JIT entry returns
+    bool isResultDouble{false};
     // Scope
     std::string currentScope;
     // Register
     RegisterAllocator registerAllocator;
+    // Variables that live in registers instead of stack slots
+    std::unordered_map<std::string, Register*> registerVars;
+    // Globals that live in registers for the region being emitted
+    std::unordered_map<std::string, Register*> promotedGlobals;
     // Stack
     StackAllocator stackAllocator;
     // Sections
     std::unordered_map<std::string, std::vector<std::pair<std::string, std::string> > > sections;
+    // Symbols of the double constant pool by bit pattern
+    std::unordered_map<uint64_t, uint32_t> doubleConstants;
+    // Symbols of the string pool by contents
+    std::unordered_map<std::string, uint32_t> stringConstants;
     // Functions
     std::vector<std::pair<void(CodeGen::*)(const DefunExpr&), const DefunExpr&> > functions;
+    // Caller-saved registers each emitted function writes, calls to functions not in here clobber them all
+    std::unordered_map<std::string, uint32_t> functionClobbers;
+    // Loops
+    LoopVectorizer loopVectorizer;
+    bool isVecWide{false};
+    // Value ranges
+    RangeAnalyzer rangeAnalyzer;
 
-    static constexpr const char* memorySize[SIZE_COUNT] = {"qword", "dword", "word", "byte", "byte"};
+    // Data sections in the order they are emitted
+    static constexpr const char* sectionNames[] = {"\nsection .rodata\n", "\nsection .data\n", "\nsection .bss\n"};
 
     static constexpr const char* dataSizeInitialized[SIZE_COUNT] = {"dq", "dd", "dw", "db", "db"};
 
@@ -116,18 +330,38 @@ private:
 
     static constexpr int memorySizeInBytes[SIZE_COUNT] = {8, 4, 2, 1, 1};
 
-    static constexpr int paramRegisters[] = {RDI, RSI, RDX, RCX, R8, R9};
+    // Every function is internal, only _start is entered from outside, so calls pass more arguments in
+    // registers than System V does
+    static constexpr int paramRegisters[] = {RDI, RSI, RDX, RCX, R8, R9, R10, R11};
 
-    static constexpr int paramRegistersSSE[] = {xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7};
-};
+    static constexpr int paramRegistersSSE[] = {
+        xmm0, xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7, xmm8, xmm9, xmm10, xmm11
+    };
+
+    // If-conversion limits, the selector cost of an arm and the tests of a cond
+    static constexpr int maxSelectArmCost = 3;
+
+    static constexpr size_t maxSelectVariants = 4;
+
+    // Switch lowering limits, the cases below which compares are chained, the percentage of a jump table's
+    // entries that have to be cases and the clauses bit tests branch to
+    static constexpr size_t minSwitchCases = 4;
 
-inline bool CodeGen::isPrimitive(const ExprPtr& var) {
-    return cast::toInt(var) ||
-           cast::toDouble(var) ||
-           cast::toNIL(var) ||
-           cast::toT(var) ||
-           cast::toString(var) ||
-           cast::toVar(var);
-}
+    static constexpr int64_t minJumpTableDensity = 40;
+
+    static constexpr size_t maxBitTestClauses = 3;
+
+    // Data layout, the weight of a loop level, the levels weighed and the references that make an entry hot
+    static constexpr int64_t loopReferenceWeight = 8;
+
+    static constexpr int maxLoopDepth = 3;
+
+    static constexpr int64_t minHotReferences = 4;
+
+    static constexpr int64_t cacheLineSize = 64;
+
+    // Globals a region keeps in registers
+    static constexpr size_t maxPromotedGlobals = 4;
+};
 
 #endif
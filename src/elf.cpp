@@ -0,0 +1,315 @@
+#include "elf.h"
+#include <algorithm>
+#include <format>
+#include <stdexcept>
+#include <tuple>
+#include <unordered_map>
+
+static constexpr uint64_t BASE_ADDRESS = 0x400000;
+static constexpr uint64_t PAGE_SIZE = 0x1000;
+
+static constexpr int EHDR_SIZE = 64;
+static constexpr int PHDR_SIZE = 56;
+static constexpr int SHDR_SIZE = 64;
+static constexpr int SYM_SIZE = 24;
+static constexpr int RELA_SIZE = 24;
+
+enum : uint32_t {
+    SHT_PROGBITS = 1, SHT_SYMTAB = 2, SHT_STRTAB = 3, SHT_RELA = 4, SHT_NOBITS = 8
+};
+
+enum : uint64_t {
+    SHF_WRITE = 1, SHF_ALLOC = 2, SHF_EXECINSTR = 4, SHF_INFO_LINK = 0x40
+};
+
+enum : uint8_t {
+    STT_OBJECT = 1, STT_FUNC = 2, STB_GLOBAL = 1
+};
+
+static constexpr uint32_t PT_LOAD = 1;
+static constexpr uint32_t R_X86_64_PC32 = 2;
+
+struct SectionHeader {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t address;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t align;
+    uint64_t entrySize;
+};
+
+static void put(std::vector<uint8_t>& out, const uint64_t value, const int size) {
+    for (int i = 0; i < size; ++i) {
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+    }
+}
+
+static uint64_t alignUp(const uint64_t n, const uint64_t align) {
+    return (n + align - 1) & ~(align - 1);
+}
+
+static uint32_t addString(std::string& table, const std::string_view str) {
+    const auto offset = static_cast<uint32_t>(table.size());
+    table += str;
+    table += '\0';
+    return offset;
+}
+
+ElfWriter::ElfWriter(const Encoder& encoder, const SymbolTable& symbols) : encoder(encoder), symbols(symbols),
+    sections{
+        {".text", encoder.text(), encoder.text().size(), 16},
+        {".rodata", {}, 0, 1},
+        {".data", {}, 0, 1},
+        {".bss", {}, 0, 1}
+    } {
+}
+
+void ElfWriter::addData(const std::string_view section, const std::string& name, std::string_view directive) {
+    const SectionIndex index = section == ".rodata" ? RODATA : section == ".bss" ? BSS : DATA;
+    Section& sec = sections[index];
+
+    const size_t space = directive.find(' ');
+    const std::string_view keyword = directive.substr(0, space);
+    std::string_view rest = directive.substr(space + 1);
+
+    // dq, dd, dw, db and resq, resd, resw, resb
+    int width;
+    switch (keyword.back()) {
+        case 'q': width = 8;
+            break;
+        case 'd': width = 4;
+            break;
+        case 'w': width = 2;
+            break;
+        case 'b': width = 1;
+            break;
+        default: throw std::runtime_error(std::format("Unknown data directive {}", keyword));
+    }
+
+    sec.size = alignUp(sec.size, width);
+    sec.align = std::max<uint64_t>(sec.align, width);
+    dataSymbols.push_back({name, index, sec.size});
+
+    if (keyword.starts_with("res")) {
+        sec.size += width * std::stoull(std::string(rest));
+        if (index != BSS) {
+            sec.bytes.resize(sec.size);
+        }
+        return;
+    }
+
+    sec.bytes.resize(sec.size);
+    while (!rest.empty()) {
+        if (rest[0] == ',' || rest[0] == ' ') {
+            rest.remove_prefix(1);
+        } else if (rest[0] == '"') {
+            const size_t end = rest.find('"', 1);
+            sec.bytes.insert(sec.bytes.end(), rest.begin() + 1, rest.begin() + static_cast<long>(end));
+            rest.remove_prefix(end + 1);
+        } else {
+            const std::string item{rest.substr(0, rest.find(','))};
+            const uint64_t value = item[0] == '-' ? std::stoll(item) : std::stoull(item, nullptr, 0);
+            put(sec.bytes, value, width);
+            rest.remove_prefix(item.size());
+        }
+    }
+
+    sec.size = sec.bytes.size();
+}
+
+ElfWriter::Image ElfWriter::write(const bool isExecutable) const {
+    // Symbols, locals sorted by address and _start last as the only global
+    std::vector<Symbol> syms = dataSymbols;
+    for (const auto& [id, offset]: encoder.labels()) {
+        if (const std::string& name = symbols.name(id); !name.starts_with(".")) {
+            syms.push_back({name, TEXT, offset});
+        }
+    }
+
+    std::ranges::sort(syms, [](const Symbol& a, const Symbol& b) {
+        if (a.name == "_start" || b.name == "_start") return b.name == "_start" && a.name != "_start";
+        return std::tie(a.section, a.offset, a.name) < std::tie(b.section, b.offset, b.name);
+    });
+
+    if (syms.empty() || syms.back().name != "_start") {
+        throw std::runtime_error("Undefined entry point _start");
+    }
+
+    std::unordered_map<std::string_view, uint32_t> symbolIndex;
+    for (size_t i = 0; i < syms.size(); ++i) {
+        symbolIndex[syms[i].name] = static_cast<uint32_t>(i + 1);
+    }
+
+    // Section layout. Each section of an executable starts a new page so it can be
+    // mapped with its own permissions, .bss follows .data in the same segment.
+    const bool hasRodata = sections[RODATA].size > 0;
+    const bool hasData = sections[DATA].size + sections[BSS].size > 0;
+    const int phnum = isExecutable ? 1 + hasRodata + hasData : 0;
+
+    uint64_t offsets[SECTION_COUNT];
+    uint64_t addresses[SECTION_COUNT];
+    uint64_t offset = EHDR_SIZE + phnum * PHDR_SIZE;
+
+    for (const int i: {TEXT, RODATA, DATA}) {
+        offset = alignUp(offset, isExecutable ? PAGE_SIZE : sections[i].align);
+        offsets[i] = offset;
+        addresses[i] = isExecutable ? BASE_ADDRESS + offset : 0;
+        offset += sections[i].bytes.size();
+    }
+
+    offsets[BSS] = offset;
+    addresses[BSS] = isExecutable ? alignUp(addresses[DATA] + sections[DATA].size, sections[BSS].align) : 0;
+
+    const auto addressOf = [&](const Symbol& sym) {
+        return addresses[sym.section] + sym.offset;
+    };
+
+    Image image;
+    std::vector<uint8_t>& out = image.bytes;
+    out.resize(EHDR_SIZE + phnum * PHDR_SIZE);
+
+    // Text, with data references resolved in an executable and left to the linker in an object
+    std::vector<uint8_t> text = sections[TEXT].bytes;
+    std::vector<uint8_t> rela;
+
+    for (const auto& relocation: encoder.relocations()) {
+        const auto it = symbolIndex.find(symbols.name(relocation.symbol));
+        if (it == symbolIndex.end()) {
+            throw std::runtime_error(std::format("Undefined symbol {}", symbols.name(relocation.symbol)));
+        }
+
+        if (isExecutable) {
+            const uint64_t target = addressOf(syms[it->second - 1]) + relocation.addend;
+            const auto rel = static_cast<uint32_t>(target - (addresses[TEXT] + relocation.offset));
+            for (int i = 0; i < 4; ++i) {
+                text[relocation.offset + i] = static_cast<uint8_t>(rel >> (8 * i));
+            }
+        } else {
+            put(rela, relocation.offset, 8);
+            put(rela, static_cast<uint64_t>(it->second) << 32 | R_X86_64_PC32, 8);
+            put(rela, relocation.addend, 8);
+        }
+    }
+
+    for (const int i: {TEXT, RODATA, DATA}) {
+        out.resize(offsets[i]);
+        const auto& bytes = i == TEXT ? text : sections[i].bytes;
+        out.insert(out.end(), bytes.begin(), bytes.end());
+    }
+
+    // Symbol and string tables
+    std::string strtab(1, '\0');
+    std::vector<uint8_t> symtab(SYM_SIZE);
+
+    for (const auto& sym: syms) {
+        const bool isGlobal = sym.name == "_start";
+        put(symtab, addString(strtab, sym.name), 4);
+        put(symtab, (isGlobal ? STB_GLOBAL << 4 : 0) | (sym.section == TEXT ? STT_FUNC : STT_OBJECT), 1);
+        put(symtab, 0, 1);
+        put(symtab, sym.section + 1, 2);
+        put(symtab, addressOf(sym), 8);
+        image.symbols[sym.name] = addressOf(sym);
+        put(symtab, 0, 8);
+    }
+
+    std::string shstrtab(1, '\0');
+    std::vector<SectionHeader> headers(1);
+
+    constexpr uint64_t flags[SECTION_COUNT] = {
+        SHF_ALLOC | SHF_EXECINSTR, SHF_ALLOC, SHF_ALLOC | SHF_WRITE, SHF_ALLOC | SHF_WRITE
+    };
+
+    for (int i = 0; i < SECTION_COUNT; ++i) {
+        headers.push_back({
+            addString(shstrtab, sections[i].name), i == BSS ? SHT_NOBITS : SHT_PROGBITS, flags[i], addresses[i],
+            offsets[i], sections[i].size, 0, 0, sections[i].align, 0
+        });
+    }
+
+    const auto symtabIndex = static_cast<uint32_t>(headers.size() + !isExecutable);
+
+    const auto appendTable = [&](const char* name, const uint32_t type, const auto& bytes, const uint32_t link,
+                                 const uint32_t info, const uint64_t align, const uint64_t entrySize) {
+        out.resize(alignUp(out.size(), align));
+        headers.push_back({
+            addString(shstrtab, name), type, type == SHT_RELA ? static_cast<uint64_t>(SHF_INFO_LINK) : uint64_t{0}, 0,
+            out.size(), bytes.size(), link, info, align, entrySize
+        });
+        out.insert(out.end(), bytes.begin(), bytes.end());
+    };
+
+    if (!isExecutable) {
+        appendTable(".rela.text", SHT_RELA, rela, symtabIndex, TEXT + 1, 8, RELA_SIZE);
+    }
+
+    appendTable(".symtab", SHT_SYMTAB, symtab, symtabIndex + 1, static_cast<uint32_t>(syms.size()), 8, SYM_SIZE);
+    appendTable(".strtab", SHT_STRTAB, strtab, 0, 0, 1, 0);
+    // The section name table names itself
+    addString(shstrtab, ".shstrtab");
+    appendTable(".shstrtab", SHT_STRTAB, shstrtab, 0, 0, 1, 0);
+
+    // Section header table
+    out.resize(alignUp(out.size(), 8));
+    const uint64_t shoff = out.size();
+
+    for (const auto& header: headers) {
+        put(out, header.name, 4);
+        put(out, header.type, 4);
+        put(out, header.flags, 8);
+        put(out, header.address, 8);
+        put(out, header.offset, 8);
+        put(out, header.size, 8);
+        put(out, header.link, 4);
+        put(out, header.info, 4);
+        put(out, header.align, 8);
+        put(out, header.entrySize, 8);
+    }
+
+    // ELF header and program headers
+    std::vector<uint8_t> header = {0x7F, 'E', 'L', 'F', 2, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    put(header, isExecutable ? 2 : 1, 2);
+    put(header, 62, 2);
+    put(header, 1, 4);
+    image.entry = isExecutable ? addressOf(syms.back()) : 0;
+    put(header, image.entry, 8);
+    put(header, phnum ? EHDR_SIZE : 0, 8);
+    put(header, shoff, 8);
+    put(header, 0, 4);
+    put(header, EHDR_SIZE, 2);
+    put(header, phnum ? PHDR_SIZE : 0, 2);
+    put(header, phnum, 2);
+    put(header, SHDR_SIZE, 2);
+    put(header, headers.size(), 2);
+    put(header, headers.size() - 1, 2);
+
+    const auto addSegment = [&](const uint32_t segmentFlags, const int first, const uint64_t fileSize,
+                                const uint64_t memSize) {
+        image.segments.push_back({offsets[first], addresses[first], fileSize, memSize, segmentFlags});
+        put(header, PT_LOAD, 4);
+        put(header, segmentFlags, 4);
+        put(header, offsets[first], 8);
+        put(header, addresses[first], 8);
+        put(header, addresses[first], 8);
+        put(header, fileSize, 8);
+        put(header, memSize, 8);
+        put(header, PAGE_SIZE, 8);
+    };
+
+    if (isExecutable) {
+        addSegment(PF_R | PF_X, TEXT, sections[TEXT].size, sections[TEXT].size);
+        if (hasRodata) {
+            addSegment(PF_R, RODATA, sections[RODATA].size, sections[RODATA].size);
+        }
+        if (hasData) {
+            addSegment(PF_R | PF_W, DATA, sections[DATA].size,
+                       addresses[BSS] + sections[BSS].size - addresses[DATA]);
+        }
+    }
+
+    std::ranges::copy(header, out.begin());
+    return image;
+}
@@ -0,0 +1,69 @@
+#ifndef ELF_H
+#define ELF_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "encoder.h"
+
+// Lays out the encoded text section and the data sections as a static ELF64 executable
+// or a relocatable object. Data is given as the NASM directives CodeGen emits.
+class ElfWriter {
+public:
+    struct Segment {
+        uint64_t offset;
+        uint64_t address;
+        uint64_t fileSize;
+        uint64_t memSize;
+        // PF_R, PF_W and PF_X
+        uint32_t flags;
+    };
+
+    // An executable and where its segments and symbols are loaded
+    struct Image {
+        std::vector<uint8_t> bytes;
+        std::vector<Segment> segments;
+        uint64_t entry;
+        std::unordered_map<std::string, uint64_t> symbols;
+    };
+
+    static constexpr uint32_t PF_X = 1, PF_W = 2, PF_R = 4;
+
+    ElfWriter(const Encoder& encoder, const SymbolTable& symbols);
+
+    // Section is one of .data, .rodata or .bss
+    void addData(std::string_view section, const std::string& name, std::string_view directive);
+
+    [[nodiscard]] std::vector<uint8_t> executable() const { return write(true).bytes; }
+
+    [[nodiscard]] std::vector<uint8_t> object() const { return write(false).bytes; }
+
+    [[nodiscard]] Image image() const { return write(true); }
+
+private:
+    enum SectionIndex { TEXT, RODATA, DATA, BSS, SECTION_COUNT };
+
+    struct Section {
+        const char* name;
+        std::vector<uint8_t> bytes;
+        uint64_t size;
+        uint64_t align;
+    };
+
+    struct Symbol {
+        std::string name;
+        SectionIndex section;
+        uint64_t offset;
+    };
+
+    [[nodiscard]] Image write(bool isExecutable) const;
+
+    const Encoder& encoder;
+    const SymbolTable& symbols;
+    Section sections[SECTION_COUNT];
+    std::vector<Symbol> dataSymbols;
+};
+
+#endif //ELF_H
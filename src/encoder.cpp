@@ -0,0 +1,531 @@
+#include "encoder.h"
+#include <format>
+#include <limits>
+#include <stdexcept>
+
+// Hardware register numbers, indexed by RegisterID
+static constexpr uint8_t registerNumbers[] = {
+    0, 7, 6,
+    2, 1, 8,
+    9, 10, 11,
+    5, 4, 3,
+    12, 13, 14, 15
+};
+
+static int hw(const Operand& operand) {
+    return operand.reg >= xmm0 ? operand.reg - xmm0 : registerNumbers[operand.reg];
+}
+
+static bool isInt8(const int64_t n) {
+    return n >= std::numeric_limits<int8_t>::min() && n <= std::numeric_limits<int8_t>::max();
+}
+
+static bool isInt32(const int64_t n) {
+    return n >= std::numeric_limits<int32_t>::min() && n <= std::numeric_limits<int32_t>::max();
+}
+
+static bool isByte(const Operand& operand) {
+    return operand.size == REG8L || operand.size == REG8H;
+}
+
+// spl, bpl, sil and dil are only addressable with a REX prefix
+static bool needsREX(const Operand& operand) {
+    return operand.isReg() && operand.reg < xmm0 && operand.size == REG8L && hw(operand) >= 4 && hw(operand) < 8;
+}
+
+[[noreturn]] static void unsupported(const Instr& instr) {
+    throw std::runtime_error(std::format("Cannot encode {} with these operands", mnemonic(instr.op)));
+}
+
+void Encoder::encode(const std::vector<Instr>& code, const SymbolTable& symbols) {
+    for (const auto& instr: code) {
+        if (instr.op == Opcode::LABEL) {
+            labelOffsets[instr.operands[0].symbol] = static_cast<uint32_t>(bytes.size());
+            continue;
+        }
+
+        encodeInstr(instr);
+    }
+
+    for (const auto& [offset, symbol]: labelFixups) {
+        const auto it = labelOffsets.find(symbol);
+        if (it == labelOffsets.end()) {
+            throw std::runtime_error(std::format("Undefined label {}", symbols.name(symbol)));
+        }
+
+        patch(offset, static_cast<int32_t>(it->second - (offset + 4)));
+    }
+
+    for (const auto& [offset, target, table]: tableFixups) {
+        patch(offset, static_cast<int32_t>(labelOffsets.at(target) - labelOffsets.at(table)));
+    }
+
+    // A jump table is addressed relative to rip like data, but its label is already placed
+    std::erase_if(dataRelocations, [&](const Relocation& relocation) {
+        const auto it = labelOffsets.find(relocation.symbol);
+        if (it == labelOffsets.end()) return false;
+
+        patch(relocation.offset, static_cast<int32_t>(it->second + relocation.addend - relocation.offset));
+        return true;
+    });
+}
+
+void Encoder::patch(const uint32_t offset, const int32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        bytes[offset + i] = static_cast<uint8_t>(static_cast<uint32_t>(value) >> (8 * i));
+    }
+}
+
+void Encoder::encodeInstr(const Instr& instr) {
+    const Operand& d = instr.operands[0];
+    const Operand& s = instr.operands[1];
+
+    forceREX = false;
+    bool isWide = false;
+    for (int i = 0; i < instr.count; ++i) {
+        forceREX |= needsREX(instr.operands[i]);
+        isWide |= (instr.operands[i].isReg() || instr.operands[i].isMem()) && instr.operands[i].size == Operand::WIDE;
+    }
+
+    switch (instr.op) {
+        case Opcode::MOV: encodeMov(instr);
+            break;
+        case Opcode::MOVZX:
+            emitOp(0, d.size == REG64, {0x0F, static_cast<uint8_t>(s.size == REG16 ? 0xB7 : 0xB6)}, hw(d), s);
+            break;
+        case Opcode::MOVSXD: emitOp(0, true, {0x63}, hw(d), s);
+            break;
+        case Opcode::LEA: emitOp(0, true, {0x8D}, hw(d), s);
+            break;
+        case Opcode::PUSH:
+        case Opcode::POP:
+            if (!d.isReg()) unsupported(instr);
+            if (hw(d) >= 8) bytes.push_back(0x41);
+            bytes.push_back((instr.op == Opcode::PUSH ? 0x50 : 0x58) + (hw(d) & 7));
+            break;
+        case Opcode::ADD: encodeALU(instr, 0);
+            break;
+        case Opcode::OR: encodeALU(instr, 1);
+            break;
+        case Opcode::AND: encodeALU(instr, 4);
+            break;
+        case Opcode::SUB: encodeALU(instr, 5);
+            break;
+        case Opcode::XOR: encodeALU(instr, 6);
+            break;
+        case Opcode::CMP: encodeALU(instr, 7);
+            break;
+        case Opcode::TEST: {
+            const bool isByteOp = isByte(d);
+            if (s.isImm()) {
+                emitOp(0, d.size == REG64, {static_cast<uint8_t>(isByteOp ? 0xF6 : 0xF7)}, 0, d, isByteOp ? 1 : 4,
+                       s.value);
+            } else if (s.isReg()) {
+                emitOp(0, d.size == REG64, {static_cast<uint8_t>(isByteOp ? 0x84 : 0x85)}, hw(s), d);
+            } else {
+                unsupported(instr);
+            }
+            break;
+        }
+        case Opcode::IMUL: {
+            // imul d, s, imm or imul d, imm
+            const Operand& src = instr.count == 3 ? s : d;
+            const Operand& imm = instr.count == 3 ? instr.operands[2] : s;
+
+            if (imm.isImm()) {
+                if (isInt8(imm.value)) {
+                    emitOp(0, d.size == REG64, {0x6B}, hw(d), src, 1, imm.value);
+                } else if (isInt32(imm.value)) {
+                    emitOp(0, d.size == REG64, {0x69}, hw(d), src, 4, imm.value);
+                } else {
+                    unsupported(instr);
+                }
+            } else {
+                emitOp(0, d.size == REG64, {0x0F, 0xAF}, hw(d), s);
+            }
+            break;
+        }
+        case Opcode::IDIV: emitOp(0, d.size == REG64, {0xF7}, 7, d);
+            break;
+        case Opcode::CQO: bytes.insert(bytes.end(), {0x48, 0x99});
+            break;
+        case Opcode::INC:
+        case Opcode::DEC:
+            emitOp(0, d.size == REG64, {static_cast<uint8_t>(isByte(d) ? 0xFE : 0xFF)}, instr.op == Opcode::DEC, d);
+            break;
+        case Opcode::BT:
+            if (!s.isReg()) unsupported(instr);
+            emitOp(0, d.size == REG64, {0x0F, 0xA3}, hw(s), d);
+            break;
+        case Opcode::CMOVL: emitOp(0, d.size == REG64, {0x0F, 0x4C}, hw(d), s);
+            break;
+        case Opcode::CMOVG: emitOp(0, d.size == REG64, {0x0F, 0x4F}, hw(d), s);
+            break;
+        case Opcode::CMOVE: emitOp(0, d.size == REG64, {0x0F, 0x44}, hw(d), s);
+            break;
+        case Opcode::CMOVNE: emitOp(0, d.size == REG64, {0x0F, 0x45}, hw(d), s);
+            break;
+        case Opcode::CMOVGE: emitOp(0, d.size == REG64, {0x0F, 0x4D}, hw(d), s);
+            break;
+        case Opcode::CMOVLE: emitOp(0, d.size == REG64, {0x0F, 0x4E}, hw(d), s);
+            break;
+        case Opcode::SETE: emitOp(0, false, {0x0F, 0x94}, 0, d);
+            break;
+        case Opcode::SETNE: emitOp(0, false, {0x0F, 0x95}, 0, d);
+            break;
+        case Opcode::SETG: emitOp(0, false, {0x0F, 0x9F}, 0, d);
+            break;
+        case Opcode::SETL: emitOp(0, false, {0x0F, 0x9C}, 0, d);
+            break;
+        case Opcode::SETGE: emitOp(0, false, {0x0F, 0x9D}, 0, d);
+            break;
+        case Opcode::SETLE: emitOp(0, false, {0x0F, 0x9E}, 0, d);
+            break;
+        case Opcode::SETA: emitOp(0, false, {0x0F, 0x97}, 0, d);
+            break;
+        case Opcode::SETB: emitOp(0, false, {0x0F, 0x92}, 0, d);
+            break;
+        case Opcode::SETAE: emitOp(0, false, {0x0F, 0x93}, 0, d);
+            break;
+        case Opcode::SETBE: emitOp(0, false, {0x0F, 0x96}, 0, d);
+            break;
+        case Opcode::JMP: bytes.push_back(0xE9);
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JE: bytes.insert(bytes.end(), {0x0F, 0x84});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JNE:
+        case Opcode::JNZ: bytes.insert(bytes.end(), {0x0F, 0x85});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JG: bytes.insert(bytes.end(), {0x0F, 0x8F});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JL: bytes.insert(bytes.end(), {0x0F, 0x8C});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JGE: bytes.insert(bytes.end(), {0x0F, 0x8D});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JLE: bytes.insert(bytes.end(), {0x0F, 0x8E});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JA: bytes.insert(bytes.end(), {0x0F, 0x87});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JB: bytes.insert(bytes.end(), {0x0F, 0x82});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JAE: bytes.insert(bytes.end(), {0x0F, 0x83});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::JBE: bytes.insert(bytes.end(), {0x0F, 0x86});
+            emitRel32(d.symbol);
+            break;
+        case Opcode::DD:
+            tableFixups.push_back({static_cast<uint32_t>(bytes.size()), d.symbol, s.symbol});
+            emitImm(0, 4);
+            break;
+        case Opcode::JMPR: emitOp(0, false, {0xFF}, 4, d);
+            break;
+        case Opcode::CALL: bytes.push_back(0xE8);
+            emitRel32(d.symbol);
+            break;
+        case Opcode::RET: bytes.push_back(0xC3);
+            break;
+        case Opcode::SYSCALL: bytes.insert(bytes.end(), {0x0F, 0x05});
+            break;
+        case Opcode::MOVQ:
+        case Opcode::VMOVQ: {
+            const bool isVEX = instr.op == Opcode::VMOVQ;
+            if (d.isReg() && d.reg >= xmm0 && s.isReg() && s.reg < xmm0) {
+                isVEX ? encodeVEX({1, 1, true}, 0x6E, hw(d), 0, s, false) : emitOp(0x66, true, {0x0F, 0x6E}, hw(d), s);
+            } else if (d.isReg() && d.reg < xmm0 && s.isReg() && s.reg >= xmm0) {
+                isVEX ? encodeVEX({1, 1, true}, 0x7E, hw(s), 0, d, false) : emitOp(0x66, true, {0x0F, 0x7E}, hw(s), d);
+            } else if (d.isReg()) {
+                isVEX ? encodeVEX({2, 1, false}, 0x7E, hw(d), 0, s, false) : emitOp(0xF3, false, {0x0F, 0x7E}, hw(d), s);
+            } else {
+                isVEX ? encodeVEX({1, 1, false}, 0xD6, hw(s), 0, d, false) : emitOp(0x66, false, {0x0F, 0xD6}, hw(s), d);
+            }
+            break;
+        }
+        case Opcode::MOVSD:
+            d.isReg() ? emitOp(0xF2, false, {0x0F, 0x10}, hw(d), s) : emitOp(0xF2, false, {0x0F, 0x11}, hw(s), d);
+            break;
+        case Opcode::MOVAPD: emitOp(0x66, false, {0x0F, 0x28}, hw(d), s);
+            break;
+        case Opcode::CVTSI2SD:
+            emitOp(0xF2, s.size == REG64, {0x0F, 0x2A}, hw(d), s);
+            break;
+        case Opcode::ADDSD: emitOp(0xF2, false, {0x0F, 0x58}, hw(d), s);
+            break;
+        case Opcode::SUBSD: emitOp(0xF2, false, {0x0F, 0x5C}, hw(d), s);
+            break;
+        case Opcode::MULSD: emitOp(0xF2, false, {0x0F, 0x59}, hw(d), s);
+            break;
+        case Opcode::DIVSD: emitOp(0xF2, false, {0x0F, 0x5E}, hw(d), s);
+            break;
+        case Opcode::UCOMISD:
+            if (!s.isReg() && !s.isMem()) unsupported(instr);
+            emitOp(0x66, false, {0x0F, 0x2E}, hw(d), s);
+            break;
+        case Opcode::ANDPD: emitOp(0x66, false, {0x0F, 0x54}, hw(d), s);
+            break;
+        case Opcode::ANDNPD: emitOp(0x66, false, {0x0F, 0x55}, hw(d), s);
+            break;
+        case Opcode::ORPD: emitOp(0x66, false, {0x0F, 0x56}, hw(d), s);
+            break;
+        case Opcode::XORPD: emitOp(0x66, false, {0x0F, 0x57}, hw(d), s);
+            break;
+        case Opcode::MOVDQA:
+        case Opcode::MOVDQU: {
+            const uint8_t prefix = instr.op == Opcode::MOVDQA ? 0x66 : 0xF3;
+            d.isReg() ? emitOp(prefix, false, {0x0F, 0x6F}, hw(d), s) : emitOp(prefix, false, {0x0F, 0x7F}, hw(s), d);
+            break;
+        }
+        case Opcode::PADDQ: emitOp(0x66, false, {0x0F, 0xD4}, hw(d), s);
+            break;
+        case Opcode::PSUBQ: emitOp(0x66, false, {0x0F, 0xFB}, hw(d), s);
+            break;
+        case Opcode::PMULUDQ: emitOp(0x66, false, {0x0F, 0xF4}, hw(d), s);
+            break;
+        case Opcode::PAND: emitOp(0x66, false, {0x0F, 0xDB}, hw(d), s);
+            break;
+        case Opcode::POR: emitOp(0x66, false, {0x0F, 0xEB}, hw(d), s);
+            break;
+        case Opcode::PXOR: emitOp(0x66, false, {0x0F, 0xEF}, hw(d), s);
+            break;
+        case Opcode::PCMPEQD: emitOp(0x66, false, {0x0F, 0x76}, hw(d), s);
+            break;
+        case Opcode::PUNPCKLQDQ: emitOp(0x66, false, {0x0F, 0x6C}, hw(d), s);
+            break;
+        case Opcode::PSRLQ: emitOp(0x66, false, {0x0F, 0x73}, 2, d, 1, s.value);
+            break;
+        case Opcode::PSLLQ: emitOp(0x66, false, {0x0F, 0x73}, 6, d, 1, s.value);
+            break;
+        case Opcode::PSHUFD: emitOp(0x66, false, {0x0F, 0x70}, hw(d), s, 1, instr.operands[2].value);
+            break;
+        case Opcode::VMOVDQA:
+        case Opcode::VMOVDQU: {
+            const VEX vex{static_cast<uint8_t>(instr.op == Opcode::VMOVDQA ? 1 : 2), 1, false};
+            d.isReg() ? encodeVEX(vex, 0x6F, hw(d), 0, s, isWide) : encodeVEX(vex, 0x7F, hw(s), 0, d, isWide);
+            break;
+        }
+        case Opcode::VPADDQ:
+        case Opcode::VPSUBQ:
+        case Opcode::VPMULUDQ:
+        case Opcode::VPAND:
+        case Opcode::VPOR:
+        case Opcode::VPXOR:
+        case Opcode::VPCMPEQD:
+        case Opcode::VPCMPGTQ: {
+            static constexpr std::pair<Opcode, uint8_t> opcodes[] = {
+                {Opcode::VPADDQ, 0xD4}, {Opcode::VPSUBQ, 0xFB}, {Opcode::VPMULUDQ, 0xF4}, {Opcode::VPAND, 0xDB},
+                {Opcode::VPOR, 0xEB}, {Opcode::VPXOR, 0xEF}, {Opcode::VPCMPEQD, 0x76}, {Opcode::VPCMPGTQ, 0x37}
+            };
+            uint8_t opcode = 0;
+            for (const auto& [op, byte]: opcodes) {
+                if (op == instr.op) opcode = byte;
+            }
+            // The two operand form accumulates into the destination
+            const Operand& src1 = instr.count == 3 ? s : d;
+            const Operand& src2 = instr.count == 3 ? instr.operands[2] : s;
+            encodeVEX({1, static_cast<uint8_t>(instr.op == Opcode::VPCMPGTQ ? 2 : 1), false}, opcode, hw(d), hw(src1),
+                      src2, isWide);
+            break;
+        }
+        case Opcode::VPSRLQ:
+        case Opcode::VPSLLQ: {
+            const Operand& src = instr.count == 3 ? s : d;
+            const Operand& imm = instr.operands[instr.count - 1];
+            encodeVEX({1, 1, false}, 0x73, instr.op == Opcode::VPSRLQ ? 2 : 6, hw(d), src, isWide, 1, imm.value);
+            break;
+        }
+        case Opcode::VPSHUFD: encodeVEX({1, 1, false}, 0x70, hw(d), 0, s, isWide, 1, instr.operands[2].value);
+            break;
+        case Opcode::VBLENDVPD:
+            encodeVEX({1, 3, false}, 0x4B, hw(d), hw(s), instr.operands[2], isWide, 1, hw(instr.operands[3]) << 4);
+            break;
+        case Opcode::VPBROADCASTQ: encodeVEX({1, 2, false}, 0x59, hw(d), 0, s, isWide);
+            break;
+        case Opcode::VEXTRACTI128: encodeVEX({1, 3, false}, 0x39, hw(s), 0, d, true, 1, instr.operands[2].value);
+            break;
+        case Opcode::VZEROUPPER: bytes.insert(bytes.end(), {0xC5, 0xF8, 0x77});
+            break;
+        default: unsupported(instr);
+    }
+}
+
+void Encoder::encodeALU(const Instr& instr, const uint8_t ext) {
+    const Operand& d = instr.operands[0];
+    const Operand& s = instr.operands[1];
+    const uint32_t size = d.isReg() || d.isMem() ? d.size : s.size;
+    const bool isByteOp = size == REG8L || size == REG8H;
+    const uint8_t prefix = size == REG16 ? 0x66 : 0;
+    const bool w = size == REG64;
+    const auto base = static_cast<uint8_t>(ext * 8);
+
+    if (s.isImm()) {
+        if (isByteOp) {
+            emitOp(prefix, w, {0x80}, ext, d, 1, s.value);
+        } else if (isInt8(s.value)) {
+            emitOp(prefix, w, {0x83}, ext, d, 1, s.value);
+        } else if (isInt32(s.value) || size != REG64) {
+            emitOp(prefix, w, {0x81}, ext, d, size == REG16 ? 2 : 4, s.value);
+        } else {
+            unsupported(instr);
+        }
+    } else if (s.isReg()) {
+        emitOp(prefix, w, {static_cast<uint8_t>(base + (isByteOp ? 0 : 1))}, hw(s), d);
+    } else if (d.isReg()) {
+        emitOp(prefix, w, {static_cast<uint8_t>(base + (isByteOp ? 2 : 3))}, hw(d), s);
+    } else {
+        unsupported(instr);
+    }
+}
+
+void Encoder::encodeMov(const Instr& instr) {
+    const Operand& d = instr.operands[0];
+    const Operand& s = instr.operands[1];
+
+    if (d.isReg() && s.isImm()) {
+        const int r = hw(d);
+        const int64_t n = s.value;
+
+        if (d.size == REG64 && isInt32(n) && n < 0) {
+            // Sign extended imm32
+            emitOp(0, true, {0xC7}, 0, d, 4, n);
+            return;
+        }
+
+        if (d.size == REG64 && !(n >= 0 && n <= std::numeric_limits<uint32_t>::max())) {
+            bytes.push_back(0x48 | (r >> 3));
+            bytes.push_back(0xB8 + (r & 7));
+            emitImm(n, 8);
+            return;
+        }
+
+        // Writing the 32-bit register zero extends into the upper half
+        const int immSize = d.size == REG16 ? 2 : isByte(d) ? 1 : 4;
+        if (d.size == REG16) bytes.push_back(0x66);
+        if (r >= 8 || forceREX) bytes.push_back(0x40 | (r >> 3));
+        bytes.push_back((isByte(d) ? 0xB0 : 0xB8) + (r & 7));
+        emitImm(n, immSize);
+        return;
+    }
+
+    if (d.isMem() && s.isImm()) {
+        const int immSize = d.size == REG16 ? 2 : isByte(d) ? 1 : 4;
+        if (d.size == REG64 && !isInt32(s.value)) unsupported(instr);
+        emitOp(d.size == REG16 ? 0x66 : 0, d.size == REG64, {static_cast<uint8_t>(isByte(d) ? 0xC6 : 0xC7)}, 0, d,
+               immSize, s.value);
+        return;
+    }
+
+    if ((d.isReg() && d.reg >= xmm0) || (s.isReg() && s.reg >= xmm0)) {
+        unsupported(instr);
+    }
+
+    if (s.isReg()) {
+        emitOp(s.size == REG16 ? 0x66 : 0, s.size == REG64, {static_cast<uint8_t>(isByte(s) ? 0x88 : 0x89)}, hw(s),
+               d);
+    } else if (d.isReg()) {
+        emitOp(d.size == REG16 ? 0x66 : 0, d.size == REG64, {static_cast<uint8_t>(isByte(d) ? 0x8A : 0x8B)}, hw(d),
+               s);
+    } else {
+        unsupported(instr);
+    }
+}
+
+void Encoder::encodeVEX(const VEX vex, const uint8_t opcode, const int reg, const int vvvv, const Operand& rm,
+                        const bool isWide, const int immSize, const int64_t imm) {
+    const int r = ~(reg >> 3) & 1;
+    const int b = rm.isReg() || rm.reg != Operand::RIP ? ~(hw(rm) >> 3) & 1 : 1;
+    const int lpp = (isWide ? 4 : 0) | vex.pp;
+    const int v = (~vvvv & 0xF) << 3;
+
+    if (vex.map == 1 && !vex.w && b) {
+        bytes.push_back(0xC5);
+        bytes.push_back(r << 7 | v | lpp);
+    } else {
+        bytes.push_back(0xC4);
+        // No index register, X is always set
+        bytes.push_back(r << 7 | 1 << 6 | b << 5 | vex.map);
+        bytes.push_back((vex.w ? 0x80 : 0) | v | lpp);
+    }
+
+    bytes.push_back(opcode);
+    emitModRM(reg, rm, immSize);
+    emitImm(imm, immSize);
+}
+
+void Encoder::emitOp(const uint8_t prefix, const bool w, const std::initializer_list<uint8_t> opcode, const int reg,
+                     const Operand& rm, const int immSize, const int64_t imm) {
+    if (prefix) {
+        bytes.push_back(prefix);
+    }
+
+    uint8_t rex = 0x40 | (w ? 8 : 0) | ((reg >> 3) & 1) << 2;
+    if (rm.isReg() || rm.reg != Operand::RIP) {
+        rex |= (hw(rm) >> 3) & 1;
+    }
+    if (rm.isIndexed()) {
+        rex |= (registerNumbers[rm.index] >> 3 & 1) << 1;
+    }
+
+    if (rex != 0x40 || forceREX) {
+        bytes.push_back(rex);
+    }
+
+    bytes.insert(bytes.end(), opcode);
+    emitModRM(reg, rm, immSize);
+    emitImm(imm, immSize);
+}
+
+void Encoder::emitModRM(const int reg, const Operand& rm, const int immSize) {
+    const int r = (reg & 7) << 3;
+
+    if (rm.isReg()) {
+        bytes.push_back(0xC0 | r | (hw(rm) & 7));
+        return;
+    }
+
+    if (rm.reg == Operand::RIP) {
+        bytes.push_back(0x05 | r);
+        dataRelocations.push_back({static_cast<uint32_t>(bytes.size()), rm.symbol, -4 - immSize});
+        emitImm(0, 4);
+        return;
+    }
+
+    const int base = hw(rm) & 7;
+    // rbp and r13 have no encoding without a displacement
+    const int mod = rm.value == 0 && base != 5 ? 0 : isInt8(rm.value) ? 1 : 2;
+
+    if (rm.isIndexed()) {
+        static constexpr uint8_t scaleBits[] = {0, 0, 1, 0, 2, 0, 0, 0, 3};
+        bytes.push_back(mod << 6 | r | 4);
+        bytes.push_back(scaleBits[rm.scale] << 6 | (registerNumbers[rm.index] & 7) << 3 | base);
+    } else {
+        bytes.push_back(mod << 6 | r | base);
+        // rsp and r12 need a SIB byte
+        if (base == 4) {
+            bytes.push_back(0x24);
+        }
+    }
+
+    if (mod) {
+        emitImm(rm.value, mod == 1 ? 1 : 4);
+    }
+}
+
+void Encoder::emitImm(const int64_t imm, const int size) {
+    for (int i = 0; i < size; ++i) {
+        bytes.push_back(static_cast<uint8_t>(static_cast<uint64_t>(imm) >> (8 * i)));
+    }
+}
+
+void Encoder::emitRel32(const uint32_t symbol) {
+    labelFixups.emplace_back(static_cast<uint32_t>(bytes.size()), symbol);
+    emitImm(0, 4);
+}
@@ -0,0 +1,76 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+#include "instr.h"
+
+// A rip-relative reference from the text section to a data symbol
+struct Relocation {
+    // Offset of the 32-bit displacement in the text section
+    uint32_t offset;
+    uint32_t symbol;
+    // Bytes from the end of the instruction back to the displacement, negated
+    int64_t addend;
+};
+
+// Translates the text section to x86-64 machine code. Jumps, calls and jump tables are resolved
+// against the labels of the text section, data references are left as relocations.
+class Encoder {
+public:
+    void encode(const std::vector<Instr>& code, const SymbolTable& symbols);
+
+    [[nodiscard]] const std::vector<uint8_t>& text() const { return bytes; }
+
+    [[nodiscard]] const std::unordered_map<uint32_t, uint32_t>& labels() const { return labelOffsets; }
+
+    [[nodiscard]] const std::vector<Relocation>& relocations() const { return dataRelocations; }
+
+private:
+    struct VEX {
+        // Implied prefix: none, 66, F3, F2
+        uint8_t pp;
+        // Opcode map: 0F, 0F38, 0F3A
+        uint8_t map;
+        bool w;
+    };
+
+    struct TableFixup {
+        uint32_t offset;
+        uint32_t target;
+        uint32_t table;
+    };
+
+    void encodeInstr(const Instr& instr);
+
+    void encodeALU(const Instr& instr, uint8_t ext);
+
+    void encodeMov(const Instr& instr);
+
+    void encodeVEX(VEX vex, uint8_t opcode, int reg, int vvvv, const Operand& rm, bool isWide, int immSize = 0,
+                   int64_t imm = 0);
+
+    void emitOp(uint8_t prefix, bool w, std::initializer_list<uint8_t> opcode, int reg, const Operand& rm,
+                int immSize = 0, int64_t imm = 0);
+
+    void emitModRM(int reg, const Operand& rm, int immSize);
+
+    void emitImm(int64_t imm, int size);
+
+    void emitRel32(uint32_t symbol);
+
+    void patch(uint32_t offset, int32_t value);
+
+    std::vector<uint8_t> bytes;
+    std::unordered_map<uint32_t, uint32_t> labelOffsets;
+    // Jumps and calls, patched once every label is placed
+    std::vector<std::pair<uint32_t, uint32_t> > labelFixups;
+    // Jump table entries, patched with the distance from the table to their case label
+    std::vector<TableFixup> tableFixups;
+    std::vector<Relocation> dataRelocations;
+    // Set while encoding an instruction that addresses spl, bpl, sil or dil
+    bool forceREX{false};
+};
+
+#endif //ENCODER_H
@@ -0,0 +1,118 @@
+#include "instr.h"
+#include <format>
+#include <iterator>
+
+static constexpr const char* mnemonics[] = {
+    "",
+    "mov", "movzx", "movsxd", "lea", "push", "pop",
+    "add", "sub", "imul", "idiv", "cqo", "and", "or", "xor", "inc", "dec", "cmp", "test", "bt",
+    "cmovl", "cmovg", "cmove", "cmovne", "cmovge", "cmovle",
+    "sete", "setne", "setg", "setl", "setge", "setle", "seta", "setb", "setae", "setbe",
+    "jmp", "je", "jne", "jg", "jl", "jge", "jle", "jnz", "ja", "jb", "jae", "jbe",
+    "dd",
+    "jmp",
+    "call", "ret", "syscall",
+    "movq", "movsd", "movapd", "cvtsi2sd", "addsd", "subsd", "mulsd", "divsd", "ucomisd", "andpd", "andnpd", "orpd",
+    "xorpd",
+    "movdqa", "movdqu", "paddq", "psubq", "pmuludq", "pand", "por", "pxor", "pcmpeqd", "psrlq", "psllq", "pshufd",
+    "vmovdqa", "vmovdqu", "vpaddq", "vpsubq", "vpmuludq", "vpand", "vpor", "vpxor", "vpcmpeqd", "vpsrlq", "vpsllq",
+    "vpshufd",
+    "punpcklqdq",
+    "vmovq", "vpcmpgtq", "vblendvpd", "vpbroadcastq", "vextracti128", "vzeroupper",
+};
+
+static_assert(std::size(mnemonics) == static_cast<size_t>(Opcode::COUNT));
+
+static constexpr const char* memorySize[] = {"qword ", "dword ", "word ", "byte ", "byte ", "yword ", ""};
+
+uint32_t SymbolTable::intern(const std::string_view name) {
+    if (const auto it = ids.find(name); it != ids.end()) {
+        return it->second;
+    }
+
+    const auto id = static_cast<uint32_t>(names.size());
+    ids.emplace(names.emplace_back(name), id);
+    return id;
+}
+
+const char* mnemonic(const Opcode op) {
+    return mnemonics[static_cast<int>(op)];
+}
+
+bool isJump(const Opcode op) {
+    return op >= Opcode::JMP && op <= Opcode::DD;
+}
+
+static void printOperand(const Operand& operand, const SymbolTable& symbols, std::string& out) {
+    auto it = std::back_inserter(out);
+
+    switch (operand.kind) {
+        case OperandKind::REG:
+            if (operand.size == Operand::WIDE) {
+                std::format_to(it, "ymm{}", operand.reg - xmm0);
+            } else {
+                out += RegisterAllocator::nameFromID(operand.reg, operand.size);
+            }
+            break;
+        case OperandKind::IMM:
+            if (operand.isHex) {
+                std::format_to(it, "0x{:X}", static_cast<uint64_t>(operand.value));
+            } else {
+                std::format_to(it, "{}", operand.value);
+            }
+            break;
+        case OperandKind::MEM:
+            out += memorySize[operand.size];
+            if (operand.reg == Operand::RIP) {
+                std::format_to(it, "[rel {}]", symbols.name(operand.symbol));
+                break;
+            }
+
+            std::format_to(it, "[{}", RegisterAllocator::nameFromID(operand.reg, REG64));
+            if (operand.isIndexed()) {
+                std::format_to(it, " + {}", RegisterAllocator::nameFromID(operand.index, REG64));
+                if (operand.scale != 1) std::format_to(it, "*{}", static_cast<int>(operand.scale));
+            }
+            if (operand.value) {
+                std::format_to(it, " {} {}", operand.value < 0 ? '-' : '+',
+                               operand.value < 0 ? -operand.value : operand.value);
+            }
+            out += ']';
+            break;
+        case OperandKind::SYMBOL:
+            out += symbols.name(operand.symbol);
+            break;
+        case OperandKind::NONE:
+            break;
+    }
+}
+
+void printInstrs(const std::vector<Instr>& code, const SymbolTable& symbols, std::string& out) {
+    for (size_t i = 0; i < code.size(); ++i) {
+        const Instr& instr = code[i];
+
+        if (instr.op == Opcode::LABEL) {
+            const std::string& name = symbols.name(instr.operands[0].symbol);
+            // Functions are separated by a blank line
+            if (!name.starts_with(".") && i > 0 && code[i - 1].op != Opcode::LABEL) {
+                out += "\n";
+            }
+            out += name;
+            out += ":\n";
+            continue;
+        }
+
+        out += "\t";
+        out += mnemonic(instr.op);
+        if (instr.op == Opcode::DD) {
+            std::format_to(std::back_inserter(out), " {} - {}\n", symbols.name(instr.operands[0].symbol),
+                           symbols.name(instr.operands[1].symbol));
+            continue;
+        }
+        for (int j = 0; j < instr.count; ++j) {
+            out += j ? ", " : " ";
+            printOperand(instr.operands[j], symbols, out);
+        }
+        out += "\n";
+    }
+}
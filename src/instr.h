@@ -0,0 +1,153 @@
+#ifndef INSTR_H
+#define INSTR_H
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "register.h"
+
+enum class Opcode : uint8_t {
+    LABEL,
+    // General purpose
+    MOV, MOVZX, MOVSXD, LEA, PUSH, POP,
+    ADD, SUB, IMUL, IDIV, CQO, AND, OR, XOR, INC, DEC, CMP, TEST, BT,
+    CMOVL, CMOVG, CMOVE, CMOVNE, CMOVGE, CMOVLE,
+    SETE, SETNE, SETG, SETL, SETGE, SETLE, SETA, SETB, SETAE, SETBE,
+    JMP, JE, JNE, JG, JL, JGE, JLE, JNZ, JA, JB, JAE, JBE,
+    // Jump table entry, dd case - table. Passes see it as a branch to its case label.
+    DD,
+    // jmp reg, which passes see falling through to the entries of its jump table
+    JMPR,
+    CALL, RET, SYSCALL,
+    // Scalar double
+    MOVQ, MOVSD, MOVAPD, CVTSI2SD, ADDSD, SUBSD, MULSD, DIVSD, UCOMISD, ANDPD, ANDNPD, ORPD, XORPD,
+    // Packed integer, the VEX forms follow in the same order
+    MOVDQA, MOVDQU, PADDQ, PSUBQ, PMULUDQ, PAND, POR, PXOR, PCMPEQD, PSRLQ, PSLLQ, PSHUFD,
+    VMOVDQA, VMOVDQU, VPADDQ, VPSUBQ, VPMULUDQ, VPAND, VPOR, VPXOR, VPCMPEQD, VPSRLQ, VPSLLQ, VPSHUFD,
+    PUNPCKLQDQ,
+    VMOVQ, VPCMPGTQ, VBLENDVPD, VPBROADCASTQ, VEXTRACTI128, VZEROUPPER,
+    COUNT
+};
+
+enum class OperandKind : uint8_t {
+    NONE,
+    REG,
+    IMM,
+    MEM,
+    SYMBOL
+};
+
+struct Operand {
+    OperandKind kind{OperandKind::NONE};
+    // Register, or the base register of a memory operand, virtual until register allocation
+    uint16_t reg{0};
+    // RegisterSize of a register or of a memory access
+    uint8_t size{REG64};
+    // Immediates from bit patterns are printed in hex
+    bool isHex{false};
+    // Label or function, or the variable of a rip-relative memory operand
+    uint32_t symbol{0};
+    // Immediate, the displacement of a memory operand, or the registers of a call, see callArgs and callClobbers
+    int64_t value{0};
+    // Index register of a memory operand, scaled by 1, 2, 4 or 8, or no index when the scale is 0
+    uint16_t index{0};
+    uint8_t scale{0};
+
+    // Vector registers of this size are 256 bits wide
+    static constexpr uint8_t WIDE = SIZE_COUNT;
+    // Memory whose size the instruction implies
+    static constexpr uint8_t UNSIZED = SIZE_COUNT + 1;
+    // Base of a rip-relative memory operand
+    static constexpr uint8_t RIP = REGISTER_COUNT;
+    // Base of a spill slot, resolved to rbp once the frame is laid out
+    static constexpr uint8_t FRAME = REGISTER_COUNT + 1;
+
+    static Operand makeReg(const uint32_t id, const uint32_t size) {
+        return {OperandKind::REG, static_cast<uint16_t>(id), static_cast<uint8_t>(size)};
+    }
+
+    static Operand makeImm(const int64_t n, const bool isHex = false) {
+        return {OperandKind::IMM, 0, REG64, isHex, 0, n};
+    }
+
+    static Operand makeMem(const uint32_t size, const uint32_t base, const int64_t disp) {
+        return {OperandKind::MEM, static_cast<uint16_t>(base), static_cast<uint8_t>(size), false, 0, disp};
+    }
+
+    static Operand makeIndexed(const uint32_t size, const uint32_t base, const uint32_t index, const uint32_t scale,
+                               const int64_t disp) {
+        return {
+            OperandKind::MEM, static_cast<uint16_t>(base), static_cast<uint8_t>(size), false, 0, disp,
+            static_cast<uint16_t>(index), static_cast<uint8_t>(scale)
+        };
+    }
+
+    static Operand makeRel(const uint32_t size, const uint32_t symbol) {
+        return {OperandKind::MEM, RIP, static_cast<uint8_t>(size), false, symbol};
+    }
+
+    static Operand makeSymbol(const uint32_t symbol) {
+        return {OperandKind::SYMBOL, 0, REG64, false, symbol};
+    }
+
+    [[nodiscard]] bool isReg() const { return kind == OperandKind::REG; }
+
+    [[nodiscard]] bool isMem() const { return kind == OperandKind::MEM; }
+
+    [[nodiscard]] bool isImm() const { return kind == OperandKind::IMM; }
+
+    [[nodiscard]] bool isIndexed() const { return kind == OperandKind::MEM && scale != 0; }
+
+    // Argument registers a call reads
+    [[nodiscard]] uint32_t callArgs() const { return static_cast<uint32_t>(value); }
+
+    // Registers the callee writes, 0 when they are unknown and the call clobbers every caller-saved register
+    [[nodiscard]] uint32_t callClobbers() const { return static_cast<uint32_t>(static_cast<uint64_t>(value) >> 32); }
+
+    bool operator==(const Operand& other) const = default;
+};
+
+struct Instr {
+    Opcode op;
+    uint8_t count{0};
+    Operand operands[4];
+};
+
+// Labels, functions and data names referenced by instructions
+class SymbolTable {
+public:
+    uint32_t intern(std::string_view name);
+
+    [[nodiscard]] const std::string& name(uint32_t id) const { return names[id]; }
+
+private:
+    // Deque elements never move, the map keys point into them
+    std::deque<std::string> names;
+    std::unordered_map<std::string_view, uint32_t> ids;
+};
+
+inline Operand toOperand(const Operand& operand) {
+    return operand;
+}
+
+inline Operand toOperand(const int64_t n) {
+    return Operand::makeImm(n);
+}
+
+// The VEX encoded form of a packed SSE instruction
+inline Opcode toVEX(const Opcode op) {
+    return static_cast<Opcode>(static_cast<int>(op) + static_cast<int>(Opcode::VMOVDQA) - static_cast<int>(Opcode::MOVDQA));
+}
+
+const char* mnemonic(Opcode op);
+
+// Jumps and jump table entries, which branch to the label of their first operand
+bool isJump(Opcode op);
+
+// Renders the text section in NASM syntax
+void printInstrs(const std::vector<Instr>& code, const SymbolTable& symbols, std::string& out);
+
+#endif //INSTR_H
@@ -0,0 +1,920 @@
+#include "ir.h"
+#include <algorithm>
+#include <format>
+#include <functional>
+
+static const char* typeNames[] = {"void", "i64", "f64", "ptr"};
+
+static const char* opNames[] = {
+    "undef", "const", "param", "load", "store", "add", "sub", "mul", "div", "and", "or", "xor",
+    "eq", "ne", "gt", "lt", "ge", "le", "sitofp", "call", "phi", "jmp", "br", "ret"
+};
+
+static bool isCompare(const IROp op) {
+    return op >= IROp::EQ && op <= IROp::LE;
+}
+
+static bool hasResult(const IROp op) {
+    return op != IROp::STORE && op != IROp::JMP && op != IROp::BR && op != IROp::RET;
+}
+
+static bool isRemovable(const IROp op) {
+    // No side effects and cannot trap
+    return hasResult(op) && op != IROp::PARAM && op != IROp::CALL && op != IROp::DIV;
+}
+
+static IRType typeOf(const VarType vType) {
+    switch (vType) {
+        case VarType::DOUBLE:
+            return IRType::F64;
+        case VarType::STRING:
+            return IRType::PTR;
+        default:
+            return IRType::I64;
+    }
+}
+
+static std::string dumpInstr(const IRInstr& instr) {
+    auto value = [](const int id) { return std::format("%{}", id); };
+    auto block = [](const int id) { return std::format("bb{}", id); };
+
+    std::string str = hasResult(instr.op) ? std::format("{} = ", value(instr.dst)) : "";
+    str += opNames[static_cast<int>(instr.op)];
+
+    switch (instr.op) {
+        case IROp::UNDEF:
+            str += std::format(" {}", typeNames[static_cast<int>(instr.type)]);
+            break;
+        case IROp::CONST:
+            if (instr.type == IRType::F64) {
+                str += std::format(" f64 {}", instr.fimm);
+            } else if (instr.type == IRType::PTR) {
+                str += std::format(" ptr \"{}\"", instr.symbol);
+            } else {
+                str += std::format(" i64 {}", instr.imm);
+            }
+            break;
+        case IROp::PARAM:
+            str += std::format(" {} {}", typeNames[static_cast<int>(instr.type)], instr.imm);
+            break;
+        case IROp::LOAD:
+            str += std::format(" {} @{}", typeNames[static_cast<int>(instr.type)], instr.symbol);
+            break;
+        case IROp::STORE:
+            str += std::format(" {} {}, @{}", typeNames[static_cast<int>(instr.type)], value(instr.args[0]),
+                               instr.symbol);
+            break;
+        case IROp::SITOFP:
+            str += std::format(" {}", value(instr.args[0]));
+            break;
+        case IROp::CALL: {
+            std::string args;
+            for (const int arg: instr.args) {
+                args += std::format("{}{}", args.empty() ? "" : ", ", value(arg));
+            }
+            str += std::format(" {} @{}({})", typeNames[static_cast<int>(instr.type)], instr.symbol, args);
+            break;
+        }
+        case IROp::PHI:
+            str += std::format(" {}", typeNames[static_cast<int>(instr.type)]);
+            for (size_t i = 0; i < instr.args.size(); ++i) {
+                str += std::format("{} [{}, {}]", i ? "," : "", value(instr.args[i]), block(instr.blocks[i]));
+            }
+            break;
+        case IROp::JMP:
+            str += std::format(" {}", block(instr.blocks[0]));
+            break;
+        case IROp::BR:
+            str += std::format(" {}, {}, {}", value(instr.args[0]), block(instr.blocks[0]), block(instr.blocks[1]));
+            break;
+        case IROp::RET:
+            if (!instr.args.empty()) {
+                str += std::format(" {} {}", typeNames[static_cast<int>(instr.type)], value(instr.args[0]));
+            }
+            break;
+        default:
+            str += std::format(" {} {}, {}", typeNames[static_cast<int>(instr.type)], value(instr.args[0]),
+                               value(instr.args[1]));
+            break;
+    }
+
+    return str;
+}
+
+std::string IRModule::dump() const {
+    std::string str;
+
+    for (const auto& [name, type, isConstant]: globals) {
+        str += std::format("{} @{}: {}\n", isConstant ? "const" : "global", name, typeNames[static_cast<int>(type)]);
+    }
+
+    for (const auto& func: functions) {
+        std::string params;
+        for (const auto type: func.params) {
+            params += std::format("{}{}", params.empty() ? "" : ", ", typeNames[static_cast<int>(type)]);
+        }
+
+        str += std::format("\nfunction @{}({}) -> {} {{\n", func.name, params,
+                           typeNames[static_cast<int>(func.returnType)]);
+
+        for (const auto& block: func.blocks) {
+            str += std::format("bb{}:\n", block.id);
+
+            for (const auto& instr: block.instrs) {
+                str += std::format("\t{}\n", dumpInstr(instr));
+            }
+        }
+
+        str += "}\n";
+    }
+
+    return str;
+}
+
+IRModule IRBuilder::build(const ExprPtr& ast) {
+    module = {};
+
+    std::vector<ExprPtr> topLevel;
+    std::vector<std::shared_ptr<DefunExpr> > defuns;
+
+    for (auto next = ast; next != nullptr; next = next->child) {
+        if (const auto defun = cast::toDefun(next)) {
+            defuns.push_back(defun);
+            continue;
+        }
+
+        if (const auto defvar = cast::toDefvar(next)) {
+            const auto var = cast::toVar(defvar->pair);
+            module.globals.push_back({cast::toString(var->name)->data, typeOf(var->vType), false});
+        } else if (const auto defconst = cast::toDefconstant(next)) {
+            const auto var = cast::toVar(defconst->pair);
+            module.globals.push_back({cast::toString(var->name)->data, typeOf(var->vType), true});
+        }
+
+        topLevel.push_back(next);
+    }
+
+    lowerFunction("main", {}, topLevel);
+
+    for (const auto& defun: defuns) {
+        lowerFunction(cast::toString(cast::toVar(defun->name)->name)->data, defun->args, defun->forms);
+    }
+
+    return std::move(module);
+}
+
+void IRBuilder::lowerFunction(const std::string& name,
+                              const std::vector<ExprPtr>& params,
+                              const std::vector<ExprPtr>& forms) {
+    module.functions.push_back({.name = name});
+    func = &module.functions.back();
+
+    varTypes.clear();
+    scopes.assign(1, {});
+    currentDef.clear();
+    incompletePhis.clear();
+    sealed.clear();
+    phis.clear();
+    loops.clear();
+
+    currentBlock = newBlock();
+    sealBlock(currentBlock);
+
+    for (size_t i = 0; i < params.size(); ++i) {
+        const auto param = cast::toVar(params[i]);
+        const IRType type = typeOf(param->vType);
+        const int var = newVar(type);
+
+        func->params.push_back(type);
+        scopes.back()[cast::toString(param->name)->data] = var;
+        writeVar(var, currentBlock, emit({.op = IROp::PARAM, .type = type, .imm = static_cast<int64_t>(i)}));
+    }
+
+    // main returns the value of the last top level form
+    const int value = lowerBody(forms);
+    func->returnType = func->valueTypes[value];
+    emit({.op = IROp::RET, .type = func->returnType, .args = {value}});
+
+    finishFunction();
+}
+
+int IRBuilder::lower(const ExprPtr& expr) {
+    if (const auto int_ = cast::toInt(expr)) {
+        return emitConst(int_->n);
+    }
+
+    if (const auto double_ = cast::toDouble(expr)) {
+        return emit({.op = IROp::CONST, .type = IRType::F64, .fimm = double_->n});
+    }
+
+    if (const auto str = cast::toString(expr)) {
+        return emit({.op = IROp::CONST, .type = IRType::PTR, .symbol = str->data});
+    }
+
+    if (cast::toT(expr)) {
+        return emitConst(1);
+    }
+
+    if (const auto var = cast::toVar(expr)) {
+        return lowerVar(*var);
+    }
+
+    if (const auto binop = cast::toBinop(expr)) {
+        return lowerBinop(*binop);
+    }
+
+    if (const auto dotimes = cast::toDotimes(expr)) {
+        return lowerDotimes(*dotimes);
+    }
+
+    if (const auto loop = cast::toLoop(expr)) {
+        return lowerLoop(*loop);
+    }
+
+    if (const auto let = cast::toLet(expr)) {
+        return lowerLet(*let);
+    }
+
+    if (const auto setq = cast::toSetq(expr)) {
+        lowerAssign(*cast::toVar(setq->pair));
+        return lowerVar(*cast::toVar(setq->pair));
+    }
+
+    if (const auto defvar = cast::toDefvar(expr)) {
+        lowerAssign(*cast::toVar(defvar->pair));
+        return emitConst(0);
+    }
+
+    if (const auto defconst = cast::toDefconstant(expr)) {
+        lowerAssign(*cast::toVar(defconst->pair));
+        return emitConst(0);
+    }
+
+    if (const auto funcCall = cast::toFuncCall(expr)) {
+        return lowerFuncCall(*funcCall);
+    }
+
+    if (const auto if_ = cast::toIf(expr)) {
+        return lowerIf(*if_);
+    }
+
+    if (const auto when = cast::toWhen(expr)) {
+        return lowerWhen(*when);
+    }
+
+    if (const auto cond = cast::toCond(expr)) {
+        return lowerCond(*cond);
+    }
+
+    if (const auto return_ = cast::toReturn(expr)) {
+        return lowerReturn(*return_);
+    }
+
+    // NIL and uninitialized values
+    return emitConst(0);
+}
+
+int IRBuilder::lowerBody(const std::vector<ExprPtr>& body) {
+    int value = -1;
+
+    for (const auto& form: body) {
+        value = lower(form);
+    }
+
+    return value == -1 ? emitConst(0) : value;
+}
+
+int IRBuilder::lowerBinop(const BinOpExpr& binop) {
+    IROp op;
+
+    switch (binop.opToken.type) {
+        case TokenType::PLUS: op = IROp::ADD;
+            break;
+        case TokenType::MINUS: op = IROp::SUB;
+            break;
+        case TokenType::MUL: op = IROp::MUL;
+            break;
+        case TokenType::DIV: op = IROp::DIV;
+            break;
+        case TokenType::LOGAND: op = IROp::AND;
+            break;
+        case TokenType::LOGIOR: op = IROp::OR;
+            break;
+        case TokenType::LOGXOR: op = IROp::XOR;
+            break;
+        case TokenType::EQUAL: op = IROp::EQ;
+            break;
+        case TokenType::NEQUAL: op = IROp::NE;
+            break;
+        case TokenType::GREATER_THEN: op = IROp::GT;
+            break;
+        case TokenType::LESS_THEN: op = IROp::LT;
+            break;
+        case TokenType::GREATER_THEN_EQ: op = IROp::GE;
+            break;
+        case TokenType::LESS_THEN_EQ: op = IROp::LE;
+            break;
+        case TokenType::AND:
+        case TokenType::OR:
+            return lowerLogOp(binop);
+        case TokenType::NOT: {
+            const int value = lower(binop.lhs);
+            const int zero = emitConvert(emitConst(0), func->valueTypes[value]);
+            return emit({.op = IROp::EQ, .type = func->valueTypes[value], .args = {value, zero}});
+        }
+        case TokenType::LOGNOR: {
+            // ~a & ~b
+            const int negOne = emitConst(-1);
+            const int lhs = emit({.op = IROp::XOR, .type = IRType::I64, .args = {lower(binop.lhs), negOne}});
+            const int rhs = emit({.op = IROp::XOR, .type = IRType::I64, .args = {lower(binop.rhs), negOne}});
+            return emit({.op = IROp::AND, .type = IRType::I64, .args = {lhs, rhs}});
+        }
+        default:
+            return emitConst(0);
+    }
+
+    int lhs = lower(binop.lhs);
+    int rhs = lower(binop.rhs);
+    const IRType type = func->valueTypes[lhs] == IRType::F64 || func->valueTypes[rhs] == IRType::F64
+                            ? IRType::F64
+                            : IRType::I64;
+
+    lhs = emitConvert(lhs, type);
+    rhs = emitConvert(rhs, type);
+
+    return emit({.op = op, .type = type, .args = {lhs, rhs}});
+}
+
+int IRBuilder::lowerLogOp(const BinOpExpr& binop) {
+    // Short-circuit, the rhs only runs when the lhs does not decide the result
+    const bool isAnd = binop.opToken.type == TokenType::AND;
+    const int lhs = emitCondition(lower(binop.lhs));
+    const int lhsBlock = currentBlock;
+    const int rhsBlock = newBlock();
+    const int done = newBlock();
+
+    const int lhsBool = emit({.op = IROp::NE, .type = IRType::I64, .args = {lhs, emitConst(0)}});
+
+    if (isAnd) {
+        emitBranch(lhs, rhsBlock, done);
+    } else {
+        emitBranch(lhs, done, rhsBlock);
+    }
+    sealBlock(rhsBlock);
+
+    currentBlock = rhsBlock;
+    const int rhs = emitCondition(lower(binop.rhs));
+    const int rhsBool = emit({.op = IROp::NE, .type = IRType::I64, .args = {rhs, emitConst(0)}});
+    const int rhsEnd = currentBlock;
+    emitJump(done);
+    sealBlock(done);
+
+    currentBlock = done;
+    return newPhi(done, -1, IRType::I64, {lhsBool, rhsBool}, {lhsBlock, rhsEnd});
+}
+
+int IRBuilder::lowerDotimes(const DotimesExpr& dotimes) {
+    const auto iterVar = cast::toVar(dotimes.iterationCount);
+    const int count = lower(iterVar->value);
+    const int one = emitConst(1);
+
+    scopes.emplace_back();
+    const int var = newVar(IRType::I64);
+    scopes.back()[cast::toString(iterVar->name)->data] = var;
+    writeVar(var, currentBlock, emitConst(0));
+
+    const int header = newBlock();
+    const int body = newBlock();
+    const int exit = newBlock();
+
+    emitJump(header);
+
+    currentBlock = header;
+    const int cmp = emit({.op = IROp::LT, .type = IRType::I64, .args = {readVar(var, header), count}});
+    emitBranch(cmp, body, exit);
+    sealBlock(body);
+
+    currentBlock = body;
+    for (const auto& statement: dotimes.statements) {
+        lower(statement);
+    }
+
+    writeVar(var, currentBlock, emit({.op = IROp::ADD, .type = IRType::I64, .args = {readVar(var, currentBlock), one}}));
+    emitJump(header);
+    sealBlock(header);
+    sealBlock(exit);
+    scopes.pop_back();
+
+    currentBlock = exit;
+    return emitConst(0);
+}
+
+int IRBuilder::lowerLoop(const LoopExpr& loop) {
+    const int header = newBlock();
+    const int exit = newBlock();
+
+    emitJump(header);
+    loops.push_back({exit});
+
+    currentBlock = header;
+    for (const auto& sexpr: loop.sexprs) {
+        lower(sexpr);
+    }
+
+    emitJump(header);
+    sealBlock(header);
+    sealBlock(exit);
+
+    currentBlock = exit;
+    const Loop loop_ = loops.back();
+    loops.pop_back();
+
+    if (loop_.results.empty()) {
+        return emitConst(0);
+    }
+
+    return emitMerge(loop_.results);
+}
+
+int IRBuilder::lowerLet(const LetExpr& let) {
+    scopes.emplace_back();
+
+    for (const auto& binding: let.bindings) {
+        const auto var = cast::toVar(binding);
+        int value = lower(var->value);
+
+        if (var->vType == VarType::DOUBLE) {
+            value = emitConvert(value, IRType::F64);
+        }
+
+        const int id = newVar(func->valueTypes[value]);
+        scopes.back()[cast::toString(var->name)->data] = id;
+        writeVar(id, currentBlock, value);
+    }
+
+    const int value = lowerBody(let.body);
+    scopes.pop_back();
+
+    return value;
+}
+
+int IRBuilder::lowerFuncCall(const FuncCallExpr& funcCall) {
+    IRInstr call{
+        .op = IROp::CALL,
+        .type = cast::toDouble(funcCall.returnType) ? IRType::F64 : IRType::I64,
+        .symbol = cast::toString(cast::toVar(funcCall.name)->name)->data
+    };
+
+    for (const auto& arg: funcCall.args) {
+        const auto param = cast::toVar(arg);
+        call.args.push_back(emitConvert(lower(param->value), typeOf(param->vType)));
+    }
+
+    return emit(std::move(call));
+}
+
+int IRBuilder::lowerIf(const IfExpr& if_) {
+    const int cond = emitCondition(lower(if_.test));
+    const int then = newBlock();
+    const int else_ = newBlock();
+    const int done = newBlock();
+    std::vector<std::pair<int, int> > results;
+
+    emitBranch(cond, then, else_);
+    sealBlock(then);
+    sealBlock(else_);
+
+    currentBlock = then;
+    results.emplace_back(lower(if_.then), currentBlock);
+    emitJump(done);
+
+    currentBlock = else_;
+    results.emplace_back(if_.else_ ? lower(if_.else_) : emitConst(0), currentBlock);
+    emitJump(done);
+    sealBlock(done);
+
+    currentBlock = done;
+    return emitMerge(results);
+}
+
+int IRBuilder::lowerWhen(const WhenExpr& when) {
+    const int cond = emitCondition(lower(when.test));
+    const int then = newBlock();
+    const int done = newBlock();
+    std::vector<std::pair<int, int> > results;
+
+    results.emplace_back(emitConst(0), currentBlock);
+    emitBranch(cond, then, done);
+    sealBlock(then);
+
+    currentBlock = then;
+    results.emplace_back(lowerBody(when.then), currentBlock);
+    emitJump(done);
+    sealBlock(done);
+
+    currentBlock = done;
+    return emitMerge(results);
+}
+
+int IRBuilder::lowerCond(const CondExpr& cond) {
+    const int done = newBlock();
+    std::vector<std::pair<int, int> > results;
+
+    for (const auto& [test, forms]: cond.variants) {
+        const int cond_ = emitCondition(lower(test));
+        const int then = newBlock();
+        const int next = newBlock();
+
+        emitBranch(cond_, then, next);
+        sealBlock(then);
+        sealBlock(next);
+
+        currentBlock = then;
+        results.emplace_back(lowerBody(forms), currentBlock);
+        emitJump(done);
+
+        currentBlock = next;
+    }
+
+    // No variant matched
+    results.emplace_back(emitConst(0), currentBlock);
+    emitJump(done);
+    sealBlock(done);
+
+    currentBlock = done;
+    return emitMerge(results);
+}
+
+int IRBuilder::lowerReturn(const ReturnExpr& return_) {
+    const int value = lower(return_.arg);
+
+    if (loops.empty()) {
+        emit({.op = IROp::RET, .type = func->valueTypes[value], .args = {value}});
+    } else {
+        loops.back().results.emplace_back(value, currentBlock);
+        emitJump(loops.back().exit);
+    }
+
+    // Anything after the return is unreachable and dropped when the function is finished
+    currentBlock = newBlock();
+    sealBlock(currentBlock);
+
+    return emitConst(0);
+}
+
+void IRBuilder::lowerAssign(const VarExpr& var) {
+    const std::string name = cast::toString(var.name)->data;
+    const int value = lower(var.value);
+
+    if (const int id = lookupVar(name); var.sType != SymbolType::GLOBAL && id != -1) {
+        writeVar(id, currentBlock, emitConvert(value, varTypes[id]));
+        return;
+    }
+
+    const IRType type = typeOf(var.vType);
+    emit({.op = IROp::STORE, .type = type, .args = {emitConvert(value, type)}, .symbol = name});
+}
+
+int IRBuilder::lowerVar(const VarExpr& var) {
+    const std::string name = cast::toString(var.name)->data;
+
+    if (const int id = lookupVar(name); var.sType != SymbolType::GLOBAL && id != -1) {
+        return readVar(id, currentBlock);
+    }
+
+    return emit({.op = IROp::LOAD, .type = typeOf(var.vType), .symbol = name});
+}
+
+int IRBuilder::emit(IRInstr instr) {
+    if (hasResult(instr.op)) {
+        instr.dst = static_cast<int>(func->valueTypes.size());
+        func->valueTypes.push_back(isCompare(instr.op) ? IRType::I64 : instr.type);
+    }
+
+    const int dst = instr.dst;
+    func->blocks[currentBlock].instrs.push_back(std::move(instr));
+
+    return dst;
+}
+
+int IRBuilder::emitConst(const int64_t n) {
+    return emit({.op = IROp::CONST, .type = IRType::I64, .imm = n});
+}
+
+int IRBuilder::emitConvert(const int value, const IRType type) {
+    if (type == IRType::F64 && func->valueTypes[value] == IRType::I64) {
+        return emit({.op = IROp::SITOFP, .type = IRType::F64, .args = {value}});
+    }
+
+    return value;
+}
+
+int IRBuilder::emitCondition(const int value) {
+    // Branches test integers against zero
+    if (func->valueTypes[value] == IRType::F64) {
+        const int zero = emit({.op = IROp::CONST, .type = IRType::F64, .fimm = 0.0});
+        return emit({.op = IROp::NE, .type = IRType::F64, .args = {value, zero}});
+    }
+
+    return value;
+}
+
+int IRBuilder::emitMerge(const std::vector<std::pair<int, int> >& results) {
+    const bool isDouble = std::ranges::any_of(results, [&](const auto& result) {
+        return func->valueTypes[result.first] == IRType::F64;
+    });
+
+    std::vector<int> args, blocks;
+    for (const auto& [value, block]: results) {
+        int arg = value;
+
+        // Convert at the end of the incoming block, before its terminator
+        if (isDouble && func->valueTypes[value] == IRType::I64) {
+            auto& instrs = func->blocks[block].instrs;
+            IRInstr convert{.op = IROp::SITOFP, .type = IRType::F64, .args = {value}};
+            convert.dst = arg = static_cast<int>(func->valueTypes.size());
+            func->valueTypes.push_back(IRType::F64);
+            instrs.insert(instrs.end() - 1, std::move(convert));
+        }
+
+        args.push_back(arg);
+        blocks.push_back(block);
+    }
+
+    const IRType type = isDouble ? IRType::F64 : func->valueTypes[results.front().first];
+    return newPhi(currentBlock, -1, type, std::move(args), std::move(blocks));
+}
+
+void IRBuilder::emitJump(const int target) {
+    emit({.op = IROp::JMP, .blocks = {target}});
+    func->blocks[target].preds.push_back(currentBlock);
+}
+
+void IRBuilder::emitBranch(const int cond, const int then, const int else_) {
+    emit({.op = IROp::BR, .args = {cond}, .blocks = {then, else_}});
+    func->blocks[then].preds.push_back(currentBlock);
+    func->blocks[else_].preds.push_back(currentBlock);
+}
+
+int IRBuilder::newBlock() {
+    const int id = static_cast<int>(func->blocks.size());
+    func->blocks.push_back({id});
+    sealed.push_back(false);
+
+    return id;
+}
+
+void IRBuilder::sealBlock(const int block) {
+    // All predecessors are known, the pending phis can be completed
+    for (const int phi: incompletePhis[block]) {
+        addPhiOperands(phi);
+    }
+
+    incompletePhis.erase(block);
+    sealed[block] = true;
+}
+
+int IRBuilder::newVar(const IRType type) {
+    varTypes.push_back(type);
+    return static_cast<int>(varTypes.size()) - 1;
+}
+
+int IRBuilder::lookupVar(const std::string& name) const {
+    for (auto scope = scopes.rbegin(); scope != scopes.rend(); ++scope) {
+        if (const auto it = scope->find(name); it != scope->end()) {
+            return it->second;
+        }
+    }
+
+    return -1;
+}
+
+void IRBuilder::writeVar(const int var, const int block, const int value) {
+    currentDef[var][block] = value;
+}
+
+int IRBuilder::readVar(const int var, const int block) {
+    if (const auto it = currentDef[var].find(block); it != currentDef[var].end()) {
+        return it->second;
+    }
+
+    return readVarRecursive(var, block);
+}
+
+int IRBuilder::readVarRecursive(const int var, const int block) {
+    int value;
+
+    if (!sealed[block]) {
+        value = newPhi(block, var, varTypes[var], {}, {});
+        incompletePhis[block].push_back(value);
+    } else if (func->blocks[block].preds.size() == 1) {
+        value = readVar(var, func->blocks[block].preds[0]);
+    } else {
+        // Break cycles through loops before looking at the predecessors
+        value = newPhi(block, var, varTypes[var], {}, {});
+        writeVar(var, block, value);
+        addPhiOperands(value);
+    }
+
+    writeVar(var, block, value);
+    return value;
+}
+
+int IRBuilder::newPhi(const int block, const int var, const IRType type, std::vector<int> args,
+                      std::vector<int> blocks) {
+    const int id = static_cast<int>(func->valueTypes.size());
+    func->valueTypes.push_back(type);
+    phis[id] = {block, var, std::move(args), std::move(blocks)};
+
+    return id;
+}
+
+void IRBuilder::addPhiOperands(const int phi) {
+    const int block = phis.at(phi).block;
+    const int var = phis.at(phi).var;
+
+    for (const int pred: func->blocks[block].preds) {
+        const int value = readVar(var, pred);
+        phis.at(phi).args.push_back(value);
+        phis.at(phi).blocks.push_back(pred);
+    }
+}
+
+void IRBuilder::finishFunction() {
+    removeUnreachableBlocks();
+    removeTrivialPhis();
+
+    // Place the phis at the top of their blocks
+    for (auto it = phis.rbegin(); it != phis.rend(); ++it) {
+        const auto& [id, phi] = *it;
+        auto& instrs = func->blocks[phi.block].instrs;
+        instrs.insert(instrs.begin(), {
+                          .op = IROp::PHI, .type = func->valueTypes[id], .dst = id, .args = phi.args,
+                          .blocks = phi.blocks
+                      });
+    }
+
+    removeDeadValues();
+
+    // Renumber values in program order
+    std::unordered_map<int, int> valueIDs;
+    std::vector<IRType> valueTypes;
+    for (const auto& block: func->blocks) {
+        for (const auto& instr: block.instrs) {
+            if (instr.dst != -1) {
+                valueIDs[instr.dst] = static_cast<int>(valueTypes.size());
+                valueTypes.push_back(func->valueTypes[instr.dst]);
+            }
+        }
+    }
+
+    for (auto& block: func->blocks) {
+        for (auto& instr: block.instrs) {
+            if (instr.dst != -1) instr.dst = valueIDs.at(instr.dst);
+            for (int& arg: instr.args) arg = valueIDs.at(arg);
+        }
+    }
+
+    func->valueTypes = std::move(valueTypes);
+}
+
+void IRBuilder::removeDeadValues() {
+    // Values of statements are often unused, e.g. the result of a setq at the top level
+    bool isChanged = true;
+
+    while (isChanged) {
+        std::unordered_map<int, int> uses;
+        for (const auto& block: func->blocks) {
+            for (const auto& instr: block.instrs) {
+                for (const int arg: instr.args) uses[arg]++;
+            }
+        }
+
+        isChanged = false;
+        for (auto& block: func->blocks) {
+            isChanged |= std::erase_if(block.instrs, [&](const IRInstr& instr) {
+                return isRemovable(instr.op) && !uses.contains(instr.dst);
+            }) > 0;
+        }
+    }
+}
+
+void IRBuilder::removeUnreachableBlocks() {
+    std::vector<bool> reachable(func->blocks.size(), false);
+    std::vector<int> worklist{0};
+    reachable[0] = true;
+
+    while (!worklist.empty()) {
+        const int block = worklist.back();
+        worklist.pop_back();
+
+        if (func->blocks[block].instrs.empty()) continue;
+
+        for (const int succ: func->blocks[block].instrs.back().blocks) {
+            if (!reachable[succ]) {
+                reachable[succ] = true;
+                worklist.push_back(succ);
+            }
+        }
+    }
+
+    for (auto it = phis.begin(); it != phis.end();) {
+        auto& phi = it->second;
+
+        if (!reachable[phi.block]) {
+            it = phis.erase(it);
+            continue;
+        }
+
+        for (size_t i = phi.blocks.size(); i-- > 0;) {
+            if (!reachable[phi.blocks[i]]) {
+                phi.args.erase(phi.args.begin() + static_cast<long>(i));
+                phi.blocks.erase(phi.blocks.begin() + static_cast<long>(i));
+            }
+        }
+
+        ++it;
+    }
+
+    std::erase_if(func->blocks, [&](const BasicBlock& block) { return !reachable[block.id]; });
+
+    // Renumber the remaining blocks in program order
+    std::unordered_map<int, int> blockIDs;
+    for (size_t i = 0; i < func->blocks.size(); ++i) {
+        blockIDs[func->blocks[i].id] = static_cast<int>(i);
+    }
+
+    for (auto& block: func->blocks) {
+        block.id = blockIDs.at(block.id);
+        std::erase_if(block.preds, [&](const int pred) { return !reachable[pred]; });
+        for (int& pred: block.preds) pred = blockIDs.at(pred);
+
+        for (auto& instr: block.instrs) {
+            for (int& target: instr.blocks) target = blockIDs.at(target);
+        }
+    }
+
+    for (auto& [_, phi]: phis) {
+        phi.block = blockIDs.at(phi.block);
+        for (int& block: phi.blocks) block = blockIDs.at(block);
+    }
+}
+
+void IRBuilder::removeTrivialPhis() {
+    // A phi whose operands are all the same value, or itself, is replaced by that value
+    std::unordered_map<int, int> replacements;
+    std::function<int(int)> resolve = [&](const int value) {
+        const auto it = replacements.find(value);
+        return it == replacements.end() ? value : resolve(it->second);
+    };
+
+    bool isChanged = true;
+    while (isChanged) {
+        isChanged = false;
+
+        for (auto it = phis.begin(); it != phis.end();) {
+            const int id = it->first;
+            int same = -1;
+            bool isTrivial = true;
+
+            for (const int arg: it->second.args) {
+                const int value = resolve(arg);
+
+                if (value == id || value == same) continue;
+                if (same != -1) {
+                    isTrivial = false;
+                    break;
+                }
+                same = value;
+            }
+
+            if (!isTrivial) {
+                ++it;
+                continue;
+            }
+
+            // Only reachable through an undefined variable
+            if (same == -1) {
+                same = static_cast<int>(func->valueTypes.size());
+                func->valueTypes.push_back(func->valueTypes[id]);
+                func->blocks[0].instrs.insert(func->blocks[0].instrs.begin(), {
+                                                  .op = IROp::UNDEF, .type = func->valueTypes[id], .dst = same
+                                              });
+            }
+
+            replacements[id] = same;
+            it = phis.erase(it);
+            isChanged = true;
+        }
+    }
+
+    for (auto& [id, phi]: phis) {
+        for (int& arg: phi.args) arg = resolve(arg);
+    }
+
+    for (auto& block: func->blocks) {
+        for (auto& instr: block.instrs) {
+            for (int& arg: instr.args) arg = resolve(arg);
+        }
+    }
+}
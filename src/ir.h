@@ -0,0 +1,192 @@
+#ifndef IR_H
+#define IR_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "parser.h"
+
+enum class IRType {
+    VOID,
+    I64,
+    F64,
+    PTR
+};
+
+enum class IROp {
+    UNDEF,
+    CONST,
+    PARAM,
+    LOAD,
+    STORE,
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    AND,
+    OR,
+    XOR,
+    EQ,
+    NE,
+    GT,
+    LT,
+    GE,
+    LE,
+    SITOFP,
+    CALL,
+    PHI,
+    JMP,
+    BR,
+    RET
+};
+
+// Three-address instruction. Values are numbered per function and defined exactly once.
+struct IRInstr {
+    IROp op;
+    // Type of the result, or of the operands for compares and stores
+    IRType type{IRType::VOID};
+    int dst{-1};
+    std::vector<int> args{};
+    // Branch targets, or the incoming block of each phi argument
+    std::vector<int> blocks{};
+    int64_t imm{0};
+    double fimm{0.0};
+    // Global, callee or string literal
+    std::string symbol{};
+};
+
+struct BasicBlock {
+    int id;
+    std::vector<int> preds{};
+    std::vector<IRInstr> instrs{};
+};
+
+struct IRFunction {
+    std::string name;
+    IRType returnType{IRType::VOID};
+    std::vector<IRType> params{};
+    std::vector<BasicBlock> blocks{};
+    std::vector<IRType> valueTypes{};
+};
+
+struct IRGlobal {
+    std::string name;
+    IRType type;
+    bool isConstant;
+};
+
+struct IRModule {
+    std::vector<IRGlobal> globals;
+    std::vector<IRFunction> functions;
+
+    [[nodiscard]] std::string dump() const;
+};
+
+// Lowers the analyzed AST to SSA form. Locals and parameters become SSA values, phis are
+// placed on the fly while blocks are filled and sealed (Braun et al., CC 2013); globals
+// stay in memory behind load/store.
+class IRBuilder {
+public:
+    IRModule build(const ExprPtr& ast);
+
+private:
+    struct Phi {
+        int block;
+        // Source variable, -1 for the merged value of an expression
+        int var;
+        std::vector<int> args;
+        std::vector<int> blocks;
+    };
+
+    struct Loop {
+        int exit;
+        // Returned values and the blocks they leave from
+        std::vector<std::pair<int, int> > results{};
+    };
+
+    void lowerFunction(const std::string& name, const std::vector<ExprPtr>& params, const std::vector<ExprPtr>& forms);
+
+    int lower(const ExprPtr& expr);
+
+    int lowerBody(const std::vector<ExprPtr>& body);
+
+    int lowerBinop(const BinOpExpr& binop);
+
+    int lowerLogOp(const BinOpExpr& binop);
+
+    int lowerDotimes(const DotimesExpr& dotimes);
+
+    int lowerLoop(const LoopExpr& loop);
+
+    int lowerLet(const LetExpr& let);
+
+    int lowerFuncCall(const FuncCallExpr& funcCall);
+
+    int lowerIf(const IfExpr& if_);
+
+    int lowerWhen(const WhenExpr& when);
+
+    int lowerCond(const CondExpr& cond);
+
+    int lowerReturn(const ReturnExpr& return_);
+
+    void lowerAssign(const VarExpr& var);
+
+    int lowerVar(const VarExpr& var);
+
+    int emit(IRInstr instr);
+
+    int emitConst(int64_t n);
+
+    int emitConvert(int value, IRType type);
+
+    int emitCondition(int value);
+
+    int emitMerge(const std::vector<std::pair<int, int> >& results);
+
+    void emitJump(int target);
+
+    void emitBranch(int cond, int then, int else_);
+
+    int newBlock();
+
+    void sealBlock(int block);
+
+    int newVar(IRType type);
+
+    int lookupVar(const std::string& name) const;
+
+    void writeVar(int var, int block, int value);
+
+    int readVar(int var, int block);
+
+    int readVarRecursive(int var, int block);
+
+    int newPhi(int block, int var, IRType type, std::vector<int> args, std::vector<int> blocks);
+
+    void addPhiOperands(int phi);
+
+    void finishFunction();
+
+    void removeUnreachableBlocks();
+
+    void removeTrivialPhis();
+
+    void removeDeadValues();
+
+    IRModule module;
+    IRFunction* func{nullptr};
+    int currentBlock{0};
+    // SSA construction state of the current function
+    std::vector<IRType> varTypes;
+    std::vector<std::unordered_map<std::string, int> > scopes;
+    std::unordered_map<int, std::unordered_map<int, int> > currentDef;
+    std::unordered_map<int, std::vector<int> > incompletePhis;
+    std::vector<bool> sealed;
+    std::map<int, Phi> phis;
+    std::vector<Loop> loops;
+};
+
+#endif //IR_H
@@ -0,0 +1,66 @@
+#include "jit.h"
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <utility>
+#include <sys/mman.h>
+
+static constexpr uint64_t PAGE_SIZE = 0x1000;
+
+JIT::JIT(ElfWriter::Image program) : image(std::move(program)) {
+#if !defined(__x86_64__)
+    throw std::runtime_error("JIT requires an x86-64 host");
+#endif
+    // Code and data are addressed relative to each other, so the image can be mapped anywhere
+    const auto& first = image.segments.front();
+    const auto& last = image.segments.back();
+    origin = first.address;
+    size = (last.address + last.memSize - origin + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        throw std::runtime_error(std::format("Cannot map {} bytes: {}", size, std::strerror(errno)));
+    }
+
+    memory = static_cast<uint8_t*>(mapped);
+
+    for (const auto& segment: image.segments) {
+        std::memcpy(toHost(segment.address), image.bytes.data() + segment.offset, segment.fileSize);
+    }
+
+    for (const auto& segment: image.segments) {
+        int prot = 0;
+        if (segment.flags & ElfWriter::PF_R) prot |= PROT_READ;
+        if (segment.flags & ElfWriter::PF_W) prot |= PROT_WRITE;
+        if (segment.flags & ElfWriter::PF_X) prot |= PROT_EXEC;
+
+        const uint64_t length = (segment.memSize + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+        if (mprotect(toHost(segment.address), length, prot) != 0) {
+            munmap(memory, size);
+            throw std::runtime_error(std::format("Cannot protect segment: {}", std::strerror(errno)));
+        }
+    }
+}
+
+JIT::~JIT() {
+    if (memory) {
+        munmap(memory, size);
+    }
+}
+
+int64_t JIT::run() const {
+    const auto entry = reinterpret_cast<int64_t (*)()>(toHost(image.entry));
+    return entry();
+}
+
+double JIT::runDouble() const {
+    // The entry moves the double into rax, see CodeGen::generate
+    return std::bit_cast<double>(run());
+}
+
+void* JIT::address(const std::string& name) const {
+    const auto it = image.symbols.find(name);
+    return it != image.symbols.end() ? toHost(it->second) : nullptr;
+}
@@ -0,0 +1,39 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstdint>
+#include <string>
+#include "elf.h"
+
+// Runs a program inside the compiler process. The segments of the executable image are
+// mapped with their own permissions and _start is called as a function, which requires
+// code generated with CodeGenOptions::jit.
+class JIT {
+public:
+    explicit JIT(ElfWriter::Image program);
+
+    JIT(const JIT&) = delete;
+
+    JIT& operator=(const JIT&) = delete;
+
+    ~JIT();
+
+    // Returns the value of the last top level form
+    int64_t run() const;
+
+    // Same as run for a program whose last top level form is a double
+    double runDouble() const;
+
+    // Mapped address of a global variable or function
+    [[nodiscard]] void* address(const std::string& name) const;
+
+private:
+    [[nodiscard]] uint8_t* toHost(uint64_t address) const { return memory + (address - origin); }
+
+    ElfWriter::Image image;
+    uint8_t* memory{nullptr};
+    size_t size{0};
+    uint64_t origin{0};
+};
+
+#endif //JIT_H
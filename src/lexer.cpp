@@ -34,6 +34,10 @@ void Lexer::process() {
         } else if (!std::strncmp("cond", currentChar, 4)) {
             tokens.emplace_back(TokenType::COND);
             advance(4);
+        } else if (!std::strncmp("case", currentChar, 4) &&
+                   (std::isspace(currentChar[4]) || currentChar[4] == '(' || currentChar[4] == ')')) {
+            tokens.emplace_back(TokenType::CASE);
+            advance(4);
         } else if (!std::strncmp("defvar", currentChar, 4)) {
             tokens.emplace_back(TokenType::DEFVAR);
             advance(6);
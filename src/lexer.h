@@ -18,7 +18,7 @@ enum class TokenType {
     // Loop
     DOTIMES, LOOP,
     // Condition
-    IF, WHEN, COND,
+    IF, WHEN, COND, CASE,
     // Assignment
     LET, SETQ, DEFVAR, DEFCONST,
     // Function
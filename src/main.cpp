@@ -1,9 +1,14 @@
 #include <iostream>
 #include <fstream>
+#include <filesystem>
 #include "lexer.h"
 #include "parser.h"
 #include "semantic.h"
 #include "codegen.h"
+#include "ir.h"
+#include "jit.h"
+#include "bytecode.h"
+#include "vm.h"
 #include "exceptions.hpp"
 
 #define VERSION_MAJOR 0
@@ -17,29 +22,103 @@
 #define ERROR_COLOR "\x1b[31m"
 #define RESET_COLOR "\x1b[0m"
 
-void compile(std::string& fn, const std::string& in, std::string& out) {
-    std::ofstream asmFile;
-    asmFile.open(out);
+enum class OutputKind {
+    EXECUTABLE,
+    OBJECT,
+    ASSEMBLY,
+    IR,
+    RUN
+};
+
+enum class Backend {
+    NATIVE,
+    VM
+};
+
+void compile(std::string& fn,
+             const std::string& in,
+             std::string& out,
+             const CodeGenOptions& options,
+             const OutputKind kind,
+             const Backend backend,
+             const bool printStats) {
+    // Runs in the JIT or the VM write no files
+    const bool isRun = kind == OutputKind::RUN || backend == Backend::VM;
+    std::ofstream outFile;
+    if (!isRun) {
+        outFile.open(out, std::ios::out | std::ios::binary);
+    }
 
     try {
         Lexer lexer{fn.c_str(), in};
         Parser parser{fn.c_str(), lexer};
         SemanticAnalyzer analyzer{fn.c_str()};
-        CodeGen cgen;
+        CodeGen cgen{options};
 
         lexer.process();
         ExprPtr ast = parser.parse();
         analyzer.analyze(ast);
-        asmFile << cgen.emit(ast);
+
+        if (backend == Backend::VM) {
+            IRBuilder irBuilder;
+            BytecodeCompiler compiler;
+            const IRModule module = irBuilder.build(ast);
+            const VMProgram program = compiler.compile(module);
+            VM vm{program};
+            const VMValue result = vm.run();
+
+            if (program.functions.front().returnType == IRType::F64) {
+                std::cout << result.f << std::endl;
+            } else {
+                std::cout << result.i << std::endl;
+            }
+        } else if (kind == OutputKind::IR) {
+            IRBuilder irBuilder;
+            outFile << irBuilder.build(ast).dump();
+        } else {
+            if (kind == OutputKind::RUN) {
+                bool returnsDouble;
+                const JIT jit{cgen.emitImage(ast, returnsDouble)};
+
+                if (returnsDouble) {
+                    std::cout << jit.runDouble() << std::endl;
+                } else {
+                    std::cout << jit.run() << std::endl;
+                }
+            } else if (kind == OutputKind::ASSEMBLY) {
+                outFile << cgen.emit(ast);
+            } else {
+                const std::vector<uint8_t> elf = cgen.emitELF(ast, kind == OutputKind::EXECUTABLE);
+                outFile.write(reinterpret_cast<const char*>(elf.data()), static_cast<long>(elf.size()));
+            }
+
+            if (printStats) {
+                std::cerr << cgen.stats();
+            }
+        }
     } catch (IllegalCharError& e) {
         std::cerr << ERROR_COLOR << e.what();
     } catch (InvalidSyntaxError& e) {
         std::cerr << ERROR_COLOR << e.what();
     } catch (SemanticError& e) {
         std::cerr << ERROR_COLOR << e.what();
+    } catch (std::runtime_error& e) {
+        std::cerr << ERROR_COLOR << e.what() << RESET_COLOR << std::endl;
     }
 
-    asmFile.close();
+    if (isRun) {
+        return;
+    }
+
+    outFile.close();
+
+    if (kind == OutputKind::EXECUTABLE) {
+        std::filesystem::permissions(out,
+                                     std::filesystem::perms::owner_exec |
+                                     std::filesystem::perms::group_exec |
+                                     std::filesystem::perms::others_exec,
+                                     std::filesystem::perm_options::add);
+    }
 }
 
 int main(int argc, char** argv) {
@@ -48,6 +127,17 @@ int main(int argc, char** argv) {
             "USAGE: tinysexp [options] file\n\n"
             "OPTIONS:\n"
             "  -o, --output          The output file name\n"
+            "  -S                    Write NASM assembly instead of an executable\n"
+            "  -c                    Write a relocatable ELF object instead of an executable\n"
+            "  --run                 Compile in memory, run the program and print the value of its last form\n"
+            "  --backend=<name>      native (default) or vm, which runs the program in a bytecode interpreter\n"
+            "  -mavx2                Use AVX2 for vectorized loops\n"
+            "  --emit-ir             Write the SSA intermediate representation instead of an executable\n"
+            "  -fno-peephole         Disable the peephole optimizer\n"
+            "  -fno-omit-frame-pointer Keep the rbp frame in leaf functions\n"
+            "  -fno-if-convert       Keep branches for if and cond with cheap arms instead of cmov\n"
+            "  -fno-switch-lowering  Compare clause by clause in cond and case instead of using jump tables\n"
+            "  --stats               Print optimizer statistics\n"
             "  -h, --help            Display available options\n"
             "  -v, --version         Display the version of this program\n";
 
@@ -67,9 +157,43 @@ int main(int argc, char** argv) {
     }
 
     std::string fn, in, out;
+    CodeGenOptions options;
+    // ELF executables only run on Linux, elsewhere assembly stays the default
+#if defined(__linux__)
+    OutputKind kind = OutputKind::EXECUTABLE;
+#else
+    OutputKind kind = OutputKind::ASSEMBLY;
+#endif
+    Backend backend = Backend::NATIVE;
+    bool printStats = false;
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "--output")) {
             out = argv[++i];
+        } else if (!strcmp(argv[i], "-mavx2")) {
+            options.avx2 = true;
+        } else if (!strcmp(argv[i], "-S")) {
+            kind = OutputKind::ASSEMBLY;
+        } else if (!strcmp(argv[i], "-c")) {
+            kind = OutputKind::OBJECT;
+        } else if (!strcmp(argv[i], "--run")) {
+            kind = OutputKind::RUN;
+            options.jit = true;
+        } else if (!strcmp(argv[i], "--backend=vm")) {
+            backend = Backend::VM;
+        } else if (!strcmp(argv[i], "--backend=native")) {
+            backend = Backend::NATIVE;
+        } else if (!strcmp(argv[i], "--emit-ir")) {
+            kind = OutputKind::IR;
+        } else if (!strcmp(argv[i], "-fno-peephole")) {
+            options.peephole = false;
+        } else if (!strcmp(argv[i], "-fno-omit-frame-pointer")) {
+            options.omitFramePointer = false;
+        } else if (!strcmp(argv[i], "-fno-if-convert")) {
+            options.ifConvert = false;
+        } else if (!strcmp(argv[i], "-fno-switch-lowering")) {
+            options.lowerSwitches = false;
+        } else if (!strcmp(argv[i], "--stats")) {
+            printStats = true;
         } else {
             fn = argv[i];
         }
@@ -78,7 +202,12 @@ int main(int argc, char** argv) {
     if (out.empty()) {
         size_t pos = fn.rfind('.');
         std::string base = pos != std::string::npos ? fn.substr(0, pos) : fn;
-        out = base + ".s";
+        static constexpr const char* extensions[] = {"", ".o", ".s", ".ir", ""};
+        out = base + extensions[static_cast<int>(kind)];
+        // An executable must not replace a source file without extension
+        if (out == fn) {
+            out += ".out";
+        }
     }
 
     std::ifstream file;
@@ -100,7 +229,7 @@ int main(int argc, char** argv) {
         exit(EXIT_FAILURE);
     }
 
-    compile(fn, in, out);
+    compile(fn, in, out, options, kind, backend, printStats);
 
     return 0;
 }
@@ -82,6 +82,9 @@ ExprPtr Parser::parseExpr() {
         case TokenType::COND:
             expr = parseCond();
             break;
+        case TokenType::CASE:
+            expr = parseCase();
+            break;
         case TokenType::VAR:
             expr = parseFuncCall();
             break;
@@ -367,6 +370,95 @@ ExprPtr Parser::parseCond() {
     return std::make_shared<CondExpr>(variants);
 }
 
+ExprPtr Parser::parseCase() {
+    ExprPtr key;
+    std::vector<ExprPtr> bindings;
+    std::vector<std::pair<ExprPtr, std::vector<ExprPtr> > > variants;
+
+    advance();
+
+    if (currentToken.type == TokenType::LPAREN) {
+        key = parseExpr();
+    } else {
+        key = parseAtom();
+    }
+
+    // Any other key is bound to a variable first, so it is evaluated once. Its name cannot clash with a
+    // user variable, which starts with a letter.
+    std::string name;
+    if (const auto var = cast::toVar(key)) {
+        name = cast::toString(var->name)->data;
+    } else {
+        name = std::format("_case{}", caseCount++);
+
+        std::string bindingName = name;
+        ExprPtr varName = std::make_shared<StringExpr>(bindingName);
+        ExprPtr binding = std::make_shared<VarExpr>(varName, key, SymbolType::LOCAL);
+        bindings.push_back(binding);
+    }
+
+    auto test = [&](ExprPtr value) -> ExprPtr {
+        std::string keyName = name;
+        ExprPtr varName = std::make_shared<StringExpr>(keyName);
+        ExprPtr uninitialized = std::make_shared<Uninitialized>();
+        ExprPtr var = std::make_shared<VarExpr>(varName, uninitialized);
+        return std::make_shared<BinOpExpr>(var, value, Token(TokenType::EQUAL));
+    };
+
+    while (currentToken.type == TokenType::LPAREN) {
+        consume(TokenType::LPAREN, MISSING_PAREN_ERROR);
+
+        // (t ...), (otherwise ...), (1 ...) or ((1 2) ...)
+        ExprPtr clauseTest;
+        if (currentToken.type == TokenType::T ||
+            (currentToken.type == TokenType::VAR && currentToken.lexeme == "otherwise")) {
+            advance();
+            clauseTest = std::make_shared<TExpr>();
+        } else if (currentToken.type == TokenType::LPAREN) {
+            advance();
+            while (currentToken.type != TokenType::RPAREN) {
+                ExprPtr valueTest = test(parseNumber());
+                clauseTest = clauseTest
+                                 ? std::make_shared<BinOpExpr>(clauseTest, valueTest, Token(TokenType::OR))
+                                 : valueTest;
+            }
+            consume(TokenType::RPAREN, MISSING_PAREN_ERROR);
+        } else {
+            clauseTest = test(parseNumber());
+        }
+
+        if (!clauseTest) {
+            throw InvalidSyntaxError(fileName, ERROR(EXPECTED_ELEMS_NUMBER_ERROR, "CASE"), 0);
+        }
+
+        std::vector<ExprPtr> statements;
+        if (currentToken.type != TokenType::LPAREN) {
+            statements.push_back(parseAtom());
+        }
+
+        while (currentToken.type == TokenType::LPAREN) {
+            statements.push_back(parseExpr());
+        }
+
+        variants.emplace_back(clauseTest, statements);
+        consume(TokenType::RPAREN, MISSING_PAREN_ERROR);
+    }
+
+    // Without a matching clause case yields nil
+    if (variants.empty() || !cast::toT(variants.back().first)) {
+        std::vector<ExprPtr> statements{std::make_shared<NILExpr>()};
+        variants.emplace_back(std::make_shared<TExpr>(), statements);
+    }
+
+    ExprPtr cond = std::make_shared<CondExpr>(variants);
+    if (bindings.empty()) {
+        return cond;
+    }
+
+    std::vector<ExprPtr> body{cond};
+    return std::make_shared<LetExpr>(bindings, body);
+}
+
 ExprPtr Parser::parseAtom() {
     if (currentToken.type == TokenType::STRING) {
         Token token = currentToken;
@@ -446,3 +538,73 @@ void Parser::expect(const TokenType expected, const char* errorStr) const {
     if (currentToken.type != expected)
         throw InvalidSyntaxError(fileName, errorStr, 0);
 }
+
+namespace ast {
+void walk(const ExprPtr& expr, const std::function<void(const ExprPtr& node, bool isBinding)>& fn) {
+    auto binding = [&](const ExprPtr& var) {
+        fn(var, true);
+        walk(cast::toVar(var)->value, fn);
+    };
+
+    if (!expr) return;
+
+    if (const auto binop = cast::toBinop(expr)) {
+        fn(expr, false);
+        walk(binop->lhs, fn);
+        walk(binop->rhs, fn);
+    } else if (const auto dotimes = cast::toDotimes(expr)) {
+        fn(expr, false);
+        binding(dotimes->iterationCount);
+        for (const auto& statement: dotimes->statements) walk(statement, fn);
+    } else if (const auto loop = cast::toLoop(expr)) {
+        fn(expr, false);
+        for (const auto& sexpr: loop->sexprs) walk(sexpr, fn);
+    } else if (const auto let = cast::toLet(expr)) {
+        fn(expr, false);
+        for (const auto& var: let->bindings) binding(var);
+        for (const auto& sexpr: let->body) walk(sexpr, fn);
+    } else if (const auto setq = cast::toSetq(expr)) {
+        fn(expr, false);
+        binding(setq->pair);
+    } else if (const auto defvar = cast::toDefvar(expr)) {
+        fn(expr, false);
+        binding(defvar->pair);
+    } else if (const auto defconst = cast::toDefconstant(expr)) {
+        fn(expr, false);
+        binding(defconst->pair);
+    } else if (const auto defun = cast::toDefun(expr)) {
+        fn(expr, false);
+        for (const auto& form: defun->forms) walk(form, fn);
+    } else if (const auto funcCall = cast::toFuncCall(expr)) {
+        fn(expr, false);
+        // Arguments are wrapped in the callee's parameter variables
+        for (const auto& arg: funcCall->args) {
+            if (const auto param = cast::toVar(arg); param && !cast::toUninitialized(param->value)) {
+                walk(param->value, fn);
+            } else {
+                walk(arg, fn);
+            }
+        }
+    } else if (const auto return_ = cast::toReturn(expr)) {
+        fn(expr, false);
+        walk(return_->arg, fn);
+    } else if (const auto if_ = cast::toIf(expr)) {
+        fn(expr, false);
+        walk(if_->test, fn);
+        walk(if_->then, fn);
+        walk(if_->else_, fn);
+    } else if (const auto when = cast::toWhen(expr)) {
+        fn(expr, false);
+        walk(when->test, fn);
+        for (const auto& form: when->then) walk(form, fn);
+    } else if (const auto cond = cast::toCond(expr)) {
+        fn(expr, false);
+        for (const auto& [test, forms]: cond->variants) {
+            walk(test, fn);
+            for (const auto& form: forms) walk(form, fn);
+        }
+    } else {
+        fn(expr, false);
+    }
+}
+}
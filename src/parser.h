@@ -1,6 +1,7 @@
 #ifndef PARSER_H
 #define PARSER_H
 
+#include <functional>
 #include <utility>
 #include <memory>
 #include "lexer.h"
@@ -228,6 +229,9 @@ private:
 
     ExprPtr parseCond();
 
+    // Case is a cond whose tests compare the key with the values of each clause
+    ExprPtr parseCase();
+
     ExprPtr parseAtom();
 
     ExprPtr parseNumber();
@@ -242,6 +246,8 @@ private:
     Token currentToken{};
     int tokenIndex;
     const char* fileName;
+    // Keys of case forms bound to a variable
+    int caseCount{0};
 };
 
 namespace cast {
@@ -326,4 +332,11 @@ inline std::shared_ptr<Uninitialized> toUninitialized(const ExprPtr& expr) {
 }
 }
 
+namespace ast {
+// Calls fn for every node below expr. Variables bound or assigned by let, setq, defvar,
+// defconstant and dotimes are passed with isBinding set, and their values are walked too.
+// Any other VarExpr is a reference and is not descended into.
+void walk(const ExprPtr& expr, const std::function<void(const ExprPtr& node, bool isBinding)>& fn);
+}
+
 #endif
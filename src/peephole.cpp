@@ -0,0 +1,731 @@
+#include "peephole.h"
+#include <algorithm>
+#include <format>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+#include "register.h"
+
+#define bit(id) (1u << (id))
+
+// rsp and rbp are never dead
+static constexpr uint32_t ALWAYS_LIVE = bit(RSP) | bit(RBP);
+
+static constexpr uint32_t CALLEE_SAVED = bit(RBX) | bit(RBP) | bit(R12) | bit(R13) | bit(R14) | bit(R15);
+
+static constexpr uint32_t CALLER_SAVED = ~(CALLEE_SAVED | bit(RSP));
+
+static bool isJump(const Instr& instr) {
+    return isJump(instr.op);
+}
+
+static int regOf(const Operand& operand, uint32_t* size = nullptr) {
+    if (!operand.isReg()) return -1;
+
+    if (size) *size = operand.size;
+    return operand.reg;
+}
+
+// The -1 of a non-register operand wraps past every register id
+static bool isGPR(const uint32_t id) {
+    return id < xmm0;
+}
+
+static bool isALU(const Instr& instr) {
+    static constexpr Opcode ops[] = {Opcode::ADD, Opcode::SUB, Opcode::AND, Opcode::OR, Opcode::XOR, Opcode::IMUL};
+    return instr.count == 2 && std::ranges::find(ops, instr.op) != std::end(ops);
+}
+
+// Straight-line instruction without implicit operands
+static bool isSimple(const Instr& instr) {
+    static constexpr Opcode ops[] = {
+        Opcode::LABEL, Opcode::CALL, Opcode::RET, Opcode::SYSCALL, Opcode::PUSH, Opcode::POP, Opcode::CQO, Opcode::IDIV,
+        Opcode::JMPR
+    };
+    return !isJump(instr) && std::ranges::find(ops, instr.op) == std::end(ops);
+}
+
+// Whether the flags set by the instruction at i can be read later
+static bool areFlagsRead(const std::vector<Instr>& code, size_t i) {
+    static constexpr Opcode writers[] = {
+        Opcode::ADD, Opcode::SUB, Opcode::AND, Opcode::OR, Opcode::XOR, Opcode::CMP, Opcode::TEST, Opcode::INC,
+        Opcode::DEC, Opcode::IMUL, Opcode::BT
+    };
+
+    while (++i < code.size()) {
+        const Opcode op = code[i].op;
+
+        if (op == Opcode::LABEL) return true;
+        if (op == Opcode::JMP || op == Opcode::CALL || op == Opcode::RET || op == Opcode::SYSCALL) return false;
+        if (isJump(op) || (op >= Opcode::CMOVL && op <= Opcode::SETBE)) return true;
+        if (std::ranges::find(writers, op) != std::end(writers)) return false;
+    }
+
+    return false;
+}
+
+static bool isInt32(const int64_t n) {
+    return n >= std::numeric_limits<int32_t>::min() && n <= std::numeric_limits<int32_t>::max();
+}
+
+// Registers used to form a memory address
+static uint32_t addrRegs(const Operand& operand) {
+    if (!operand.isMem() || operand.reg == Operand::RIP) return 0;
+    return bit(operand.reg) | (operand.isIndexed() ? bit(operand.index) : 0);
+}
+
+static void erase(std::vector<Instr>& code, const size_t i) {
+    code.erase(code.begin() + static_cast<long>(i));
+}
+
+PeepholeOptimizer::PeepholeOptimizer() : rules({
+    {"redundant-jump", &PeepholeOptimizer::redundantJump, 0},
+    {"invert-branch", &PeepholeOptimizer::invertBranch, 0},
+    {"jump-threading", &PeepholeOptimizer::jumpThreading, 0},
+    {"unreachable-code", &PeepholeOptimizer::unreachableCode, 0},
+    {"dead-label", &PeepholeOptimizer::deadLabel, 0},
+    {"self-move", &PeepholeOptimizer::selfMove, 0},
+    {"store-reload", &PeepholeOptimizer::storeReload, 0},
+    {"fold-immediate", &PeepholeOptimizer::foldImmediate, 0},
+    {"fold-load", &PeepholeOptimizer::foldLoad, 0},
+    {"copy-propagation", &PeepholeOptimizer::copyPropagation, 0},
+    {"rename-chain", &PeepholeOptimizer::renameChain, 0},
+    {"fold-compare", &PeepholeOptimizer::foldCompare, 0},
+    {"lea-to-add", &PeepholeOptimizer::leaToAdd, 0},
+    {"identity-op", &PeepholeOptimizer::identityOp, 0},
+    {"stack-adjust", &PeepholeOptimizer::stackAdjust, 0},
+    {"dead-move", &PeepholeOptimizer::deadMove, 0},
+}) {
+}
+
+void PeepholeOptimizer::run(std::vector<Instr>& code, const SymbolTable& symbols) {
+    auto countInstrs = [&]() {
+        return std::ranges::count_if(code, [](const Instr& instr) { return instr.op != Opcode::LABEL; });
+    };
+
+    this->symbols = &symbols;
+    instrsBefore += countInstrs();
+
+    bool isChanged = true;
+    while (isChanged) {
+        isChanged = false;
+        computeLiveness(code);
+
+        for (size_t i = 0; i < code.size(); ++i) {
+            for (auto& rule: rules) {
+                if ((this->*rule.apply)(code, i)) {
+                    rule.hits++;
+                    isChanged = true;
+                    computeLiveness(code);
+                }
+
+                if (i >= code.size()) break;
+            }
+        }
+    }
+
+    instrsAfter += countInstrs();
+}
+
+std::string PeepholeOptimizer::stats() const {
+    const double reduction = instrsBefore ? 100.0 * (instrsBefore - instrsAfter) / instrsBefore : 0.0;
+    std::string str = std::format("peephole: {} -> {} instructions (-{:.1f}%)\n", instrsBefore, instrsAfter, reduction);
+
+    for (const auto& [name, _, hits]: rules) {
+        str += std::format("  {:<20}{}\n", name, hits);
+    }
+
+    return str;
+}
+
+bool PeepholeOptimizer::redundantJump(std::vector<Instr>& code, const size_t i) {
+    // jmp .L1
+    // .L1:
+    if (!isJump(code[i]) || code[i].op == Opcode::DD) return false;
+
+    for (size_t j = i + 1; j < code.size() && code[j].op == Opcode::LABEL; ++j) {
+        if (code[j].operands[0] == code[i].operands[0]) {
+            erase(code, i);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool PeepholeOptimizer::invertBranch(std::vector<Instr>& code, const size_t i) {
+    // je .L1      jne .L2
+    // jmp .L2  ->  .L1:
+    // .L1:
+    static constexpr std::pair<Opcode, Opcode> inverses[] = {
+        {Opcode::JE, Opcode::JNE}, {Opcode::JNE, Opcode::JE}, {Opcode::JNZ, Opcode::JE}, {Opcode::JG, Opcode::JLE},
+        {Opcode::JLE, Opcode::JG}, {Opcode::JL, Opcode::JGE}, {Opcode::JGE, Opcode::JL}, {Opcode::JA, Opcode::JBE},
+        {Opcode::JBE, Opcode::JA}, {Opcode::JB, Opcode::JAE}, {Opcode::JAE, Opcode::JB}
+    };
+
+    const auto inverse = std::ranges::find(inverses, code[i].op, &std::pair<Opcode, Opcode>::first);
+    if (inverse == std::end(inverses) || i + 1 >= code.size() || code[i + 1].op != Opcode::JMP) return false;
+
+    for (size_t j = i + 2; j < code.size() && code[j].op == Opcode::LABEL; ++j) {
+        if (code[j].operands[0] == code[i].operands[0]) {
+            code[i].op = inverse->second;
+            code[i].operands[0] = code[i + 1].operands[0];
+            erase(code, i + 1);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool PeepholeOptimizer::jumpThreading(std::vector<Instr>& code, const size_t i) {
+    // jmp .L1 ... .L1: jmp .L2  ->  jmp .L2
+    if (!isJump(code[i])) return false;
+
+    auto jumpAt = [&](const Operand& target) -> const Instr* {
+        auto next = std::ranges::find_if(code, [&](const Instr& instr) {
+            return instr.op == Opcode::LABEL && instr.operands[0] == target;
+        });
+
+        while (next != code.end() && next->op == Opcode::LABEL) ++next;
+        return next != code.end() && next->op == Opcode::JMP ? &*next : nullptr;
+    };
+
+    // Follow the chain to its end, jumps that cycle are left alone
+    Operand target = code[i].operands[0];
+    for (size_t steps = 0; const Instr* next = jumpAt(target); ++steps) {
+        if (steps == code.size()) return false;
+        target = next->operands[0];
+    }
+
+    if (target == code[i].operands[0]) return false;
+
+    code[i].operands[0] = target;
+    return true;
+}
+
+bool PeepholeOptimizer::unreachableCode(std::vector<Instr>& code, const size_t i) {
+    // Nothing falls into an instruction after jmp or ret, only labels make code reachable again
+    if (code[i].op != Opcode::JMP && code[i].op != Opcode::RET) return false;
+    if (i + 1 >= code.size() || code[i + 1].op == Opcode::LABEL) return false;
+
+    erase(code, i + 1);
+    return true;
+}
+
+bool PeepholeOptimizer::deadLabel(std::vector<Instr>& code, const size_t i) {
+    // Local labels nobody jumps to
+    if (code[i].op != Opcode::LABEL || !symbols->name(code[i].operands[0].symbol).starts_with(".L")) return false;
+    if (std::ranges::find(jumpTargets, code[i].operands[0].symbol) != jumpTargets.end()) return false;
+
+    erase(code, i);
+    return true;
+}
+
+bool PeepholeOptimizer::selfMove(std::vector<Instr>& code, const size_t i) {
+    // mov r10, r10 (a 32-bit self move clears the upper half and has to stay)
+    const Instr& instr = code[i];
+    if (instr.count != 2 || !instr.operands[0].isReg() || instr.operands[0] != instr.operands[1]) return false;
+
+    if ((instr.op == Opcode::MOV && instr.operands[0].size == REG64) ||
+        instr.op == Opcode::MOVAPD || instr.op == Opcode::MOVDQA) {
+        erase(code, i);
+        return true;
+    }
+
+    return false;
+}
+
+bool PeepholeOptimizer::storeReload(std::vector<Instr>& code, const size_t i) {
+    // mov qword [rbp - 8], rdi
+    // mov r10, qword [rbp - 8]  ->  mov r10, rdi
+    if (i + 1 >= code.size()) return false;
+
+    const Instr& store = code[i];
+    Instr& load = code[i + 1];
+
+    if (store.op != load.op || (store.op != Opcode::MOV && store.op != Opcode::MOVSD)) return false;
+    if (!store.operands[0].isMem() || store.operands[0] != load.operands[1]) return false;
+
+    uint32_t srcSize, dstSize;
+    const int src = regOf(store.operands[1], &srcSize);
+    const int dst = regOf(load.operands[0], &dstSize);
+
+    if (src == -1 || dst == -1 || srcSize != dstSize || addrRegs(store.operands[0]) & bit(src)) return false;
+
+    if (src == dst) {
+        erase(code, i + 1);
+    } else {
+        load.op = load.op == Opcode::MOVSD ? Opcode::MOVAPD : Opcode::MOV;
+        load.operands[1] = store.operands[1];
+    }
+
+    return true;
+}
+
+bool PeepholeOptimizer::foldImmediate(std::vector<Instr>& code, const size_t i) {
+    // mov r11d, 1
+    // cmp r10, r11  ->  cmp r10, 1
+    static constexpr Opcode ops[] = {
+        Opcode::ADD, Opcode::SUB, Opcode::AND, Opcode::OR, Opcode::XOR, Opcode::CMP, Opcode::IMUL, Opcode::MOV
+    };
+
+    if (i + 1 >= code.size()) return false;
+
+    const Instr& mov = code[i];
+    Instr& use = code[i + 1];
+
+    if (mov.op != Opcode::MOV || use.count != 2 || std::ranges::find(ops, use.op) == std::end(ops)) return false;
+
+    uint32_t movSize, useSize;
+    const int reg = regOf(mov.operands[0], &movSize);
+    const Operand& imm = mov.operands[1];
+
+    if (!isGPR(reg) || !imm.isImm() || regOf(use.operands[1], &useSize) != reg) return false;
+    // The immediate is sign-extended from 32 bits, partial registers are left alone
+    if (!isInt32(imm.value) || (movSize != REG64 && movSize != REG32) || (useSize != REG64 && useSize != REG32)) {
+        return false;
+    }
+    // The destination needs an explicit size when it is memory
+    if (use.operands[0].isMem() ? use.operands[0].size != REG64 : regOf(use.operands[0]) == reg) return false;
+    if (isLiveAfter(i + 1, reg)) return false;
+
+    use.operands[1] = Operand::makeImm(imm.value);
+    erase(code, i);
+    return true;
+}
+
+bool PeepholeOptimizer::foldLoad(std::vector<Instr>& code, const size_t i) {
+    // mov r11, qword [rbp - 16]
+    // add r10, r11  ->  add r10, qword [rbp - 16]
+    static constexpr Opcode ops[] = {
+        Opcode::ADD, Opcode::SUB, Opcode::AND, Opcode::OR, Opcode::XOR, Opcode::CMP, Opcode::IMUL
+    };
+    static constexpr Opcode opsSSE[] = {Opcode::ADDSD, Opcode::SUBSD, Opcode::MULSD, Opcode::DIVSD, Opcode::UCOMISD};
+
+    if (i + 1 >= code.size()) return false;
+
+    const Instr& load = code[i];
+    Instr& use = code[i + 1];
+
+    if (use.count != 2) return false;
+
+    const bool isGPRLoad = load.op == Opcode::MOV && std::ranges::find(ops, use.op) != std::end(ops);
+    const bool isSSELoad = load.op == Opcode::MOVSD && std::ranges::find(opsSSE, use.op) != std::end(opsSSE);
+    if (!isGPRLoad && !isSSELoad) return false;
+    if (!load.operands[1].isMem() || use.operands[0].isMem()) return false;
+
+    uint32_t loadSize, useSize;
+    const int reg = regOf(load.operands[0], &loadSize);
+
+    if (reg == -1 || regOf(use.operands[1], &useSize) != reg || loadSize != REG64 || useSize != REG64) return false;
+    if (regOf(use.operands[0]) == reg || isLiveAfter(i + 1, reg)) return false;
+
+    use.operands[1] = load.operands[1];
+    erase(code, i);
+    return true;
+}
+
+bool PeepholeOptimizer::copyPropagation(std::vector<Instr>& code, const size_t i) {
+    // mov r10, rax
+    // add rsp, 8
+    // mov rdi, r10  ->  mov rdi, rax
+    // add r11, r10  ->  add r11, rax
+    // mov qword [rel a], r10  ->  mov qword [rel a], rax
+    const Instr& def = code[i];
+    if (def.op != Opcode::MOV && def.op != Opcode::MOVSD) return false;
+
+    const Operand& src = def.operands[1];
+    const int reg = regOf(def.operands[0]);
+    if (reg == -1) return false;
+
+    // Skip instructions that leave both the register and the source alone
+    const uint32_t srcRegs = src.isReg() ? bit(src.reg) : addrRegs(src);
+    size_t k = i + 1;
+
+    for (; k < code.size() && isSimple(code[k]); ++k) {
+        const auto [use, def_] = effectOf(code[k]);
+        if ((use | def_) & bit(reg)) break;
+        if (def_ & srcRegs) return false;
+        if (src.isMem() && std::ranges::any_of(code[k].operands, &Operand::isMem)) return false;
+    }
+
+    if (k >= code.size()) return false;
+
+    Instr& use = code[k];
+    if (use.count != 2) return false;
+
+    const bool isCopy = use.op == def.op;
+    if (!isCopy && !(def.op == Opcode::MOV && (isALU(use) || use.op == Opcode::CMP))) return false;
+
+    uint32_t defSize, srcSize, dstSize;
+    regOf(def.operands[0], &defSize);
+    const int dst = regOf(use.operands[0], &dstSize);
+
+    if (regOf(use.operands[1], &srcSize) != reg || defSize != srcSize) return false;
+    if (dst == reg || isLiveAfter(k, reg)) return false;
+    // Memory to memory moves do not exist, other sources are folded by their own rules
+    const bool isRegSource = src.isReg() && src.size == defSize;
+
+    if (!isCopy || dst == -1 ? !isRegSource : dstSize != defSize || (src.isMem() && use.operands[0].isMem())) {
+        return false;
+    }
+
+    use.operands[1] = src;
+    erase(code, i);
+    return true;
+}
+
+bool PeepholeOptimizer::renameChain(std::vector<Instr>& code, const size_t i) {
+    // mov r10, qword [rbp - 8]
+    // sub r10, 1
+    // mov rdi, r10  ->  mov rdi, qword [rbp - 8]
+    //                   sub rdi, 1
+    const Instr& def = code[i];
+    if (def.op != Opcode::MOV) return false;
+
+    const int reg = regOf(def.operands[0]);
+    if (!isGPR(reg)) return false;
+
+    auto mentions = [](const Operand& operand, const int id) {
+        return regOf(operand) == id || addrRegs(operand) & bit(id);
+    };
+
+    size_t j = i + 1;
+    while (j < code.size() && isALU(code[j]) && regOf(code[j].operands[0]) == reg &&
+           !mentions(code[j].operands[1], reg)) {
+        ++j;
+    }
+
+    if (j == i + 1 || j >= code.size() || code[j].op != Opcode::MOV) return false;
+
+    uint32_t srcSize, dstSize;
+    const int dst = regOf(code[j].operands[0], &dstSize);
+
+    if (!isGPR(dst) || dst == reg || regOf(code[j].operands[1], &srcSize) != reg || srcSize != dstSize) return false;
+    if (isLiveAfter(j, reg)) return false;
+
+    for (size_t k = i + 1; k < j; ++k) {
+        if (mentions(code[k].operands[1], dst)) return false;
+    }
+
+    // Every write goes to the copy's destination instead, at the size it was written
+    for (size_t k = i; k < j; ++k) {
+        code[k].operands[0].reg = static_cast<uint16_t>(dst);
+    }
+
+    erase(code, j);
+    return true;
+}
+
+bool PeepholeOptimizer::foldCompare(std::vector<Instr>& code, const size_t i) {
+    // mov r10, rdi
+    // cmp r10d, 1  ->  cmp edi, 1
+    if (i + 1 >= code.size()) return false;
+
+    const Instr& mov = code[i];
+    Instr& cmp = code[i + 1];
+
+    if (mov.op != Opcode::MOV || (cmp.op != Opcode::CMP && cmp.op != Opcode::TEST)) return false;
+
+    uint32_t movSize, cmpSize;
+    const int reg = regOf(mov.operands[0], &movSize);
+    Operand src = mov.operands[1];
+
+    if (!isGPR(reg) || regOf(cmp.operands[0], &cmpSize) != reg || isLiveAfter(i + 1, reg)) return false;
+    // A 32-bit compare reads the low half of a 64-bit move
+    if (movSize != cmpSize && (movSize != REG64 || cmpSize != REG32)) return false;
+
+    if (src.isMem()) {
+        // One memory operand per instruction, immediates need the explicit size
+        if (cmp.operands[1].isMem() || regOf(cmp.operands[1]) == reg || src.size != movSize) return false;
+    } else if (!isGPR(regOf(src)) || src.size != movSize) {
+        return false;
+    }
+
+    src.size = static_cast<uint8_t>(cmpSize);
+
+    if (regOf(cmp.operands[1]) == reg) {
+        cmp.operands[1] = src;
+    } else if (addrRegs(cmp.operands[1]) & bit(reg)) {
+        return false;
+    }
+
+    cmp.operands[0] = src;
+    erase(code, i);
+    return true;
+}
+
+bool PeepholeOptimizer::leaToAdd(std::vector<Instr>& code, const size_t i) {
+    // lea r10, [r10 + r11]  ->  add r10, r11
+    // lea r10, [r10 - 2]  ->  sub r10, 2
+    Instr& lea = code[i];
+    if (lea.op != Opcode::LEA || !lea.operands[0].isReg()) return false;
+
+    const Operand dst = lea.operands[0];
+    const Operand& addr = lea.operands[1];
+
+    if (addr.isIndexed()) {
+        if (addr.scale != 1 || addr.value != 0 || (addr.reg != dst.reg && addr.index != dst.reg)) return false;
+        if (areFlagsRead(code, i)) return false;
+
+        const uint32_t other = addr.reg == dst.reg ? addr.index : addr.reg;
+        lea = {Opcode::ADD, 2, {dst, Operand::makeReg(other, REG64)}};
+        return true;
+    }
+
+    // The negated displacement has to fit an immediate as well
+    if (addr.reg != dst.reg || !isInt32(-addr.value) || areFlagsRead(code, i)) return false;
+
+    const Opcode op = addr.value < 0 ? Opcode::SUB : Opcode::ADD;
+    lea = {op, 2, {dst, Operand::makeImm(addr.value < 0 ? -addr.value : addr.value)}};
+    return true;
+}
+
+bool PeepholeOptimizer::identityOp(std::vector<Instr>& code, const size_t i) {
+    // add r10, 0
+    // imul r10, 1
+    const Instr& instr = code[i];
+    if (!isALU(instr) || instr.op == Opcode::AND || !instr.operands[0].isReg()) return false;
+
+    const Operand& imm = instr.operands[1];
+    if (!imm.isImm() || imm.value != (instr.op == Opcode::IMUL ? 1 : 0) || areFlagsRead(code, i)) return false;
+    // A 32-bit operation also clears the upper half
+    if (instr.operands[0].size == REG32) return false;
+
+    erase(code, i);
+    return true;
+}
+
+bool PeepholeOptimizer::stackAdjust(std::vector<Instr>& code, const size_t i) {
+    // sub rsp, 8
+    // mov qword [rbp - 8], rdi
+    // sub rsp, 8  ->  sub rsp, 16
+    //
+    // add rsp, 8
+    // mov qword [rel a], rax
+    // sub rsp, 8  ->  (nothing)
+    auto adjustOf = [&](const Instr& instr) -> std::optional<int64_t> {
+        if ((instr.op != Opcode::ADD && instr.op != Opcode::SUB) || regOf(instr.operands[0]) != RSP) {
+            return std::nullopt;
+        }
+
+        if (!instr.operands[1].isImm()) return std::nullopt;
+        return instr.op == Opcode::SUB ? -instr.operands[1].value : instr.operands[1].value;
+    };
+
+    const auto first = adjustOf(code[i]);
+    if (!first) return false;
+
+    size_t j = i + 1;
+    while (j < code.size() && isSimple(code[j]) && !adjustOf(code[j]) &&
+           !((effectOf(code[j]).use | effectOf(code[j]).def) & bit(RSP))) {
+        ++j;
+    }
+
+    const auto second = j < code.size() ? adjustOf(code[j]) : std::nullopt;
+    if (!second) return false;
+
+    // Stack space may be allocated earlier and released later, never the other way around
+    const int64_t total = *first + *second;
+    if (*first < 0 && *second > 0) return false;
+    if (!isInt32(total) || areFlagsRead(code, i) || areFlagsRead(code, j)) return false;
+
+    const size_t keep = *first < 0 ? i : j;
+    code[keep].op = total < 0 ? Opcode::SUB : Opcode::ADD;
+    code[keep].operands[1] = Operand::makeImm(total < 0 ? -total : total);
+
+    erase(code, keep == i ? j : i);
+    if (total == 0) {
+        erase(code, keep == i ? i : j - 1);
+    }
+    return true;
+}
+
+bool PeepholeOptimizer::deadMove(std::vector<Instr>& code, const size_t i) {
+    // A register write nobody reads
+    static constexpr Opcode ops[] = {
+        Opcode::MOV, Opcode::MOVZX, Opcode::MOVSXD, Opcode::MOVSD, Opcode::MOVQ, Opcode::MOVAPD, Opcode::MOVDQA,
+        Opcode::LEA
+    };
+
+    const Instr& instr = code[i];
+    if (std::ranges::find(ops, instr.op) == std::end(ops)) return false;
+
+    const int reg = regOf(instr.operands[0]);
+    if (reg == -1 || reg == RSP || reg == RBP || isLiveAfter(i, reg)) return false;
+
+    erase(code, i);
+    return true;
+}
+
+void PeepholeOptimizer::computeLiveness(const std::vector<Instr>& code) {
+    const size_t size = code.size();
+    std::unordered_map<uint32_t, size_t> labels;
+    std::vector<Effect> effects(size);
+
+    jumpTargets.clear();
+    for (size_t i = 0; i < size; ++i) {
+        if (code[i].op == Opcode::LABEL) {
+            labels[code[i].operands[0].symbol] = i;
+        } else {
+            effects[i] = effectOf(code[i]);
+            if (isJump(code[i])) jumpTargets.push_back(code[i].operands[0].symbol);
+            // The label of a jump table is only addressed, its entries keep it
+            if (code[i].op == Opcode::DD) jumpTargets.push_back(code[i].operands[1].symbol);
+        }
+    }
+
+    // Backward dataflow until nothing changes
+    std::vector<uint32_t> liveIn(size, 0);
+    liveOut.assign(size, 0);
+
+    auto liveAt = [&](const size_t i) { return i < size ? liveIn[i] : 0u; };
+
+    bool isChanged = true;
+    while (isChanged) {
+        isChanged = false;
+
+        for (size_t i = size; i-- > 0;) {
+            const Instr& instr = code[i];
+            uint32_t out;
+
+            if (isJump(instr)) {
+                const auto target = labels.find(instr.operands[0].symbol);
+                out = target != labels.end() ? liveAt(target->second) : ~0u;
+                if (instr.op != Opcode::JMP) out |= liveAt(i + 1);
+            } else if (instr.op == Opcode::RET) {
+                out = 0;
+            } else {
+                out = liveAt(i + 1);
+            }
+
+            const uint32_t in = effects[i].use | (out & ~effects[i].def) | ALWAYS_LIVE;
+            if (in != liveIn[i] || out != liveOut[i]) {
+                liveIn[i] = in;
+                liveOut[i] = out;
+                isChanged = true;
+            }
+        }
+    }
+}
+
+bool PeepholeOptimizer::isLiveAfter(const size_t i, const int reg) const {
+    return liveOut[i] & bit(reg);
+}
+
+PeepholeOptimizer::Effect PeepholeOptimizer::effectOf(const Instr& instr) {
+    Effect effect{0, 0};
+    const auto& ops = instr.operands;
+
+    auto use = [&](const Operand& operand) {
+        effect.use |= operand.isReg() ? bit(operand.reg) : addrRegs(operand);
+    };
+
+    // Writes to 8 and 16-bit registers and merging SSE writes keep part of the old value
+    auto def = [&](const Operand& operand, const bool isMerging = false) {
+        if (!operand.isReg()) {
+            effect.use |= addrRegs(operand);
+            return;
+        }
+
+        if (isMerging || (isGPR(operand.reg) && operand.size != REG64 && operand.size != REG32)) {
+            effect.use |= bit(operand.reg);
+        }
+        effect.def |= bit(operand.reg);
+    };
+
+    switch (instr.op) {
+        case Opcode::MOV:
+        case Opcode::MOVZX:
+        case Opcode::MOVSXD:
+        case Opcode::MOVQ:
+        case Opcode::MOVAPD:
+        case Opcode::MOVDQA:
+        case Opcode::LEA:
+            def(ops[0]);
+            use(ops[1]);
+            break;
+        case Opcode::MOVSD:
+            // movsd xmm, xmm merges, the load form clears the upper half
+            def(ops[0], !ops[1].isMem());
+            use(ops[1]);
+            break;
+        case Opcode::CVTSI2SD:
+            def(ops[0], true);
+            use(ops[1]);
+            break;
+        case Opcode::CMP:
+        case Opcode::TEST:
+        case Opcode::BT:
+        case Opcode::UCOMISD:
+            use(ops[0]);
+            use(ops[1]);
+            break;
+        case Opcode::SETE:
+        case Opcode::SETNE:
+        case Opcode::SETG:
+        case Opcode::SETL:
+        case Opcode::SETGE:
+        case Opcode::SETLE:
+        case Opcode::SETA:
+        case Opcode::SETB:
+        case Opcode::SETAE:
+        case Opcode::SETBE:
+        case Opcode::POP:
+            def(ops[0]);
+            break;
+        case Opcode::PUSH:
+        case Opcode::JMPR:
+            use(ops[0]);
+            break;
+        case Opcode::IMUL:
+            // imul r, r/m, imm does not read its destination
+            if (instr.count == 3) {
+                def(ops[0]);
+                use(ops[1]);
+            } else {
+                use(ops[0]);
+                use(ops[1]);
+                def(ops[0], true);
+            }
+            break;
+        case Opcode::IDIV:
+            use(ops[0]);
+            effect.use |= bit(RAX) | bit(RDX);
+            effect.def |= bit(RAX) | bit(RDX);
+            break;
+        case Opcode::CQO:
+            effect.use |= bit(RAX);
+            effect.def |= bit(RDX);
+            break;
+        case Opcode::CALL:
+            effect.use |= ops[0].callArgs();
+            effect.def |= ops[0].callClobbers() ? ops[0].callClobbers() : CALLER_SAVED;
+            break;
+        case Opcode::SYSCALL:
+            effect.use |= bit(RAX) | bit(RDI) | bit(RSI) | bit(RDX) | bit(R10) | bit(R8) | bit(R9);
+            effect.def |= bit(RAX) | bit(RCX) | bit(R11);
+            break;
+        case Opcode::RET:
+            effect.use |= bit(RAX) | bit(xmm0) | CALLEE_SAVED;
+            break;
+        case Opcode::LABEL:
+        case Opcode::VZEROUPPER:
+            break;
+        default:
+            if (isJump(instr.op)) break;
+            // Zeroing idiom, the old value is not read
+            if ((instr.op == Opcode::XOR || instr.op == Opcode::PXOR || instr.op == Opcode::XORPD) &&
+                ops[0] == ops[1]) {
+                def(ops[0]);
+                break;
+            }
+            // Anything else reads all its operands and updates the first one
+            for (int i = 0; i < instr.count; ++i) use(ops[i]);
+            if (instr.count) def(ops[0], true);
+            break;
+    }
+
+    return effect;
+}
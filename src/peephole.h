@@ -0,0 +1,77 @@
+#ifndef PEEPHOLE_H
+#define PEEPHOLE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "instr.h"
+
+// Rewrites short windows of the text section with a table of rules. Rules that drop or
+// merge a register write check register liveness, which is recomputed after every change.
+class PeepholeOptimizer {
+public:
+    PeepholeOptimizer();
+
+    void run(std::vector<Instr>& code, const SymbolTable& symbols);
+
+    [[nodiscard]] std::string stats() const;
+
+private:
+    struct Rule {
+        const char* name;
+        bool (PeepholeOptimizer::*apply)(std::vector<Instr>& code, size_t i);
+        int hits;
+    };
+
+    struct Effect {
+        uint32_t use;
+        uint32_t def;
+    };
+
+    bool redundantJump(std::vector<Instr>& code, size_t i);
+
+    bool invertBranch(std::vector<Instr>& code, size_t i);
+
+    bool jumpThreading(std::vector<Instr>& code, size_t i);
+
+    bool unreachableCode(std::vector<Instr>& code, size_t i);
+
+    bool deadLabel(std::vector<Instr>& code, size_t i);
+
+    bool selfMove(std::vector<Instr>& code, size_t i);
+
+    bool storeReload(std::vector<Instr>& code, size_t i);
+
+    bool foldImmediate(std::vector<Instr>& code, size_t i);
+
+    bool foldLoad(std::vector<Instr>& code, size_t i);
+
+    bool copyPropagation(std::vector<Instr>& code, size_t i);
+
+    bool renameChain(std::vector<Instr>& code, size_t i);
+
+    bool foldCompare(std::vector<Instr>& code, size_t i);
+
+    bool leaToAdd(std::vector<Instr>& code, size_t i);
+
+    bool identityOp(std::vector<Instr>& code, size_t i);
+
+    bool stackAdjust(std::vector<Instr>& code, size_t i);
+
+    bool deadMove(std::vector<Instr>& code, size_t i);
+
+    void computeLiveness(const std::vector<Instr>& code);
+
+    [[nodiscard]] bool isLiveAfter(size_t i, int reg) const;
+
+    static Effect effectOf(const Instr& instr);
+
+    std::vector<Rule> rules;
+    std::vector<uint32_t> liveOut;
+    std::vector<uint32_t> jumpTargets;
+    const SymbolTable* symbols{nullptr};
+    size_t instrsBefore{0};
+    size_t instrsAfter{0};
+};
+
+#endif //PEEPHOLE_H
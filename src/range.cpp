@@ -0,0 +1,260 @@
+#include "range.h"
+#include <algorithm>
+#include <bit>
+
+// A range that keeps growing after this many updates is widened to the full range
+static constexpr int WIDENING_THRESHOLD = 4;
+
+Range Range::join(const Range& other) const {
+    if (isEmpty()) return other;
+    if (other.isEmpty()) return *this;
+
+    return {std::min(lo, other.lo), std::max(hi, other.hi)};
+}
+
+void RangeAnalyzer::analyze(const ExprPtr& ast) {
+    // Iterate until no variable, parameter or return range grows. Widening bounds the
+    // number of updates per key, so this terminates.
+    do {
+        isChanged = false;
+
+        for (auto next = ast; next != nullptr; next = next->child) {
+            currentScope = "main";
+            exprRange(next);
+        }
+    } while (isChanged);
+
+    // Record the final range of every node for codegen
+    isRecording = true;
+    for (auto next = ast; next != nullptr; next = next->child) {
+        currentScope = "main";
+        exprRange(next);
+    }
+    isRecording = false;
+}
+
+Range RangeAnalyzer::rangeOf(const IExpr& expr) const {
+    if (const auto* int_ = dynamic_cast<const IntExpr*>(&expr)) {
+        return Range::of(int_->n);
+    }
+
+    // Nodes that were never reached or never got a value are unknown
+    if (const auto it = ranges.find(&expr); it != ranges.end() && !it->second.isEmpty()) {
+        return it->second;
+    }
+
+    return Range::full();
+}
+
+bool RangeAnalyzer::isUInt32(const IExpr& expr) const {
+    return rangeOf(expr).isWithin(0, std::numeric_limits<uint32_t>::max());
+}
+
+bool RangeAnalyzer::isInt32(const IExpr& expr) const {
+    return rangeOf(expr).isWithin(std::numeric_limits<int32_t>::min(), std::numeric_limits<int32_t>::max());
+}
+
+Range RangeAnalyzer::exprRange(const ExprPtr& expr) {
+    Range range = Range::full();
+
+    if (const auto int_ = cast::toInt(expr)) {
+        range = Range::of(int_->n);
+    } else if (cast::toT(expr)) {
+        range = Range::of(1);
+    } else if (cast::toNIL(expr)) {
+        range = Range::of(0);
+    } else if (const auto var = cast::toVar(expr)) {
+        if (var->vType != VarType::DOUBLE) {
+            // Nothing assigned yet, the variable stays empty until the next iteration
+            const auto it = vars.find(varKey(*var));
+            range = it != vars.end() ? it->second : Range{};
+        }
+    } else if (const auto binop = cast::toBinop(expr)) {
+        range = binopRange(*binop);
+    } else if (const auto dotimes = cast::toDotimes(expr)) {
+        const auto iterVar = cast::toVar(dotimes->iterationCount);
+
+        if (const Range count = exprRange(iterVar->value); !count.isEmpty()) {
+            assign(vars, varKey(*iterVar), {0, std::max<int64_t>(0, count.hi - 1)});
+        }
+
+        bodyRange(dotimes->statements);
+        range = Range::of(0);
+    } else if (const auto loop = cast::toLoop(expr)) {
+        bodyRange(loop->sexprs);
+    } else if (const auto let = cast::toLet(expr)) {
+        for (const auto& binding: let->bindings) {
+            const auto var = cast::toVar(binding);
+            assign(vars, varKey(*var), cast::toUninitialized(var->value) ? Range::full() : exprRange(var->value));
+        }
+
+        range = bodyRange(let->body);
+    } else if (const auto setq = cast::toSetq(expr)) {
+        const auto var = cast::toVar(setq->pair);
+        range = exprRange(var->value);
+        assign(vars, varKey(*var), range);
+    } else if (const auto defvar = cast::toDefvar(expr)) {
+        const auto var = cast::toVar(defvar->pair);
+        assign(vars, varKey(*var), cast::toUninitialized(var->value) ? Range::full() : exprRange(var->value));
+    } else if (const auto defconst = cast::toDefconstant(expr)) {
+        const auto var = cast::toVar(defconst->pair);
+        assign(vars, varKey(*var), exprRange(var->value));
+    } else if (const auto defun = cast::toDefun(expr)) {
+        const std::string funcName = cast::toString(cast::toVar(defun->name)->name)->data;
+        const std::string outerScope = currentScope;
+
+        currentScope = funcName;
+        assign(returns, funcName, bodyRange(defun->forms));
+        currentScope = outerScope;
+    } else if (const auto funcCall = cast::toFuncCall(expr)) {
+        const std::string funcName = cast::toString(cast::toVar(funcCall->name)->name)->data;
+
+        for (const auto& arg: funcCall->args) {
+            const auto param = cast::toVar(arg);
+            const std::string paramName = cast::toString(param->name)->data;
+            assign(vars, funcName + "::" + paramName, exprRange(param->value));
+        }
+
+        const auto it = returns.find(funcName);
+        range = it != returns.end() ? it->second : Range{};
+    } else if (const auto if_ = cast::toIf(expr)) {
+        exprRange(if_->test);
+        range = exprRange(if_->then).join(cast::toUninitialized(if_->else_) ? Range::of(0) : exprRange(if_->else_));
+    } else if (const auto when = cast::toWhen(expr)) {
+        exprRange(when->test);
+        range = bodyRange(when->then).join(Range::of(0));
+    } else if (const auto cond = cast::toCond(expr)) {
+        range = Range::of(0);
+
+        for (const auto& [test, forms]: cond->variants) {
+            exprRange(test);
+            range = range.join(bodyRange(forms));
+        }
+    }
+
+    if (isRecording) {
+        ranges[expr.get()] = range;
+    }
+
+    return range;
+}
+
+Range RangeAnalyzer::binopRange(const BinOpExpr& binop) {
+    const Range lhs = exprRange(binop.lhs);
+    const Range rhs = cast::toUninitialized(binop.rhs) ? Range::of(0) : exprRange(binop.rhs);
+
+    switch (binop.opToken.type) {
+        case TokenType::EQUAL:
+        case TokenType::NEQUAL:
+        case TokenType::GREATER_THEN:
+        case TokenType::LESS_THEN:
+        case TokenType::GREATER_THEN_EQ:
+        case TokenType::LESS_THEN_EQ:
+        case TokenType::AND:
+        case TokenType::OR:
+        case TokenType::NOT:
+            return {0, 1};
+        default:
+            break;
+    }
+
+    if (lhs.isEmpty() || rhs.isEmpty()) {
+        return {};
+    }
+
+    switch (binop.opToken.type) {
+        case TokenType::PLUS:
+            return checked(static_cast<__int128>(lhs.lo) + rhs.lo, static_cast<__int128>(lhs.hi) + rhs.hi);
+        case TokenType::MINUS:
+            return checked(static_cast<__int128>(lhs.lo) - rhs.hi, static_cast<__int128>(lhs.hi) - rhs.lo);
+        case TokenType::MUL: {
+            const __int128 corners[] = {
+                static_cast<__int128>(lhs.lo) * rhs.lo, static_cast<__int128>(lhs.lo) * rhs.hi,
+                static_cast<__int128>(lhs.hi) * rhs.lo, static_cast<__int128>(lhs.hi) * rhs.hi
+            };
+            return checked(*std::ranges::min_element(corners), *std::ranges::max_element(corners));
+        }
+        case TokenType::DIV:
+            return divRange(lhs, rhs);
+        case TokenType::LOGAND:
+        case TokenType::LOGIOR:
+        case TokenType::LOGXOR:
+            return bitRange(binop.opToken.type, lhs, rhs);
+        default:
+            return Range::full();
+    }
+}
+
+Range RangeAnalyzer::bodyRange(const std::vector<ExprPtr>& body) {
+    Range range = Range::of(0);
+
+    for (const auto& form: body) {
+        range = exprRange(form);
+    }
+
+    return range;
+}
+
+void RangeAnalyzer::assign(std::unordered_map<std::string, Range>& ranges_,
+                           const std::string& key,
+                           const Range& range) {
+    Range& current = ranges_[key];
+    Range joined = current.join(range);
+
+    if (joined == current) {
+        return;
+    }
+
+    if (++updates[&ranges_ == &vars ? key : "()" + key] > WIDENING_THRESHOLD) {
+        joined = Range::full();
+    }
+
+    current = joined;
+    isChanged = true;
+}
+
+std::string RangeAnalyzer::varKey(const VarExpr& var) const {
+    return varKey(cast::toString(var.name)->data, var.sType);
+}
+
+std::string RangeAnalyzer::varKey(const std::string& name, const SymbolType stype) const {
+    return stype == SymbolType::GLOBAL ? "::" + name : currentScope + "::" + name;
+}
+
+Range RangeAnalyzer::bitRange(const TokenType op, const Range& lhs, const Range& rhs) {
+    // Only non-negative operands have known high bits
+    if (op == TokenType::LOGAND) {
+        if (lhs.lo >= 0 && rhs.lo >= 0) return {0, std::min(lhs.hi, rhs.hi)};
+        if (lhs.lo >= 0) return {0, lhs.hi};
+        if (rhs.lo >= 0) return {0, rhs.hi};
+        return Range::full();
+    }
+
+    if (lhs.lo < 0 || rhs.lo < 0) {
+        return Range::full();
+    }
+
+    const auto width = std::bit_width(static_cast<uint64_t>(std::max(lhs.hi, rhs.hi)));
+    return {0, static_cast<int64_t>((uint64_t{1} << width) - 1)};
+}
+
+Range RangeAnalyzer::divRange(const Range& lhs, const Range& rhs) {
+    if (rhs.lo <= 0 && rhs.hi >= 0) {
+        return Range::full();
+    }
+    // idiv truncates towards zero, which is monotonic on either side of a non-zero divisor
+    const __int128 corners[] = {
+        static_cast<__int128>(lhs.lo) / rhs.lo, static_cast<__int128>(lhs.lo) / rhs.hi,
+        static_cast<__int128>(lhs.hi) / rhs.lo, static_cast<__int128>(lhs.hi) / rhs.hi
+    };
+
+    return checked(*std::ranges::min_element(corners), *std::ranges::max_element(corners));
+}
+
+Range RangeAnalyzer::checked(const __int128 lo, const __int128 hi) {
+    if (lo < std::numeric_limits<int64_t>::min() || hi > std::numeric_limits<int64_t>::max()) {
+        return Range::full();
+    }
+
+    return {static_cast<int64_t>(lo), static_cast<int64_t>(hi)};
+}
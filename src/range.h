@@ -0,0 +1,72 @@
+#ifndef RANGE_H
+#define RANGE_H
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include "parser.h"
+
+struct Range {
+    int64_t lo{std::numeric_limits<int64_t>::max()};
+    int64_t hi{std::numeric_limits<int64_t>::min()};
+
+    static Range full() { return {std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max()}; }
+
+    static Range of(const int64_t n) { return {n, n}; }
+
+    [[nodiscard]] bool isEmpty() const { return lo > hi; }
+
+    [[nodiscard]] bool isConstant() const { return lo == hi; }
+
+    [[nodiscard]] bool isWithin(const int64_t min, const int64_t max) const { return !isEmpty() && lo >= min && hi <= max; }
+
+    [[nodiscard]] Range join(const Range& other) const;
+
+    bool operator==(const Range& other) const = default;
+};
+
+// Flow-insensitive interval analysis over the resolved AST. A variable's range covers
+// every value assigned to it anywhere in its scope; parameters take their ranges from
+// all call sites. Expressions that are not integers get the full range.
+class RangeAnalyzer {
+public:
+    void analyze(const ExprPtr& ast);
+
+    [[nodiscard]] Range rangeOf(const IExpr& expr) const;
+
+    // The value fits a zero-extended 32-bit register
+    [[nodiscard]] bool isUInt32(const IExpr& expr) const;
+
+    // The value survives truncation to a 32-bit register under signed compares
+    [[nodiscard]] bool isInt32(const IExpr& expr) const;
+
+private:
+    Range exprRange(const ExprPtr& expr);
+
+    Range binopRange(const BinOpExpr& binop);
+
+    Range bodyRange(const std::vector<ExprPtr>& body);
+
+    void assign(std::unordered_map<std::string, Range>& ranges_, const std::string& key, const Range& range);
+
+    std::string varKey(const VarExpr& var) const;
+
+    std::string varKey(const std::string& name, SymbolType stype) const;
+
+    static Range bitRange(TokenType op, const Range& lhs, const Range& rhs);
+
+    static Range divRange(const Range& lhs, const Range& rhs);
+
+    static Range checked(__int128 lo, __int128 hi);
+
+    std::unordered_map<std::string, Range> vars;
+    std::unordered_map<std::string, Range> returns;
+    std::unordered_map<std::string, int> updates;
+    std::unordered_map<const IExpr*, Range> ranges;
+    std::string currentScope;
+    bool isChanged{false};
+    bool isRecording{false};
+};
+
+#endif //RANGE_H
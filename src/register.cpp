@@ -1,17 +1,50 @@
 #include "register.h"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <format>
+#include <ranges>
+#include <stdexcept>
+#include <unordered_map>
+#include "instr.h"
+
+#define bit(id) (1u << (id))
+
+static constexpr uint32_t SSE_REGISTERS = 0xFFFF0000u;
+
+static constexpr uint32_t CALLEE_SAVED = bit(RBX) | bit(R12) | bit(R13) | bit(R14) | bit(R15);
+
+static constexpr uint32_t CALLER_SAVED = ~(CALLEE_SAVED | bit(RBP) | bit(RSP));
 
 Register* RegisterAllocator::alloc(const uint8_t rt) {
-    if (rt == SSE) {
-        return scan(priorityOrderSSE, 2);
+    const auto id = static_cast<uint32_t>(VIRTUAL_REGISTER_BASE + virtualRegisters.size());
+    if (id > std::numeric_limits<uint16_t>::max()) {
+        throw std::runtime_error("Too many virtual registers in one function");
     }
 
-    return scan(priorityOrder, 3);
+    liveCount[isSSE(rt)]++;
+    virtualRegisters.push_back({.id = id, .rType = rt == SSE ? SSE : SCRATCH, .status = INUSE});
+    return &virtualRegisters.back();
 }
 
 void RegisterAllocator::free(Register* reg) {
+    if (reg->id >= VIRTUAL_REGISTER_BASE && isINUSE(reg->status)) {
+        liveCount[isSSE(reg->rType)]--;
+    }
+
     reg->status &= ~INUSE;
 }
 
+int RegisterAllocator::available(const uint8_t rt) const {
+    int count = 0;
+
+    for (const uint32_t id: allocationOrder) {
+        count += isSSE(registers[id].rType) == isSSE(rt);
+    }
+
+    return std::max(count - liveCount[isSSE(rt)], 0);
+}
+
 const char* RegisterAllocator::nameFromReg(const Register* reg, const uint32_t size) {
     return registerNames[reg->id][size];
 }
@@ -21,18 +54,818 @@ const char* RegisterAllocator::nameFromID(const uint32_t id, const uint32_t size
 }
 
 Register* RegisterAllocator::regFromID(const uint32_t id) {
-    return &registers[id];
+    return isVirtual(id) ? &virtualRegisters[id - VIRTUAL_REGISTER_BASE] : &registers[id];
+}
+
+Allocation RegisterAllocator::allocate(std::vector<Instr>& code, const size_t begin) {
+    spillSlots.clear();
+
+    // Spilled values are replaced by short-lived registers, then the function is allocated again
+    for (;;) {
+        // Positions move as code is inserted, slots of earlier rounds are no longer shared
+        for (auto& slot: spillSlots) {
+            slot.ranges = {{0, NO_REGISTER}};
+        }
+
+        isSpillTemp.resize(virtualRegisters.size(), false);
+        computeLiveness(code, begin);
+
+        const std::vector<uint32_t> spilled = assign();
+        if (spilled.empty()) break;
+
+        insertSpillCode(code, begin, spilled);
+    }
+
+    insertCallerSaves(code, begin);
+
+    // Rewrite to physical registers and drop the moves that were coalesced
+    uint32_t usedRegs = 0;
+    size_t out = begin;
+    for (size_t i = begin; i < code.size(); ++i) {
+        Instr& instr = code[i];
+
+        for (int k = 0; k < instr.count; ++k) {
+            Operand& operand = instr.operands[k];
+            if ((operand.isReg() || operand.isMem()) && isVirtual(operand.reg)) {
+                operand.reg = static_cast<uint16_t>(assigned[operand.reg - VIRTUAL_REGISTER_BASE]);
+                usedRegs |= bit(operand.reg);
+            }
+            if (operand.isIndexed() && isVirtual(operand.index)) {
+                operand.index = static_cast<uint16_t>(assigned[operand.index - VIRTUAL_REGISTER_BASE]);
+                usedRegs |= bit(operand.index);
+            }
+        }
+
+        static constexpr Opcode moves[] = {
+            Opcode::MOV, Opcode::MOVSD, Opcode::MOVAPD, Opcode::MOVDQA, Opcode::MOVDQU, Opcode::VMOVDQA, Opcode::VMOVDQU
+        };
+        const Operand& dst = instr.operands[0];
+        // mov r32, r32 clears the upper half
+        const bool isSelfMove = std::ranges::find(moves, instr.op) != std::end(moves) && dst.isReg() &&
+                                dst == instr.operands[1] && dst.size != REG32;
+
+        if (!isSelfMove) {
+            code[out++] = instr;
+        }
+    }
+    code.resize(out);
+
+    const uint32_t spillSize = spillSlots.empty() ? 0 : spillSlots.back().offset;
+
+    virtualRegisters.clear();
+    isSpillTemp.clear();
+    liveCount[0] = liveCount[1] = 0;
+
+    return {usedRegs & CALLEE_SAVED, spillSize};
+}
+
+uint32_t RegisterAllocator::clobbersOf(const std::vector<Instr>& code, const size_t begin) {
+    uint32_t clobbers = 0;
+    for (size_t i = begin; i < code.size(); ++i) {
+        const Access access = accessOf(code[i]);
+        if (access.def != NO_REGISTER) clobbers |= bit(access.def);
+        clobbers |= access.implicitDef;
+    }
+
+    // The epilogue restores the callee-saved registers
+    return clobbers & CALLER_SAVED;
+}
+
+void RegisterAllocator::computeLiveness(const std::vector<Instr>& code, const size_t begin) {
+    const size_t count = code.size() - begin;
+    const size_t vregCount = virtualRegisters.size();
+    const size_t words = (vregCount + 63) / 64;
+
+    // Register moves between the same class are coalesced when the ranges allow it
+    accesses.assign(count, {});
+    hints.assign(vregCount, {});
+
+    for (size_t i = 0; i < count; ++i) {
+        const Instr& instr = code[begin + i];
+        accesses[i] = accessOf(instr);
+
+        static constexpr Opcode moves[] = {Opcode::MOV, Opcode::MOVSD, Opcode::MOVAPD, Opcode::MOVDQA};
+        const Operand& dst = instr.operands[0];
+        const Operand& src = instr.operands[1];
+
+        if (std::ranges::find(moves, instr.op) != std::end(moves) && dst.isReg() && src.isReg() &&
+            isSSEReg(dst.reg) == isSSEReg(src.reg)) {
+            if (isVirtual(dst.reg)) hints[dst.reg - VIRTUAL_REGISTER_BASE].push_back(src.reg);
+            if (isVirtual(src.reg)) hints[src.reg - VIRTUAL_REGISTER_BASE].push_back(dst.reg);
+        }
+    }
+
+    // Basic blocks start at labels and after jumps
+    std::vector<size_t> blockStarts;
+    std::unordered_map<uint32_t, size_t> labelBlocks;
+
+    for (size_t i = 0; i < count; ++i) {
+        const Instr& instr = code[begin + i];
+        const bool isAfterJump = i > 0 && (isJump(code[begin + i - 1].op) || code[begin + i - 1].op == Opcode::RET);
+
+        if (i == 0 || instr.op == Opcode::LABEL || isAfterJump) {
+            blockStarts.push_back(i);
+        }
+
+        if (instr.op == Opcode::LABEL) {
+            labelBlocks[instr.operands[0].symbol] = blockStarts.size() - 1;
+        }
+    }
+
+    const size_t blockCount = blockStarts.size();
+    blockStarts.push_back(count);
+
+    // A jump back to an earlier block closes a loop around the instructions in between
+    std::vector<std::vector<size_t> > successors(blockCount);
+    std::vector<int> depthChanges(count + 1, 0);
+
+    for (size_t b = 0; b < blockCount; ++b) {
+        const size_t last = blockStarts[b + 1] - 1;
+        const Instr& instr = code[begin + last];
+
+        if (isJump(instr.op)) {
+            if (const auto it = labelBlocks.find(instr.operands[0].symbol); it != labelBlocks.end()) {
+                successors[b].push_back(it->second);
+
+                if (it->second <= b) {
+                    depthChanges[blockStarts[it->second]]++;
+                    depthChanges[last + 1]--;
+                }
+            }
+        }
+
+        if (instr.op != Opcode::JMP && instr.op != Opcode::RET && instr.op != Opcode::SYSCALL && b + 1 < blockCount) {
+            successors[b].push_back(b + 1);
+        }
+    }
+
+    loopDepths.assign(count, 0);
+    for (size_t i = 0, depth = 0; i < count; ++i) {
+        depth += depthChanges[i];
+        loopDepths[i] = static_cast<uint32_t>(depth);
+    }
+
+    // Virtual registers are bit sets, physical registers a mask
+    struct LiveSet {
+        std::vector<uint64_t> vregs;
+        uint32_t regs{0};
+    };
+
+    auto makeSet = [&] { return LiveSet{std::vector<uint64_t>(words, 0), 0}; };
+
+    auto addUses = [&](LiveSet& set, const Access& access) {
+        for (int k = 0; k < access.useCount; ++k) {
+            const uint32_t id = access.uses[k];
+            if (isVirtual(id)) {
+                set.vregs[(id - VIRTUAL_REGISTER_BASE) / 64] |= 1ull << (id - VIRTUAL_REGISTER_BASE) % 64;
+            } else {
+                set.regs |= bit(id);
+            }
+        }
+        set.regs |= access.implicitUse;
+    };
+
+    auto removeDefs = [&](LiveSet& set, const Access& access) {
+        if (isVirtual(access.def)) {
+            set.vregs[(access.def - VIRTUAL_REGISTER_BASE) / 64] &= ~(1ull << (access.def - VIRTUAL_REGISTER_BASE) % 64);
+        } else if (access.def != NO_REGISTER) {
+            set.regs &= ~bit(access.def);
+        }
+        set.regs &= ~access.implicitDef;
+    };
+
+    // Live variables, iterated to a fixed point
+    std::vector<LiveSet> liveIn(blockCount, makeSet());
+    std::vector<LiveSet> liveOut(blockCount, makeSet());
+
+    for (bool isChanged = true; isChanged;) {
+        isChanged = false;
+
+        for (size_t b = blockCount; b-- > 0;) {
+            LiveSet out = makeSet();
+            for (const size_t succ: successors[b]) {
+                for (size_t w = 0; w < words; ++w) out.vregs[w] |= liveIn[succ].vregs[w];
+                out.regs |= liveIn[succ].regs;
+            }
+
+            LiveSet in = out;
+            for (size_t i = blockStarts[b + 1]; i-- > blockStarts[b];) {
+                removeDefs(in, accesses[i]);
+                addUses(in, accesses[i]);
+            }
+
+            if (in.vregs != liveIn[b].vregs || in.regs != liveIn[b].regs) {
+                liveIn[b] = std::move(in);
+                isChanged = true;
+            }
+            liveOut[b] = std::move(out);
+        }
+    }
+
+    // Instruction i reads its operands at 2i and writes its result at 2i + 1. A virtual
+    // register lives in a list of ranges, the physical registers occupied at each position
+    // are a mask.
+    ranges.assign(vregCount, {});
+    occupied.assign(count * 2, 0);
+    callClobbers.assign(count * 2, 0);
+    calls.clear();
+    std::vector<uint32_t> rangeEnds(vregCount, NO_REGISTER);
+
+    auto closeRange = [&](const uint32_t vreg, const size_t pos) {
+        ranges[vreg].push_back({static_cast<uint32_t>(pos), rangeEnds[vreg]});
+        rangeEnds[vreg] = NO_REGISTER;
+    };
+
+    auto forEachVreg = [&](const LiveSet& set, const auto& fn) {
+        for (size_t w = 0; w < words; ++w) {
+            for (uint64_t bits = set.vregs[w]; bits; bits &= bits - 1) {
+                fn(static_cast<uint32_t>(w * 64 + std::countr_zero(bits)));
+            }
+        }
+    };
+
+    for (size_t b = 0; b < blockCount; ++b) {
+        const size_t first = blockStarts[b], last = blockStarts[b + 1] - 1;
+        forEachVreg(liveOut[b], [&](const uint32_t vreg) { rangeEnds[vreg] = static_cast<uint32_t>(last * 2 + 1); });
+
+        uint32_t live = liveOut[b].regs;
+        for (size_t i = last + 1; i-- > first;) {
+            const Access& access = accesses[i];
+
+            occupied[i * 2 + 1] = live | access.implicitDef;
+            // A value can stay in a register the call clobbers if it is saved around it, but
+            // not in one the call returns a value in
+            if (code[begin + i].op == Opcode::CALL) {
+                callClobbers[i * 2 + 1] = access.implicitDef & ~live;
+                calls.push_back(static_cast<uint32_t>(i));
+            }
+            if (isVirtual(access.def)) {
+                const uint32_t vreg = access.def - VIRTUAL_REGISTER_BASE;
+                // A dead definition still needs a register
+                if (rangeEnds[vreg] == NO_REGISTER) rangeEnds[vreg] = static_cast<uint32_t>(i * 2 + 1);
+                closeRange(vreg, i * 2 + 1);
+            } else if (access.def != NO_REGISTER) {
+                occupied[i * 2 + 1] |= bit(access.def);
+                live &= ~bit(access.def);
+            }
+
+            live &= ~access.implicitDef;
+            live |= access.implicitUse;
+            for (int k = 0; k < access.useCount; ++k) {
+                if (!isVirtual(access.uses[k])) {
+                    live |= bit(access.uses[k]);
+                } else if (const uint32_t vreg = access.uses[k] - VIRTUAL_REGISTER_BASE; rangeEnds[vreg] == NO_REGISTER) {
+                    rangeEnds[vreg] = static_cast<uint32_t>(i * 2);
+                }
+            }
+
+            occupied[i * 2] = live;
+        }
+
+        forEachVreg(liveIn[b], [&](const uint32_t vreg) { closeRange(vreg, first * 2); });
+    }
+
+    for (auto& vregRanges: ranges) {
+        std::ranges::sort(vregRanges, {}, &Range::start);
+    }
+
+    // Spilling costs a load per use and a store per definition, ten times more per loop level
+    std::vector<int> defCounts(vregCount, 0);
+    std::vector<size_t> defs(vregCount, 0);
+    spillCosts.assign(vregCount, 0);
+
+    for (size_t i = 0; i < count; ++i) {
+        const double weight = std::pow(10.0, std::min(loopDepths[i], 8u));
+        const Access& access = accesses[i];
+
+        for (int k = 0; k < access.useCount; ++k) {
+            if (isVirtual(access.uses[k])) spillCosts[access.uses[k] - VIRTUAL_REGISTER_BASE] += weight;
+        }
+
+        if (isVirtual(access.def)) {
+            const uint32_t vreg = access.def - VIRTUAL_REGISTER_BASE;
+            spillCosts[vreg] += weight;
+            defCounts[vreg]++;
+            defs[vreg] = i;
+        }
+    }
+
+    isRemat.assign(vregCount, false);
+    for (uint32_t v = 0; v < vregCount; ++v) {
+        if (defCounts[v] == 1 && isRematerializable(code[begin + defs[v]])) {
+            isRemat[v] = true;
+            spillCosts[v] -= std::pow(10.0, std::min(loopDepths[defs[v]], 8u));
+        }
+    }
+}
+
+std::vector<uint32_t> RegisterAllocator::assign() {
+    const size_t vregCount = virtualRegisters.size();
+
+    std::vector<std::pair<uint32_t, uint32_t> > intervals;
+    for (uint32_t v = 0; v < vregCount; ++v) {
+        if (!ranges[v].empty()) {
+            intervals.emplace_back(ranges[v].front().start, v);
+        }
+    }
+    std::ranges::sort(intervals);
+
+    uint32_t allocatable = 0;
+    for (const uint32_t id: allocationOrder) {
+        allocatable |= bit(id);
+    }
+
+    // The free registers at each position are the complement of the occupied mask. Assigned
+    // ranges are added to a copy of it, so lifetime holes stay usable.
+    std::vector<uint32_t> taken = occupied;
+    std::vector<std::vector<uint32_t> > owners(REGISTER_COUNT);
+    std::vector<uint32_t> spilled;
+    assigned.assign(vregCount, NO_REGISTER);
+    isSavedAroundCalls.assign(vregCount, false);
+
+    // Registers taken anywhere in the ranges, apart from the ones ignored at each position
+    auto blockedOver = [&](const std::vector<uint32_t>& masks, const std::vector<Range>& vregRanges,
+                           const std::vector<uint32_t>& ignored = {}) {
+        uint32_t blocked = 0;
+        for (const auto& [start, end]: vregRanges) {
+            for (uint32_t pos = start; pos <= end; ++pos) {
+                blocked |= masks[pos] & (ignored.empty() ? ~0u : ~ignored[pos]);
+            }
+        }
+        return blocked;
+    };
+
+    auto mark = [&](const uint32_t vreg, const uint32_t reg, const bool isTaken) {
+        for (const auto& [start, end]: ranges[vreg]) {
+            for (uint32_t pos = start; pos <= end; ++pos) {
+                isTaken ? taken[pos] |= bit(reg) : taken[pos] &= ~bit(reg);
+            }
+        }
+    };
+
+    for (const uint32_t vreg: intervals | std::views::values) {
+        const bool isSSEClass = isSSE(virtualRegisters[vreg].rType);
+        const uint32_t classRegs = allocatable & (isSSEClass ? SSE_REGISTERS : ~SSE_REGISTERS);
+        const uint32_t candidates = classRegs & ~blockedOver(taken, ranges[vreg]);
+
+        uint32_t reg = NO_REGISTER;
+        for (const uint32_t hint: hints[vreg]) {
+            const uint32_t hintReg = isVirtual(hint) ? assigned[hint - VIRTUAL_REGISTER_BASE] : hint;
+
+            if (hintReg != NO_REGISTER && candidates & bit(hintReg)) {
+                reg = hintReg;
+                break;
+            }
+        }
+
+        for (size_t k = 0; reg == NO_REGISTER && k < std::size(allocationOrder); ++k) {
+            if (candidates & bit(allocationOrder[k])) {
+                reg = allocationOrder[k];
+            }
+        }
+
+        // Out of registers. The value either keeps a caller-saved register that is only
+        // clobbered by calls, or this value or the cheapest overlapping values of one register
+        // are spilled.
+        if (reg == NO_REGISTER) {
+            uint32_t saveReg = NO_REGISTER;
+            if (!isSpillTemp[vreg]) {
+                const uint32_t saveCandidates = classRegs & ~blockedOver(taken, ranges[vreg], callClobbers);
+
+                for (size_t k = 0; saveReg == NO_REGISTER && k < std::size(allocationOrder); ++k) {
+                    if (saveCandidates & bit(allocationOrder[k])) {
+                        saveReg = allocationOrder[k];
+                    }
+                }
+            }
+
+            const double saveCost = saveReg != NO_REGISTER
+                                        ? callerSaveCost(vreg)
+                                        : std::numeric_limits<double>::infinity();
+            const uint32_t evictable = classRegs & ~blockedOver(occupied, ranges[vreg]);
+            double bestCost = std::numeric_limits<double>::infinity();
+
+            for (const uint32_t id: allocationOrder) {
+                if (!(evictable & bit(id))) continue;
+
+                double cost = 0;
+                for (const uint32_t owner: owners[id]) {
+                    if (!overlaps(ranges[owner], ranges[vreg])) continue;
+
+                    cost += isSpillTemp[owner] ? std::numeric_limits<double>::infinity() : spillCosts[owner];
+                }
+
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    reg = id;
+                }
+            }
+
+            if (saveCost < bestCost && saveCost < spillCosts[vreg]) {
+                reg = saveReg;
+                isSavedAroundCalls[vreg] = true;
+            } else if (reg == NO_REGISTER || (!isSpillTemp[vreg] && spillCosts[vreg] <= bestCost)) {
+                if (isSpillTemp[vreg]) {
+                    throw std::runtime_error(std::format("Out of {} registers", isSSEClass ? "SSE" : "general purpose"));
+                }
+
+                spilled.push_back(vreg);
+                continue;
+            } else {
+                std::erase_if(owners[reg], [&](const uint32_t owner) {
+                    if (!overlaps(ranges[owner], ranges[vreg])) return false;
+
+                    mark(owner, reg, false);
+                    assigned[owner] = NO_REGISTER;
+                    isSavedAroundCalls[owner] = false;
+                    spilled.push_back(owner);
+                    return true;
+                });
+            }
+        }
+
+        assigned[vreg] = reg;
+        owners[reg].push_back(vreg);
+        mark(vreg, reg, true);
+    }
+
+    return spilled;
 }
 
-Register* RegisterAllocator::scan(const uint32_t* priorityOrder, const int size) {
-    for (int i = 0; i < size; ++i) {
-        for (auto& register_: registers) {
-            if (priorityOrder[i] == register_.rType && !isINUSE(register_.status)) {
-                register_.status |= INUSE;
-                return &register_;
+void RegisterAllocator::insertSpillCode(std::vector<Instr>& code, const size_t begin,
+                                        const std::vector<uint32_t>& spilled) {
+    const size_t vregCount = virtualRegisters.size();
+    std::vector<bool> isSpilled(vregCount, false);
+
+    for (const uint32_t vreg: spilled) {
+        isSpilled[vreg] = true;
+    }
+
+    computeSlotWidths(code, begin);
+
+    for (const uint32_t vreg: spilled) {
+        if (!isRemat[vreg]) {
+            slotOffsets[vreg] = assignSlot(slotWidths[vreg], ranges[vreg]);
+        }
+    }
+
+    std::vector<Instr> remats(vregCount);
+    for (size_t i = begin; i < code.size(); ++i) {
+        if (const uint32_t def = accesses[i - begin].def; isVirtual(def) && isSpilled[def - VIRTUAL_REGISTER_BASE]) {
+            remats[def - VIRTUAL_REGISTER_BASE] = code[i];
+        }
+    }
+
+    // Every instruction that touches a spilled value gets its own register for it, loaded
+    // before and stored after
+    std::vector<Instr> function;
+    for (size_t i = begin; i < code.size(); ++i) {
+        Instr instr = code[i];
+        const Access& access = accesses[i - begin];
+
+        if (isVirtual(access.def) && isSpilled[access.def - VIRTUAL_REGISTER_BASE] &&
+            isRemat[access.def - VIRTUAL_REGISTER_BASE]) {
+            continue;
+        }
+
+        std::vector<std::pair<uint32_t, uint32_t> > temps;
+        auto replace = [&](uint16_t& reg) {
+            if (!isVirtual(reg) || !isSpilled[reg - VIRTUAL_REGISTER_BASE]) return;
+
+            const uint32_t vreg = reg - VIRTUAL_REGISTER_BASE;
+            auto it = std::ranges::find(temps, vreg, &std::pair<uint32_t, uint32_t>::first);
+            if (it == temps.end()) {
+                Register* temp = alloc(virtualRegisters[vreg].rType);
+                free(temp);
+                it = temps.insert(temps.end(), {vreg, temp->id});
+            }
+
+            reg = static_cast<uint16_t>(it->second);
+        };
+
+        for (int k = 0; k < instr.count; ++k) {
+            Operand& operand = instr.operands[k];
+            if (operand.isReg() || operand.isMem()) replace(operand.reg);
+            if (operand.isIndexed()) replace(operand.index);
+        }
+
+        for (const auto& [vreg, temp]: temps) {
+            const bool isUsed = std::ranges::find(access.uses, access.uses + access.useCount,
+                                                  vreg + VIRTUAL_REGISTER_BASE) != access.uses + access.useCount;
+            if (!isUsed) continue;
+
+            if (!isRemat[vreg]) {
+                function.push_back(slotAccess(vreg, temp, slotOffsets[vreg], true));
+                continue;
+            }
+
+            Instr remat = remats[vreg];
+            // xor clobbers the flags the instruction may read
+            if (remat.op == Opcode::XOR || remat.op == Opcode::SUB) {
+                remat = {Opcode::MOV, 2, {Operand::makeReg(temp, REG32), Operand::makeImm(0)}};
+            }
+
+            for (int k = 0; k < remat.count; ++k) {
+                if (remat.operands[k].isReg() && remat.operands[k].reg == vreg + VIRTUAL_REGISTER_BASE) {
+                    remat.operands[k].reg = static_cast<uint16_t>(temp);
+                }
+            }
+            function.push_back(remat);
+        }
+
+        function.push_back(instr);
+
+        for (const auto& [vreg, temp]: temps) {
+            if (access.def == vreg + VIRTUAL_REGISTER_BASE) {
+                function.push_back(slotAccess(vreg, temp, slotOffsets[vreg], false));
+            }
+        }
+    }
+
+    code.resize(begin);
+    code.insert(code.end(), function.begin(), function.end());
+    isSpillTemp.resize(virtualRegisters.size(), true);
+}
+
+void RegisterAllocator::insertCallerSaves(std::vector<Instr>& code, const size_t begin) {
+    const auto vregs = std::views::iota(0u, static_cast<uint32_t>(isSavedAroundCalls.size()));
+    if (std::ranges::none_of(vregs, [&](const uint32_t vreg) { return isSavedAroundCalls[vreg]; })) {
+        return;
+    }
+
+    computeSlotWidths(code, begin);
+
+    // Each value gets a slot for the calls it crosses, stored right before them and reloaded
+    // right after
+    std::vector<std::vector<uint32_t> > crossings(code.size() - begin);
+    for (const uint32_t vreg: vregs) {
+        if (!isSavedAroundCalls[vreg]) continue;
+
+        std::vector<Range> callRanges;
+        for (const uint32_t call: calls) {
+            if (isLiveAcross(vreg, call)) {
+                callRanges.push_back({call * 2, call * 2 + 1});
+                crossings[call].push_back(vreg);
             }
         }
+
+        slotOffsets[vreg] = assignSlot(slotWidths[vreg], callRanges);
+    }
+
+    std::vector<Instr> function;
+    for (size_t i = begin; i < code.size(); ++i) {
+        const auto& crossing = crossings[i - begin];
+
+        for (const uint32_t vreg: crossing) {
+            function.push_back(slotAccess(vreg, vreg + VIRTUAL_REGISTER_BASE, slotOffsets[vreg], false));
+        }
+
+        function.push_back(code[i]);
+
+        for (const uint32_t vreg: crossing) {
+            function.push_back(slotAccess(vreg, vreg + VIRTUAL_REGISTER_BASE, slotOffsets[vreg], true));
+        }
+    }
+
+    code.resize(begin);
+    code.insert(code.end(), function.begin(), function.end());
+}
+
+void RegisterAllocator::computeSlotWidths(const std::vector<Instr>& code, const size_t begin) {
+    slotWidths.assign(virtualRegisters.size(), 8);
+    slotOffsets.resize(virtualRegisters.size(), 0);
+
+    // Packed values take a whole vector register
+    for (size_t i = begin; i < code.size(); ++i) {
+        const Instr& instr = code[i];
+        const bool isPacked = (instr.op >= Opcode::MOVDQA && instr.op <= Opcode::PUNPCKLQDQ) ||
+                              (instr.op >= Opcode::VPCMPGTQ && instr.op <= Opcode::VEXTRACTI128);
+
+        for (int k = 0; k < instr.count; ++k) {
+            const Operand& operand = instr.operands[k];
+            if (!operand.isReg() || !isVirtual(operand.reg)) continue;
+
+            uint32_t& width = slotWidths[operand.reg - VIRTUAL_REGISTER_BASE];
+            width = std::max(width, operand.size == Operand::WIDE ? 32u : isPacked ? 16u : 8u);
+        }
+    }
+}
+
+uint32_t RegisterAllocator::assignSlot(const uint32_t width, const std::vector<Range>& slotRanges) {
+    // Values whose ranges do not overlap share a slot
+    auto slot = std::ranges::find_if(spillSlots, [&](const SpillSlot& other) {
+        return other.width == width && !overlaps(other.ranges, slotRanges);
+    });
+
+    if (slot == spillSlots.end()) {
+        const uint32_t offset = (spillSlots.empty() ? 0 : spillSlots.back().offset) + width;
+        slot = spillSlots.insert(spillSlots.end(), {offset, width, {}});
+    }
+
+    slot->ranges.insert(slot->ranges.end(), slotRanges.begin(), slotRanges.end());
+    std::ranges::sort(slot->ranges, {}, &Range::start);
+    return slot->offset;
+}
+
+Instr RegisterAllocator::slotAccess(const uint32_t vreg, const uint32_t reg, const uint32_t offset,
+                                    const bool isLoad) const {
+    const uint32_t width = slotWidths[vreg];
+    const uint32_t slotSize = width == 8 ? static_cast<uint32_t>(REG64) : Operand::UNSIZED;
+    const Operand slot = Operand::makeMem(slotSize, Operand::FRAME, offset);
+    const Operand regOp = Operand::makeReg(reg, width == 32 ? Operand::WIDE : static_cast<uint32_t>(REG64));
+    const Opcode op = !isSSEReg(vreg + VIRTUAL_REGISTER_BASE)
+                          ? Opcode::MOV
+                          : width == 8 ? Opcode::MOVSD : width == 16 ? Opcode::MOVDQU : Opcode::VMOVDQU;
+
+    return isLoad ? Instr{op, 2, {regOp, slot}} : Instr{op, 2, {slot, regOp}};
+}
+
+double RegisterAllocator::callerSaveCost(const uint32_t vreg) const {
+    double cost = 0;
+    for (const uint32_t call: calls) {
+        if (isLiveAcross(vreg, call)) {
+            cost += 2 * std::pow(10.0, std::min(loopDepths[call], 8u));
+        }
+    }
+
+    return cost;
+}
+
+bool RegisterAllocator::isLiveAcross(const uint32_t vreg, const uint32_t call) const {
+    // Live after the call, a virtual register is never written by one
+    return std::ranges::any_of(ranges[vreg], [&](const Range& range) {
+        return range.start <= call * 2 + 1 && call * 2 + 1 <= range.end;
+    });
+}
+
+bool RegisterAllocator::isRematerializable(const Instr& def) {
+    const Operand& dst = def.operands[0];
+    const Operand& src = def.operands[1];
+
+    if (!dst.isReg()) return false;
+
+    switch (def.op) {
+        case Opcode::MOV:
+            return src.isImm();
+        case Opcode::LEA:
+            return src.reg == Operand::RIP;
+        case Opcode::XOR:
+        case Opcode::SUB:
+        case Opcode::PXOR:
+        case Opcode::XORPD:
+        case Opcode::PCMPEQD:
+            return dst == src;
+        default:
+            return false;
+    }
+}
+
+bool RegisterAllocator::isVirtual(const uint32_t id) const {
+    return id >= VIRTUAL_REGISTER_BASE && id != NO_REGISTER;
+}
+
+bool RegisterAllocator::isSSEReg(const uint32_t id) const {
+    return isVirtual(id) ? isSSE(virtualRegisters[id - VIRTUAL_REGISTER_BASE].rType) : id >= xmm0;
+}
+
+bool RegisterAllocator::overlaps(const std::vector<Range>& a, const std::vector<Range>& b) {
+    // Both are sorted by start
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+        if (a[i].end < b[j].start) {
+            ++i;
+        } else if (b[j].end < a[i].start) {
+            ++j;
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+RegisterAllocator::Access RegisterAllocator::accessOf(const Instr& instr) {
+    Access access;
+    const auto& ops = instr.operands;
+
+    auto use = [&](const Operand& operand) {
+        if (operand.isReg() || (operand.isMem() && operand.reg != Operand::RIP && operand.reg != Operand::FRAME)) {
+            access.uses[access.useCount++] = operand.reg;
+        }
+        if (operand.isIndexed()) {
+            access.uses[access.useCount++] = operand.index;
+        }
+    };
+
+    // Writes to 8 and 16-bit registers keep the rest of the old value
+    auto def = [&](const Operand& operand, const bool isMerging = false) {
+        if (!operand.isReg()) {
+            use(operand);
+            return;
+        }
+
+        if (isMerging || operand.size == REG16 || operand.size == REG8H || operand.size == REG8L) {
+            use(operand);
+        }
+        access.def = operand.reg;
+    };
+
+    // Zeroing and all-ones idioms do not read the old value
+    const bool isIdiom = (instr.op == Opcode::XOR || instr.op == Opcode::SUB || instr.op == Opcode::PXOR ||
+                          instr.op == Opcode::XORPD || instr.op == Opcode::PCMPEQD || instr.op == Opcode::VPXOR ||
+                          instr.op == Opcode::VPCMPEQD) &&
+                         ops[0].isReg() && ops[0] == ops[1] && (instr.count == 2 || ops[0] == ops[2]);
+    if (isIdiom) {
+        def(ops[0]);
+        return access;
+    }
+
+    switch (instr.op) {
+        case Opcode::MOV:
+        case Opcode::MOVZX:
+        case Opcode::MOVSXD:
+        case Opcode::LEA:
+        case Opcode::MOVQ:
+        case Opcode::VMOVQ:
+        case Opcode::MOVAPD:
+        case Opcode::MOVDQA:
+        case Opcode::MOVDQU:
+        case Opcode::VMOVDQA:
+        case Opcode::VMOVDQU:
+        case Opcode::VPBROADCASTQ:
+        // The upper half of a scalar double is never read
+        case Opcode::MOVSD:
+        case Opcode::CVTSI2SD:
+        // Three operand forms write the whole destination
+        case Opcode::PSHUFD:
+        case Opcode::VPSHUFD:
+        case Opcode::VPADDQ:
+        case Opcode::VPSUBQ:
+        case Opcode::VPMULUDQ:
+        case Opcode::VPAND:
+        case Opcode::VPOR:
+        case Opcode::VPXOR:
+        case Opcode::VPCMPEQD:
+        case Opcode::VPSRLQ:
+        case Opcode::VPSLLQ:
+        case Opcode::VPCMPGTQ:
+        case Opcode::VBLENDVPD:
+        case Opcode::VEXTRACTI128:
+            def(ops[0]);
+            for (int k = 1; k < instr.count; ++k) use(ops[k]);
+            break;
+        case Opcode::CMP:
+        case Opcode::TEST:
+        case Opcode::BT:
+        case Opcode::UCOMISD:
+        case Opcode::PUSH:
+        case Opcode::JMPR:
+            for (int k = 0; k < instr.count; ++k) use(ops[k]);
+            break;
+        case Opcode::POP:
+            def(ops[0]);
+            break;
+        case Opcode::IMUL:
+            // imul r, r/m, imm does not read its destination
+            if (instr.count == 3) {
+                def(ops[0]);
+                use(ops[1]);
+            } else {
+                use(ops[0]);
+                use(ops[1]);
+                def(ops[0], true);
+            }
+            break;
+        case Opcode::IDIV:
+            use(ops[0]);
+            access.implicitUse = bit(RAX) | bit(RDX);
+            access.implicitDef = bit(RAX) | bit(RDX);
+            break;
+        case Opcode::CQO:
+            access.implicitUse = bit(RAX);
+            access.implicitDef = bit(RDX);
+            break;
+        case Opcode::CALL:
+            access.implicitUse = ops[0].callArgs();
+            access.implicitDef = ops[0].callClobbers() ? ops[0].callClobbers() : CALLER_SAVED;
+            break;
+        case Opcode::SYSCALL:
+            // Only exit is emitted
+            access.implicitUse = bit(RAX) | bit(RDI);
+            access.implicitDef = bit(RAX) | bit(RCX) | bit(R11);
+            break;
+        case Opcode::RET:
+        // The return value is written right before the epilogue, which restores the
+        // callee-saved registers
+        case Opcode::LABEL:
+        case Opcode::VZEROUPPER:
+            break;
+        default:
+            if (isJump(instr.op)) break;
+            // Anything else reads all its operands and updates the first one
+            for (int k = 0; k < instr.count; ++k) use(ops[k]);
+            if (instr.count) def(ops[0], true);
+            break;
     }
 
-    return nullptr;
+    return access;
 }
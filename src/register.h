@@ -2,6 +2,9 @@
 #define REGISTER_H
 
 #include <cstdint>
+#include <deque>
+#include <limits>
+#include <vector>
 
 #define INUSE 1 << 0
 #define isINUSE(status) (status & INUSE)
@@ -12,6 +15,8 @@
 
 static constexpr int REGISTER_COUNT = 32;
 static constexpr int SIZE_COUNT = 5;
+// Registers handed out by alloc are virtual until allocate assigns them
+static constexpr uint32_t VIRTUAL_REGISTER_BASE = 64;
 
 struct Register {
     uint32_t id;
@@ -44,23 +49,125 @@ enum RegisterType : uint8_t {
     PARAM = 1 << 3,
 };
 
+struct Instr;
+
+// Result of allocating the registers of a function
+struct Allocation {
+    // Callee-saved registers the function has to preserve
+    uint32_t savedRegs;
+    // Bytes of spill slots, addressed from Operand::FRAME
+    uint32_t spillSize;
+};
+
+// Code is emitted with virtual registers. Once a function is complete, allocate assigns
+// physical registers by linear scan over live intervals, spilling to stack slots when
+// registers run out.
 class RegisterAllocator {
 public:
+    // A new virtual register of the SSE or general purpose class
     Register* alloc(uint8_t rt = 0);
 
     void free(Register* reg);
 
+    // Physical registers not taken by the virtual registers in use
+    [[nodiscard]] int available(uint8_t rt = 0) const;
+
+    // Rewrites the function starting at begin to physical registers
+    Allocation allocate(std::vector<Instr>& code, size_t begin);
+
+    // Caller-saved registers the allocated function starting at begin writes, including those of its calls
+    static uint32_t clobbersOf(const std::vector<Instr>& code, size_t begin);
+
     const char* nameFromReg(const Register* reg, uint32_t size);
 
-    const char* nameFromID(uint32_t id, uint32_t size);
+    static const char* nameFromID(uint32_t id, uint32_t size);
 
     Register* regFromID(uint32_t id);
 
 private:
-    Register* scan(const uint32_t* priorityOrder, int size);
+    static constexpr uint32_t NO_REGISTER = std::numeric_limits<uint32_t>::max();
+
+    // Positions of a virtual register, see computeLiveness
+    struct Range {
+        uint32_t start;
+        uint32_t end;
+    };
+
+    // Registers an instruction reads and writes. Operand registers may be virtual,
+    // implicit ones are always physical.
+    struct Access {
+        uint32_t uses[6];
+        int useCount{0};
+        uint32_t def{NO_REGISTER};
+        uint32_t implicitUse{0};
+        uint32_t implicitDef{0};
+    };
+
+    struct SpillSlot {
+        // End of the slot within the spill area
+        uint32_t offset;
+        uint32_t width;
+        std::vector<Range> ranges;
+    };
+
+    void computeLiveness(const std::vector<Instr>& code, size_t begin);
+
+    // Assigns registers in order of interval start and returns the virtual registers to spill
+    std::vector<uint32_t> assign();
+
+    void insertSpillCode(std::vector<Instr>& code, size_t begin, const std::vector<uint32_t>& spilled);
+
+    void insertCallerSaves(std::vector<Instr>& code, size_t begin);
+
+    void computeSlotWidths(const std::vector<Instr>& code, size_t begin);
+
+    // Offset of a slot free over the ranges
+    uint32_t assignSlot(uint32_t width, const std::vector<Range>& slotRanges);
+
+    [[nodiscard]] Instr slotAccess(uint32_t vreg, uint32_t reg, uint32_t offset, bool isLoad) const;
+
+    // A store and a load around every call the value is live across
+    [[nodiscard]] double callerSaveCost(uint32_t vreg) const;
+
+    [[nodiscard]] bool isLiveAcross(uint32_t vreg, uint32_t call) const;
+
+    static bool isRematerializable(const Instr& def);
+
+    [[nodiscard]] bool isVirtual(uint32_t id) const;
+
+    [[nodiscard]] bool isSSEReg(uint32_t id) const;
+
+    static Access accessOf(const Instr& instr);
+
+    static bool overlaps(const std::vector<Range>& a, const std::vector<Range>& b);
+
+    std::deque<Register> virtualRegisters;
+    int liveCount[2]{};
+    // Current function
+    std::vector<Access> accesses;
+    std::vector<std::vector<uint32_t> > hints;
+    std::vector<std::vector<Range> > ranges;
+    // Physical registers live or written at each position
+    std::vector<uint32_t> occupied;
+    // Registers a call clobbers and nothing reads after it, at the position it writes
+    std::vector<uint32_t> callClobbers;
+    std::vector<uint32_t> calls;
+    // Loop nesting of each instruction, a use in a loop costs more to spill
+    std::vector<uint32_t> loopDepths;
+    std::vector<uint32_t> assigned;
+    std::vector<double> spillCosts;
+    // Values defined once by a constant or an address are recomputed instead of reloaded
+    std::vector<bool> isRemat;
+    // Registers that load or store a spilled value, they are never spilled themselves
+    std::vector<bool> isSpillTemp;
+    // Values kept in a caller-saved register, stored and reloaded around the calls they cross
+    std::vector<bool> isSavedAroundCalls;
+    std::vector<SpillSlot> spillSlots;
+    std::vector<uint32_t> slotWidths;
+    std::vector<uint32_t> slotOffsets;
 
     Register registers[REGISTER_COUNT] = {
-        {.id = RAX, .rType = SCRATCH, .status = INUSE},
+        {.id = RAX, .rType = SCRATCH, .status = 0},
         {.id = RDI, .rType = SCRATCH | PARAM, .status = 0},
         {.id = RSI, .rType = SCRATCH | PARAM, .status = 0},
         {.id = RDX, .rType = SCRATCH | PARAM, .status = 0},
@@ -76,7 +183,7 @@ private:
         {.id = R13, .rType = PRESERVED, .status = 0},
         {.id = R14, .rType = PRESERVED, .status = 0},
         {.id = R15, .rType = PRESERVED, .status = 0},
-        {.id = xmm0, .rType = SSE | PARAM, .status = INUSE},
+        {.id = xmm0, .rType = SSE | PARAM, .status = 0},
         {.id = xmm1, .rType = SSE | PARAM, .status = 0},
         {.id = xmm2, .rType = SSE | PARAM, .status = 0},
         {.id = xmm3, .rType = SSE | PARAM, .status = 0},
@@ -129,9 +236,11 @@ private:
         {"xmm15", "", "", "", ""},
     };
 
-    static constexpr uint32_t priorityOrder[3] = {SCRATCH, SCRATCH | PARAM, PRESERVED};
-
-    static constexpr uint32_t priorityOrderSSE[2] = {SSE | PARAM, SSE};
+    // Scratch registers first, a callee-saved register costs a save and a restore
+    static constexpr uint32_t allocationOrder[] = {
+        R10, R11, RDI, RSI, RDX, RCX, R8, R9, RAX, RBX, R12, R13, R14, R15,
+        xmm1, xmm2, xmm3, xmm4, xmm5, xmm6, xmm7, xmm8, xmm9, xmm10, xmm11, xmm12, xmm13, xmm14, xmm15, xmm0
+    };
 };
 
 #endif //REGISTER_H
@@ -0,0 +1,157 @@
+#include "selector.h"
+#include <algorithm>
+
+using enum Goal;
+using enum TileForm;
+
+static const std::vector COMPARES = {
+    TokenType::EQUAL, TokenType::NEQUAL, TokenType::GREATER_THEN, TokenType::LESS_THEN, TokenType::GREATER_THEN_EQ,
+    TokenType::LESS_THEN_EQ
+};
+
+// Costs are roughly the instructions a tile emits, multiplies count three. Address arithmetic is free
+// until lea materializes it, so a tree folds into one lea whenever it fits an addressing mode.
+// On equal cost the rule listed first wins.
+InstructionSelector::InstructionSelector() : patterns({
+    // Chain rules
+    {"load-reg", REG, {}, SRC, REG, 1, COPY, Opcode::MOV, false, {}},
+    {"load-imm", REG, {}, IMM, REG, 1, COPY, Opcode::MOV, false, {}},
+    {"load-mem", REG, {}, MEM, REG, 1, COPY, Opcode::MOV, false, {}},
+    {"lea", REG, {}, ADDR, REG, 1, LEA, Opcode::LEA, false, {}},
+    {"borrow", SRC, {}, REG, SRC, 0, BORROW, Opcode::MOV, false, {}},
+    {"index", INDEX, {}, SRC, INDEX, 0, BORROW, Opcode::MOV, false, {}},
+    {"base", ADDR, {}, SRC, ADDR, 0, BASE, Opcode::MOV, false, {}},
+    // Arithmetic
+    {"inc", REG, {TokenType::PLUS}, REG, IMM, 1, UNARY, Opcode::INC, true, {1}},
+    {"add-imm", REG, {TokenType::PLUS}, REG, IMM, 1, OP, Opcode::ADD, true, {}},
+    {"add-reg", REG, {TokenType::PLUS}, REG, SRC, 1, OP, Opcode::ADD, true, {}},
+    {"add-mem", REG, {TokenType::PLUS}, REG, MEM, 1, OP, Opcode::ADD, true, {}},
+    {"dec", REG, {TokenType::MINUS}, REG, IMM, 1, UNARY, Opcode::DEC, false, {1}},
+    {"sub-imm", REG, {TokenType::MINUS}, REG, IMM, 1, OP, Opcode::SUB, false, {}},
+    {"sub-reg", REG, {TokenType::MINUS}, REG, SRC, 1, OP, Opcode::SUB, false, {}},
+    {"sub-mem", REG, {TokenType::MINUS}, REG, MEM, 1, OP, Opcode::SUB, false, {}},
+    {"imul-imm", REG, {TokenType::MUL}, REG, IMM, 3, OP, Opcode::IMUL, true, {}},
+    {"imul-reg", REG, {TokenType::MUL}, REG, SRC, 3, OP, Opcode::IMUL, true, {}},
+    {"imul-mem", REG, {TokenType::MUL}, REG, MEM, 3, OP, Opcode::IMUL, true, {}},
+    {"imul3-reg", REG, {TokenType::MUL}, SRC, IMM, 3, IMUL3, Opcode::IMUL, true, {}},
+    {"imul3-mem", REG, {TokenType::MUL}, MEM, IMM, 3, IMUL3, Opcode::IMUL, true, {}},
+    {"and-imm", REG, {TokenType::LOGAND}, REG, IMM, 1, OP, Opcode::AND, true, {}},
+    {"and-reg", REG, {TokenType::LOGAND}, REG, SRC, 1, OP, Opcode::AND, true, {}},
+    {"and-mem", REG, {TokenType::LOGAND}, REG, MEM, 1, OP, Opcode::AND, true, {}},
+    {"or-imm", REG, {TokenType::LOGIOR}, REG, IMM, 1, OP, Opcode::OR, true, {}},
+    {"or-reg", REG, {TokenType::LOGIOR}, REG, SRC, 1, OP, Opcode::OR, true, {}},
+    {"or-mem", REG, {TokenType::LOGIOR}, REG, MEM, 1, OP, Opcode::OR, true, {}},
+    {"xor-imm", REG, {TokenType::LOGXOR}, REG, IMM, 1, OP, Opcode::XOR, true, {}},
+    {"xor-reg", REG, {TokenType::LOGXOR}, REG, SRC, 1, OP, Opcode::XOR, true, {}},
+    {"xor-mem", REG, {TokenType::LOGXOR}, REG, MEM, 1, OP, Opcode::XOR, true, {}},
+    // Addressing modes
+    {"scale", INDEX, {TokenType::MUL}, SRC, IMM, 0, SCALE, Opcode::LEA, true, {2, 4, 8}},
+    {"base-index", ADDR, {TokenType::PLUS}, SRC, INDEX, 0, BASE_INDEX, Opcode::LEA, true, {}},
+    {"disp", ADDR, {TokenType::PLUS}, ADDR, IMM, 0, DISP, Opcode::LEA, true, {}},
+    {"neg-disp", ADDR, {TokenType::MINUS}, ADDR, IMM, 0, DISP, Opcode::LEA, false, {}},
+    {"multiple", ADDR, {TokenType::MUL}, SRC, IMM, 0, MULTIPLE, Opcode::LEA, true, {2, 3, 5, 9}},
+    // Compares
+    {"test", FLAGS, COMPARES, SRC, IMM, 1, TEST, Opcode::TEST, false, {0}},
+    {"cmp-imm", FLAGS, COMPARES, SRC, IMM, 1, COMPARE, Opcode::CMP, false, {}},
+    {"cmp-reg", FLAGS, COMPARES, SRC, SRC, 1, COMPARE, Opcode::CMP, false, {}},
+    {"cmp-mem", FLAGS, COMPARES, SRC, MEM, 1, COMPARE, Opcode::CMP, false, {}},
+    {"cmp-mem-imm", FLAGS, COMPARES, MEM, IMM, 1, COMPARE, Opcode::CMP, false, {}},
+    {"cmp-mem-reg", FLAGS, COMPARES, MEM, SRC, 1, COMPARE, Opcode::CMP, false, {}},
+}) {
+}
+
+bool InstructionSelector::label(const BinOpExpr& root, const Goal goal, const LeafFn& leafOf) {
+    labels.clear();
+
+    Label& label = labels[&root];
+    labelOperator(root, label, leafOf);
+    return label.cost(goal) < INFINITE_COST;
+}
+
+InstructionSelector::Choice InstructionSelector::choiceOf(const IExpr& node, const Goal goal) const {
+    const Label& label = labels.at(&node);
+    const auto g = static_cast<size_t>(goal);
+    return {label.patterns[g], label.isSwapped[g]};
+}
+
+int InstructionSelector::costOf(const IExpr& node, const Goal goal) const {
+    return labels.at(&node).cost(goal);
+}
+
+const InstructionSelector::Leaf& InstructionSelector::leafOf(const IExpr& node) const {
+    return *labels.at(&node).leaf;
+}
+
+const InstructionSelector::Label& InstructionSelector::labelNode(const ExprPtr& node, const LeafFn& leafOf) {
+    if (const auto it = labels.find(node.get()); it != labels.end()) {
+        return it->second;
+    }
+
+    Label label;
+    if (auto leaf = leafOf(node)) {
+        label.costs[static_cast<size_t>(leaf->goal)] = 0;
+        label.leaf = std::move(leaf);
+        closeChains(label);
+    } else if (const auto binop = cast::toBinop(node)) {
+        labelOperator(*binop, label, leafOf);
+    }
+
+    return labels[node.get()] = std::move(label);
+}
+
+void InstructionSelector::labelOperator(const BinOpExpr& binop, Label& label, const LeafFn& leafOf) {
+    const Label lhs = labelNode(binop.lhs, leafOf);
+    const Label rhs = labelNode(binop.rhs, leafOf);
+
+    // Only leaves reduce to an immediate
+    auto operandCost = [](const Label& operand, const Goal goal, const std::vector<int64_t>& imms) {
+        if (goal == IMM && !imms.empty() &&
+            (!operand.leaf || std::ranges::find(imms, operand.leaf->value) == imms.end())) {
+            return INFINITE_COST;
+        }
+        return operand.cost(goal);
+    };
+
+    for (const auto& pattern: patterns) {
+        if (std::ranges::find(pattern.ops, binop.opToken.type) == pattern.ops.end()) continue;
+
+        const int cost = pattern.cost + operandCost(lhs, pattern.lhs, pattern.imms) +
+                         operandCost(rhs, pattern.rhs, pattern.imms);
+        update(label, pattern, cost, false);
+
+        if (pattern.isCommutative) {
+            const int swappedCost = pattern.cost + operandCost(rhs, pattern.lhs, pattern.imms) +
+                                    operandCost(lhs, pattern.rhs, pattern.imms);
+            update(label, pattern, swappedCost, true);
+        }
+    }
+
+    closeChains(label);
+}
+
+void InstructionSelector::closeChains(Label& label) const {
+    // Chain rules only add cost, so this stops once every goal has its cheapest chain
+    bool isChanged = true;
+    while (isChanged) {
+        isChanged = false;
+
+        for (const auto& pattern: patterns) {
+            if (!pattern.ops.empty() || label.cost(pattern.lhs) >= INFINITE_COST) continue;
+
+            const int cost = label.cost(pattern.lhs) + pattern.cost;
+            if (cost < label.cost(pattern.goal)) {
+                update(label, pattern, cost, false);
+                isChanged = true;
+            }
+        }
+    }
+}
+
+void InstructionSelector::update(Label& label, const Pattern& pattern, const int cost, const bool isSwapped) {
+    const auto g = static_cast<size_t>(pattern.goal);
+    if (cost >= label.costs[g]) return;
+
+    label.costs[g] = cost;
+    label.patterns[g] = &pattern;
+    label.isSwapped[g] = isSwapped;
+}
@@ -0,0 +1,116 @@
+#ifndef SELECTOR_H
+#define SELECTOR_H
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+#include "instr.h"
+#include "parser.h"
+
+// What a subtree is reduced to
+enum class Goal : uint8_t {
+    REG,   // A register the tile owns and may overwrite
+    SRC,   // A register that is only read, such as a variable kept in a register
+    IMM,   // A 32-bit immediate
+    MEM,   // A memory operand
+    INDEX, // A register scaled by 1, 2, 4 or 8
+    ADDR,  // base + index*scale + disp, the source of lea
+    FLAGS, // The flags of a compare, read by the branch that follows
+    COUNT
+};
+
+// How a tile turns the operands of its pattern into instructions, see CodeGen::emitTile
+enum class TileForm : uint8_t {
+    COPY,       // mov reg, operand
+    LEA,        // lea reg, [addr]
+    BORROW,     // The operand itself, nothing is emitted
+    BASE,       // [src]
+    OP,         // op reg, operand
+    UNARY,      // op reg
+    IMUL3,      // imul reg, operand, imm
+    SCALE,      // src*imm
+    BASE_INDEX, // [src + index*scale]
+    DISP,       // [addr +- imm]
+    MULTIPLE,   // [src + src*(imm - 1)]
+    COMPARE,    // cmp operand, operand
+    TEST        // test src, src
+};
+
+// Bottom-up rewrite system over integer expression trees. Every node is labeled with the cheapest
+// pattern reducing it to each goal, then the tiles of the wanted goal are emitted top-down from the root.
+// Leaves are the variables and constants the caller recognizes, a tree with any other node is rejected.
+class InstructionSelector {
+public:
+    struct Pattern {
+        const char* name;
+        Goal goal;
+        // Operators the pattern matches, a chain rule has none and converts its lhs goal
+        std::vector<TokenType> ops;
+        Goal lhs;
+        Goal rhs;
+        int cost;
+        TileForm form;
+        Opcode opcode;
+        bool isCommutative;
+        // Values the immediate operand is restricted to, any when empty
+        std::vector<int64_t> imms;
+    };
+
+    struct Leaf {
+        Goal goal;
+        // The immediate of an IMM leaf
+        int64_t value;
+        std::shared_ptr<VarExpr> var;
+    };
+
+    struct Choice {
+        // nullptr for a leaf
+        const Pattern* pattern;
+        bool isSwapped;
+    };
+
+    using LeafFn = std::function<std::optional<Leaf>(const ExprPtr&)>;
+
+    InstructionSelector();
+
+    // Labels the tree below root, false if it cannot be reduced to goal
+    bool label(const BinOpExpr& root, Goal goal, const LeafFn& leafOf);
+
+    [[nodiscard]] Choice choiceOf(const IExpr& node, Goal goal) const;
+
+    [[nodiscard]] int costOf(const IExpr& node, Goal goal) const;
+
+    [[nodiscard]] const Leaf& leafOf(const IExpr& node) const;
+
+private:
+    static constexpr int INFINITE_COST = std::numeric_limits<int>::max() / 4;
+    static constexpr size_t GOAL_COUNT = static_cast<size_t>(Goal::COUNT);
+
+    struct Label {
+        std::array<int, GOAL_COUNT> costs;
+        std::array<const Pattern*, GOAL_COUNT> patterns{};
+        std::array<bool, GOAL_COUNT> isSwapped{};
+        std::optional<Leaf> leaf;
+
+        Label() { costs.fill(INFINITE_COST); }
+
+        [[nodiscard]] int cost(const Goal goal) const { return costs[static_cast<size_t>(goal)]; }
+    };
+
+    const Label& labelNode(const ExprPtr& node, const LeafFn& leafOf);
+
+    void labelOperator(const BinOpExpr& binop, Label& label, const LeafFn& leafOf);
+
+    void closeChains(Label& label) const;
+
+    static void update(Label& label, const Pattern& pattern, int cost, bool isSwapped);
+
+    std::vector<Pattern> patterns;
+    std::unordered_map<const IExpr*, Label> labels;
+};
+
+#endif //SELECTOR_H
@@ -150,6 +150,14 @@ ExprPtr SemanticAnalyzer::binopResolve(BinOpExpr& binop) {
     ExprPtr lhs = nodeResolve(binop.lhs, binop.opToken.type);
     ExprPtr rhs = nodeResolve(binop.rhs, binop.opToken.type);
 
+    // A test is 0 or 1 whatever it compares
+    if (const TokenType type = binop.opToken.type;
+        type == TokenType::EQUAL || type == TokenType::NEQUAL || type == TokenType::GREATER_THEN ||
+        type == TokenType::LESS_THEN || type == TokenType::GREATER_THEN_EQ || type == TokenType::LESS_THEN_EQ ||
+        type == TokenType::AND || type == TokenType::OR || type == TokenType::NOT) {
+        return std::make_shared<IntExpr>(0);
+    }
+
     if (cast::toDouble(lhs)) {
         return lhs;
     }
@@ -370,11 +378,11 @@ ExprPtr SemanticAnalyzer::funcCallResolve(FuncCallExpr& funcCall, bool isParam)
     // Make the arg type local because we'll keep them onto stack inside the function
     int scratchIdx = 0, sseIdx = 0;
     auto makeLocal = [&](VarExpr& arg) {
-        // The params beyond 6 for scratch and beyond 7 for SSE are already onto stack
-        if (arg.vType == VarType::INT && scratchIdx < 6) {
+        // The params beyond 8 for scratch and beyond 12 for SSE are already onto stack
+        if (arg.vType == VarType::INT && scratchIdx < 8) {
             arg.sType = SymbolType::LOCAL;
             scratchIdx++;
-        } else if (arg.vType == VarType::DOUBLE && sseIdx < 8) {
+        } else if (arg.vType == VarType::DOUBLE && sseIdx < 12) {
             arg.sType = SymbolType::LOCAL;
             sseIdx++;
         }
@@ -31,29 +31,34 @@ int StackAllocator::pushStackFrame(const std::string& funcName, const std::strin
     return updateStackFrame(sf, varName, stype);
 }
 
-uint32_t StackAllocator::calculateRequiredStackSize(const std::vector<ExprPtr>& args) const {
-    int sseCount = 0;
-    int stackParamCount = 0;
+int StackAllocator::pushRegisterParam(const std::string& funcName, const std::string& varName) {
+    StackFrame& sf = stack[funcName];
 
-    for (const auto& arg: args) {
-        const auto param = cast::toVar(arg);
-        sseCount += param->vType == VarType::DOUBLE;
+    if (const auto it = sf.offsets.find(varName); it != sf.offsets.end()) {
+        return it->second;
     }
 
-    if (args.size() > 6) {
-        if (args.size() == sseCount) {
-            stackParamCount = static_cast<int>(args.size()) - 8;
-        } else {
-            stackParamCount = static_cast<int>(args.size()) - 6 - sseCount;
-        }
-    }
+    const int offset = -sf.currentVarOffset;
+    sf.currentVarOffset += 8;
+    sf.offsets.emplace(varName, offset);
+
+    return offset;
+}
 
-    uint32_t alignedSize = stackOffset + (stackParamCount > 0 ? stackParamCount * 8 : 0);
+uint32_t StackAllocator::calculateRequiredStackSize(const std::vector<ExprPtr>& args, const size_t intRegisters,
+                                                    const size_t sseRegisters) {
+    size_t intCount = 0, sseCount = 0;
 
-    if (alignedSize % 16 != 0)
-        alignedSize += 8;
+    for (const auto& arg: args) {
+        const auto param = cast::toVar(arg);
+        intCount += param->vType == VarType::INT;
+        sseCount += param->vType == VarType::DOUBLE;
+    }
 
-    return alignedSize - stackOffset;
+    // Internal calls leave the stack unaligned, no generated code depends on it
+    const size_t stackParamCount = (intCount > intRegisters ? intCount - intRegisters : 0) +
+                                   (sseCount > sseRegisters ? sseCount - sseRegisters : 0);
+    return static_cast<uint32_t>(stackParamCount * 8);
 }
 
 int StackAllocator::updateStackFrame(StackFrame* sf, const std::string& varName, const SymbolType stype) {
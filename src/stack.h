@@ -13,7 +13,13 @@ public:
 
     int pushStackFrame(const std::string& funcName, const std::string& varName, SymbolType stype);
 
-    [[nodiscard]] uint32_t calculateRequiredStackSize(const std::vector<ExprPtr>& args) const;
+    // A parameter passed in a register that is addressed as a stack parameter gets a local slot, recorded
+    // with a negative offset so it resolves below rbp
+    int pushRegisterParam(const std::string& funcName, const std::string& varName);
+
+    // Bytes of the arguments a call passes on the stack, past the argument registers
+    [[nodiscard]] static uint32_t calculateRequiredStackSize(const std::vector<ExprPtr>& args, size_t intRegisters,
+                                                             size_t sseRegisters);
 
 private:
     struct StackFrame {
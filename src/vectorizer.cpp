@@ -0,0 +1,202 @@
+#include "vectorizer.h"
+
+std::optional<Reduction> LoopVectorizer::match(const DotimesExpr& dotimes) const {
+    if (dotimes.statements.size() != 1) {
+        return std::nullopt;
+    }
+
+    const auto setq = cast::toSetq(dotimes.statements[0]);
+    if (!setq) {
+        return std::nullopt;
+    }
+
+    const auto iterVar = cast::toVar(dotimes.iterationCount);
+    const std::string iterVarName = cast::toString(iterVar->name)->data;
+
+    const auto acc = cast::toVar(setq->pair);
+    const std::string accName = cast::toString(acc->name)->data;
+
+    if (acc->vType != VarType::INT || iterVar->vType != VarType::INT || accName == iterVarName) {
+        return std::nullopt;
+    }
+
+    std::optional<Reduction> reduction;
+
+    if (const auto binop = cast::toBinop(acc->value)) {
+        ReductionOp op;
+        switch (binop->opToken.type) {
+            case TokenType::PLUS: op = ReductionOp::ADD;
+                break;
+            case TokenType::MINUS: op = ReductionOp::SUB;
+                break;
+            case TokenType::MUL: op = ReductionOp::MUL;
+                break;
+            case TokenType::LOGAND: op = ReductionOp::AND;
+                break;
+            case TokenType::LOGIOR: op = ReductionOp::IOR;
+                break;
+            case TokenType::LOGXOR: op = ReductionOp::XOR;
+                break;
+            default:
+                return std::nullopt;
+        }
+        // acc - term is not commutative, the accumulator has to come first
+        if (isVarNamed(binop->lhs, accName)) {
+            reduction = Reduction{.op = op, .accumulator = acc, .term = binop->rhs};
+        } else if (isVarNamed(binop->rhs, accName) && op != ReductionOp::SUB) {
+            reduction = Reduction{.op = op, .accumulator = acc, .term = binop->lhs};
+        }
+    } else if (const auto if_ = cast::toIf(acc->value)) {
+        reduction = matchMinMax(*if_, accName);
+        if (reduction) {
+            reduction->accumulator = acc;
+        }
+    }
+
+    if (!reduction || !isVectorizableTerm(reduction->term, iterVarName, accName, reduction->termDepth)) {
+        return std::nullopt;
+    }
+
+    collectInvariants(reduction->term, iterVarName, reduction->invariants);
+    reduction->readsIterVar = readsVar(reduction->term, iterVarName);
+
+    return reduction;
+}
+
+bool LoopVectorizer::isVectorizableTerm(const ExprPtr& term,
+                                        const std::string& iterVarName,
+                                        const std::string& accName,
+                                        int& depth) const {
+    if (cast::toInt(term)) {
+        return true;
+    }
+    // The iter var or a variable the loop never assigns
+    if (const auto var = cast::toVar(term)) {
+        return var->vType == VarType::INT && !isVarNamed(term, accName);
+    }
+
+    const auto binop = cast::toBinop(term);
+    if (!binop) {
+        return false;
+    }
+
+    switch (binop->opToken.type) {
+        case TokenType::PLUS:
+        case TokenType::MINUS:
+        case TokenType::MUL:
+        case TokenType::LOGAND:
+        case TokenType::LOGIOR:
+        case TokenType::LOGXOR:
+            break;
+        default:
+            return false;
+    }
+
+    int lhsDepth = 0, rhsDepth = 0;
+    if (!isVectorizableTerm(binop->lhs, iterVarName, accName, lhsDepth) ||
+        !isVectorizableTerm(binop->rhs, iterVarName, accName, rhsDepth)) {
+        return false;
+    }
+
+    depth = std::max(lhsDepth, rhsDepth) + 1;
+    return true;
+}
+
+std::optional<Reduction> LoopVectorizer::matchMinMax(const IfExpr& if_, const std::string& accName) const {
+    // (if (> term acc) term acc) or (if (< acc term) term acc) and the mirrored forms
+    const auto test = cast::toBinop(if_.test);
+    if (!test || cast::toUninitialized(if_.else_)) {
+        return std::nullopt;
+    }
+
+    bool isGreater;
+    switch (test->opToken.type) {
+        case TokenType::GREATER_THEN:
+        case TokenType::GREATER_THEN_EQ: isGreater = true;
+            break;
+        case TokenType::LESS_THEN:
+        case TokenType::LESS_THEN_EQ: isGreater = false;
+            break;
+        default:
+            return std::nullopt;
+    }
+
+    ExprPtr term;
+    bool termFirst;
+    if (isVarNamed(test->rhs, accName) && !isVarNamed(test->lhs, accName)) {
+        term = test->lhs;
+        termFirst = true;
+    } else if (isVarNamed(test->lhs, accName) && !isVarNamed(test->rhs, accName)) {
+        term = test->rhs;
+        termFirst = false;
+    } else {
+        return std::nullopt;
+    }
+
+    bool selectsTerm;
+    if (isSameTerm(if_.then, term) && isVarNamed(if_.else_, accName)) {
+        selectsTerm = true;
+    } else if (isVarNamed(if_.then, accName) && isSameTerm(if_.else_, term)) {
+        selectsTerm = false;
+    } else {
+        return std::nullopt;
+    }
+    // Picking term when term > acc keeps the maximum
+    const bool isMax = (isGreater == termFirst) == selectsTerm;
+
+    return Reduction{.op = isMax ? ReductionOp::MAX : ReductionOp::MIN, .term = term};
+}
+
+bool LoopVectorizer::isVarNamed(const ExprPtr& expr, const std::string& name) {
+    const auto var = cast::toVar(expr);
+    return var && cast::toString(var->name)->data == name;
+}
+
+bool LoopVectorizer::isSameTerm(const ExprPtr& lhs, const ExprPtr& rhs) {
+    if (const auto int_ = cast::toInt(lhs)) {
+        const auto other = cast::toInt(rhs);
+        return other && other->n == int_->n;
+    }
+
+    if (const auto var = cast::toVar(lhs)) {
+        return isVarNamed(rhs, cast::toString(var->name)->data);
+    }
+
+    const auto binop = cast::toBinop(lhs);
+    const auto other = cast::toBinop(rhs);
+
+    return binop && other &&
+           binop->opToken.type == other->opToken.type &&
+           isSameTerm(binop->lhs, other->lhs) &&
+           isSameTerm(binop->rhs, other->rhs);
+}
+
+bool LoopVectorizer::readsVar(const ExprPtr& term, const std::string& name) {
+    if (const auto binop = cast::toBinop(term)) {
+        return readsVar(binop->lhs, name) || readsVar(binop->rhs, name);
+    }
+
+    return isVarNamed(term, name);
+}
+
+void LoopVectorizer::collectInvariants(const ExprPtr& term,
+                                       const std::string& iterVarName,
+                                       std::vector<ExprPtr>& invariants) {
+    if (const auto binop = cast::toBinop(term)) {
+        collectInvariants(binop->lhs, iterVarName, invariants);
+        collectInvariants(binop->rhs, iterVarName, invariants);
+        return;
+    }
+
+    if (isVarNamed(term, iterVarName)) {
+        return;
+    }
+
+    for (const auto& invariant: invariants) {
+        if (isSameTerm(invariant, term)) {
+            return;
+        }
+    }
+
+    invariants.push_back(term);
+}
@@ -0,0 +1,49 @@
+#ifndef VECTORIZER_H
+#define VECTORIZER_H
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+enum class ReductionOp {
+    ADD, SUB, MUL,
+    AND, IOR, XOR,
+    MIN, MAX
+};
+
+// (dotimes (i n) (setq acc (op acc term))), where term is integer arithmetic
+// of the iter var, constants and loop invariant variables.
+struct Reduction {
+    ReductionOp op;
+    std::shared_ptr<VarExpr> accumulator{};
+    ExprPtr term{};
+    // Loop invariant variables and constants referenced by term, without duplicates
+    std::vector<ExprPtr> invariants{};
+    int termDepth{0};
+    // Whether term reads the iter var, otherwise the loop needs no index vectors
+    bool readsIterVar{false};
+};
+
+class LoopVectorizer {
+public:
+    [[nodiscard]] std::optional<Reduction> match(const DotimesExpr& dotimes) const;
+
+    static bool isVarNamed(const ExprPtr& expr, const std::string& name);
+
+    static bool isSameTerm(const ExprPtr& lhs, const ExprPtr& rhs);
+
+    static bool readsVar(const ExprPtr& term, const std::string& name);
+
+private:
+    [[nodiscard]] bool isVectorizableTerm(const ExprPtr& term,
+                                          const std::string& iterVarName,
+                                          const std::string& accName,
+                                          int& depth) const;
+
+    [[nodiscard]] std::optional<Reduction> matchMinMax(const IfExpr& if_, const std::string& accName) const;
+
+    static void collectInvariants(const ExprPtr& term, const std::string& iterVarName, std::vector<ExprPtr>& invariants);
+};
+
+#endif //VECTORIZER_H
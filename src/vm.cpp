@@ -0,0 +1,167 @@
+#include "vm.h"
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
+VM::VM(const VMProgram& program) : program(program), globals(program.globals.size(), VMValue{.i = 0}),
+                                   stack(new VMValue[STACK_SIZE]) {
+}
+
+VMValue VM::global(const std::string& name) const {
+    for (size_t i = 0; i < program.globals.size(); ++i) {
+        if (program.globals[i] == name) {
+            return globals[i];
+        }
+    }
+
+    throw std::runtime_error("Undefined global " + name);
+}
+
+// Integer arithmetic wraps around like the native code
+static int64_t wrap(const uint64_t n) {
+    return static_cast<int64_t>(n);
+}
+
+VMValue VM::run() {
+    const VMInstr* code = program.code.data();
+    const VMValue* constants = program.constants.data();
+    // main is compiled first
+    const VMFunction& main = program.functions.front();
+    const VMInstr* ip = code + main.entry;
+    VMValue* regs = stack.get();
+    VMValue* top = regs + main.registerCount;
+    VMValue* const stackEnd = stack.get() + STACK_SIZE;
+
+    frames.clear();
+
+#if defined(__GNUC__)
+    static const void* dispatch[] = {
+        &&LOADK, &&MOV, &&ITOF, &&GLOAD, &&GSTORE,
+        &&ADDI, &&SUBI, &&MULI, &&DIVI, &&ANDI, &&ORI, &&XORI,
+        &&EQI, &&NEI, &&GTI, &&LTI, &&GEI, &&LEI,
+        &&ADDF, &&SUBF, &&MULF, &&DIVF,
+        &&EQF, &&NEF, &&GTF, &&LTF, &&GEF, &&LEF,
+        &&JMP, &&JZ, &&JNZ,
+        &&JEQ, &&JNE, &&JGT, &&JLT, &&JGE, &&JLE,
+        &&CALL, &&RET
+    };
+    static_assert(std::size(dispatch) == static_cast<size_t>(VMOp::COUNT));
+
+#define HANDLER(op) op:
+#define DISPATCH() goto *dispatch[static_cast<uint8_t>(ip->op)]
+#else
+#define HANDLER(op) case VMOp::op:
+#define DISPATCH() continue
+#endif
+
+#define NEXT() ++ip; DISPATCH()
+#define A regs[ip->a]
+#define B regs[ip->b]
+#define C regs[ip->c]
+#define BRANCH(cond) \
+    if (cond) { \
+        ip = code + ip->k; \
+        DISPATCH(); \
+    } \
+    NEXT()
+
+#if defined(__GNUC__)
+    DISPATCH();
+    {
+#else
+    for (;;) {
+        switch (ip->op) {
+#endif
+    HANDLER(LOADK) A = constants[ip->k]; NEXT();
+    HANDLER(MOV) A = B; NEXT();
+    HANDLER(ITOF) A.f = static_cast<double>(B.i); NEXT();
+    HANDLER(GLOAD) A = globals[ip->k]; NEXT();
+    HANDLER(GSTORE) globals[ip->k] = A; NEXT();
+
+    HANDLER(ADDI) A.i = wrap(static_cast<uint64_t>(B.i) + static_cast<uint64_t>(C.i)); NEXT();
+    HANDLER(SUBI) A.i = wrap(static_cast<uint64_t>(B.i) - static_cast<uint64_t>(C.i)); NEXT();
+    HANDLER(MULI) A.i = wrap(static_cast<uint64_t>(B.i) * static_cast<uint64_t>(C.i)); NEXT();
+    HANDLER(DIVI)
+        if (C.i == 0) {
+            throw std::runtime_error("Division by zero");
+        }
+        A.i = B.i == std::numeric_limits<int64_t>::min() && C.i == -1 ? B.i : B.i / C.i;
+        NEXT();
+    HANDLER(ANDI) A.i = B.i & C.i; NEXT();
+    HANDLER(ORI) A.i = B.i | C.i; NEXT();
+    HANDLER(XORI) A.i = B.i ^ C.i; NEXT();
+
+    HANDLER(EQI) A.i = B.i == C.i; NEXT();
+    HANDLER(NEI) A.i = B.i != C.i; NEXT();
+    HANDLER(GTI) A.i = B.i > C.i; NEXT();
+    HANDLER(LTI) A.i = B.i < C.i; NEXT();
+    HANDLER(GEI) A.i = B.i >= C.i; NEXT();
+    HANDLER(LEI) A.i = B.i <= C.i; NEXT();
+
+    HANDLER(ADDF) A.f = B.f + C.f; NEXT();
+    HANDLER(SUBF) A.f = B.f - C.f; NEXT();
+    HANDLER(MULF) A.f = B.f * C.f; NEXT();
+    HANDLER(DIVF) A.f = B.f / C.f; NEXT();
+
+    HANDLER(EQF) A.i = B.f == C.f; NEXT();
+    HANDLER(NEF) A.i = B.f != C.f; NEXT();
+    HANDLER(GTF) A.i = B.f > C.f; NEXT();
+    HANDLER(LTF) A.i = B.f < C.f; NEXT();
+    HANDLER(GEF) A.i = B.f >= C.f; NEXT();
+    HANDLER(LEF) A.i = B.f <= C.f; NEXT();
+
+    HANDLER(JMP) ip = code + ip->k; DISPATCH();
+    HANDLER(JZ) BRANCH(A.i == 0);
+    HANDLER(JNZ) BRANCH(A.i != 0);
+    HANDLER(JEQ) BRANCH(A.i == B.i);
+    HANDLER(JNE) BRANCH(A.i != B.i);
+    HANDLER(JGT) BRANCH(A.i > B.i);
+    HANDLER(JLT) BRANCH(A.i < B.i);
+    HANDLER(JGE) BRANCH(A.i >= B.i);
+    HANDLER(JLE) BRANCH(A.i <= B.i);
+
+    HANDLER(CALL) {
+        const VMFunction& callee = program.functions[ip->k];
+        if (top + callee.registerCount > stackEnd) {
+            throw std::runtime_error("Stack overflow");
+        }
+
+        for (uint16_t i = 0; i < ip->c; ++i) {
+            top[i] = regs[ip->b + i];
+        }
+
+        frames.push_back({ip, regs, top, ip->a});
+        regs = top;
+        top = regs + callee.registerCount;
+        ip = code + callee.entry;
+        DISPATCH();
+    }
+    HANDLER(RET) {
+        const VMValue value = A;
+        if (frames.empty()) {
+            return value;
+        }
+
+        const Frame frame = frames.back();
+        frames.pop_back();
+        regs = frame.regs;
+        top = frame.top;
+        regs[frame.dst] = value;
+        ip = frame.ip;
+        NEXT();
+    }
+#if !defined(__GNUC__)
+        default:
+            throw std::runtime_error("Invalid bytecode");
+        }
+#endif
+    }
+
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef A
+#undef B
+#undef C
+#undef BRANCH
+}
@@ -0,0 +1,38 @@
+#ifndef VM_H
+#define VM_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include "bytecode.h"
+
+// Interprets bytecode with threaded dispatch: each handler jumps directly to the handler
+// of the next instruction through a table of label addresses instead of returning to a
+// central switch. Compilers without computed goto fall back to the switch.
+class VM {
+public:
+    explicit VM(const VMProgram& program);
+
+    // Runs main and returns the value of its last form
+    VMValue run();
+
+    [[nodiscard]] VMValue global(const std::string& name) const;
+
+private:
+    struct Frame {
+        const VMInstr* ip;
+        VMValue* regs;
+        VMValue* top;
+        uint16_t dst;
+    };
+
+    static constexpr size_t STACK_SIZE = 1 << 18;
+
+    const VMProgram& program;
+    std::vector<VMValue> globals;
+    // Registers of all active frames, left uninitialized
+    std::unique_ptr<VMValue[]> stack;
+    std::vector<Frame> frames;
+};
+
+#endif //VM_H